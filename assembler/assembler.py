@@ -2,9 +2,13 @@ import sys, re
 
 
 def main():
+    # Usage: assembler.py [source.asm [program.bin]]
+    source = sys.argv[1] if len(sys.argv) > 1 else sys.path[0] + "/../code.asm"
+    output = sys.argv[2] if len(sys.argv) > 2 else "assembler/program.bin"
+
     # Open file and clean comments and empty lines
     lines = []
-    file = open(sys.path[0] + "/../code.asm", "r")
+    file = open(source, "r")
     for line in file:
         l = re.sub(r";.+\n", "", line).strip()
         l = l.replace(';', '')
@@ -15,20 +19,52 @@ def main():
     program = [0] * len(lines)
     for i in range(len(lines)):
         tokens = lines[i].split(" ")
-        if tokens[0] == "HALT":
-            program[i] = 0xF025
+        if tokens[0] == ".FILL":
+            # .FILL 0xVALUE: raw data word
+            program[i] = int(tokens[1], 16)
         else:
-            program[i] += instructions[tokens[0]] << 12
-        program[i] = instrAttribute(program[i], tokens)
+            if tokens[0] == "HALT":
+                program[i] = 0xF025
+            else:
+                program[i] += instructions[tokens[0]] << 12
+            program[i] = instrAttribute(program[i], tokens)
 
         print(f"0x{hex(0x300 + i)[2:].upper()}: 0b{bin(program[i])[2:].zfill(16)} 0x{hex(program[i])[2:].zfill(4).upper()} {lines[i]}")
     
-    binfile = open("assembler/program.bin", "wb")
-    for inst in program:
-        binfile.write(inst.to_bytes(2, byteorder='little'))
+    # The extension picks the format (vm/image.h): .obj is the big endian LC-3
+    # object with the origin first, .lc3 the container, anything else a raw image
+    binfile = open(output, "wb")
+    if output.endswith(".obj"):
+        binfile.write(ORIGIN.to_bytes(2, byteorder='big'))
+        for inst in program:
+            binfile.write(inst.to_bytes(2, byteorder='big'))
+    elif output.endswith(".lc3"):
+        binfile.write(container(program, source))
+    else:
+        for inst in program:
+            binfile.write(inst.to_bytes(2, byteorder='little'))
     binfile.close()
 
 
+ORIGIN = 0x3000
+IMAGE_MAGIC = b"LC3IMG1\n"
+IMAGE_CODE, IMAGE_METADATA = 1, 3
+
+
+def container(program, source):
+    # Header, section table, then the code and the metadata sections
+    code = b"".join(inst.to_bytes(2, byteorder='little') for inst in program)
+    metadata = f"source={source}\n".encode()
+    header = IMAGE_MAGIC + ORIGIN.to_bytes(2, 'little') + (2).to_bytes(2, 'little')
+    offset = len(header) + 2 * 12
+    table = b""
+    for kind, origin, data in ((IMAGE_CODE, ORIGIN, code), (IMAGE_METADATA, 0, metadata)):
+        table += offset.to_bytes(4, 'little') + len(data).to_bytes(4, 'little')
+        table += kind.to_bytes(2, 'little') + origin.to_bytes(2, 'little')
+        offset += len(data)
+    return header + table + code + metadata
+
+
 def instrAttribute(binary, token):
     # TRAP binary: 1111|0000|TRAPVEC8
     if token[0] == "TRAP":
@@ -82,13 +118,15 @@ def instrAttribute(binary, token):
             binary += (0b1 << 11) + int(token[1], 16)
 
     # BR binarys: 0000|NZP|OFFSET009
+    # the condition is any combination of N, Z and P (NZP: always)
     if token[0] == "BR":
-        if token[1] == "P":
-            binary += (0b001 << 9) + int(token[2], 16)
-        elif token[1] == "Z":
-            binary += (0b010 << 9) + int(token[2], 16)
-        else:
-            binary += (0b100 << 9) + int(token[2], 16)
+        if "N" in token[1]:
+            binary += 0b100 << 9
+        if "Z" in token[1]:
+            binary += 0b010 << 9
+        if "P" in token[1]:
+            binary += 0b001 << 9
+        binary += int(token[2], 16)
 
     return binary
 
@@ -132,6 +170,15 @@ traps = {
     "HALT": 0x25,
     "IN_U16": 0x26,
     "OUT_U16": 0x27,
+    "MEMCPY": 0x28,
+    "MEMSET": 0x29,
+    "STRLEN": 0x2A,
+    "STRCMP": 0x2B,
+    "MUL": 0x2C,
+    "DIV": 0x2D,
+    "MOD": 0x2E,
+    "FREAD": 0x2F,
+    "FWRITE": 0x30,
 }
 
 if __name__ == "__main__":
@@ -0,0 +1,145 @@
+import argparse
+import json
+import os
+import platform
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+# Standard benchmark suite: run every program of bench/ on every engine of
+# vm/main and report wall time, retired instructions, MIPS and ns/instruction.
+# The programs are assembled by `make bench` (bench/*.asm -> bench/*.bin).
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(BENCH_DIR)
+
+STRING = 'THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG'[::-1]
+
+# name: (input of the IN_U16 traps, expected output). The counters of the
+# programs are signed, so inputs stay below 32768.
+BENCHMARKS = {
+    'fib':     ('30\n',    '45608'),                # recursive calls, stack traffic
+    'sieve':   ('80\n',    '1862'),                 # primes below 16000, LDR/STR and branches
+    'bubble':  ('40\n',    '138 32693'),            # bubble sort of 400 words
+    'muldiv':  ('30000\n', '53962'),                # shift-add multiply, restoring divide
+    'strings': ('30000\n', (STRING + '\n') * 30000), # case conversion, reversal and PUTS
+    'stream':  ('100\n',   '61440'),                # copy/scale/add over 8 KiW arrays
+}
+
+ENGINES = ['switch', 'decoded', 'threaded', 'fused', 'jit']
+
+STATS = re.compile(r'engine (\S+): (\d+) instructions in ([\d.]+) s, ([\d.]+) MIPS')
+
+
+def run(vm, engine, name):
+    stdin, expected = BENCHMARKS[name]
+    binary = os.path.join(BENCH_DIR, name + '.bin')
+    start = time.perf_counter()
+    proc = subprocess.run([vm, '-s', '-e', engine, binary], input=stdin.encode(),
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    wall = time.perf_counter() - start
+
+    output = ' '.join(proc.stdout.decode(errors='replace').split()) if name != 'strings' \
+        else proc.stdout.decode(errors='replace')
+    if proc.returncode != 0 or output != expected:
+        sys.exit(f'{name} on {engine}: wrong output or exit status {proc.returncode}\n'
+                 + proc.stderr.decode(errors='replace'))
+    stats = STATS.search(proc.stderr.decode())
+    if stats is None:
+        sys.exit(f'{name} on {engine}: no statistics on stderr')
+    return wall, int(stats.group(2)), float(stats.group(4))
+
+
+def measure(vm, engine, name, repeat):
+    # Median of the repetitions, so a single noisy run does not move the result
+    runs = [run(vm, engine, name) for _ in range(repeat)]
+    wall = statistics.median(r[0] for r in runs)
+    mips = statistics.median(r[2] for r in runs)
+    return {
+        'benchmark': name,
+        'engine': engine,
+        'wall_s': round(wall, 6),
+        'instructions': runs[0][1],
+        'mips': mips,
+        'ns_per_instruction': round(1e3 / mips, 3) if mips > 0 else None,
+    }
+
+
+def compare(results, baseline, tolerance):
+    # Flag every benchmark/engine pair whose MIPS dropped more than tolerance
+    old = {(r['benchmark'], r['engine']): r for r in baseline['results']}
+    regressions = 0
+    for r in results:
+        prev = old.get((r['benchmark'], r['engine']))
+        if prev is None or not prev['mips']:
+            continue
+        change = r['mips'] / prev['mips'] - 1
+        if change < -tolerance:
+            regressions += 1
+            print(f"regression: {r['benchmark']} on {r['engine']}: {prev['mips']:.1f} -> "
+                  f"{r['mips']:.1f} MIPS ({change:+.1%})", file=sys.stderr)
+        if r['instructions'] != prev['instructions']:
+            print(f"note: {r['benchmark']} retired {r['instructions']} instructions, "
+                  f"{prev['instructions']} in the baseline", file=sys.stderr)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run the LC-3 benchmark suite')
+    parser.add_argument('-e', '--engines', default=','.join(ENGINES),
+                        help='comma separated engines (default: all)')
+    parser.add_argument('-b', '--benchmarks', default=','.join(BENCHMARKS),
+                        help='comma separated benchmarks (default: all)')
+    parser.add_argument('-r', '--repeat', type=int, default=5, help='runs per measurement')
+    parser.add_argument('--vm', default=os.path.join(ROOT, 'vm', 'main'))
+    parser.add_argument('--format', choices=['csv', 'json'], default='csv', help='format on stdout')
+    parser.add_argument('--json', metavar='FILE', help='also write the results as JSON')
+    parser.add_argument('--baseline', metavar='FILE',
+                        help='JSON of a previous run; exit 1 if a MIPS figure dropped')
+    parser.add_argument('--tolerance', type=float, default=0.10,
+                        help='allowed MIPS drop against the baseline (default 0.10)')
+    args = parser.parse_args()
+
+    engines = args.engines.split(',')
+    names = args.benchmarks.split(',')
+    for name in names:
+        if name not in BENCHMARKS:
+            sys.exit(f'unknown benchmark {name}')
+        if not os.path.exists(os.path.join(BENCH_DIR, name + '.bin')):
+            sys.exit(f'bench/{name}.bin not found, run make bench')
+
+    fields = ['benchmark', 'engine', 'wall_s', 'instructions', 'mips', 'ns_per_instruction']
+    if args.format == 'csv':
+        print(','.join(fields), flush=True)
+    results = []
+    for name in names:
+        for engine in engines:
+            r = measure(args.vm, engine, name, args.repeat)
+            results.append(r)
+            if args.format == 'csv':
+                print(','.join(str(r[f]) for f in fields), flush=True)
+
+    report = {
+        'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'host': platform.node(),
+        'machine': platform.machine(),
+        'vm': args.vm,
+        'results': results,
+    }
+    if args.format == 'json':
+        print(json.dumps(report, indent=2))
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+            f.write('\n')
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            if compare(results, json.load(f), args.tolerance):
+                sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
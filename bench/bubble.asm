@@ -0,0 +1,51 @@
+TRAP IN_U16         ; repetitions
+ADD R5 R0 0x00      ;
+LD R1 0x02B         ; REP: fill with x = 5x + 13849, 15 bits
+ADD R1 R1 0x01      ;
+LD R2 0x02A         ;
+LD R3 0x02A         ;
+LD R4 0x02B         ;
+ADD R0 R3 R3        ; FILL:
+ADD R0 R0 R0        ;
+ADD R3 R0 R3        ;
+LD R0 0x026         ;
+ADD R3 R3 R0        ;
+AND R0 R3 R4        ;
+STR R0 R1 0x3F      ;
+ADD R1 R1 0x01      ;
+ADD R2 R2 0x1F      ;
+BR P 0x1F6          ;
+ST R3 0x01E         ;
+LD R4 0x01C         ; pass length
+ADD R4 R4 0x1F      ;
+LD R1 0x019         ; PASS:
+ADD R1 R1 0x02      ; &a[k] + 2
+ADD R2 R4 0x00      ;
+LDR R0 R1 0x3E      ; CMP:
+LDR R3 R1 0x3F      ;
+NOT R6 R0           ;
+ADD R6 R6 0x01      ;
+ADD R6 R3 R6        ; a[k+1] - a[k]
+BR ZP 0x002         ;
+STR R3 R1 0x3E      ;
+STR R0 R1 0x3F      ;
+ADD R1 R1 0x01      ; NOSWAP:
+ADD R2 R2 0x1F      ;
+BR P 0x1F5          ;
+ADD R4 R4 0x1F      ;
+BR P 0x1F0          ;
+ADD R5 R5 0x1F      ;
+BR P 0x1DC          ;
+LD R1 0x007         ;
+LDR R0 R1 0x00      ;
+TRAP OUT_U16        ; smallest
+LD R2 0x005         ;
+ADD R1 R1 R2        ;
+LDR R0 R1 0x3F      ;
+TRAP OUT_U16        ; largest
+HALT                ;
+.FILL 0x4000        ; BASE:
+.FILL 0x0190        ; SIZE:
+.FILL 0x0001        ; SEED:
+.FILL 0x3619        ; INCR:
+.FILL 0x7FFF        ; MASK:
@@ -0,0 +1,25 @@
+TRAP IN_U16         ; n
+LD R6 0x015         ;
+JSR 0x002           ;
+TRAP OUT_U16        ; fib(n) mod 2^16
+HALT                ;
+; R0 = fib(R0). Frame below R6: return address, n, fib(n-1)
+ADD R1 R0 0x1E      ; FIB:
+BR N 0x00F          ; fib(0) = 0, fib(1) = 1
+STR R7 R6 0x3F      ;
+STR R0 R6 0x3E      ;
+ADD R6 R6 0x1D      ;
+ADD R0 R0 0x1F      ;
+JSR 0x7F9           ;
+ADD R6 R6 0x03      ;
+STR R0 R6 0x3D      ;
+LDR R0 R6 0x3E      ;
+ADD R0 R0 0x1E      ;
+ADD R6 R6 0x1D      ;
+JSR 0x7F3           ;
+ADD R6 R6 0x03      ;
+LDR R1 R6 0x3D      ;
+ADD R0 R0 R1        ;
+LDR R7 R6 0x3F      ;
+JMP R7              ; FIBRET:
+.FILL 0xFD00        ; STACK:
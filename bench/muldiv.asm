@@ -0,0 +1,76 @@
+TRAP IN_U16         ; iterations
+ST R0 0x042         ;
+AND R0 R0 0x00      ;
+ST R0 0x041         ;
+LD R0 0x041         ; LOOP: x = 5x + 13849
+ADD R1 R0 R0        ;
+ADD R1 R1 R1        ;
+ADD R0 R1 R0        ;
+LD R1 0x03F         ;
+ADD R0 R0 R1        ;
+ST R0 0x03B         ;
+LD R1 0x03D         ; y = (x & 0x3FF) + 1
+AND R1 R0 R1        ;
+ADD R1 R1 0x01      ;
+ST R1 0x038         ;
+JSR 0x011           ; R0 = x * y
+LD R1 0x034         ;
+ADD R1 R1 R0        ;
+ST R1 0x032         ;
+LD R0 0x032         ;
+LD R1 0x032         ;
+JSR 0x018           ; R0 = x / y, R1 = x % y
+LD R2 0x02E         ;
+ADD R2 R2 R0        ;
+ADD R2 R2 R1        ;
+ST R2 0x02B         ;
+LD R0 0x029         ;
+ADD R0 R0 0x1F      ;
+ST R0 0x027         ;
+BR P 0x1E6          ;
+LD R0 0x026         ;
+TRAP OUT_U16        ;
+HALT                ;
+; R0 = R0 * R1 mod 2^16, shift and add from the top bit of R1
+AND R2 R2 0x00      ; MUL:
+AND R3 R3 0x00      ;
+ADD R3 R3 0x0F      ;
+ADD R3 R3 0x01      ;
+ADD R2 R2 R2        ; MULBIT:
+ADD R1 R1 0x00      ;
+BR ZP 0x001         ;
+ADD R2 R2 R0        ;
+ADD R1 R1 R1        ; MULNEXT:
+ADD R3 R3 0x1F      ;
+BR P 0x1F9          ;
+ADD R0 R2 0x00      ;
+JMP R7              ;
+; R0 = R0 / R1, R1 = R0 % R1 for a divisor below 0x4000, restoring division
+NOT R4 R1           ; DIV:
+ADD R4 R4 0x01      ; -divisor
+AND R2 R2 0x00      ; quotient
+AND R5 R5 0x00      ; remainder
+AND R3 R3 0x00      ;
+ADD R3 R3 0x0F      ;
+ADD R3 R3 0x01      ;
+ADD R5 R5 R5        ; DIVBIT:
+ADD R0 R0 0x00      ;
+BR ZP 0x001         ;
+ADD R5 R5 0x01      ;
+ADD R0 R0 R0        ; DIVSHIFT:
+ADD R2 R2 R2        ;
+ADD R6 R5 R4        ;
+BR N 0x002          ;
+ADD R5 R6 0x00      ;
+ADD R2 R2 0x01      ;
+ADD R3 R3 0x1F      ; DIVNEXT:
+BR P 0x1F4          ;
+ADD R0 R2 0x00      ;
+ADD R1 R5 0x00      ;
+JMP R7              ;
+.FILL 0x0000        ; COUNT:
+.FILL 0x0000        ; SUM:
+.FILL 0x0007        ; X:
+.FILL 0x0000        ; Y:
+.FILL 0x3619        ; INCR:
+.FILL 0x03FF        ; DMASK:
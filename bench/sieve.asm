@@ -0,0 +1,41 @@
+TRAP IN_U16         ; repetitions
+ADD R5 R0 0x00      ;
+LD R1 0x022         ; REP: clear the table
+ADD R1 R1 0x01      ;
+LD R2 0x021         ;
+AND R3 R3 0x00      ;
+STR R3 R1 0x3F      ; CLEAR:
+ADD R1 R1 0x01      ;
+ADD R2 R2 0x1F      ;
+BR P 0x1FC          ;
+AND R4 R4 0x00      ; primes found
+AND R2 R2 0x00      ;
+ADD R2 R2 0x02      ; i = 2
+AND R3 R3 0x00      ;
+ADD R3 R3 0x01      ;
+LD R1 0x015         ; OUTER:
+ADD R1 R1 R2        ;
+LDR R0 R1 0x00      ;
+BR NP 0x009         ; composite
+ADD R4 R4 0x01      ;
+ADD R1 R1 R2        ;
+ADD R1 R1 0x01      ; &a[2i] + 1
+LD R0 0x010         ; MARK:
+ADD R0 R1 R0        ;
+BR ZP 0x003         ;
+STR R3 R1 0x3F      ;
+ADD R1 R1 R2        ;
+BR NZP 0x1FA        ;
+ADD R2 R2 0x01      ; NEXT:
+LD R0 0x00A         ;
+ADD R0 R2 R0        ;
+BR N 0x1EF          ;
+ADD R5 R5 0x1F      ;
+BR P 0x1E0          ;
+ADD R0 R4 0x00      ;
+TRAP OUT_U16        ; primes below SIZE
+HALT                ;
+.FILL 0x4000        ; BASE:
+.FILL 0x3E80        ; SIZE:
+.FILL 0x817F        ; NEGEND: -(BASE + SIZE + 1)
+.FILL 0xC180        ; NEGSIZE:
@@ -0,0 +1,85 @@
+TRAP IN_U16         ; repetitions
+ADD R5 R0 0x00      ;
+LD R1 0x04E         ; a[i] = i
+ADD R1 R1 0x01      ;
+LD R4 0x04F         ;
+AND R0 R0 0x00      ;
+STR R0 R1 0x3F      ; INIT:
+ADD R0 R0 0x01      ;
+ADD R1 R1 0x01      ;
+ADD R4 R4 0x1F      ;
+BR P 0x1FB          ;
+LD R1 0x045         ; REP:
+ADD R1 R1 0x01      ;
+LD R3 0x045         ;
+ADD R3 R3 0x01      ;
+LD R4 0x044         ;
+LDR R0 R1 0x3F      ; COPY: c = a
+STR R0 R3 0x3F      ;
+ADD R1 R1 0x01      ;
+ADD R3 R3 0x01      ;
+ADD R4 R4 0x1F      ;
+BR P 0x1FA          ;
+LD R2 0x03B         ;
+ADD R2 R2 0x01      ;
+LD R3 0x03A         ;
+ADD R3 R3 0x01      ;
+LD R4 0x039         ;
+LDR R0 R3 0x3F      ; SCALE: b = 3c
+ADD R6 R0 R0        ;
+ADD R0 R6 R0        ;
+STR R0 R2 0x3F      ;
+ADD R2 R2 0x01      ;
+ADD R3 R3 0x01      ;
+ADD R4 R4 0x1F      ;
+BR P 0x1F8          ;
+LD R1 0x02D         ;
+ADD R1 R1 0x01      ;
+LD R2 0x02C         ;
+ADD R2 R2 0x01      ;
+LD R3 0x02B         ;
+ADD R3 R3 0x01      ;
+LD R4 0x02A         ;
+LDR R0 R1 0x3F      ; SUM: c = a + b
+LDR R6 R2 0x3F      ;
+ADD R0 R0 R6        ;
+STR R0 R3 0x3F      ;
+ADD R1 R1 0x01      ;
+ADD R2 R2 0x01      ;
+ADD R3 R3 0x01      ;
+ADD R4 R4 0x1F      ;
+BR P 0x1F7          ;
+LD R1 0x01D         ;
+ADD R1 R1 0x01      ;
+LD R2 0x01C         ;
+ADD R2 R2 0x01      ;
+LD R3 0x01B         ;
+ADD R3 R3 0x01      ;
+LD R4 0x01A         ;
+LDR R0 R3 0x3F      ; TRIAD: a = b + 3c
+ADD R6 R0 R0        ;
+ADD R0 R6 R0        ;
+LDR R6 R2 0x3F      ;
+ADD R0 R0 R6        ;
+STR R0 R1 0x3F      ;
+ADD R1 R1 0x01      ;
+ADD R2 R2 0x01      ;
+ADD R3 R3 0x01      ;
+ADD R4 R4 0x1F      ;
+BR P 0x1F5          ;
+ADD R5 R5 0x1F      ;
+BR P 0x1C4          ;
+LD R1 0x009         ; checksum of a
+LD R4 0x00B         ;
+AND R0 R0 0x00      ;
+LDR R6 R1 0x00      ; CHECK:
+ADD R0 R0 R6        ;
+ADD R1 R1 0x01      ;
+ADD R4 R4 0x1F      ;
+BR P 0x1FB          ;
+TRAP OUT_U16        ;
+HALT                ;
+.FILL 0x4000        ; A:
+.FILL 0x6000        ; B:
+.FILL 0x8000        ; C:
+.FILL 0x2000        ; SIZE:
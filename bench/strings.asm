@@ -0,0 +1,89 @@
+TRAP IN_U16         ; lines
+ADD R5 R0 0x00      ;
+LEA R1 0x02A        ; LINE: copy MSG to BUF in upper case
+LD R2 0x026         ;
+ADD R2 R2 0x01      ; &buf[i] + 1
+LDR R0 R1 0x00      ; COPY:
+BR Z 0x00C          ;
+LD R3 0x023         ;
+ADD R3 R0 R3        ;
+BR N 0x005          ; below 'a'
+LD R3 0x021         ;
+ADD R3 R0 R3        ;
+BR P 0x002          ; above 'z'
+ADD R0 R0 0x10      ;
+ADD R0 R0 0x10      ;
+STR R0 R2 0x3F      ; STORE:
+ADD R1 R1 0x01      ;
+ADD R2 R2 0x01      ;
+BR NZP 0x1F2        ;
+STR R0 R2 0x3F      ; COPIED: terminator
+LD R1 0x015         ; reverse in place
+ADD R1 R1 0x01      ; &buf[left] + 1
+ADD R2 R2 0x1F      ; &buf[right] + 1
+NOT R3 R2           ; REV:
+ADD R3 R3 0x01      ;
+ADD R3 R1 R3        ;
+BR ZP 0x007         ;
+LDR R3 R1 0x3F      ;
+LDR R4 R2 0x3F      ;
+STR R4 R1 0x3F      ;
+STR R3 R2 0x3F      ;
+ADD R1 R1 0x01      ;
+ADD R2 R2 0x1F      ;
+BR NZP 0x1F5        ;
+LD R0 0x007         ; REVERSED:
+TRAP PUTS           ;
+AND R0 R0 0x00      ;
+ADD R0 R0 0x0A      ;
+TRAP OUT            ;
+ADD R5 R5 0x1F      ;
+BR P 0x1D9          ;
+HALT                ;
+.FILL 0x4000        ; BUF:
+.FILL 0xFF9F        ; NEGA:
+.FILL 0xFF86        ; NEGZ:
+.FILL 0x0054        ; MSG: 'T'
+.FILL 0x0068        ; 'h'
+.FILL 0x0065        ; 'e'
+.FILL 0x0020        ; ' '
+.FILL 0x0071        ; 'q'
+.FILL 0x0075        ; 'u'
+.FILL 0x0069        ; 'i'
+.FILL 0x0063        ; 'c'
+.FILL 0x006B        ; 'k'
+.FILL 0x0020        ; ' '
+.FILL 0x0062        ; 'b'
+.FILL 0x0072        ; 'r'
+.FILL 0x006F        ; 'o'
+.FILL 0x0077        ; 'w'
+.FILL 0x006E        ; 'n'
+.FILL 0x0020        ; ' '
+.FILL 0x0066        ; 'f'
+.FILL 0x006F        ; 'o'
+.FILL 0x0078        ; 'x'
+.FILL 0x0020        ; ' '
+.FILL 0x006A        ; 'j'
+.FILL 0x0075        ; 'u'
+.FILL 0x006D        ; 'm'
+.FILL 0x0070        ; 'p'
+.FILL 0x0073        ; 's'
+.FILL 0x0020        ; ' '
+.FILL 0x006F        ; 'o'
+.FILL 0x0076        ; 'v'
+.FILL 0x0065        ; 'e'
+.FILL 0x0072        ; 'r'
+.FILL 0x0020        ; ' '
+.FILL 0x0074        ; 't'
+.FILL 0x0068        ; 'h'
+.FILL 0x0065        ; 'e'
+.FILL 0x0020        ; ' '
+.FILL 0x006C        ; 'l'
+.FILL 0x0061        ; 'a'
+.FILL 0x007A        ; 'z'
+.FILL 0x0079        ; 'y'
+.FILL 0x0020        ; ' '
+.FILL 0x0064        ; 'd'
+.FILL 0x006F        ; 'o'
+.FILL 0x0067        ; 'g'
+.FILL 0x0000        ; end of string
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lc3vm.h"
+#include "aot.h"
+#include "console.h"
+#include "interrupt.h"
+
+// ===================================================================================
+// ================================== AOT RUNTIME ====================================
+// ===================================================================================
+void aotInit(struct aot_state *st, struct lc3_vm *vm, const struct aot_block *blocks, int nblocks)
+{
+    // Translated stores do not track dirty pages: a snapshot restore copies all of them
+    memset(vm->dirty, 1, sizeof(vm->dirty));
+    vm->bulk_size = 0;
+
+    memset(st, 0, sizeof(*st));
+    for (int i = 0; i < nblocks; ++i) {
+        memset(st->code + blocks[i].start, 1, blocks[i].length);
+        st->block[blocks[i].start] = 1;
+    }
+}
+
+// Address written by a store instruction, computed like OP_ST/OP_STI/OP_STR.
+// Return false for the other instructions.
+static bool storeTarget(struct lc3_vm *vm, uint16_t instruction, uint16_t *address)
+{
+    uint16_t *reg = vm->reg;
+    uint16_t PCoffset9 = sign_extend(instruction & 0x1FF, 9);
+
+    switch (instruction >> 12) {
+    case op_st:
+        *address = reg[RPC] + PCoffset9;
+        return true;
+    case op_sti:
+        *address = vm->memory[(uint16_t)(reg[RPC] + PCoffset9)];
+        return true;
+    case op_str:
+        *address = reg[(instruction >> 6) & 0x7] + sign_extend(instruction & 0x1FF, 6);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Single steps with executeInstruction. Stores are checked against the code map
+// before they run, so a write into translated code is noticed here too.
+void aotInterpret(struct aot_state *st, struct lc3_vm *vm)
+{
+    while (vm->running && (st->modified || !st->block[vm->reg[RPC]]))
+    {
+        uint16_t instruction = mem_read(vm, vm->reg[RPC]++);
+        uint16_t address;
+        if (storeTarget(vm, instruction, &address) && st->code[address])
+            st->modified = true;
+        ++st->count;
+        executeInstruction(vm, instruction);
+        if (aotBulk(st, vm))
+            st->modified = true;
+    }
+}
+
+int aotMain(int argc, char **argv, uint64_t (*run)(struct lc3_vm *vm),
+            const struct aot_segment *segments, int nsegments, uint16_t entry)
+{
+    bool stats = false;
+    enum console_mode mode = isatty(STDOUT_FILENO) ? CONSOLE_LINE : CONSOLE_BUFFERED;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "suh")) != -1) {
+        if (opt == 's') {
+            stats = true;
+            continue;
+        }
+        if (opt == 'u') {
+            mode = CONSOLE_UNBUFFERED;
+            continue;
+        }
+        fprintf(stderr, "Usage: %s [-s] [-u]\n", argv[0]);
+        fprintf(stderr, "  -s         print retired instructions and MIPS on stderr\n");
+        fprintf(stderr, "  -u         unbuffered console: flush after every output trap\n");
+        return opt == 'h' ? 0 : 1;
+    }
+
+    // VM Initialization
+    struct lc3_vm *vm = vmCreate();
+    vm->io->mode = mode;
+    for (int i = 0; i < nsegments; ++i)
+        memcpy(vm->memory + segments[i].origin, segments[i].data, segments[i].words * sizeof(uint16_t));
+    vm->reg[RPC] = entry;
+
+    // Program run
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t count = run(vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    consoleFlush(vm);
+
+    if (stats) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        fprintf(stderr, "engine aot: %llu instructions in %.3f s, %.1f MIPS\n",
+                (unsigned long long)count, seconds, seconds > 0 ? count / seconds * 1e-6 : 0.0);
+        consoleReport(vm);
+        interruptReport(vm, stderr);
+    }
+
+    vmDestroy(vm);
+    return 0;
+}
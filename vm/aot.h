@@ -0,0 +1,83 @@
+#ifndef H_AOT
+#define H_AOT
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lc3vm.h"
+
+// AHEAD-OF-TIME TRANSLATION
+// vm/lc3aot reads an image in the format of loadProgram, follows its control
+// flow from the entry point and writes a C translation unit with a label for every
+// basic block (one function, so known branch targets are plain gotos) and a
+// switch over the block addresses for JMP/RET. The console traps call the T_*
+// routines, the other vectors go through OP_TRAP and the trap table. Taken
+// branches and JMP test vm->event and take pending interrupts (interrupt.h).
+// The generated file is compiled together with this runtime, which provides
+// main, the state shared with the interpreter and the interpreter fallback:
+// - JMP to an address that was not translated runs in the interpreter until
+//   a translated block is reached again
+// - a store into a translated word (or a native trap writing over one) stops
+//   the native code for good: the rest of the run is interpreted, so
+//   self-modifying images still run correctly
+
+// Word range translated as a single block
+struct aot_block {
+    uint16_t start;
+    uint16_t length;
+};
+
+// Registers live in locals of the generated code and are exchanged with vm->reg
+// around the fallback
+struct aot_state {
+    bool modified;                  // the program wrote into translated code
+    uint64_t count;                 // instructions retired by the fallback
+    uint8_t code[MEMORY_MAX];       // 1 for every translated word
+    uint8_t block[MEMORY_MAX];      // 1 for every translated block start
+};
+
+// Fill the code and block maps from the table of the translated blocks
+void aotInit(struct aot_state *st, struct lc3_vm *vm, const struct aot_block *blocks, int nblocks);
+
+// Interpret from vm->reg[RPC] until a translated block start is reached, or
+// until the program halts when translated code was modified
+void aotInterpret(struct aot_state *st, struct lc3_vm *vm);
+
+// Store done by translated code. Return true when it hits translated code, or
+// when a device write stopped the machine: either way the generated code leaves
+// through the fallback, which sees vm->running.
+static inline bool aotStore(struct aot_state *st, struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (address >= MR_BASE) {
+        mem_write(vm, address, val);
+        return !vm->running;
+    }
+    vm->memory[address] = val;
+    return st->code[address];
+}
+
+// After a trap: true when it wrote a block of memory (trap.h) that overlaps
+// translated code
+static inline bool aotBulk(struct aot_state *st, struct lc3_vm *vm)
+{
+    bool hit = false;
+    for (uint16_t i = 0; i < vm->bulk_size; ++i)
+        hit |= st->code[(uint16_t)(vm->bulk_start + i)];
+    vm->bulk_size = 0;
+    return hit;
+}
+
+// Segment of the image embedded in the generated code
+struct aot_segment {
+    uint16_t origin;
+    uint32_t words;
+    const uint16_t *data;
+};
+
+// Entry point of a translated program: load the embedded segments, run from
+// entry and print the statistics with -s, like vm/main
+int aotMain(int argc, char **argv, uint64_t (*run)(struct lc3_vm *vm),
+            const struct aot_segment *segments, int nsegments, uint16_t entry);
+
+#endif
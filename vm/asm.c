@@ -0,0 +1,743 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lc3vm.h"
+#include "disasm.h"
+#include "image.h"
+#include "asm.h"
+
+#define ASM_VERSION "lc3asm 1"    // part of the cache key: change it when the output changes
+#define MAX_TOKENS 6                // label, mnemonic and up to four operands
+
+// A source line, split into words in a copy of the text
+struct line {
+    int number;
+    char *tokens[MAX_TOKENS];
+    int ntokens;
+    const char *problem;            // found while splitting, reported in order by the second pass
+};
+
+struct label {
+    char *name;
+    uint16_t address;
+    int line;                       // where it is defined
+};
+
+struct assembler {
+    const char *fileName;
+    struct asm_program *program;
+    FILE *listing;
+    int pass;                       // 1: addresses of the labels, 2: words and diagnostics
+    const struct line *line;
+    bool failed;                    // the line already has an error
+    uint32_t pc;                    // past 0xFFFF when a segment runs off memory
+    bool open;                      // a segment is open at pc
+    bool ended;                     // .END seen
+    struct label *labels;
+    int nlabels;
+    int *buckets;                   // hash of the names: index + 1 into labels, 0 for empty
+    int nbuckets;
+    uint8_t used[MEMORY_MAX];       // words already assembled
+};
+
+// ===================================================================================
+// =================================== DIAGNOSTICS ===================================
+// ===================================================================================
+// Errors are only reported in the second pass, which goes over the same lines
+// again with every label known; one error per line is enough.
+static void error(struct assembler *as, const char *format, ...)
+{
+    if (as->pass != 2 || as->failed) return;
+    as->failed = true;
+    ++as->program->errors;
+    fprintf(stderr, "%s:%d: ", as->fileName, as->line->number);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static void *allocate(size_t size)
+{
+    void *p = calloc(1, size ? size : 1);
+    if (p == NULL) {
+        fprintf(stderr, "Cannot allocate %zu bytes for the assembler\n", size);
+        abort();
+    }
+    return p;
+}
+
+
+// ===================================================================================
+// ===================================== LABELS ======================================
+// ===================================================================================
+static unsigned nameHash(const char *name)
+{
+    unsigned h = 2166136261u;
+    while (*name) h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+static struct label *findLabel(struct assembler *as, const char *name)
+{
+    if (as->nbuckets == 0) return NULL;
+    for (unsigned i = nameHash(name); ; ++i) {
+        int index = as->buckets[i & (as->nbuckets - 1)];
+        if (index == 0) return NULL;
+        if (strcmp(as->labels[index - 1].name, name) == 0) return &as->labels[index - 1];
+    }
+}
+
+static void insertBucket(struct assembler *as, int index)
+{
+    unsigned i = nameHash(as->labels[index].name);
+    while (as->buckets[i & (as->nbuckets - 1)]) ++i;
+    as->buckets[i & (as->nbuckets - 1)] = index + 1;
+}
+
+// Define a label in the first pass. The table is kept at most half full.
+static void addLabel(struct assembler *as, char *name, uint16_t address)
+{
+    if (findLabel(as, name)) return;        // duplicate, reported by the second pass
+    if (2 * (as->nlabels + 1) > as->nbuckets) {
+        int n = as->nbuckets ? 2 * as->nbuckets : 64;
+        as->labels = realloc(as->labels, n / 2 * sizeof(struct label));
+        free(as->buckets);
+        as->buckets = allocate(n * sizeof(int));
+        if (as->labels == NULL) {
+            fprintf(stderr, "Cannot allocate %d labels\n", n / 2);
+            abort();
+        }
+        as->nbuckets = n;
+        for (int i = 0; i < as->nlabels; ++i) insertBucket(as, i);
+    }
+    as->labels[as->nlabels] = (struct label){ name, address, as->line->number };
+    insertBucket(as, as->nlabels++);
+}
+
+
+// ===================================================================================
+// ===================================== OPERANDS ====================================
+// ===================================================================================
+// 0x1F, x1F, #-3, -3, 3, b101
+static bool parseNumber(const char *s, long *value)
+{
+    if (*s == '#') ++s;
+    bool negative = *s == '-';
+    if (negative) ++s;
+    int base = 10;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) base = 16, s += 2;
+    else if (s[0] == 'x' || s[0] == 'X') base = 16, ++s;
+    else if (s[0] == 'b' || s[0] == 'B') base = 2, ++s;
+    if (!isalnum((unsigned char)*s)) return false;
+
+    char *end;
+    errno = 0;
+    long v = strtol(s, &end, base);
+    if (*end != '\0' || errno) return false;
+    *value = negative ? -v : v;
+    return true;
+}
+
+static int parseRegister(const char *s)
+{
+    if ((s[0] == 'R' || s[0] == 'r') && s[1] >= '0' && s[1] <= '7' && s[2] == '\0')
+        return s[1] - '0';
+    return -1;
+}
+
+static bool isLabelName(const char *s)
+{
+    if (!isalpha((unsigned char)*s) && *s != '_') return false;
+    while (*++s)
+        if (!isalnum((unsigned char)*s) && *s != '_') return false;
+    return true;
+}
+
+static int reg(struct assembler *as, const char *s)
+{
+    int r = parseRegister(s);
+    if (r < 0) error(as, "expected a register, found '%s'", s);
+    return r < 0 ? 0 : r;
+}
+
+// A number for a bits wide field, as a signed value or as the raw field
+static uint16_t field(struct assembler *as, long value, int bits)
+{
+    if (value < -(1L << (bits - 1)) || value >= (1L << bits))
+        error(as, "%ld does not fit in %d bits", value, bits);
+    return (uint16_t)value & ((1u << bits) - 1);
+}
+
+static uint16_t immediate(struct assembler *as, const char *s, int bits)
+{
+    long value;
+    if (!parseNumber(s, &value)) {
+        error(as, "expected a number, found '%s'", s);
+        return 0;
+    }
+    return field(as, value, bits);
+}
+
+// Address of a label, false if s is not one. The first pass does not know
+// every label yet and takes 0.
+static bool labelAddress(struct assembler *as, const char *s, uint16_t *address)
+{
+    if (!isLabelName(s)) return false;
+    const struct label *label = findLabel(as, s);
+    if (label == NULL && as->pass == 2) error(as, "undefined label '%s'", s);
+    *address = label ? label->address : 0;
+    return true;
+}
+
+// PC relative offset: a label, or a number for the field
+static uint16_t offset(struct assembler *as, const char *s, int bits)
+{
+    long value;
+    if (parseNumber(s, &value)) return field(as, value, bits);
+
+    uint16_t address;
+    if (!labelAddress(as, s, &address)) {
+        error(as, "expected a label or an offset, found '%s'", s);
+        return 0;
+    }
+    long distance = (long)address - (long)(as->pc + 1);
+    if (distance < -(1L << (bits - 1)) || distance >= (1L << (bits - 1)))
+        error(as, "'%s' is %ld words away, out of the range of %d bits", s, distance, bits);
+    return (uint16_t)distance & ((1u << bits) - 1);
+}
+
+// .FILL value: a number or the address of a label
+static uint16_t word(struct assembler *as, const char *s)
+{
+    long value;
+    if (parseNumber(s, &value)) {
+        if (value < -0x8000 || value > 0xFFFF) error(as, "%ld does not fit in a word", value);
+        return (uint16_t)value;
+    }
+    uint16_t address = 0;
+    if (!labelAddress(as, s, &address)) error(as, "expected a value or a label, found '%s'", s);
+    return address;
+}
+
+// TRAP vector: a number or a trap name
+static uint16_t vector(struct assembler *as, const char *s)
+{
+    for (int v = 0; v < 256; ++v)
+        if (trapName(v) && strcasecmp(trapName(v), s) == 0) return v;
+    return immediate(as, s, 8);
+}
+
+
+// ===================================================================================
+// ================================ INSTRUCTION SET ==================================
+// ===================================================================================
+enum form {
+    F_NONE,         // RET, RTI, HALT...: the word as it is
+    F_ARITH,        // ADD/AND DR SR1 SR2|imm5
+    F_NOT,          // NOT DR SR
+    F_PCREL,        // LD/LDI/LEA/ST/STI R PCoffset9
+    F_BASE,         // LDR/STR R BaseR offset6
+    F_JSR,          // JSR PCoffset11 (JSR R is JSRR, as in assembler.py)
+    F_REG,          // JMP/JSRR BaseR
+    F_TRAP,         // TRAP vector
+    F_BR,           // BRnzp PCoffset9, BR [NZP] PCoffset9
+};
+
+struct mnemonic {
+    const char *name;
+    enum form form;
+    uint16_t word;
+    int operands;
+};
+
+static const struct mnemonic mnemonics[] = {
+    { "ADD",   F_ARITH, 0x1000, 3 }, { "AND",   F_ARITH, 0x5000, 3 }, { "NOT",  F_NOT,   0x903F, 2 },
+    { "LD",    F_PCREL, 0x2000, 2 }, { "LDI",   F_PCREL, 0xA000, 2 }, { "LEA",  F_PCREL, 0xE000, 2 },
+    { "ST",    F_PCREL, 0x3000, 2 }, { "STI",   F_PCREL, 0xB000, 2 },
+    { "LDR",   F_BASE,  0x6000, 3 }, { "STR",   F_BASE,  0x7000, 3 },
+    { "JSR",   F_JSR,   0x4800, 1 }, { "JSRR",  F_REG,   0x4000, 1 }, { "JMP",  F_REG,   0xC000, 1 },
+    { "RET",   F_NONE,  0xC1C0, 0 }, { "RTI",   F_NONE,  0x8000, 0 }, { "RES",  F_NONE,  0xD000, 0 },
+    { "TRAP",  F_TRAP,  0xF000, 1 },
+    { "GETC",  F_NONE,  0xF020, 0 }, { "OUT",   F_NONE,  0xF021, 0 }, { "PUTS", F_NONE,  0xF022, 0 },
+    { "IN",    F_NONE,  0xF023, 0 }, { "PUTSP", F_NONE,  0xF024, 0 }, { "HALT", F_NONE,  0xF025, 0 },
+};
+
+static const char *directives[] = { ".ORIG", ".FILL", ".BLKW", ".STRINGZ", ".END" };
+
+// Condition bits of the letters of s (any of N, Z, P), -1 if s has others
+static int conditions(const char *s)
+{
+    int nzp = 0;
+    for (; *s; ++s) {
+        switch (toupper((unsigned char)*s)) {
+        case 'N': nzp |= 0x4; break;
+        case 'Z': nzp |= 0x2; break;
+        case 'P': nzp |= 0x1; break;
+        default:  return -1;
+        }
+    }
+    return nzp;
+}
+
+// The mnemonic of a word, NULL if it is not one. A BR with conditions in the
+// name gets them in *nzp (0 for plain BR).
+static const struct mnemonic *findMnemonic(const char *s, int *nzp)
+{
+    static const struct mnemonic branch = { "BR", F_BR, 0x0000, 1 };
+    if (strncasecmp(s, "BR", 2) == 0 && (*nzp = conditions(s + 2)) >= 0) return &branch;
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); ++i)
+        if (strcasecmp(mnemonics[i].name, s) == 0) return &mnemonics[i];
+    return NULL;
+}
+
+static bool isKeyword(const char *s)
+{
+    int nzp;
+    for (size_t i = 0; i < sizeof(directives) / sizeof(directives[0]); ++i)
+        if (strcasecmp(directives[i], s) == 0) return true;
+    return findMnemonic(s, &nzp) != NULL;
+}
+
+
+// ===================================================================================
+// ===================================== OUTPUT ======================================
+// ===================================================================================
+static void startSegment(struct assembler *as, uint16_t origin)
+{
+    struct asm_program *program = as->program;
+    if (program->nsegments == 0) program->entry = origin;
+    if (program->nsegments > 0 && program->segments[program->nsegments - 1].words == 0)
+        --program->nsegments;               // nothing went in the last one
+    as->pc = origin;
+    as->open = true;
+    if (program->nsegments == IMAGE_SEGMENTS) error(as, "more than %d segments", IMAGE_SEGMENTS);
+    else program->segments[program->nsegments++] = (struct asm_segment){ origin, 0 };
+}
+
+// Put a word at pc. The first pass only counts it.
+static void emit(struct assembler *as, uint16_t value, const char *text)
+{
+    if (!as->open) startSegment(as, PC_START);
+    if (as->pc >= MEMORY_MAX) {
+        if (as->pc++ == MEMORY_MAX) error(as, "past the end of memory");
+        return;
+    }
+    if (as->pass == 2) {
+        if (as->used[as->pc]) error(as, "overlaps the code at 0x%04X", as->pc);
+        as->used[as->pc] = 1;
+        as->program->memory[as->pc] = value;
+        if (as->program->nsegments) as->program->segments[as->program->nsegments - 1].words++;
+        if (as->listing) {
+            fprintf(as->listing, "0x%04X: 0b", as->pc);
+            for (int bit = 15; bit >= 0; --bit) fputc('0' + (value >> bit & 1), as->listing);
+            fprintf(as->listing, " 0x%04X %s\n", value, text);
+        }
+    }
+    ++as->pc;
+}
+
+
+// ===================================================================================
+// ==================================== STATEMENTS ===================================
+// ===================================================================================
+// Emit the chars of a "string" and a 0; false if s is not one
+static bool stringz(struct assembler *as, const char *s, const char *text)
+{
+    size_t n = strlen(s);
+    if (n < 2 || s[0] != '"' || s[n - 1] != '"') return false;
+    for (const char *in = s + 1; in < s + n - 1; ++in, text = "") {
+        char c = *in;
+        if (c == '\\' && in + 1 < s + n - 1) {
+            switch (*++in) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case '0': c = '\0'; break;
+            default:  c = *in; break;
+            }
+        }
+        emit(as, (uint8_t)c, text);
+    }
+    emit(as, 0, text);
+    return true;
+}
+
+static void directive(struct assembler *as, char **operands, int n, const char *name, const char *text)
+{
+    long value;
+    if (strcasecmp(name, ".ORIG") == 0) {
+        if (n != 1 || !parseNumber(operands[0], &value) || value < 0 || value > 0xFFFF)
+            error(as, ".ORIG needs an address");
+        else startSegment(as, value);
+    }
+    else if (strcasecmp(name, ".FILL") == 0) {
+        if (n != 1) error(as, ".FILL needs one value");
+        emit(as, n == 1 ? word(as, operands[0]) : 0, text);
+    }
+    else if (strcasecmp(name, ".BLKW") == 0) {
+        if (n < 1 || n > 2 || !parseNumber(operands[0], &value) || value < 1 || value > MEMORY_MAX) {
+            error(as, ".BLKW needs a count of words and an optional value");
+            return;
+        }
+        uint16_t fill = n == 2 ? word(as, operands[1]) : 0;
+        for (long i = 0; i < value && !as->failed; ++i) emit(as, fill, i ? "" : text);
+    }
+    else if (strcasecmp(name, ".STRINGZ") == 0) {
+        if (n != 1 || !stringz(as, operands[0], text)) error(as, ".STRINGZ needs a \"string\"");
+    }
+    else as->ended = true;                  // .END
+}
+
+static void instruction(struct assembler *as, const struct mnemonic *m, int nzp, char **operands, int n, const char *text)
+{
+    // BR NZP offset: the conditions as an operand
+    if (m->form == F_BR && nzp == 0 && n == 2 && conditions(operands[0]) > 0) {
+        nzp = conditions(operands[0]);
+        ++operands, --n;
+    }
+    if (n != m->operands) {
+        error(as, "%s takes %d operand%s, found %d", m->name, m->operands, m->operands == 1 ? "" : "s", n);
+        emit(as, 0, text);
+        return;
+    }
+
+    uint16_t w = m->word;
+    switch (m->form) {
+    case F_NONE:
+        break;
+    case F_ARITH:
+        w |= reg(as, operands[0]) << 9 | reg(as, operands[1]) << 6;
+        if (parseRegister(operands[2]) >= 0) w |= parseRegister(operands[2]);
+        else w |= 0x20 | immediate(as, operands[2], 5);
+        break;
+    case F_NOT:
+        w |= reg(as, operands[0]) << 9 | reg(as, operands[1]) << 6;
+        break;
+    case F_PCREL:
+        w |= reg(as, operands[0]) << 9 | offset(as, operands[1], 9);
+        break;
+    case F_BASE:
+        w |= reg(as, operands[0]) << 9 | reg(as, operands[1]) << 6 | immediate(as, operands[2], 6);
+        break;
+    case F_JSR:
+        if (parseRegister(operands[0]) >= 0) w = 0x4000 | parseRegister(operands[0]) << 6;
+        else w |= offset(as, operands[0], 11);
+        break;
+    case F_REG:
+        w |= reg(as, operands[0]) << 6;
+        break;
+    case F_TRAP:
+        w |= vector(as, operands[0]);
+        break;
+    case F_BR:
+        w |= (nzp ? nzp : 0x7) << 9 | offset(as, operands[0], 9);
+        break;
+    }
+    emit(as, w, text);
+}
+
+static void statement(struct assembler *as, const struct line *line)
+{
+    as->line = line;
+    as->failed = false;
+    if (line->problem) {
+        error(as, "%s", line->problem);
+        return;
+    }
+    char *const *t = line->tokens;
+    int n = line->ntokens, first = 0;
+
+    // Source text of the listing, without the comment
+    char text[256] = "";
+    if (as->pass == 2 && as->listing) {
+        for (int i = 0, at = 0; i < n && at < (int)sizeof(text); ++i)
+            at += snprintf(text + at, sizeof(text) - at, "%s%s", i ? " " : "", t[i]);
+    }
+
+    if (!isKeyword(t[0])) {
+        if (n > 1 && !isKeyword(t[1])) {
+            error(as, "unknown instruction '%s'", t[0]);
+            return;
+        }
+        size_t length = strlen(t[0]);
+        if (length > 1 && t[0][length - 1] == ':') t[0][length - 1] = '\0';
+        if (!isLabelName(t[0])) {
+            error(as, n > 1 ? "bad label '%s'" : "unknown instruction '%s'", t[0]);
+            return;
+        }
+        if (!as->open) startSegment(as, PC_START);
+        if (as->pass == 1) addLabel(as, t[0], as->pc);
+        else {
+            const struct label *label = findLabel(as, t[0]);
+            if (label->line != line->number)
+                error(as, "label '%s' already defined at line %d", t[0], label->line);
+        }
+        first = 1;
+    }
+    if (first == n) return;
+
+    int nzp = 0;
+    const struct mnemonic *m = findMnemonic(t[first], &nzp);
+    if (m) instruction(as, m, nzp, (char **)t + first + 1, n - first - 1, text);
+    else directive(as, (char **)t + first + 1, n - first - 1, t[first], text);
+}
+
+
+// ===================================================================================
+// ===================================== SOURCE ======================================
+// ===================================================================================
+// Split text (a copy, modified in place) into the lines that have words
+static struct line *splitLines(char *text, size_t length, int *nlines)
+{
+    int capacity = 64, n = 0;
+    struct line *lines = allocate(capacity * sizeof(struct line));
+    char *s = text, *end = text + length;
+    for (int number = 1; s < end; ++number) {
+        char *eol = memchr(s, '\n', end - s);
+        if (eol == NULL) eol = end;
+        *eol = '\0';
+
+        struct line line = { .number = number };
+        bool overflow = false, unterminated = false;
+        while (true) {
+            while (*s == ' ' || *s == '\t' || *s == ',' || *s == '\r') ++s;
+            if (*s == '\0' || *s == ';') break;
+            char *token = s;
+            if (*s == '"') {
+                for (++s; *s && *s != '"'; ++s)
+                    if (*s == '\\' && s[1]) ++s;
+                // The closing quote ends the word
+                if (*s == '"') ++s;
+                else unterminated = true;
+                if (*s && !isspace((unsigned char)*s) && *s != ',' && *s != ';') unterminated = true;
+            }
+            else {
+                while (*s && !isspace((unsigned char)*s) && *s != ',' && *s != ';') ++s;
+            }
+            if (line.ntokens == MAX_TOKENS) overflow = true;
+            else line.tokens[line.ntokens++] = token;
+            char c = *s;
+            *s = '\0';
+            if (c == '\0' || c == ';') break;
+            ++s;
+        }
+        if (overflow || unterminated) line.problem = overflow ? "too many operands" : "malformed string";
+        if (line.ntokens) {
+            if (n == capacity) {
+                capacity *= 2;
+                lines = realloc(lines, capacity * sizeof(struct line));
+                if (lines == NULL) {
+                    fprintf(stderr, "Cannot allocate %d source lines\n", capacity);
+                    abort();
+                }
+            }
+            lines[n++] = line;
+        }
+        s = eol + 1;
+    }
+    *nlines = n;
+    return lines;
+}
+
+static int byAddress(const void *a, const void *b)
+{
+    return ((const struct image_symbol *)a)->address - ((const struct image_symbol *)b)->address;
+}
+
+struct asm_program *asmAssemble(const char *fileName, const char *text, size_t length, FILE *listing)
+{
+    struct asm_program *program = allocate(sizeof(struct asm_program));
+    struct assembler *as = allocate(sizeof(struct assembler));
+    as->fileName = fileName;
+    as->program = program;
+    as->listing = listing;
+    program->entry = PC_START;
+
+    char *copy = allocate(length + 1);
+    memcpy(copy, text, length);
+    int nlines;
+    struct line *lines = splitLines(copy, length, &nlines);
+
+    for (as->pass = 1; as->pass <= 2; ++as->pass) {
+        as->pc = PC_START;
+        as->open = false;
+        as->ended = false;
+        program->nsegments = 0;
+        for (int i = 0; i < nlines; ++i) {
+            statement(as, &lines[i]);
+            if (as->ended) break;
+        }
+    }
+    if (program->nsegments > 0 && program->segments[program->nsegments - 1].words == 0)
+        --program->nsegments;
+
+    program->symbols = allocate(as->nlabels * sizeof(struct image_symbol));
+    for (int i = 0; i < as->nlabels; ++i) {
+        program->symbols[i].address = as->labels[i].address;
+        program->symbols[i].name = strdup(as->labels[i].name);
+    }
+    program->nsymbols = as->nlabels;
+    if (program->nsymbols) qsort(program->symbols, program->nsymbols, sizeof(struct image_symbol), byAddress);
+
+    free(lines);
+    free(copy);
+    free(as->labels);
+    free(as->buckets);
+    free(as);
+    return program;
+}
+
+void asmFree(struct asm_program *program)
+{
+    for (int i = 0; i < program->nsymbols; ++i) free((char *)program->symbols[i].name);
+    free(program->symbols);
+    free(program);
+}
+
+
+// ===================================================================================
+// ==================================== CONTAINER ====================================
+// ===================================================================================
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+    return put16(put16(p, v & 0xFFFF), v >> 16);
+}
+
+// Header, section table, the code sections, then the symbols
+uint8_t *asmContainer(const struct asm_program *program, size_t *size)
+{
+    int nsections = program->nsegments + (program->nsymbols > 0);
+    size_t header = strlen(IMAGE_MAGIC) + 4 + nsections * 12, symbols = 0;
+    size_t code = 0;
+    for (int s = 0; s < program->nsegments; ++s) code += 2 * program->segments[s].words;
+    for (int i = 0; i < program->nsymbols; ++i) symbols += 2 + strlen(program->symbols[i].name) + 1;
+
+    *size = header + code + symbols;
+    uint8_t *image = allocate(*size);
+    uint8_t *p = image + strlen(IMAGE_MAGIC), *data = image + header;
+    memcpy(image, IMAGE_MAGIC, strlen(IMAGE_MAGIC));
+    p = put16(put16(p, program->entry), nsections);
+    for (int s = 0; s < program->nsegments; ++s) {
+        const struct asm_segment *segment = &program->segments[s];
+        p = put16(put16(put32(put32(p, data - image), 2 * segment->words), IMAGE_CODE), segment->origin);
+        for (uint32_t w = 0; w < segment->words; ++w)
+            data = put16(data, program->memory[segment->origin + w]);
+    }
+    if (program->nsymbols) {
+        put16(put16(put32(put32(p, data - image), symbols), IMAGE_SYMBOLS), 0);
+        for (int i = 0; i < program->nsymbols; ++i) {
+            data = put16(data, program->symbols[i].address);
+            size_t n = strlen(program->symbols[i].name) + 1;
+            memcpy(data, program->symbols[i].name, n);
+            data += n;
+        }
+    }
+    return image;
+}
+
+
+// ===================================================================================
+// ====================================== CACHE ======================================
+// ===================================================================================
+static char *readSource(const char *fileName, size_t *length)
+{
+    FILE *file = fopen(fileName, "rb");
+    struct stat st;
+    if (file == NULL || fstat(fileno(file), &st) != 0) {
+        fprintf(stderr, "Cannot open file %s\n", fileName);
+        abort();
+    }
+    char *text = allocate(st.st_size);
+    *length = fread(text, 1, st.st_size, file);
+    fclose(file);
+    return text;
+}
+
+// Create dir and its missing parents; false if it cannot be done
+static bool makeDirectory(char *dir)
+{
+    for (char *s = dir + 1; ; ++s) {
+        if (*s != '/' && *s != '\0') continue;
+        char c = *s;
+        *s = '\0';
+        bool ok = mkdir(dir, 0755) == 0 || errno == EEXIST;
+        *s = c;
+        if (!ok) return false;
+        if (c == '\0') return true;
+    }
+}
+
+// Path of the cached image of a source text, false without a cache
+static bool cachePath(const char *text, size_t length, char *path, size_t size)
+{
+    const char *env = getenv("LC3_CACHE");
+    char dir[PATH_MAX];
+    if (env) snprintf(dir, sizeof(dir), "%s", env);
+    else if (getenv("XDG_CACHE_HOME") && *getenv("XDG_CACHE_HOME"))
+        snprintf(dir, sizeof(dir), "%s/lc3vm", getenv("XDG_CACHE_HOME"));
+    else if (getenv("HOME")) snprintf(dir, sizeof(dir), "%s/.cache/lc3vm", getenv("HOME"));
+    else return false;
+    if (dir[0] == '\0' || !makeDirectory(dir)) return false;
+
+    // FNV-1a of the assembler version and the text
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *s = ASM_VERSION; *s; ++s) hash = (hash ^ (uint8_t)*s) * 1099511628211ull;
+    for (size_t i = 0; i < length; ++i) hash = (hash ^ (uint8_t)text[i]) * 1099511628211ull;
+    return snprintf(path, size, "%s/%016llx-%zu.lc3", dir, (unsigned long long)hash, length) < (int)size;
+}
+
+// Write an image into the cache. It is written aside and renamed, so readers
+// (other processes assembling the same source) never see half of it.
+static void storeCache(const char *path, const uint8_t *image, size_t size)
+{
+    char temporary[PATH_MAX + 32];
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) return;
+    bool ok = fwrite(image, 1, size, file) == size;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary, path) != 0) remove(temporary);
+}
+
+struct lc3_image *asmOpen(const char *fileName)
+{
+    size_t length;
+    char *text = readSource(fileName, &length);
+    char path[PATH_MAX];
+    bool cached = cachePath(text, length, path, sizeof(path));
+    if (cached && access(path, R_OK) == 0) {
+        free(text);
+        return imageOpen(path);
+    }
+
+    struct asm_program *program = asmAssemble(fileName, text, length, NULL);
+    free(text);
+    if (program->errors) {
+        fprintf(stderr, "Cannot assemble %s: %d error%s\n", fileName, program->errors, program->errors == 1 ? "" : "s");
+        abort();
+    }
+    size_t size;
+    uint8_t *image = asmContainer(program, &size);
+    asmFree(program);
+    if (cached) storeCache(path, image, size);
+    return imageAdopt(fileName, image, size);
+}
@@ -0,0 +1,67 @@
+#ifndef H_ASM
+#define H_ASM
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "lc3vm.h"
+#include "image.h"
+
+// ASSEMBLER
+// Two pass assembler for LC-3 sources, linked into the VM so a program can be
+// run straight from its source (imageOpen of a name ending in .asm). It takes
+// both the syntax of assembler/assembler.py and the standard one, in any mix:
+//   LOOP  ADD R1, R1, #-1      ; label, commas, decimal immediate
+//         BRp LOOP             ; BR with the conditions in the name, label target
+//         BR NZP 0x1FE         ; or as an operand, raw offset field
+//         TRAP x25             ; or TRAP HALT, or HALT
+// - mnemonics, registers and trap names are case insensitive, labels are not
+// - a label is the first word of a line when it is not a mnemonic (a trailing
+//   ':' is dropped); it names the address of the next word
+// - numbers: 0x1F and x1F hex, #-3 and -3 decimal, b101 binary. Immediates and
+//   offsets are written either as the signed value or as the raw bit field
+//   (0x1F for -1 in imm5), so the sources of assembler.py keep their meaning
+// - a label as a PC-relative operand is turned into the offset, and must be in
+//   the range of the field; as a .FILL operand it is its address
+// - RET, JSRR, RTI and the traps GETC, OUT, PUTS, IN, PUTSP, HALT as mnemonics
+// Directives: .ORIG address (starts a segment; code before the first .ORIG
+// goes at PC_START), .FILL value, .BLKW count [value], .STRINGZ "text" (one
+// char per word and a 0, with \n \t \" \\ \0 escapes), .END (ignores the rest).
+// The entry point is the start of the first segment.
+// Diagnostics go to stderr as "file:line: message", and assembly goes on after
+// an error to report the others.
+
+struct asm_segment {
+    uint16_t origin;
+    uint32_t words;
+};
+
+struct asm_program {
+    uint16_t entry;
+    uint16_t memory[MEMORY_MAX];            // assembled words, at their addresses
+    struct asm_segment segments[IMAGE_SEGMENTS];
+    int nsegments;
+    struct image_symbol *symbols;           // labels, sorted by address (names malloc'd)
+    int nsymbols;
+    int errors;
+};
+
+// Assemble length bytes of source text. With a listing stream, write every
+// word as "address: binary hex source". Check program->errors before using it.
+struct asm_program *asmAssemble(const char *fileName, const char *text, size_t length, FILE *listing);
+void asmFree(struct asm_program *program);
+
+// Container image (image.h) with the segments and the symbols, malloc'd
+uint8_t *asmContainer(const struct asm_program *program, size_t *size);
+
+// ASSEMBLY CACHE
+// asmOpen assembles a source file into an image. Assembled images are kept as
+// containers in a cache directory, named by a hash of the source text, so a
+// source that was assembled before (under any name) is only mapped again.
+// The directory is $LC3_CACHE, else $XDG_CACHE_HOME/lc3vm, else
+// $HOME/.cache/lc3vm; LC3_CACHE set to an empty string disables the cache.
+// A source with errors is a fatal error, after its diagnostics.
+struct lc3_image *asmOpen(const char *fileName);
+
+#endif
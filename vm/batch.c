@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "lc3vm.h"
+#include "snapshot.h"
+#include "console.h"
+#include "batch.h"
+#include "warp.h"
+
+// ===================================================================================
+// ==================================== JOB LIST =====================================
+// ===================================================================================
+struct lc3_job *batchLoad(const char *fileName, size_t *njobs)
+{
+    FILE *fileptr = fopen(fileName, "r");
+    if (fileptr == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", fileName);
+        abort();
+    }
+
+    struct lc3_job *jobs = NULL;
+    size_t n = 0, cap = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), fileptr) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char *program = strtok(line, " \t\r\n");
+        if (program == NULL) continue;
+        char *input = strtok(NULL, " \t\r\n");
+
+        if (n == cap) {
+            cap = cap ? 2 * cap : 64;
+            jobs = realloc(jobs, cap * sizeof(*jobs));
+            if (jobs == NULL) {
+                fprintf(stderr, "Cannot allocate %zu jobs\n", cap);
+                abort();
+            }
+        }
+        jobs[n] = (struct lc3_job){0};
+        jobs[n].program = strdup(program);
+        jobs[n].input = input ? strdup(input) : NULL;
+        ++n;
+    }
+    fclose(fileptr);
+
+    *njobs = n;
+    return jobs;
+}
+
+void batchFree(struct lc3_job *jobs, size_t njobs)
+{
+    for (size_t i = 0; i < njobs; ++i) {
+        free(jobs[i].program);
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+}
+
+
+// ===================================================================================
+// ================================== WORKER POOL ====================================
+// ===================================================================================
+// Units [head, tail) of a worker not taken yet. The owner takes from the tail,
+// thieves from the head.
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    size_t head, tail;
+    struct pool *pool;
+    int id;
+    uint64_t instructions;
+    size_t exhausted;
+    struct warp_stats warp;
+};
+
+// The workers take units: a job, or with warps up to WARP_LANES jobs of the
+// same program, order[start[u]] to order[start[u + 1] - 1]
+struct pool {
+    struct lc3_job *jobs;
+    struct lc3_snapshot **images;   // loaded image of each job, shared by the jobs of a program
+    struct worker *workers;
+    int nworkers;
+    uint64_t (*run)(struct lc3_vm *vm);
+    uint64_t budget;
+    bool warps;
+    size_t *order;
+    size_t *start;
+    size_t nunits;
+};
+
+// Take the last unit of the worker's own range, or -1
+static long takeOwn(struct worker *w)
+{
+    long job = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) job = --w->tail;
+    pthread_mutex_unlock(&w->lock);
+    return job;
+}
+
+// Take the first unit of another worker's range, or -1 when all are empty
+static long steal(struct worker *w)
+{
+    struct pool *pool = w->pool;
+    for (int i = 1; i < pool->nworkers; ++i) {
+        struct worker *victim = &pool->workers[(w->id + i) % pool->nworkers];
+        long job = -1;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) job = victim->head++;
+        pthread_mutex_unlock(&victim->lock);
+        if (job >= 0) return job;
+    }
+    return -1;
+}
+
+// Restoring the image of the job only copies back the pages written by the
+// previous job of this VM, when it ran the same program
+static void startJob(struct pool *pool, struct lc3_vm *vm, size_t index, FILE **in, FILE **out)
+{
+    struct lc3_job *job = &pool->jobs[index];
+    snapshotRestore(vm, pool->images[index]);
+
+    *in = fopen(job->input ? job->input : "/dev/null", "r");
+    if (*in == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", job->input);
+        abort();
+    }
+    *out = open_memstream(&job->output, &job->output_size);
+    if (*out == NULL) {
+        fprintf(stderr, "Cannot capture the output of %s\n", job->program);
+        abort();
+    }
+    consoleAttach(vm, *in, *out);
+}
+
+static void endJob(struct worker *w, struct lc3_vm *vm, struct lc3_job *job, FILE *in, FILE *out)
+{
+    job->halted = !vm->running;
+    consoleAttach(vm, stdin, stdout);       // flush, and drop the streams before closing them
+    fclose(in);
+    fclose(out);
+    w->instructions += job->count;
+    if (!job->halted) ++w->exhausted;
+}
+
+static void runUnit(struct worker *w, struct lc3_vm **vms, long unit)
+{
+    struct pool *pool = w->pool;
+    size_t first = pool->start[unit], n = pool->start[unit + 1] - first;
+    FILE *in[WARP_LANES], *out[WARP_LANES];
+    uint64_t count[WARP_LANES];
+    for (size_t k = 0; k < n; ++k)
+        startJob(pool, vms[k], pool->order[first + k], &in[k], &out[k]);
+    if (pool->warps) warpRun(vms, (int)n, count, &w->warp);
+    else count[0] = pool->run(vms[0]);
+    for (size_t k = 0; k < n; ++k) {
+        struct lc3_job *job = &pool->jobs[pool->order[first + k]];
+        job->count = count[k];
+        endJob(w, vms[k], job, in[k], out[k]);
+    }
+}
+
+static void *workerMain(void *arg)
+{
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+    struct lc3_vm *vms[WARP_LANES];
+    int nvms = pool->warps ? WARP_LANES : 1;
+    for (int k = 0; k < nvms; ++k) {
+        vms[k] = vmCreate();
+        vms[k]->budget = pool->budget;
+    }
+
+    long unit;
+    while ((unit = takeOwn(w)) >= 0 || (unit = steal(w)) >= 0)
+        runUnit(w, vms, unit);
+
+    for (int k = 0; k < nvms; ++k) vmDestroy(vms[k]);
+    return NULL;
+}
+
+// Load every distinct program once, as a snapshot of a VM right after loadProgram
+static struct lc3_snapshot **loadImages(struct lc3_job *jobs, size_t njobs,
+                                        struct lc3_snapshot ***distinct, size_t *ndistinct)
+{
+    struct lc3_snapshot **images = calloc(njobs ? njobs : 1, sizeof(*images));
+    *distinct = calloc(njobs ? njobs : 1, sizeof(**distinct));
+    size_t *first = calloc(njobs ? njobs : 1, sizeof(*first));    // job that loaded each image
+    if (images == NULL || *distinct == NULL || first == NULL) {
+        fprintf(stderr, "Cannot allocate %zu jobs\n", njobs);
+        abort();
+    }
+
+    struct lc3_vm *vm = vmCreate();
+    *ndistinct = 0;
+    for (size_t i = 0; i < njobs; ++i) {
+        for (size_t k = 0; k < *ndistinct && images[i] == NULL; ++k)
+            if (strcmp(jobs[first[k]].program, jobs[i].program) == 0)
+                images[i] = (*distinct)[k];
+        if (images[i] != NULL) continue;
+
+        vmReset(vm);
+        vm->reg[RPC] = loadProgram(jobs[i].program, vm->memory);
+        images[i] = (*distinct)[*ndistinct] = snapshotCreate(vm);
+        first[(*ndistinct)++] = i;
+    }
+    vmDestroy(vm);
+    free(first);
+    return images;
+}
+
+void batchRun(struct lc3_job *jobs, size_t njobs, int threads,
+              uint64_t (*run)(struct lc3_vm *vm), uint64_t budget,
+              struct batch_report *report)
+{
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    if ((size_t)threads > njobs) threads = njobs ? (int)njobs : 1;
+
+    struct lc3_snapshot **distinct;
+    size_t ndistinct;
+    struct lc3_snapshot **images = loadImages(jobs, njobs, &distinct, &ndistinct);
+
+    struct pool pool = { jobs, images, calloc(threads, sizeof(struct worker)), threads, run, budget,
+                         run == programRunWarp, NULL, NULL, 0 };
+    pool.order = calloc(njobs ? njobs : 1, sizeof(size_t));
+    pool.start = calloc(njobs + 1, sizeof(size_t));
+    if (pool.workers == NULL || pool.order == NULL || pool.start == NULL) {
+        fprintf(stderr, "Cannot allocate %d workers\n", threads);
+        abort();
+    }
+    // Warps take the jobs of a program WARP_LANES at a time, in job order
+    size_t placed = 0;
+    for (size_t k = 0; k < (pool.warps ? ndistinct : 1); ++k) {
+        size_t lanes = 0;
+        for (size_t i = 0; i < njobs; ++i) {
+            if (pool.warps && images[i] != distinct[k]) continue;
+            if (!pool.warps || lanes++ % WARP_LANES == 0) pool.start[pool.nunits++] = placed;
+            pool.order[placed++] = i;
+        }
+    }
+    pool.start[pool.nunits] = placed;
+    if ((size_t)threads > pool.nunits) threads = pool.nworkers = pool.nunits ? (int)pool.nunits : 1;
+
+    for (int i = 0; i < threads; ++i) {
+        struct worker *w = &pool.workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->head = pool.nunits * i / threads;
+        w->tail = pool.nunits * (i + 1) / threads;
+        w->pool = &pool;
+        w->id = i;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; ++i)
+        if (pthread_create(&pool.workers[i].thread, NULL, workerMain, &pool.workers[i]) != 0) {
+            fprintf(stderr, "Cannot create worker thread\n");
+            abort();
+        }
+    for (int i = 0; i < threads; ++i)
+        pthread_join(pool.workers[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *report = (struct batch_report){ njobs, threads, 0, 0, 0.0, {0} };
+    report->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    for (int i = 0; i < threads; ++i) {
+        struct worker *w = &pool.workers[i];
+        report->instructions += w->instructions;
+        report->exhausted += w->exhausted;
+        report->warp.steps += w->warp.steps;
+        report->warp.lanes += w->warp.lanes;
+        report->warp.divergent += w->warp.divergent;
+        report->warp.peeled += w->warp.peeled;
+        report->warp.scalar += w->warp.scalar;
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(pool.workers);
+    free(pool.order);
+    free(pool.start);
+    for (size_t i = 0; i < ndistinct; ++i)
+        snapshotDestroy(distinct[i]);
+    free(distinct);
+    free(images);
+}
+
+void batchReport(const struct batch_report *report)
+{
+    double seconds = report->seconds;
+    fprintf(stderr, "batch: %zu jobs on %d threads in %.3f s, %.1f jobs/s, %llu instructions, %.1f MIPS\n",
+            report->jobs, report->threads, seconds, seconds > 0 ? report->jobs / seconds : 0.0,
+            (unsigned long long)report->instructions,
+            seconds > 0 ? report->instructions / seconds * 1e-6 : 0.0);
+    if (report->exhausted)
+        fprintf(stderr, "batch: %zu jobs stopped by the instruction budget\n", report->exhausted);
+    if (report->warp.steps || report->warp.peeled) warpReport(stderr, &report->warp);
+}
@@ -0,0 +1,53 @@
+#ifndef H_BATCH
+#define H_BATCH
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lc3vm.h"
+#include "warp.h"
+
+// BATCH RUNNER
+// Run a list of independent jobs (an image and a file read by the input traps)
+// on a pool of worker threads, each with its own VM reused from job to job.
+// Every distinct image is loaded once into a snapshot (snapshot.h) that the
+// workers restore before each job.
+// The job list is split in contiguous ranges, one per worker. A worker takes
+// jobs from the end of its own range and, once it is empty, steals from the
+// start of the range of another worker, so a few long jobs do not leave the
+// other threads idle. The output of every job is captured in memory.
+// With the warp engine (programRunWarp, warp.h) the unit of work is a warp:
+// up to WARP_LANES jobs of the same program, run in lockstep by warpRun.
+struct lc3_job {
+    char *program;          // image, in the format of loadProgram
+    char *input;            // input file, NULL for an empty input
+    char *output;           // captured output, filled by batchRun
+    size_t output_size;
+    uint64_t count;         // retired instructions
+    bool halted;            // false if the job was stopped by the budget
+};
+
+struct batch_report {
+    size_t jobs;
+    int threads;
+    size_t exhausted;       // jobs stopped by the budget
+    uint64_t instructions;
+    double seconds;
+    struct warp_stats warp; // warp engine only
+};
+
+// Read a job list: one job per line, "program.bin [input]", '#' starts a comment
+struct lc3_job *batchLoad(const char *fileName, size_t *njobs);
+void batchFree(struct lc3_job *jobs, size_t njobs);
+
+// Run every job with the given engine, which must not use global state.
+// budget limits each job (0: no limit), threads <= 0 uses one per online CPU.
+void batchRun(struct lc3_job *jobs, size_t njobs, int threads,
+              uint64_t (*run)(struct lc3_vm *vm), uint64_t budget,
+              struct batch_report *report);
+
+// Print jobs/sec and total MIPS on stderr
+void batchReport(const struct batch_report *report);
+
+#endif
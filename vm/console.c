@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+
+#include "lc3vm.h"
+#include "console.h"
+
+// ===================================================================================
+// ==================================== CONSOLE ======================================
+// ===================================================================================
+struct console *consoleCreate(void)
+{
+    struct console *io = malloc(sizeof(struct console));
+    if (io == NULL) {
+        fprintf(stderr, "Cannot allocate console buffers\n");
+        abort();
+    }
+    io->mode = CONSOLE_BUFFERED;
+    io->newline = false;
+    io->eof = false;
+    io->out_used = 0;
+    io->in_pos = io->in_len = 0;
+    io->parks = 0;
+    io->parked = 0.0;
+    io->log = NULL;
+    return io;
+}
+
+void consoleDestroy(struct console *io)
+{
+    free(io);
+}
+
+void consoleAttach(struct lc3_vm *vm, FILE *in, FILE *out)
+{
+    consoleFlush(vm);
+    vm->in = in;
+    vm->out = out;
+    vm->io->in_pos = vm->io->in_len = 0;
+    vm->io->eof = false;
+}
+
+void consoleFlush(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    if (io->out_used) fwrite(io->out, 1, io->out_used, vm->out);
+    fflush(vm->out);
+    io->out_used = 0;
+    io->newline = false;
+}
+
+void consoleWrite(struct lc3_vm *vm, const char *data, size_t size)
+{
+    struct console *io = vm->io;
+    while (size) {
+        if (io->out_used == CONSOLE_OUT_SIZE) consoleFlush(vm);
+        size_t n = CONSOLE_OUT_SIZE - io->out_used;
+        if (n > size) n = size;
+        memcpy(io->out + io->out_used, data, n);
+        if (!io->newline && memchr(data, '\n', n)) io->newline = true;
+        io->out_used += n;
+        data += n;
+        size -= n;
+    }
+}
+
+// Refill the input buffer. Streams without a descriptor (fmemopen) use fread.
+static bool fill(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    if (io->eof) return false;
+
+    consoleFlush(vm);
+    int fd = fileno(vm->in);
+    ssize_t n;
+    if (fd >= 0) {
+        do n = read(fd, io->in, CONSOLE_IN_SIZE);
+        while (n < 0 && errno == EINTR);
+    }
+    else n = fread(io->in, 1, CONSOLE_IN_SIZE, vm->in);
+
+    if (n <= 0) {
+        io->eof = true;
+        return false;
+    }
+    io->in_pos = 0;
+    io->in_len = n;
+    return true;
+}
+
+static int peek(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    if (io->in_pos == io->in_len && !fill(vm)) return EOF;
+    return (unsigned char)io->in[io->in_pos];
+}
+
+// Terminal settings before the first keyboard poll, restored at exit
+static struct termios saved_termios;
+static int raw_fd = -1;
+
+static void restoreTerminal(void)
+{
+    tcsetattr(raw_fd, TCSANOW, &saved_termios);
+}
+
+static void interrupted(int sig)
+{
+    restoreTerminal();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// Deliver keys as they are typed, without echo
+static void rawInput(int fd)
+{
+    if (raw_fd >= 0 || !isatty(fd) || tcgetattr(fd, &saved_termios) != 0) return;
+    struct termios raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &raw) != 0) return;
+
+    raw_fd = fd;
+    atexit(restoreTerminal);
+    signal(SIGINT, interrupted);
+    signal(SIGTERM, interrupted);
+}
+
+bool consoleReady(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    if (io->in_pos < io->in_len) return true;
+    if (io->eof) return false;
+
+    int fd = fileno(vm->in);
+    if (fd >= 0) {
+        rawInput(fd);
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, 0) <= 0) return false;
+    }
+    return fill(vm);
+}
+
+void consoleWait(struct lc3_vm *vm, int timeout)
+{
+    struct console *io = vm->io;
+    int fd = fileno(vm->in);
+    if (io->in_pos < io->in_len || io->eof || fd < 0) return;
+
+    consoleFlush(vm);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd p = { fd, POLLIN, 0 };
+    while (poll(&p, 1, timeout) < 0 && errno == EINTR);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ++io->parks;
+    io->parked += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+void consoleReport(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    if (io->parks)
+        fprintf(stderr, "console: parked %llu times waiting for input, %.3f s of host CPU not spent spinning\n",
+                (unsigned long long)io->parks, io->parked);
+}
+
+int consoleGetc(struct lc3_vm *vm)
+{
+    int c = peek(vm);
+    if (c != EOF) ++vm->io->in_pos;
+    return c;
+}
+
+bool consoleReadU16(struct lc3_vm *vm, uint16_t *value)
+{
+    int c;
+    while ((c = peek(vm)) == ' ' || (c >= '\t' && c <= '\r'))
+        consoleGetc(vm);
+
+    bool negative = false;
+    if (c == '+' || c == '-') {
+        negative = c == '-';
+        consoleGetc(vm);
+        c = peek(vm);
+    }
+    if (c < '0' || c > '9') return false;
+
+    // strtoul semantics: saturate on overflow, then truncate to 16 bits
+    unsigned long n = 0;
+    bool overflow = false;
+    for (; c >= '0' && c <= '9'; consoleGetc(vm), c = peek(vm)) {
+        if (n > (ULONG_MAX - (c - '0')) / 10) overflow = true;
+        else n = 10 * n + (c - '0');
+    }
+    if (overflow) n = ULONG_MAX;
+    else if (negative) n = -n;
+
+    *value = (uint16_t)n;
+    return true;
+}
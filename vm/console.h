@@ -0,0 +1,93 @@
+#ifndef H_CONSOLE
+#define H_CONSOLE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lc3vm.h"
+
+struct input_log;
+
+// CONSOLE I/O
+// Buffering between the TRAP routines and the streams of a VM (vm->in/vm->out).
+// Output collects in a large buffer written with a single fwrite+fflush when:
+// - the guest halts or the engine returns (consoleFlush)
+// - the guest is about to block on input (so a prompt is always visible)
+// - the buffer is full
+// - the mode asks for it at the end of an output trap
+// Input is read in large chunks (read(2) on the stream's descriptor, which
+// returns what is available on a terminal) and handed out one char at a time.
+//
+// Modes:
+// - CONSOLE_BUFFERED:   flush only in the cases above (default)
+// - CONSOLE_LINE:       also flush after a trap that wrote a newline
+// - CONSOLE_UNBUFFERED: flush after every output trap, like the original VM
+enum console_mode { CONSOLE_BUFFERED = 0, CONSOLE_LINE, CONSOLE_UNBUFFERED };
+
+#define CONSOLE_OUT_SIZE (1 << 16)
+#define CONSOLE_IN_SIZE  (1 << 12)
+
+struct console {
+    enum console_mode mode;
+    bool newline;                   // a newline was buffered since the last flush
+    bool eof;                       // input ended, sticky like stdio
+    size_t out_used;
+    size_t in_pos, in_len;
+    uint64_t parks;                 // consoleWait calls that blocked
+    double parked;                  // seconds spent in them
+    struct input_log *log;          // input record/replay (replay.h), NULL for none
+    char out[CONSOLE_OUT_SIZE];
+    char in[CONSOLE_IN_SIZE];
+};
+
+struct console *consoleCreate(void);
+void consoleDestroy(struct console *io);
+
+// Flush pending output to the old streams, drop buffered input and switch
+// the VM to new streams
+void consoleAttach(struct lc3_vm *vm, FILE *in, FILE *out);
+
+// Write all buffered output to vm->out
+void consoleFlush(struct lc3_vm *vm);
+
+// Next input char (0-255) or EOF. Flushes output before blocking on a read.
+int consoleGetc(struct lc3_vm *vm);
+
+// True when consoleGetc would not block (input buffered, or readable right
+// now). Used by the keyboard status register; a terminal is switched to raw
+// input (no line editing, no echo) on the first call and restored at exit.
+bool consoleReady(struct lc3_vm *vm);
+
+// Block until input is available (or ends), instead of letting the guest spin
+// on KBSR, or until timeout milliseconds passed (-1 for no limit). Does
+// nothing for a stream without a descriptor.
+void consoleWait(struct lc3_vm *vm, int timeout);
+
+// Print the parking statistics on stderr, if the guest ever parked
+void consoleReport(struct lc3_vm *vm);
+
+// Parse an unsigned decimal like scanf("%hu"). Return false and consume only
+// the leading blanks (and sign) when the input does not start with a number.
+bool consoleReadU16(struct lc3_vm *vm, uint16_t *value);
+
+void consoleWrite(struct lc3_vm *vm, const char *data, size_t size);
+
+// Apply the flush policy of the mode, at the end of every output trap (and DDR write)
+static inline void consoleEndTrap(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    if (io->mode == CONSOLE_UNBUFFERED || (io->mode == CONSOLE_LINE && io->newline))
+        consoleFlush(vm);
+}
+
+static inline void consolePutc(struct lc3_vm *vm, char c)
+{
+    struct console *io = vm->io;
+    if (io->out_used == CONSOLE_OUT_SIZE)
+        consoleFlush(vm);
+    io->out[io->out_used++] = c;
+    io->newline |= c == '\n';
+}
+
+#endif
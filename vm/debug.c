@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "console.h"
+#include "disasm.h"
+#include "image.h"
+#include "interrupt.h"
+#include "debug.h"
+
+enum stop { STOP_NONE, STOP_BREAK, STOP_WATCH };
+
+struct breakpoint {
+    uint16_t address;
+    uint16_t word;                  // the instruction the RES replaced
+};
+
+struct watchpoint {
+    uint16_t address;
+    uint16_t count;
+};
+
+struct lc3_debug {
+    struct lc3_vm *vm;
+    struct lc3_image *image;        // symbols, NULL if the program has none
+    struct breakpoint breaks[DEBUG_BREAKPOINTS];
+    int nbreaks;
+    struct watchpoint watches[DEBUG_WATCHPOINTS];
+    int nwatches;
+    uint8_t pages[PAGE_COUNT];      // watchpoints on each page, vm->watch when any
+    uint64_t count;                 // retired under the debugger
+    int32_t over;                   // breakpoint being stepped over, -1 for none
+
+    // why the last run stopped
+    enum stop reason;
+    bool resume;                    // the stop was the debugger's, not a halt
+    uint16_t at;                    // breakpoint, or address of the watched store
+    uint16_t pc;                    // instruction of the store
+    uint16_t old, val;
+};
+
+
+// ===================================================================================
+// =================================== BREAKPOINTS ===================================
+// ===================================================================================
+static struct breakpoint *findBreak(struct lc3_debug *d, uint16_t address)
+{
+    for (int i = 0; i < d->nbreaks; ++i)
+        if (d->breaks[i].address == address) return &d->breaks[i];
+    return NULL;
+}
+
+// Words are patched behind the back of mem_write: the guest did not write
+// them, so they are neither dirty nor watched
+static void patch(struct lc3_vm *vm, uint16_t address, uint16_t word)
+{
+    vm->memory[address] = word;
+    decode_invalidate(vm->decode, address);
+}
+
+// The word at address as the program has it, under a breakpoint or not
+static uint16_t original(struct lc3_debug *d, uint16_t address)
+{
+    struct breakpoint *b = findBreak(d, address);
+    uint16_t word = d->vm->memory[address];
+    return b && word == DEBUG_BREAK_WORD ? b->word : word;
+}
+
+static bool addBreak(struct lc3_debug *d, uint16_t address)
+{
+    if (findBreak(d, address)) return true;
+    if (d->nbreaks == DEBUG_BREAKPOINTS || address >= MR_BASE) return false;
+    d->breaks[d->nbreaks++] = (struct breakpoint){ address, d->vm->memory[address] };
+    patch(d->vm, address, DEBUG_BREAK_WORD);
+    return true;
+}
+
+// A breakpoint the guest stored over is already gone from memory
+static void removeBreak(struct lc3_debug *d, struct breakpoint *b)
+{
+    if (d->vm->memory[b->address] == DEBUG_BREAK_WORD) patch(d->vm, b->address, b->word);
+    *b = d->breaks[--d->nbreaks];
+}
+
+bool debugBreak(struct lc3_vm *vm)
+{
+    struct lc3_debug *d = vm->debug;
+    uint16_t address = vm->reg[RPC] - 1;
+    if (findBreak(d, address) == NULL || address == d->over) return false;     // a RES of the program
+    vm->reg[RPC] = address;
+    --vm->retired;                  // it runs again when the guest continues
+    d->reason = STOP_BREAK;
+    d->resume = true;
+    d->at = address;
+    vm->running = false;
+    return true;
+}
+
+
+// ===================================================================================
+// =================================== WATCHPOINTS ===================================
+// ===================================================================================
+static void markPages(struct lc3_debug *d, const struct watchpoint *w, int delta)
+{
+    uint32_t last = (uint32_t)w->address + w->count - 1;
+    for (uint32_t page = w->address >> PAGE_BITS; page <= last >> PAGE_BITS; ++page)
+        d->pages[page] += delta;
+    d->vm->watch = d->nwatches ? d->pages : NULL;
+}
+
+static bool addWatch(struct lc3_debug *d, uint16_t address, uint16_t count)
+{
+    if (d->nwatches == DEBUG_WATCHPOINTS || count == 0 || (uint32_t)address + count > MEMORY_MAX)
+        return false;
+    d->watches[d->nwatches] = (struct watchpoint){ address, count };
+    ++d->nwatches;
+    markPages(d, &d->watches[d->nwatches - 1], 1);
+    return true;
+}
+
+static void removeWatch(struct lc3_debug *d, struct watchpoint *w)
+{
+    struct watchpoint gone = *w;
+    *w = d->watches[--d->nwatches];
+    markPages(d, &gone, -1);
+}
+
+// The first hit of an instruction is the one reported
+void debugWatch(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    struct lc3_debug *d = vm->debug;
+    if (d->reason != STOP_NONE) return;
+    for (int i = 0; i < d->nwatches; ++i) {
+        const struct watchpoint *w = &d->watches[i];
+        if (address < w->address || address - w->address >= w->count) continue;
+        d->reason = STOP_WATCH;
+        d->resume = !(address == MR_MCR && !(val & 0x8000));
+        d->at = address;
+        d->pc = vm->reg[RPC] - 1;
+        d->old = vm->memory[address];
+        d->val = val;
+        vm->running = false;
+        return;
+    }
+}
+
+
+// ===================================================================================
+// ===================================== LISTING =====================================
+// ===================================================================================
+static const char *symbol(struct lc3_debug *d, uint16_t address)
+{
+    return d->image ? imageSymbol(d->image, address) : NULL;
+}
+
+// One line of disassembly: PC mark, breakpoint mark, address, label, word
+static void listLine(struct lc3_debug *d, uint16_t address)
+{
+    struct lc3_vm *vm = d->vm;
+    uint16_t word = original(d, address);
+    char text[64];
+    disassemble(word, text, sizeof(text));
+    const char *label = symbol(d, address);
+    fprintf(stderr, "%s%c 0x%04X %-12s 0x%04X  %s\n", address == vm->reg[RPC] ? "=>" : "  ",
+            findBreak(d, address) ? '*' : ' ', address, label ? label : "", word, text);
+}
+
+static void printRegisters(struct lc3_debug *d)
+{
+    struct lc3_vm *vm = d->vm;
+    uint16_t *reg = vm->reg;
+    for (int r = R0; r <= R7; ++r)
+        fprintf(stderr, "R%d 0x%04X %6d%s", r, reg[r], (int16_t)reg[r], r % 4 == 3 ? "\n" : "   ");
+    uint16_t cc = reg[RCND];
+    fprintf(stderr, "PC 0x%04X   CC %c%c%c   PSR 0x%04X (%s, priority %d)   retired %llu\n",
+            reg[RPC], cc & FN ? 'n' : '-', cc & FZ ? 'z' : '-', cc & FP ? 'p' : '-',
+            vm->psr | cc, vm->psr & PSR_USER ? "user" : "supervisor", (vm->psr & PSR_PRIORITY) >> 8,
+            (unsigned long long)d->count);
+}
+
+static void dump(struct lc3_debug *d, uint16_t address, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i += 8) {
+        fprintf(stderr, "0x%04X:", (uint16_t)(address + i));
+        for (uint32_t k = i; k < count && k < i + 8; ++k)
+            fprintf(stderr, " %04X", original(d, address + k));
+        fprintf(stderr, "\n");
+    }
+}
+
+static void info(struct lc3_debug *d)
+{
+    if (d->nbreaks == 0 && d->nwatches == 0) fprintf(stderr, "no breakpoints or watchpoints\n");
+    for (int i = 0; i < d->nbreaks; ++i) {
+        const char *label = symbol(d, d->breaks[i].address);
+        fprintf(stderr, "breakpoint 0x%04X %s%s\n", d->breaks[i].address, label ? label : "",
+                d->vm->memory[d->breaks[i].address] == DEBUG_BREAK_WORD ? "" : " (overwritten by the guest)");
+    }
+    for (int i = 0; i < d->nwatches; ++i)
+        fprintf(stderr, "watchpoint 0x%04X, %u words\n", d->watches[i].address, d->watches[i].count);
+}
+
+
+// ===================================================================================
+// ===================================== RUNNING =====================================
+// ===================================================================================
+// Run up to n instructions (0: up to the budget of the VM) in the switch loop
+static void run(struct lc3_debug *d, uint64_t n)
+{
+    struct lc3_vm *vm = d->vm;
+    uint64_t budget = vm->budget;
+    d->reason = STOP_NONE;
+    if (n) vm->budget = n;
+    uint64_t count = programRun(vm);
+    vm->budget = budget;
+    if (d->reason == STOP_BREAK) --count;
+    if (d->reason != STOP_NONE) vm->running = d->resume;
+    d->count += count;
+}
+
+// Run the instruction at RPC, with its original word if it has a breakpoint
+static void stepOver(struct lc3_debug *d)
+{
+    struct lc3_vm *vm = d->vm;
+    uint16_t pc = vm->reg[RPC];
+    struct breakpoint *b = findBreak(d, pc);
+    if (b == NULL || vm->memory[pc] != DEBUG_BREAK_WORD) {
+        run(d, 1);
+        return;
+    }
+    patch(vm, pc, b->word);
+    d->over = pc;
+    run(d, 1);
+    d->over = -1;
+    if (vm->memory[pc] == b->word) patch(vm, pc, DEBUG_BREAK_WORD);
+}
+
+// n instructions, 0 to continue
+static void resume(struct lc3_debug *d, uint64_t n)
+{
+    struct lc3_vm *vm = d->vm;
+    if (!vm->running) {
+        fprintf(stderr, "the program is not running\n");
+        return;
+    }
+    uint64_t start = d->count;
+    stepOver(d);
+    if (vm->running && d->reason == STOP_NONE && n != 1)
+        run(d, n ? n - 1 : 0);
+    consoleFlush(vm);
+
+    if (d->reason == STOP_BREAK) {
+        const char *label = symbol(d, d->at);
+        fprintf(stderr, "breakpoint 0x%04X %s\n", d->at, label ? label : "");
+    }
+    else if (d->reason == STOP_WATCH)
+        fprintf(stderr, "watchpoint 0x%04X: 0x%04X -> 0x%04X, written at 0x%04X\n",
+                d->at, d->old, d->val, d->pc);
+    else if (n == 0 && vm->running)
+        fprintf(stderr, "stopped by the budget after %llu instructions\n",
+                (unsigned long long)(d->count - start));
+    if (!vm->running) {
+        fprintf(stderr, "program halted, %llu instructions retired\n", (unsigned long long)d->count);
+        return;
+    }
+    listLine(d, vm->reg[RPC]);
+}
+
+
+// ===================================================================================
+// ===================================== COMMANDS ====================================
+// ===================================================================================
+// A number (0x1F or x1F hexadecimal, decimal otherwise) or a symbol
+static bool parseAddress(struct lc3_debug *d, const char *text, uint16_t *value)
+{
+    char *end;
+    unsigned long n;
+    if (text[0] == 'x' || text[0] == 'X') n = strtoul(text + 1, &end, 16);
+    else n = strtoul(text, &end, 0);
+    if (*end == '\0' && end != text) {
+        if (n <= 0xFFFF) *value = (uint16_t)n;
+        else fprintf(stderr, "%s is not a 16 bit value\n", text);
+        return n <= 0xFFFF;
+    }
+    for (int i = 0; d->image && i < d->image->nsymbols; ++i)
+        if (strcmp(d->image->symbols[i].name, text) == 0) {
+            *value = d->image->symbols[i].address;
+            return true;
+        }
+    fprintf(stderr, "unknown address %s\n", text);
+    return false;
+}
+
+// R0-R7, PC, CC, PSR, or -1
+static int parseRegister(const char *text)
+{
+    if ((text[0] == 'R' || text[0] == 'r') && text[1] >= '0' && text[1] <= '7' && text[2] == '\0')
+        return text[1] - '0';
+    if (strcasecmp(text, "PC") == 0) return RPC;
+    if (strcasecmp(text, "CC") == 0) return RCND;
+    if (strcasecmp(text, "PSR") == 0) return REG_SIZE;
+    return -1;
+}
+
+static void set(struct lc3_debug *d, const char *target, const char *text)
+{
+    struct lc3_vm *vm = d->vm;
+    uint16_t value;
+    if (text == NULL || !parseAddress(d, text, &value)) {
+        fprintf(stderr, "usage: set REGISTER|ADDRESS VALUE\n");
+        return;
+    }
+    int r = parseRegister(target);
+    if (r == RCND) vm->reg[RCND] = value & 0x7;
+    else if (r == REG_SIZE) {
+        vm->psr = value & (PSR_USER | PSR_PRIORITY);
+        vm->reg[RCND] = value & 0x7;
+    }
+    else if (r >= 0) vm->reg[r] = value;
+    else {
+        uint16_t address;
+        if (!parseAddress(d, target, &address)) return;
+        struct breakpoint *b = findBreak(d, address);
+        if (b && vm->memory[address] == DEBUG_BREAK_WORD) b->word = value;    // stays patched
+        else mem_write(vm, address, value);
+    }
+}
+
+static void help(void)
+{
+    fprintf(stderr,
+            "break|b ADDR          stop before the instruction at ADDR runs\n"
+            "watch|w ADDR [N]      stop after an instruction writes one of N words from ADDR\n"
+            "delete|d [ADDR]       remove the breakpoint or watchpoint at ADDR (all of them)\n"
+            "info|i                list breakpoints and watchpoints\n"
+            "step|s [N]            run N instructions (1)\n"
+            "continue|c            run until a breakpoint, a watchpoint or the end\n"
+            "regs|r                print the registers\n"
+            "x ADDR [N]            dump N words of memory (8)\n"
+            "list|l [ADDR] [N]     disassemble N words from ADDR (8 from PC)\n"
+            "set REG|ADDR VALUE    write a register (R0-R7, PC, CC, PSR) or a word\n"
+            "quit|q                stop debugging\n"
+            "ADDR is a number (0x3000, x3000, 12288) or a label of the image.\n"
+            "An empty line repeats the last command.\n");
+}
+
+static bool is(const char *command, const char *name, const char *alias)
+{
+    return strcmp(command, name) == 0 || (alias && strcmp(command, alias) == 0);
+}
+
+// Execute one command line. Return false on quit.
+static bool command(struct lc3_debug *d, char *line)
+{
+    char *argv[4] = { NULL };
+    int argc = 0;
+    for (char *word = strtok(line, " \t\r\n"); word && argc < 4; word = strtok(NULL, " \t\r\n"))
+        argv[argc++] = word;
+    if (argc == 0 || argv[0][0] == '#') return true;
+
+    struct lc3_vm *vm = d->vm;
+    const char *c = argv[0];
+    uint16_t address, n;
+    if (is(c, "quit", "q")) return false;
+    else if (is(c, "help", "h")) help();
+    else if (is(c, "step", "s")) {
+        uint64_t steps = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+        resume(d, steps ? steps : 1);
+    }
+    else if (is(c, "continue", "c")) resume(d, 0);
+    else if (is(c, "regs", "r")) printRegisters(d);
+    else if (is(c, "info", "i")) info(d);
+    else if (is(c, "break", "b")) {
+        if (argc < 2) fprintf(stderr, "usage: break ADDR\n");
+        else if (parseAddress(d, argv[1], &address) && !addBreak(d, address))
+            fprintf(stderr, "cannot set a breakpoint at 0x%04X\n", address);
+    }
+    else if (is(c, "watch", "w")) {
+        n = 1;
+        if (argc < 2) fprintf(stderr, "usage: watch ADDR [N]\n");
+        else if (parseAddress(d, argv[1], &address) && (argc < 3 || parseAddress(d, argv[2], &n)) &&
+                 !addWatch(d, address, n))
+            fprintf(stderr, "cannot watch %u words at 0x%04X\n", n, address);
+    }
+    else if (is(c, "delete", "d")) {
+        if (argc < 2) {
+            while (d->nbreaks) removeBreak(d, &d->breaks[0]);
+            while (d->nwatches) removeWatch(d, &d->watches[0]);
+        }
+        else if (parseAddress(d, argv[1], &address)) {
+            struct breakpoint *b = findBreak(d, address);
+            bool found = b != NULL;
+            if (b) removeBreak(d, b);
+            for (int i = d->nwatches - 1; i >= 0; --i)
+                if (d->watches[i].address == address) {
+                    removeWatch(d, &d->watches[i]);
+                    found = true;
+                }
+            if (!found) fprintf(stderr, "nothing at 0x%04X\n", address);
+        }
+    }
+    else if (is(c, "x", NULL)) {
+        n = 8;
+        if (argc < 2) fprintf(stderr, "usage: x ADDR [N]\n");
+        else if (parseAddress(d, argv[1], &address) && (argc < 3 || parseAddress(d, argv[2], &n)))
+            dump(d, address, n);
+    }
+    else if (is(c, "list", "l")) {
+        address = vm->reg[RPC];
+        n = 8;
+        if ((argc < 2 || parseAddress(d, argv[1], &address)) && (argc < 3 || parseAddress(d, argv[2], &n)))
+            for (uint32_t i = 0; i < n; ++i) listLine(d, address + i);
+    }
+    else if (is(c, "set", NULL)) {
+        if (argc < 3) fprintf(stderr, "usage: set REGISTER|ADDRESS VALUE\n");
+        else set(d, argv[1], argv[2]);
+    }
+    else fprintf(stderr, "unknown command %s, try help\n", c);
+    return true;
+}
+
+uint64_t debugRun(struct lc3_vm *vm, FILE *in, const char *program)
+{
+    struct lc3_debug *d = calloc(1, sizeof(struct lc3_debug));
+    if (d == NULL) {
+        fprintf(stderr, "Cannot allocate the debugger\n");
+        abort();
+    }
+    d->vm = vm;
+    d->over = -1;
+    d->image = imageOpen(program);
+    if (d->image->nsymbols == 0) {
+        imageClose(d->image);
+        d->image = NULL;
+    }
+    vm->debug = d;
+
+    bool interactive = isatty(fileno(in));
+    char line[256], last[256] = "";
+    listLine(d, vm->reg[RPC]);
+    for (;;) {
+        if (interactive) {
+            fprintf(stderr, "(lc3) ");
+            fflush(stderr);
+        }
+        if (fgets(line, sizeof(line), in) == NULL) break;
+        if (strspn(line, " \t\r\n") == strlen(line)) strcpy(line, last);
+        else strcpy(last, line);
+        if (!command(d, line)) break;
+    }
+
+    // Leave the memory of the guest as the program has it
+    while (d->nbreaks) removeBreak(d, &d->breaks[0]);
+    vm->watch = NULL;
+    vm->debug = NULL;
+    uint64_t count = d->count;
+    if (d->image) imageClose(d->image);
+    free(d);
+    return count;
+}
@@ -0,0 +1,42 @@
+#ifndef H_DEBUG
+#define H_DEBUG
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// DEBUGGER
+// Run a guest in the switch loop under commands read from a file or a terminal:
+// step, continue, register and memory dumps, disassembly, breakpoints and
+// write watchpoints. Its messages go to stderr, the guest keeps its streams.
+// None of it costs anything per instruction:
+// - a breakpoint replaces the word at its address with RES (DEBUG_BREAK_WORD),
+//   and only OP_RES looks for breakpoints (debugBreak). Continuing from one
+//   puts the original word back for a single step. A guest that loads the
+//   word sees the RES; one that stores over it replaces the breakpoint.
+// - a watchpoint marks the pages of its words in vm->watch, the only table
+//   mem_write looks at (debugWatch), and it is NULL without watchpoints. The
+//   native traps write watched pages a word at a time, through mem_write.
+// Both stop the run after the instruction that hit them; a breakpoint does
+// not count as retired, so vm->retired (and input replay) stay exact.
+#define DEBUG_BREAK_WORD  0xD000
+#define DEBUG_BREAKPOINTS 64
+#define DEBUG_WATCHPOINTS 16
+
+struct lc3_debug;
+
+// Run the loaded vm under the commands of in (a prompt is printed when it is a
+// terminal) until quit or the end of in. program is the image, for its
+// symbols. Return the retired instructions.
+uint64_t debugRun(struct lc3_vm *vm, FILE *in, const char *program);
+
+// OP_RES: true when the word at RPC - 1 is a breakpoint. Stop the run there.
+bool debugBreak(struct lc3_vm *vm);
+
+// mem_write of val at address, in a watched page: stop the run if a
+// watchpoint covers address
+void debugWatch(struct lc3_vm *vm, uint16_t address, uint16_t val);
+
+#endif
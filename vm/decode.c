@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+
+// ===================================================================================
+// ================================ DECODE INSTRUCTION ===============================
+// ===================================================================================
+// Extract the fields of the instruction stored at address. The offsets are computed
+// with the same expressions used by the OP_* functions so the decoded engine behaves
+// exactly like programRun, quirks included (e.g. JSRR adds the register index to RPC
+// and STR sign extends a 9 bit field on 6 bits).
+void decodeInstruction(struct decoded *d, uint16_t address, uint16_t instruction)
+{
+    uint16_t next = address + 1;    // value of RPC while the instruction executes
+    uint16_t DR1 = (instruction >> 9) & 0x7;
+    uint16_t SR1 = (instruction >> 6) & 0x7;
+
+    d->dr = DR1;
+    d->sr1 = SR1;
+    d->sr2 = instruction & 0x7;
+    d->imm = 0;
+    d->instruction = instruction;
+
+    switch (instruction >> 12)
+    {
+    case op_add:
+    case op_and:
+        if ((instruction >> 5) & 0x1) {
+            d->op = (instruction >> 12) == op_add ? DOP_ADDI : DOP_ANDI;
+            d->imm = sign_extend(instruction & 0x1F, 5);
+        }
+        else
+            d->op = (instruction >> 12) == op_add ? DOP_ADD : DOP_AND;
+        break;
+    case op_not:
+        d->op = DOP_NOT;
+        break;
+    case op_br:
+        d->op = DOP_BR;
+        d->sr2 = DR1;   // NZP mask
+        d->imm = next + sign_extend(instruction & 0x1FF, 9);
+        break;
+    case op_jmp:
+        d->op = DOP_JMP;
+        break;
+    case op_jsr:
+        d->op = DOP_JSR;
+        if ((instruction >> 11) & 1)
+            d->imm = next + sign_extend(instruction & 0x7FF, 11);
+        else
+            d->imm = next + SR1;
+        break;
+    case op_ld:
+        d->op = DOP_LD;
+        d->imm = next + sign_extend(instruction & 0x1FF, 9);
+        break;
+    case op_ldi:
+        d->op = DOP_LDI;
+        d->imm = next + sign_extend(instruction & 0x1FF, 9);
+        break;
+    case op_ldr:
+        d->op = DOP_LDR;
+        d->imm = sign_extend(instruction & 0x3F, 6);
+        break;
+    case op_lea:
+        d->op = DOP_LEA;
+        d->imm = next + sign_extend(instruction & 0x1FF, 9);
+        break;
+    case op_st:
+        d->op = DOP_ST;
+        d->imm = next + sign_extend(instruction & 0x1FF, 9);
+        break;
+    case op_sti:
+        d->op = DOP_STI;
+        d->imm = next + sign_extend(instruction & 0x1FF, 9);
+        break;
+    case op_str:
+        d->op = DOP_STR;
+        d->imm = sign_extend(instruction & 0x1FF, 6);
+        break;
+    case op_trap:
+        d->op = DOP_TRAP;
+        break;
+    case op_rti:
+        d->op = DOP_RTI;
+        break;
+    default:
+        d->op = DOP_RES;
+        break;
+    }
+}
+
+
+// ===================================================================================
+// ============================== RUN DECODED PROGRAM ================================
+// ===================================================================================
+// Same machine as programRun but executing from the decode cache. An entry is
+// filled the first time its address is executed and dropped by mem_write when the
+// program writes into it, so self-modifying code keeps working.
+// The registers are copied to locals, RPC and RCND included, and copied back to
+// vm->reg only around the TRAP routines, RTI, RES and interrupts, which are the
+// only code outside this loop that uses them, and when the run stops. The budget is checked by the control
+// flow instructions only.
+// Return the number of retired instructions.
+uint64_t programRunDecoded(struct lc3_vm *vm)
+{
+    struct decoded *cache = vm->decode;
+    uint16_t reg[REG_SIZE];
+    memcpy(reg, vm->reg, sizeof(reg));
+    uint16_t pc = reg[RPC];
+    uint16_t cc = reg[RCND];
+
+    bool running = vm->running;
+    uint64_t count = 0;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
+
+// Taken branches, JMP and JSR take the pending interrupts (interrupt.h)
+#define POLL_EVENTS() do { \
+        if (eventPending(vm)) { \
+            saveRegisters(vm, reg, pc, cc); \
+            interruptPoll(vm); \
+            loadRegisters(vm, reg, &pc, &cc); \
+        } \
+    } while (0)
+
+    while (running)
+    {
+        struct decoded *d = &cache[pc++];
+        ++count;
+
+        switch (d->op)
+        {
+        case DOP_NONE:
+            // First execution of this word: decode it and dispatch again
+            --pc;
+            --count;
+            decodeInstruction(d, pc, mem_read(vm, pc));
+            break;
+        case DOP_ADD:
+            cc = cc_of(reg[d->dr] = reg[d->sr1] + reg[d->sr2]);
+            break;
+        case DOP_ADDI:
+            cc = cc_of(reg[d->dr] = reg[d->sr1] + d->imm);
+            break;
+        case DOP_AND:
+            cc = cc_of(reg[d->dr] = reg[d->sr1] & reg[d->sr2]);
+            break;
+        case DOP_ANDI:
+            cc = cc_of(reg[d->dr] = reg[d->sr1] & d->imm);
+            break;
+        case DOP_NOT:
+            cc = cc_of(reg[d->dr] = ~reg[d->sr1]);
+            break;
+        case DOP_BR:
+            if (d->sr2 & cc) {
+                pc = d->imm;
+                POLL_EVENTS();
+            }
+            running = count < limit;
+            break;
+        case DOP_JMP:
+            pc = reg[d->sr1];
+            POLL_EVENTS();
+            running = count < limit;
+            break;
+        case DOP_JSR:
+            reg[R7] = pc;
+            pc = d->imm;
+            POLL_EVENTS();
+            running = count < limit;
+            break;
+        case DOP_LD:
+            cc = cc_of(reg[d->dr] = load(vm, d->imm, pc));
+            break;
+        case DOP_LDI:
+            cc = cc_of(reg[d->dr] = load(vm, load(vm, d->imm, pc), pc));
+            break;
+        case DOP_LDR:
+            cc = cc_of(reg[d->dr] = load(vm, reg[d->sr1] + d->imm, pc));
+            break;
+        case DOP_LEA:
+            cc = cc_of(reg[d->dr] = d->imm);
+            break;
+        case DOP_ST:
+            if (!store(vm, d->imm, reg[d->dr])) running = false;
+            break;
+        case DOP_STI:
+            if (!store(vm, load(vm, d->imm, pc), reg[d->dr])) running = false;
+            break;
+        case DOP_STR:
+            if (!store(vm, reg[d->sr1] + d->imm, reg[d->dr])) running = false;
+            break;
+        case DOP_TRAP:
+            memcpy(vm->reg, reg, sizeof(reg));
+            vm->reg[RPC] = pc;
+            vm->reg[RCND] = cc;
+            OP_TRAP(vm, d->instruction);
+            memcpy(reg, vm->reg, sizeof(reg));
+            cc = reg[RCND];
+            running = vm->running;
+            break;
+        case DOP_RTI:
+        case DOP_RES:
+            saveRegisters(vm, reg, pc, cc);
+            executeInstruction(vm, d->instruction);
+            loadRegisters(vm, reg, &pc, &cc);
+            running = vm->running && count < limit;   // the handler entry may push onto MCR
+            break;
+        default:
+            // Superinstructions are run only by the threaded engine: decode the word alone
+            --pc;
+            --count;
+            decodeInstruction(d, pc, mem_read(vm, pc));
+            break;
+        }
+    }
+
+    memcpy(vm->reg, reg, sizeof(reg));
+    vm->reg[RPC] = pc;
+    vm->reg[RCND] = cc;
+    return count;
+
+#undef POLL_EVENTS
+}
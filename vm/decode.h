@@ -0,0 +1,116 @@
+#ifndef H_DECODE
+#define H_DECODE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "interrupt.h"
+
+// DECODED INSTRUCTIONS
+// Every instruction is split into its fields only the first time it is
+// executed. The result is saved in a cache parallel to main memory, so hot
+// loops skip the field extraction and sign_extend on each execution.
+// DOP_NONE (0) marks an entry that has not been decoded yet: a zeroed cache
+// is an empty cache and invalidating a word is a single store.
+// Ops from DOP_FUSED on are superinstructions (see fuse.h) and replace only the
+// op of the first word of their group: the other words keep their own decoded
+// form, so a branch into the middle of a group runs them one by one.
+enum dop { DOP_NONE = 0, DOP_ADD, DOP_ADDI, DOP_AND, DOP_ANDI, DOP_NOT,
+           DOP_BR, DOP_JMP, DOP_JSR, DOP_LD, DOP_LDI, DOP_LDR, DOP_LEA,
+           DOP_ST, DOP_STI, DOP_STR, DOP_TRAP, DOP_RTI, DOP_RES,
+           DOP_ADDI_BR, DOP_CONST,      // fused pairs
+           DOP_LDR_ADD_STR,             // fused triples
+           DOP_COUNT };
+#define DOP_FUSED  DOP_ADDI_BR
+#define DOP_FUSED3 DOP_LDR_ADD_STR
+
+// The cache of a VM is vm->decode (see lc3vm.h)
+
+// Compact decoded form of an instruction (8 bytes)
+// - op:  handler to run (enum dop)
+// - dr:  destination register (source register for ST/STI/STR)
+// - sr1: first source / base register
+// - sr2: second source register, BR condition mask or trap vector
+// - imm: sign-extended immediate/offset. For PC relative instructions
+//        (BR, JSR, LD, LDI, LEA, ST, STI) it already is the final address
+//        since RPC of a given memory word is always the same.
+struct decoded {
+    uint8_t op;
+    uint8_t dr;
+    uint8_t sr1;
+    uint8_t sr2;
+    uint16_t imm;
+    uint16_t instruction;   // raw word, used by TRAP
+};
+
+void decodeInstruction(struct decoded *d, uint16_t address, uint16_t instruction);
+
+// Drop the decoded copy of a word, and the fused group that covers it if any
+static inline void decode_invalidate(struct decoded *cache, uint16_t address)
+{
+    cache[address].op = DOP_NONE;
+    if (cache[(uint16_t)(address - 1)].op >= DOP_FUSED)
+        cache[(uint16_t)(address - 1)].op = DOP_NONE;
+    if (cache[(uint16_t)(address - 2)].op >= DOP_FUSED3)
+        cache[(uint16_t)(address - 2)].op = DOP_NONE;
+}
+
+// Same rule as update_flag but returning the flag of a value, so the condition
+// codes can live in a local inside the engines
+static inline uint16_t cc_of(uint16_t value)
+{
+    if (value == 0) return FZ;
+    else if (value >> 15) return FN;
+    else return FP;
+}
+
+// mem_read/mem_write live in another translation unit. These keep the ordinary
+// RAM access inline and call them only for the device region.
+// pc is RPC while the load runs (its address + 1). The engines keep it in a
+// local, so it is saved in vm->reg[RPC] for the device handlers, which look at
+// the code around a keyboard poll (device.h).
+static inline uint16_t load(struct lc3_vm *vm, uint16_t address, uint16_t pc)
+{
+    if (__builtin_expect(address >= MR_BASE, 0)) {
+        vm->reg[RPC] = pc;
+        return mem_read(vm, address);
+    }
+    return vm->memory[address];
+}
+
+// Return false when the store stopped the machine (MCR), so the engines check
+// vm->running only after a device write
+static inline bool store(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (__builtin_expect(address >= MR_BASE, 0)) {
+        mem_write(vm, address, val);
+        return vm->running;
+    }
+    vm->memory[address] = val;
+    vm->dirty[address >> PAGE_BITS] = 1;
+    decode_invalidate(vm->decode, address);
+    return true;
+}
+
+// The engines keep the registers, RPC and RCND in locals: these copy them to
+// vm->reg and back around code that may change any of them, RPC included
+// (interruptPoll, RTI, RES)
+static inline void saveRegisters(struct lc3_vm *vm, const uint16_t *reg, uint16_t pc, uint16_t cc)
+{
+    memcpy(vm->reg, reg, REG_SIZE * sizeof(uint16_t));
+    vm->reg[RPC] = pc;
+    vm->reg[RCND] = cc;
+}
+
+static inline void loadRegisters(struct lc3_vm *vm, uint16_t *reg, uint16_t *pc, uint16_t *cc)
+{
+    memcpy(reg, vm->reg, REG_SIZE * sizeof(uint16_t));
+    *pc = reg[RPC];
+    *cc = reg[RCND];
+}
+
+uint64_t programRunDecoded(struct lc3_vm *vm);
+
+#endif
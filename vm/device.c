@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "lc3vm.h"
+#include "console.h"
+#include "device.h"
+#include "replay.h"
+#include "interrupt.h"
+
+// ===================================================================================
+// ================================ DEVICE REGISTERS =================================
+// ===================================================================================
+// Update the memory word of a register read by the guest
+static uint16_t latch(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    vm->memory[address] = val;
+    vm->dirty[address >> PAGE_BITS] = 1;
+    return val;
+}
+
+// Longest polling loop recognized, in words
+#define POLL_LOOP_MAX 8
+
+static bool isLoad(uint16_t instruction)
+{
+    uint16_t op = instruction >> 12;
+    return op == op_ld || op == op_ldi || op == op_ldr;
+}
+
+// True when the load before RPC is the poll of a loop made only of loads and
+// closed by a branch taken while KBSR reads 0, like "POLL LDI R0, KBSR; BRzp POLL".
+// Such a loop writes nothing but the registers it loads, always with the same
+// values until a key arrives, so running it again and again is the same as
+// waiting for the key.
+static bool pollingLoop(struct lc3_vm *vm)
+{
+    uint16_t poll = vm->reg[RPC] - 1;
+    uint16_t branch = vm->reg[RPC];
+    uint16_t instruction = vm->memory[branch];
+    uint16_t nzp = (instruction >> 9) & 0x7;
+    if (!isLoad(vm->memory[poll]) || instruction >> 12 != op_br || !(nzp & FZ) || (nzp & FN))
+        return false;
+
+    uint16_t target = branch + 1 + sign_extend(instruction & 0x1FF, 9);
+    if ((uint16_t)(poll - target) >= POLL_LOOP_MAX) return false;
+    for (uint16_t word = target; word != poll; ++word)
+        if (!isLoad(vm->memory[word])) return false;
+    return true;
+}
+
+// With a budget the spinning is counted like any other loop, so it is not skipped.
+// An enabled timer interrupt ends the wait when it is due.
+static uint16_t readKBSR(struct lc3_vm *vm, uint16_t address)
+{
+    int wait = vm->budget == 0 && pollingLoop(vm) ? interruptTimeout(vm) : 0;
+    uint16_t enable = vm->memory[address] & SR_ENABLE;
+    return latch(vm, address, enable | (inputReady(vm, wait) ? SR_READY : 0));
+}
+
+// Only the interrupt enable bit is written
+static void writeKBSR(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    vm->memory[address] = val & SR_ENABLE;
+    interruptArm(vm);
+}
+
+static uint16_t readKBDR(struct lc3_vm *vm, uint16_t address)
+{
+    int c = inputKey(vm);
+    if (c != EOF) latch(vm, address, (uint16_t)c);
+    return vm->memory[address];
+}
+
+static uint16_t readDSR(struct lc3_vm *vm, uint16_t address)
+{
+    return latch(vm, address, 0x8000);
+}
+
+static void writeDDR(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    (void)address;
+    consolePutc(vm, (char)(val & 0xFF));
+    consoleEndTrap(vm);
+}
+
+// Reading acknowledges the expiry
+static uint16_t readTSR(struct lc3_vm *vm, uint16_t address)
+{
+    uint16_t val = interruptTimerStatus(vm);
+    latch(vm, address, val & ~SR_READY);
+    return val;
+}
+
+static void writeTSR(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    vm->memory[address] = val & SR_ENABLE;
+    interruptArm(vm);
+}
+
+static void writeTIR(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    (void)address;
+    (void)val;
+    interruptTimerStart(vm);
+}
+
+static uint16_t readPSR(struct lc3_vm *vm, uint16_t address)
+{
+    return latch(vm, address, vm->psr);
+}
+
+// User mode cannot change its privilege: the store leaves the PSR as it was.
+// A new priority may unmask a request.
+static void writePSR(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (!(vm->psr & PSR_USER)) vm->psr = val & (PSR_USER | PSR_PRIORITY);
+    vm->memory[address] = vm->psr;
+    if (vm->irq) interruptArm(vm);
+}
+
+static void writeMCR(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    (void)address;
+    if (!(val & 0x8000)) {
+        consoleFlush(vm);
+        vm->running = false;
+    }
+}
+
+
+// ===================================================================================
+// ================================= DISPATCH TABLE ==================================
+// ===================================================================================
+struct device {
+    uint16_t (*read)(struct lc3_vm *vm, uint16_t address);
+    void (*write)(struct lc3_vm *vm, uint16_t address, uint16_t val);
+};
+
+static const struct device devices[MEMORY_MAX - MR_BASE] = {
+    [MR_KBSR - MR_BASE] = {readKBSR, writeKBSR},
+    [MR_KBDR - MR_BASE] = {readKBDR, NULL},
+    [MR_DSR - MR_BASE]  = {readDSR, NULL},
+    [MR_DDR - MR_BASE]  = {NULL, writeDDR},
+    [MR_TSR - MR_BASE]  = {readTSR, writeTSR},
+    [MR_TIR - MR_BASE]  = {NULL, writeTIR},
+    [MR_PSR - MR_BASE]  = {readPSR, writePSR},
+    [MR_MCR - MR_BASE]  = {NULL, writeMCR},
+};
+
+uint16_t deviceRead(struct lc3_vm *vm, uint16_t address)
+{
+    const struct device *device = &devices[address - MR_BASE];
+    if (device->read) return device->read(vm, address);
+    return vm->memory[address];
+}
+
+void deviceWrite(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    const struct device *device = &devices[address - MR_BASE];
+    if (device->write) device->write(vm, address, val);
+}
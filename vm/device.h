@@ -0,0 +1,36 @@
+#ifndef H_DEVICE
+#define H_DEVICE
+
+#include <stdint.h>
+
+#include "lc3vm.h"
+
+// MEMORY MAPPED DEVICES
+// Accesses from MR_BASE up, routed here by mem_read/mem_write (and the inline
+// load/store of the decode engines). Every word of the region has an entry in a
+// dispatch table; words without a device behave like RAM. The value of a
+// register is kept in its memory word, so snapshots save it like any other.
+// - KBSR: bit 15 set when a key is available, from a non-blocking poll of the
+//         input stream (a terminal is switched to raw input on the first poll).
+//         When no key is ready and the read comes from a polling loop that
+//         cannot change anything else, the host thread blocks until input
+//         arrives (consoleWait), or an enabled timer interrupt is due, instead
+//         of running the loop: see pollingLoop.
+//         Bit 14 enables the keyboard interrupt, the only bit written.
+// - KBDR: the last key read; reading it takes the next key when one is ready
+// - DSR:  bit 15 always set, the display is always ready
+// - DDR:  writing prints the low byte, like TRAP OUT
+// - TSR:  timer status, bit 15 set when the interval elapsed (reading clears
+//         it), bit 14 enables the timer interrupt, the only bit written
+// - TIR:  timer interval in milliseconds, writing restarts the timer, 0 stops it
+// - PSR:  privilege and priority of the processor status (vm->psr), written
+//         only in supervisor mode
+// - MCR:  clearing bit 15 halts the machine (vmReset sets it)
+// Interrupts are in interrupt.h.
+// vm->reg[RPC] must be RPC of the instruction doing the access (see load in decode.h)
+uint16_t deviceRead(struct lc3_vm *vm, uint16_t address);
+
+// Called after the word was stored in memory
+void deviceWrite(struct lc3_vm *vm, uint16_t address, uint16_t val);
+
+#endif
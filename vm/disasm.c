@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "lc3vm.h"
+#include "disasm.h"
+
+// ===================================================================================
+// ================================= DISASSEMBLER ====================================
+// ===================================================================================
+static const char *opcodes[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+const char *opcodeName(unsigned op)
+{
+    return opcodes[op & 0xF];
+}
+
+const char *trapName(uint8_t vector)
+{
+    switch (vector) {
+    case TRAP_GETC:     return "GETC";
+    case TRAP_OUT:      return "OUT";
+    case TRAP_PUTS:     return "PUTS";
+    case TRAP_IN:       return "IN";
+    case TRAP_PUTSP:    return "PUTSP";
+    case TRAP_HALT:     return "HALT";
+    case TRAP_INU16:    return "IN_U16";
+    case TRAP_OUTU16:   return "OUT_U16";
+    case TRAP_MEMCPY:   return "MEMCPY";
+    case TRAP_MEMSET:   return "MEMSET";
+    case TRAP_STRLEN:   return "STRLEN";
+    case TRAP_STRCMP:   return "STRCMP";
+    case TRAP_MUL:      return "MUL";
+    case TRAP_DIV:      return "DIV";
+    case TRAP_MOD:      return "MOD";
+    case TRAP_FREAD:    return "FREAD";
+    case TRAP_FWRITE:   return "FWRITE";
+    default:            return NULL;
+    }
+}
+
+int disassemble(uint16_t instruction, char *text, size_t size)
+{
+    unsigned op = instruction >> 12;
+    unsigned dr = (instruction >> 9) & 0x7;
+    unsigned sr = (instruction >> 6) & 0x7;
+    const char *name = opcodes[op];
+
+    switch (op) {
+    case op_add:
+    case op_and:
+        if (instruction & 0x20)
+            return snprintf(text, size, "%s R%u R%u 0x%02X", name, dr, sr, instruction & 0x1F);
+        return snprintf(text, size, "%s R%u R%u R%u", name, dr, sr, instruction & 0x7);
+    case op_not:
+        return snprintf(text, size, "NOT R%u R%u", dr, sr);
+    case op_ld:
+    case op_ldi:
+    case op_lea:
+    case op_st:
+    case op_sti:
+        return snprintf(text, size, "%s R%u 0x%03X", name, dr, instruction & 0x1FF);
+    case op_ldr:
+    case op_str:
+        return snprintf(text, size, "%s R%u R%u 0x%02X", name, dr, sr, instruction & 0x3F);
+    case op_jmp:
+        return snprintf(text, size, "JMP R%u", sr);
+    case op_jsr:
+        if (instruction & 0x800)
+            return snprintf(text, size, "JSR 0x%03X", instruction & 0x7FF);
+        return snprintf(text, size, "JSR R%u", sr);
+    case op_br:
+        if (dr == 0) break;
+        return snprintf(text, size, "BR %s%s%s 0x%03X", dr & 4 ? "N" : "", dr & 2 ? "Z" : "",
+                        dr & 1 ? "P" : "", instruction & 0x1FF);
+    case op_trap: {
+        const char *trap = trapName(instruction & 0xFF);
+        if (trap == NULL) break;
+        if ((instruction & 0xFF) == TRAP_HALT) return snprintf(text, size, "HALT");
+        return snprintf(text, size, "TRAP %s", trap);
+    }
+    case op_rti:
+    case op_res:
+        return snprintf(text, size, "%s", name);
+    }
+    return snprintf(text, size, ".FILL 0x%04X", instruction);
+}
@@ -0,0 +1,19 @@
+#ifndef H_DISASM
+#define H_DISASM
+
+#include <stdint.h>
+#include <stddef.h>
+
+// DISASSEMBLER
+// Write instruction as a line of the assembler (assembler/assembler.py), e.g.
+// "ADD R1 R0 0x1F", "BR NZ 0x1FD", "TRAP PUTS", so a listing can be assembled
+// again. Offsets and immediates are the raw bit fields, like in the sources.
+// Words without an assembler form (BR with no condition, unknown trap vectors)
+// are written as ".FILL 0xVALUE". Return the length, like snprintf.
+int disassemble(uint16_t instruction, char *text, size_t size);
+
+// Name of an opcode (instruction >> 12) and of a trap vector (NULL if unknown)
+const char *opcodeName(unsigned op);
+const char *trapName(uint8_t vector);
+
+#endif
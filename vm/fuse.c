@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "fuse.h"
+
+_Thread_local uint64_t fused_instructions = 0;
+
+// ADD Rx Ry #imm followed by a conditional branch
+static bool isAddiBr(const struct decoded *d)
+{
+    return d[0].op == DOP_ADDI && d[1].op == DOP_BR;
+}
+
+// AND Rx Ry #0 followed by ADD Rz Rx #imm: Rz gets a constant
+static bool isConst(const struct decoded *d)
+{
+    return d[0].op == DOP_ANDI && d[0].imm == 0 &&
+           d[1].op == DOP_ADDI && d[1].sr1 == d[0].dr;
+}
+
+// LDR Rx Rb #o, ADD Rx Rx (Ry or #imm), STR Rx Rb #o with Rb not overwritten
+static bool isLdrAddStr(const struct decoded *d)
+{
+    return d[0].op == DOP_LDR &&
+           (d[1].op == DOP_ADD || d[1].op == DOP_ADDI) &&
+           d[2].op == DOP_STR &&
+           d[1].sr1 == d[0].dr && d[2].dr == d[1].dr &&
+           d[2].sr1 == d[0].sr1 && d[0].dr != d[0].sr1;
+}
+
+// ===================================================================================
+// ================================= PEEPHOLE PASS ===================================
+// ===================================================================================
+// The group is matched on plain decodes of the words: the entries after the head
+// may not be decoded yet, or be the heads of groups of their own.
+void fuseInstruction(struct lc3_vm *vm, uint16_t address)
+{
+    struct decoded *cache = vm->decode;
+    if ((uint32_t)address + 2 >= MR_BASE) {
+        decodeInstruction(&cache[address], address, mem_read(vm, address));
+        return;
+    }
+
+    struct decoded group[3];
+    for (int i = 0; i < 3; ++i)
+        decodeInstruction(&group[i], address + i, vm->memory[address + i]);
+    cache[address] = group[0];
+
+    uint8_t op = DOP_NONE;
+    if (isLdrAddStr(group))
+        op = DOP_LDR_ADD_STR;
+    else if (isAddiBr(group))
+        op = DOP_ADDI_BR;
+    else if (isConst(group))
+        op = DOP_CONST;
+    if (op == DOP_NONE) return;
+
+    // The handler reads the other words from their own entries
+    for (int i = 1; i < (op >= DOP_FUSED3 ? 3 : 2); ++i)
+        if (cache[address + i].op == DOP_NONE) cache[address + i] = group[i];
+    cache[address].op = op;
+}
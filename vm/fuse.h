@@ -0,0 +1,29 @@
+#ifndef H_FUSE
+#define H_FUSE
+
+#include <stdint.h>
+
+#include "lc3vm.h"
+
+// SUPERINSTRUCTIONS
+// Peephole fusion in the decode cache: common instruction sequences get the
+// first word of each one marked with a fused op, executed by the threaded
+// engine with a single dispatch:
+// - DOP_ADDI_BR:     ADD Rx Ry #imm + BR          (loop counter)
+// - DOP_CONST:       AND Rx Ry #0 + ADD Rz Rx #imm (load a constant)
+// - DOP_LDR_ADD_STR: LDR Rx Rb #o + ADD Rx Rx * + STR Rx Rb #o (read-modify-write)
+// Words are fused when the fused engine decodes them: the first time they run,
+// and again after a store or a snapshot restore dropped their entry
+// (decode_invalidate drops the groups that cover a word too), so a run costs
+// nothing for the memory it does not execute. Only the head is fused: jumping
+// into the middle of a group finds the plain entries of its other words.
+// Entries decoded by the decoded and threaded engines stay plain.
+
+// Decode the word at address into the cache, as the head of a group if it starts one
+void fuseInstruction(struct lc3_vm *vm, uint16_t address);
+
+// Dynamic instructions executed inside fused handlers during the last run of
+// the calling thread
+extern _Thread_local uint64_t fused_instructions;
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lc3vm.h"
+#include "image.h"
+#include "asm.h"
+
+#define HEADER_SIZE   12            // magic, entry, nsections
+#define SECTION_SIZE  12            // offset, size, kind, origin
+
+// ===================================================================================
+// ===================================== FORMATS =====================================
+// ===================================================================================
+static uint16_t le16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t le32(const uint8_t *p) { return le16(p) | (uint32_t)le16(p + 2) << 16; }
+
+static void corrupt(const char *fileName, const char *what)
+{
+    fprintf(stderr, "Cannot load %s: %s\n", fileName, what);
+    abort();
+}
+
+static bool endsWith(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), k = strlen(suffix);
+    return n >= k && strcmp(s + n - k, suffix) == 0;
+}
+
+static void addSegment(struct lc3_image *image, const char *fileName, uint16_t origin,
+                       const uint8_t *data, size_t bytes, bool big_endian)
+{
+    if (image->nsegments == IMAGE_SEGMENTS) corrupt(fileName, "too many segments");
+    if (origin + bytes / 2 > MEMORY_MAX) corrupt(fileName, "segment does not fit in memory");
+    image->segments[image->nsegments++] = (struct image_segment){ origin, bytes / 2, data, big_endian };
+}
+
+static int byAddress(const void *a, const void *b)
+{
+    return ((const struct image_symbol *)a)->address - ((const struct image_symbol *)b)->address;
+}
+
+// Index the symbol records of a section
+static void addSymbols(struct lc3_image *image, const char *fileName, const uint8_t *data, size_t size)
+{
+    int n = 0;
+    for (size_t at = 0; at < size; ++n) {
+        const uint8_t *end = at + 2 < size ? memchr(data + at + 2, '\0', size - at - 2) : NULL;
+        if (end == NULL) corrupt(fileName, "truncated symbol table");
+        at = end + 1 - data;
+    }
+    if (n == 0) return;
+
+    image->symbols = realloc(image->symbols, (image->nsymbols + n) * sizeof(struct image_symbol));
+    if (image->symbols == NULL) {
+        fprintf(stderr, "Cannot allocate %d symbols\n", image->nsymbols + n);
+        abort();
+    }
+    for (size_t at = 0; at < size; ) {
+        const char *name = (const char *)data + at + 2;
+        image->symbols[image->nsymbols++] = (struct image_symbol){ le16(data + at), name };
+        at += 2 + strlen(name) + 1;
+    }
+}
+
+static void indexContainer(struct lc3_image *image, const char *fileName)
+{
+    const uint8_t *file = image->map;
+    if (image->size < HEADER_SIZE) corrupt(fileName, "truncated header");
+    image->entry = le16(file + 8);
+    uint16_t nsections = le16(file + 10);
+    if (image->size < HEADER_SIZE + (size_t)nsections * SECTION_SIZE)
+        corrupt(fileName, "truncated section table");
+
+    for (uint16_t i = 0; i < nsections; ++i) {
+        const uint8_t *section = file + HEADER_SIZE + i * SECTION_SIZE;
+        uint32_t offset = le32(section), size = le32(section + 4);
+        uint16_t kind = le16(section + 8), origin = le16(section + 10);
+        if (offset > image->size || size > image->size - offset)
+            corrupt(fileName, "section out of the file");
+
+        switch (kind) {
+        case IMAGE_CODE:
+            addSegment(image, fileName, origin, file + offset, size, false);
+            break;
+        case IMAGE_SYMBOLS:
+            addSymbols(image, fileName, file + offset, size);
+            break;
+        case IMAGE_METADATA:
+            image->metadata = (const char *)file + offset;
+            image->metadata_size = size;
+            break;
+        default:
+            break;
+        }
+    }
+    if (image->nsymbols) qsort(image->symbols, image->nsymbols, sizeof(struct image_symbol), byAddress);
+}
+
+
+// ===================================================================================
+// ===================================== IMAGES ======================================
+// ===================================================================================
+// Find the segments, symbols and metadata of a file already in image->map
+static void indexImage(struct lc3_image *image, const char *fileName)
+{
+    const uint8_t *file = image->map;
+    size_t magic = strlen(IMAGE_MAGIC);
+    if (image->size >= magic && memcmp(file, IMAGE_MAGIC, magic) == 0) {
+        indexContainer(image, fileName);
+    }
+    else if (endsWith(fileName, ".obj")) {
+        if (image->size < 2) corrupt(fileName, "no origin");
+        image->entry = file[0] << 8 | file[1];
+        addSegment(image, fileName, image->entry, file + 2, image->size - 2, true);
+    }
+    else {
+        image->entry = PC_START;
+        if (image->size) addSegment(image, fileName, PC_START, file, image->size, false);
+    }
+}
+
+static struct lc3_image *newImage(void)
+{
+    struct lc3_image *image = calloc(1, sizeof(struct lc3_image));
+    if (image == NULL) {
+        fprintf(stderr, "Cannot allocate image\n");
+        abort();
+    }
+    return image;
+}
+
+struct lc3_image *imageOpen(const char *fileName)
+{
+    if (endsWith(fileName, ".asm")) return asmOpen(fileName);
+
+    int fd = open(fileName, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open file %s\n", fileName);
+        abort();
+    }
+    struct lc3_image *image = newImage();
+    image->size = st.st_size;
+    if (image->size > 0) {
+        image->map = mmap(NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image->map == MAP_FAILED) {
+            fprintf(stderr, "Cannot map file %s\n", fileName);
+            abort();
+        }
+        image->mapped = true;
+    }
+    close(fd);
+    indexImage(image, fileName);
+    return image;
+}
+
+struct lc3_image *imageAdopt(const char *fileName, void *data, size_t size)
+{
+    struct lc3_image *image = newImage();
+    image->map = data;
+    image->size = size;
+    indexImage(image, fileName);
+    return image;
+}
+
+void imageClose(struct lc3_image *image)
+{
+    if (image->mapped) munmap(image->map, image->size);
+    else free(image->map);
+    free(image->symbols);
+    free(image);
+}
+
+void imageCopy(const struct lc3_image *image, uint16_t *memory)
+{
+    for (int i = 0; i < image->nsegments; ++i) {
+        const struct image_segment *s = &image->segments[i];
+        uint16_t *dst = memory + s->origin;
+        if (s->big_endian) {
+            for (uint32_t w = 0; w < s->words; ++w)
+                dst[w] = s->data[2 * w] << 8 | s->data[2 * w + 1];
+        }
+        else if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            memcpy(dst, s->data, s->words * sizeof(uint16_t));
+        }
+        else {
+            for (uint32_t w = 0; w < s->words; ++w)
+                dst[w] = le16(s->data + 2 * w);
+        }
+    }
+}
+
+const char *imageSymbol(const struct lc3_image *image, uint16_t address)
+{
+    if (image->nsymbols == 0) return NULL;
+    struct image_symbol key = { address, NULL };
+    const struct image_symbol *found = bsearch(&key, image->symbols, image->nsymbols,
+                                               sizeof(struct image_symbol), byAddress);
+    return found ? found->name : NULL;
+}
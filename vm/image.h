@@ -0,0 +1,75 @@
+#ifndef H_IMAGE
+#define H_IMAGE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lc3vm.h"
+
+// PROGRAM IMAGES
+// imageOpen maps a program file read-only and indexes it in place; imageCopy
+// copies its segments from the mapping straight into guest memory, without
+// reading the file into a buffer first. The mapping shares the page cache, so
+// after the first load of an image (by any process) opening it again does no I/O.
+// Three formats are recognized:
+// - container: starts with IMAGE_MAGIC, see below
+// - LC-3 object (a name ending in .obj): big endian words, the first one is
+//   the origin of the others and the entry point, as written by the LC-3 tools
+// - raw image (anything else): little endian words loaded at PC_START, the
+//   output of assembler/assembler.py
+// A name ending in .asm is a source, assembled by asm.h.
+//
+// Container layout, little endian:
+//   magic[8]  entry:u16  nsections:u16
+//   nsections x { offset:u32  size:u32  kind:u16  origin:u16 }   (bytes of the file)
+// Section kinds:
+// - IMAGE_CODE:     size / 2 words loaded at origin
+// - IMAGE_SYMBOLS:  records of { address:u16  name, NUL terminated }
+// - IMAGE_METADATA: free text for tools (source file, build options)
+// Other kinds are skipped, so a section added later (a pre-decoded cache, say)
+// does not break older loaders.
+#define IMAGE_MAGIC "LC3IMG1\n"
+enum { IMAGE_CODE = 1, IMAGE_SYMBOLS = 2, IMAGE_METADATA = 3 };
+
+#define IMAGE_SEGMENTS 64           // code sections of a container
+
+struct image_segment {
+    uint16_t origin;
+    uint32_t words;
+    const uint8_t *data;            // in the mapping
+    bool big_endian;
+};
+
+struct image_symbol {
+    uint16_t address;
+    const char *name;               // in the mapping
+};
+
+struct lc3_image {
+    void *map;                      // the file, or a buffer of imageAdopt
+    bool mapped;
+    size_t size;
+    uint16_t entry;
+    struct image_segment segments[IMAGE_SEGMENTS];
+    int nsegments;
+    struct image_symbol *symbols;   // sorted by address
+    int nsymbols;
+    const char *metadata;           // in the mapping, not NUL terminated
+    size_t metadata_size;
+};
+
+// Map and index a program file. A malformed file is a fatal error.
+struct lc3_image *imageOpen(const char *fileName);
+void imageClose(struct lc3_image *image);
+
+// Index an image held in memory. It takes the buffer (malloc'd), freed by imageClose.
+struct lc3_image *imageAdopt(const char *fileName, void *data, size_t size);
+
+// Copy every segment into memory
+void imageCopy(const struct lc3_image *image, uint16_t *memory);
+
+// Name of the symbol at address, NULL for none
+const char *imageSymbol(const struct lc3_image *image, uint16_t address);
+
+#endif
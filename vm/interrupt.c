@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lc3vm.h"
+#include "console.h"
+#include "replay.h"
+#include "interrupt.h"
+
+// Priority levels of the sources
+#define KEYBOARD_PRIORITY 4
+#define TIMER_PRIORITY    6
+
+// Longest idle loop recognized, in words
+#define IDLE_LOOP_MAX 8
+
+struct interrupts {
+    pthread_t ticker;
+    bool ticking;
+    atomic_bool stop;
+    struct lc3_vm *vm;
+    uint16_t interval;              // TIR the timer runs with, 0 stopped
+    uint64_t deadline;              // next timer expiry, ms of CLOCK_MONOTONIC
+    uint64_t keyboard, timer;       // interrupts taken
+    uint64_t idle;                  // waits of an idle guest
+};
+
+static uint64_t now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+static void post(struct lc3_vm *vm)
+{
+    atomic_store_explicit(&vm->event, true, memory_order_relaxed);
+}
+
+
+// ===================================================================================
+// ===================================== TICKER ======================================
+// ===================================================================================
+// The only thing the ticker touches is vm->event: the sources are looked at by
+// the thread running the guest, in interruptPoll
+static void *tickerMain(void *arg)
+{
+    struct interrupts *irq = arg;
+    struct timespec tick = { 0, INTERRUPT_TICK_MS * 1000000L };
+    while (!atomic_load(&irq->stop)) {
+        nanosleep(&tick, NULL);
+        post(irq->vm);
+    }
+    return NULL;
+}
+
+static void stopTicker(struct interrupts *irq)
+{
+    if (!irq->ticking) return;
+    atomic_store(&irq->stop, true);
+    pthread_join(irq->ticker, NULL);
+    irq->ticking = false;
+}
+
+static bool enabled(struct lc3_vm *vm)
+{
+    return (vm->memory[MR_KBSR] | vm->memory[MR_TSR]) & SR_ENABLE;
+}
+
+void interruptArm(struct lc3_vm *vm)
+{
+    uint16_t interval = vm->memory[MR_TIR];
+    if (vm->irq == NULL && !enabled(vm) && interval == 0) return;
+
+    if (vm->irq == NULL) {
+        vm->irq = calloc(1, sizeof(struct interrupts));
+        if (vm->irq == NULL) {
+            fprintf(stderr, "Cannot allocate the interrupt controller\n");
+            abort();
+        }
+        vm->irq->vm = vm;
+    }
+    struct interrupts *irq = vm->irq;
+    if (interval != irq->interval) {
+        irq->interval = interval;
+        irq->deadline = now() + interval;
+    }
+    if (enabled(vm) && !irq->ticking) {
+        atomic_store(&irq->stop, false);
+        if (pthread_create(&irq->ticker, NULL, tickerMain, irq) != 0) {
+            fprintf(stderr, "Cannot create the interrupt ticker\n");
+            abort();
+        }
+        irq->ticking = true;
+    }
+    post(vm);
+}
+
+void interruptStop(struct lc3_vm *vm)
+{
+    if (vm->irq == NULL) return;
+    stopTicker(vm->irq);
+    free(vm->irq);
+    vm->irq = NULL;
+}
+
+
+// ===================================================================================
+// ====================================== TIMER ======================================
+// ===================================================================================
+void interruptTimerStart(struct lc3_vm *vm)
+{
+    if (vm->irq) vm->irq->interval = 0;     // a new interval, even if it is the same
+    interruptArm(vm);
+}
+
+// Set the ready bit of TSR if the interval elapsed since the last expiry
+static void timerUpdate(struct lc3_vm *vm)
+{
+    struct interrupts *irq = vm->irq;
+    if (irq == NULL || irq->interval == 0) return;
+    uint64_t t = now();
+    if (t < irq->deadline) return;
+    irq->deadline += irq->interval;
+    if (irq->deadline <= t) irq->deadline = t + irq->interval;     // missed ticks are not queued
+    vm->memory[MR_TSR] |= SR_READY;
+    vm->dirty[MR_TSR >> PAGE_BITS] = 1;
+}
+
+uint16_t interruptTimerStatus(struct lc3_vm *vm)
+{
+    timerUpdate(vm);
+    return vm->memory[MR_TSR];
+}
+
+int interruptTimeout(struct lc3_vm *vm)
+{
+    struct interrupts *irq = vm->irq;
+    if (irq == NULL || irq->interval == 0 || !(vm->memory[MR_TSR] & SR_ENABLE) ||
+        (int)((vm->psr & PSR_PRIORITY) >> 8) >= TIMER_PRIORITY)
+        return -1;
+    post(vm);
+    timerUpdate(vm);
+    if (vm->memory[MR_TSR] & SR_READY) return 0;
+    uint64_t t = now();
+    return irq->deadline > t ? (int)(irq->deadline - t) : 0;
+}
+
+
+// ===================================================================================
+// ===================================== DELIVERY ====================================
+// ===================================================================================
+void interruptEnter(struct lc3_vm *vm, uint8_t vector, int priority)
+{
+    uint16_t *reg = vm->reg;
+    uint16_t psr = vm->psr | reg[RCND];
+    if (psr & PSR_USER) {
+        vm->usp = reg[R6];
+        reg[R6] = vm->ssp;
+    }
+    mem_write(vm, --reg[R6], psr);
+    mem_write(vm, --reg[R6], reg[RPC]);
+    // The pushes may land on translated code, like the block a native trap writes
+    vm->bulk_start = reg[R6];
+    vm->bulk_size = 2;
+    if (priority >= 0) {
+        vm->psr = priority << 8;
+        reg[RCND] = 0;
+    }
+    else vm->psr &= PSR_PRIORITY;
+    reg[RPC] = vm->memory[IVT_BASE + vector];
+}
+
+// True when the code at RPC is a loop that only loads from RAM and branches
+// back to RPC, and the branch is taken with what memory holds now. Until an
+// interrupt handler writes memory the guest would run it forever.
+static bool idleLoop(struct lc3_vm *vm)
+{
+    uint16_t start = vm->reg[RPC];
+    uint16_t reg[8];
+    uint16_t cc = vm->reg[RCND];
+    memcpy(reg, vm->reg, sizeof(reg));
+
+    uint16_t a = start;
+    for (int n = 0; n < IDLE_LOOP_MAX; ++n, ++a) {
+        uint16_t instruction = vm->memory[a];
+        uint16_t op = instruction >> 12, next = a + 1;
+        uint16_t pc9 = next + sign_extend(instruction & 0x1FF, 9);
+        uint16_t address;
+        switch (op) {
+        case op_br:
+            return pc9 == start && (((instruction >> 9) & 0x7) & cc);
+        case op_ld:
+            address = pc9;
+            break;
+        case op_ldi:
+            if (pc9 >= MR_BASE) return false;
+            address = vm->memory[pc9];
+            break;
+        case op_ldr:
+            address = reg[(instruction >> 6) & 0x7] + sign_extend(instruction & 0x3F, 6);
+            break;
+        default:
+            return false;
+        }
+        if (address >= MR_BASE) return false;
+        uint16_t value = reg[(instruction >> 9) & 0x7] = vm->memory[address];
+        cc = value == 0 ? FZ : value >> 15 ? FN : FP;
+    }
+    return false;
+}
+
+// Block until a key (keyboard enabled) or the next timer expiry (timer
+// enabled). Nothing else can end an idle loop: without either it keeps running.
+static void idle(struct lc3_vm *vm, bool keyboard, bool timer)
+{
+    struct interrupts *irq = vm->irq;
+    int timeout = -1;
+    if (vm->io->eof || fileno(vm->in) < 0) keyboard = false;    // no key can come
+    if (timer) {
+        uint64_t t = now();
+        timeout = irq->deadline > t ? (int)(irq->deadline - t) : 0;
+    }
+    if (!keyboard && timeout < 0) return;
+    ++irq->idle;
+    if (keyboard) consoleWait(vm, timeout);
+    else if (timeout >= 0) {
+        struct timespec wait = { timeout / 1000, (timeout % 1000) * 1000000L };
+        consoleFlush(vm);
+        nanosleep(&wait, NULL);
+    }
+    post(vm);      // poll again at the branch of the loop
+}
+
+void interruptPoll(struct lc3_vm *vm)
+{
+    atomic_store_explicit(&vm->event, false, memory_order_relaxed);
+    struct interrupts *irq = vm->irq;
+    if (irq == NULL) return;
+
+    uint16_t *memory = vm->memory;
+    bool keyboard = memory[MR_KBSR] & SR_ENABLE, timer = memory[MR_TSR] & SR_ENABLE;
+    if (!keyboard && !timer) {
+        stopTicker(irq);        // nothing to look at until a source is enabled again
+        return;
+    }
+
+    timerUpdate(vm);
+    bool key = keyboard && inputReady(vm, 0);
+    bool tick = timer && (memory[MR_TSR] & SR_READY);
+    int priority = (vm->psr & PSR_PRIORITY) >> 8;
+    if (tick && TIMER_PRIORITY > priority) {
+        ++irq->timer;
+        interruptEnter(vm, VEC_TIMER, TIMER_PRIORITY);
+    }
+    else if (key && KEYBOARD_PRIORITY > priority) {
+        ++irq->keyboard;
+        interruptEnter(vm, VEC_KEYBOARD, KEYBOARD_PRIORITY);
+    }
+    else if (!key && !tick && vm->budget == 0 && idleLoop(vm))
+        idle(vm, keyboard, timer && irq->interval != 0);
+}
+
+void interruptReport(struct lc3_vm *vm, FILE *out)
+{
+    struct interrupts *irq = vm->irq;
+    if (irq == NULL || (irq->keyboard == 0 && irq->timer == 0)) return;
+    fprintf(out, "interrupts: %llu keyboard, %llu timer, %llu idle waits\n",
+            (unsigned long long)irq->keyboard, (unsigned long long)irq->timer,
+            (unsigned long long)irq->idle);
+}
@@ -0,0 +1,91 @@
+#ifndef H_INTERRUPT
+#define H_INTERRUPT
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// INTERRUPTS AND PRIVILEGE
+// The LC-3 interrupt model:
+// - PSR: vm->psr holds the privilege (bit 15, 1 = user) and the priority
+//   level (bits 10-8), also read at MR_PSR and written there in supervisor
+//   mode (a user mode store leaves it as it is). The condition codes stay in
+//   RCND and are merged in when the PSR is pushed on the stack.
+//   vmReset starts in user mode at priority 0.
+// - Supervisor stack: R6 is the stack pointer of the current mode, the other
+//   one is saved in vm->ssp/vm->usp (vmReset sets ssp to SSP_START).
+// - Interrupt vector table: the word at IVT_BASE + vector is the address of
+//   the handler. An interrupt or exception pushes the PSR and RPC on the
+//   supervisor stack, switching to it from user mode, enters supervisor mode
+//   (an interrupt also at its priority, with the condition codes cleared) and
+//   jumps to the handler. RTI pops RPC and the PSR back, and R6 back to the
+//   user stack when it returns to user mode.
+// - Exceptions: RTI in user mode (vector 0x00) and the reserved opcode (0x01).
+//   When the table has no handler for them (word 0) the VM stops with an
+//   error, as it did before interrupts existed.
+// - Sources, each requesting while both its ready (15) and interrupt
+//   enable (14) bits are set:
+//   - keyboard, KBSR: vector 0x80, priority 4. A key is ready until KBDR is read.
+//   - timer, TSR: vector 0x81, priority 6. Bit 15 is set every TIR milliseconds
+//     (writing TIR restarts the timer, 0 stops it) and cleared by reading TSR.
+//   The highest request above the current priority is taken.
+//
+// Requests are only looked at on block boundaries: a taken BR, JMP/RET,
+// JSR/JSRR and RTI test vm->event and call interruptPoll when it is set, so
+// the other instructions pay nothing and an idle guest needs no polling loop.
+// vm->event is set by a ticker thread every INTERRUPT_TICK_MS milliseconds
+// while a source is enabled, and by the writes that may unmask a request.
+// When nothing is taken and the guest waits in a loop that only loads and
+// branches back (WAIT BRnzp WAIT, or LD R0, FLAG / BRz back), the host thread
+// blocks until input or the next timer tick instead (not with a budget).
+// Interrupts arrive at host times: they are not recorded by -R, and engines
+// that cannot run a block boundary check (warp lanes) leave the guest to
+// programRun once it enables a source.
+#define IVT_BASE  0x0100
+#define SSP_START 0x3000
+#define PSR_USER      0x8000
+#define PSR_PRIORITY  0x0700
+#define INTERRUPT_TICK_MS 1
+
+enum vectors { VEC_PRIVILEGE = 0x00, VEC_ILLEGAL = 0x01, VEC_KEYBOARD = 0x80, VEC_TIMER = 0x81 };
+
+#define SR_READY  0x8000        // device status registers (KBSR, TSR)
+#define SR_ENABLE 0x4000
+
+static inline bool eventPending(struct lc3_vm *vm)
+{
+    return atomic_load_explicit(&vm->event, memory_order_relaxed);
+}
+
+// Take the highest request above the current priority, if any; park an idle
+// guest. vm->reg must be up to date (RPC of the next instruction).
+void interruptPoll(struct lc3_vm *vm);
+
+// Start the ticker if a source is enabled, and set vm->event. Called after
+// writes to the interrupt registers and after a snapshot restore.
+void interruptArm(struct lc3_vm *vm);
+
+// Stop the ticker and drop the state of the sources (vmReset, vmDestroy)
+void interruptStop(struct lc3_vm *vm);
+
+// TIR was written: restart the timer from now
+void interruptTimerStart(struct lc3_vm *vm);
+
+// TSR with the ready bit set if the interval elapsed
+uint16_t interruptTimerStatus(struct lc3_vm *vm);
+
+// Milliseconds a guest parked on KBSR may block before the timer interrupt is
+// due (0 when it is), -1 when no timer interrupt can be taken. Sets vm->event,
+// so the branch of the polling loop takes the interrupt after the wait.
+int interruptTimeout(struct lc3_vm *vm);
+
+// Push the PSR and RPC and jump to the handler of vector (see above)
+void interruptEnter(struct lc3_vm *vm, uint8_t vector, int priority);
+
+// Print the interrupts taken on out, if any
+void interruptReport(struct lc3_vm *vm, FILE *out);
+
+#endif
@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "threaded.h"
+#include "jit.h"
+#include "interrupt.h"
+
+#if LC3_JIT
+#include <sys/mman.h>
+
+// Host registers (x86-64 encoding numbers)
+enum host { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, H8, H9, H10, H11, H12, H13, H14, H15 };
+#define GUEST(r) (H8 + (r))     // guest Rn lives in host r(8+n)
+
+// x86 condition codes for jcc
+enum jcc { CC_E = 0x4, CC_NE = 0x5, CC_AE = 0x3, CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE, CC_G = 0xF };
+
+// State shared by the dispatcher and native code, which addresses it through rsi
+struct jit_state {
+    uint16_t reg[REG_SIZE];     // R0-R7, RPC, RCND
+    uint16_t flag;              // last flag-setting result, RCND is derived from it
+    uint32_t smc;               // address written into compiled code, JIT_NO_SMC or JIT_SIDE_EXIT
+    uint8_t *link;              // patchable jump that left native code, or NULL
+    uint64_t count;             // retired instructions
+    uint8_t **entry;            // native entry of the block starting at each address
+    uint8_t *code_map;          // nonzero for words covered by a compiled block
+};
+#define JIT_NO_SMC    0xFFFFFFFF
+#define JIT_SIDE_EXIT 0xFFFFFFFE   // left before an instruction that needs the interpreter
+#define JIT_NEVER     0xFFFF       // hits value of an address that cannot start a block
+
+// Native code entry: rdi = memory, rsi = state, rdx = block code
+typedef void (*jit_enter_fn)(uint16_t *memory, struct jit_state *st, uint8_t *code);
+
+struct jit_block {
+    uint16_t start;
+    uint16_t length;
+    bool live;
+};
+
+// Jump patched to go directly to the block starting at target. stub is where it
+// jumped before (the exit stub), restored when the target block is invalidated.
+struct jit_link {
+    uint8_t *site;
+    uint8_t *stub;
+    uint16_t target;
+};
+
+static uint8_t *code_buffer = NULL;
+static size_t code_used = 0;
+static size_t code_start = 0;           // first byte after the enter/exit trampolines
+static jit_enter_fn enter_native;
+static uint8_t *exit_native;
+
+static uint8_t *entry[MEMORY_MAX];
+static uint8_t *no_entry[MEMORY_MAX];   // empty table: JMP/RET always leave native code
+static uint8_t code_map[MEMORY_MAX];
+static uint16_t hits[MEMORY_MAX];
+
+static struct jit_block *blocks = NULL;
+static size_t nblocks = 0, cap_blocks = 0;
+static struct jit_link *links = NULL;
+static size_t nlinks = 0, cap_links = 0;
+
+static struct {
+    uint64_t compiled, invalidated, flushes, native;
+} jit_stats;
+
+
+// ===================================================================================
+// ================================== x86-64 EMITTER =================================
+// ===================================================================================
+struct emitter { uint8_t *p; };
+
+static void emit8(struct emitter *e, uint8_t b) { *e->p++ = b; }
+static void emit16(struct emitter *e, uint16_t v) { memcpy(e->p, &v, 2); e->p += 2; }
+static void emit32(struct emitter *e, uint32_t v) { memcpy(e->p, &v, 4); e->p += 4; }
+static void emit64(struct emitter *e, uint64_t v) { memcpy(e->p, &v, 8); e->p += 8; }
+
+// REX prefix, only when one of its bits is needed (index < 0: no index register)
+static void rex(struct emitter *e, int w, int reg, int index, int base)
+{
+    uint8_t v = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) |
+                ((index >= 0 ? (index >> 3) & 1 : 0) << 1) | ((base >> 3) & 1);
+    if (v != 0x40) emit8(e, v);
+}
+
+static void prefix(struct emitter *e, int size, int reg, int index, int base)
+{
+    if (size == 16) emit8(e, 0x66);
+    rex(e, size == 64, reg, index, base);
+}
+
+// op reg, rm (register direct)
+static void op_rr(struct emitter *e, int size, uint8_t op, int reg, int rm)
+{
+    prefix(e, size, reg, -1, rm);
+    emit8(e, op);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + index * (1 << scale) + disp]
+static void op_rm(struct emitter *e, int size, int twobyte, uint8_t op, int reg,
+                  int base, int index, int scale, int32_t disp)
+{
+    prefix(e, size, reg, index, base);
+    if (twobyte) emit8(e, 0x0F);
+    emit8(e, op);
+
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP) mod = 0;
+    else if (disp >= -128 && disp <= 127) mod = 1;
+
+    if (index < 0)
+        emit8(e, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    else {
+        emit8(e, (mod << 6) | ((reg & 7) << 3) | 4);
+        emit8(e, (scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+    if (mod == 1) emit8(e, (uint8_t)disp);
+    if (mod == 2) emit32(e, (uint32_t)disp);
+}
+
+static void mov_rr(struct emitter *e, int dst, int src) { op_rr(e, 32, 0x89, src, dst); }
+static void alu_rr(struct emitter *e, uint8_t op, int dst, int src) { op_rr(e, 32, op, src, dst); }
+static void test16(struct emitter *e, int r) { op_rr(e, 16, 0x85, r, r); }
+static void not_r(struct emitter *e, int r) { op_rr(e, 32, 0xF7, 2, r); }
+
+// movzx dst32, src16
+static void movzx_rr(struct emitter *e, int dst, int src)
+{
+    rex(e, 0, dst, -1, src);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit8(e, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// add/and/cmp dst32, imm32 (ext selects the operation)
+enum { ALU_ADD = 0, ALU_AND = 4, ALU_SUB = 5, ALU_CMP = 7 };
+static void alu_ri(struct emitter *e, int ext, int dst, uint32_t imm)
+{
+    op_rr(e, 32, 0x81, ext, dst);
+    emit32(e, imm);
+}
+
+static void mov_ri(struct emitter *e, int r, uint32_t imm)
+{
+    rex(e, 0, 0, -1, r);
+    emit8(e, 0xB8 + (r & 7));
+    emit32(e, imm);
+}
+
+static void mov_ri64(struct emitter *e, int r, uint64_t imm)
+{
+    rex(e, 1, 0, -1, r);
+    emit8(e, 0xB8 + (r & 7));
+    emit64(e, imm);
+}
+
+// Guest memory access: word [rdi + index * 2 + disp]
+static void mem_load(struct emitter *e, int dst, int index, int32_t disp)
+{
+    op_rm(e, 32, 1, 0xB7, dst, RDI, index, 1, disp);
+}
+
+static void mem_store(struct emitter *e, int src, int index, int32_t disp)
+{
+    op_rm(e, 16, 0, 0x89, src, RDI, index, 1, disp);
+}
+
+// jcc/jmp rel32, return the address of the rel32 field to patch
+static uint8_t *jcc(struct emitter *e, int cc)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | cc);
+    uint8_t *site = e->p;
+    emit32(e, 0);
+    return site;
+}
+
+static uint8_t *jmp(struct emitter *e)
+{
+    emit8(e, 0xE9);
+    uint8_t *site = e->p;
+    emit32(e, 0);
+    return site;
+}
+
+static void patch(uint8_t *site, uint8_t *target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, 4);
+}
+
+static void jmp_to(struct emitter *e, uint8_t *target) { patch(jmp(e), target); }
+
+
+// ===================================================================================
+// ================================== TRAMPOLINES ====================================
+// ===================================================================================
+// enter: save callee-saved registers, load the guest state in host registers and
+// jump to the block. exit: the opposite, shared by every exit stub.
+static void emitTrampolines(struct emitter *e)
+{
+    static const int saved[] = { RBX, RBP, H12, H13, H14, H15 };
+
+    enter_native = (jit_enter_fn)(void *)e->p;
+    for (int i = 0; i < 6; ++i) {
+        rex(e, 0, 0, -1, saved[i]);
+        emit8(e, 0x50 + (saved[i] & 7));
+    }
+    op_rm(e, 64, 0, 0x8B, RBP, RSI, -1, 0, offsetof(struct jit_state, code_map));
+    for (int r = R0; r <= R7; ++r)
+        op_rm(e, 32, 1, 0xB7, GUEST(r), RSI, -1, 0, 2 * r);
+    op_rm(e, 32, 1, 0xB7, RBX, RSI, -1, 0, offsetof(struct jit_state, flag));
+    emit8(e, 0xFF);                 // jmp rdx
+    emit8(e, 0xE2);
+
+    exit_native = e->p;
+    for (int r = R0; r <= R7; ++r)
+        op_rm(e, 16, 0, 0x89, GUEST(r), RSI, -1, 0, 2 * r);
+    op_rm(e, 16, 0, 0x89, RBX, RSI, -1, 0, offsetof(struct jit_state, flag));
+    for (int i = 5; i >= 0; --i) {
+        rex(e, 0, 0, -1, saved[i]);
+        emit8(e, 0x58 + (saved[i] & 7));
+    }
+    emit8(e, 0xC3);                 // ret
+}
+
+static bool jitInit(void)
+{
+    if (code_buffer != NULL) return true;
+
+    void *buffer = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED) return false;
+
+    code_buffer = buffer;
+    struct emitter e = { code_buffer };
+    emitTrampolines(&e);
+    code_start = code_used = e.p - code_buffer;
+    return true;
+}
+
+// Drop all the compiled code
+static void jitFlush(void)
+{
+    memset(entry, 0, sizeof(entry));
+    memset(code_map, 0, sizeof(code_map));
+    memset(hits, 0, sizeof(hits));
+    nblocks = 0;
+    nlinks = 0;
+    code_used = code_start;
+}
+
+
+// ===================================================================================
+// ================================= BLOCK COMPILER ==================================
+// ===================================================================================
+// Exit stubs are emitted after the body of the block
+enum stub_kind { STUB_CHAIN, STUB_SIDE, STUB_SMC };
+struct stub {
+    uint8_t *site;
+    enum stub_kind kind;
+    uint16_t pc;        // RPC when leaving native code
+    uint16_t skip;      // instructions counted at block entry but not executed
+};
+
+// Devices are handled by mem_read/mem_write only: native code leaves before any
+// access at or above the first mapped register
+static bool isDevice(uint16_t address) { return address >= MR_KBSR; }
+
+static bool endsBlock(const struct decoded *d)
+{
+    return (d->op == DOP_BR && d->sr2 != 0) || d->op == DOP_JMP || d->op == DOP_JSR;
+}
+
+// Instructions that never run natively, or need the interpreter for a device
+static bool compilable(const struct decoded *d)
+{
+    switch (d->op) {
+    case DOP_TRAP:
+    case DOP_RTI:
+    case DOP_RES:
+        return false;
+    case DOP_LD:
+    case DOP_LDI:
+    case DOP_ST:
+    case DOP_STI:
+        return !isDevice(d->imm);
+    default:
+        return true;
+    }
+}
+
+// Branch condition mask (NZP) as x86 condition on test bx, bx
+static int branchCondition(uint8_t nzp)
+{
+    switch (nzp) {
+    case FP:            return CC_G;
+    case FZ:            return CC_E;
+    case FZ | FP:       return CC_NS;
+    case FN:            return CC_S;
+    case FN | FP:       return CC_NE;
+    default:            return CC_LE;   // FN | FZ
+    }
+}
+
+static void addBlock(uint16_t start, uint16_t length)
+{
+    if (nblocks == cap_blocks) {
+        cap_blocks = cap_blocks ? 2 * cap_blocks : 256;
+        blocks = realloc(blocks, cap_blocks * sizeof(*blocks));
+        if (blocks == NULL) { fprintf(stderr, "Cannot allocate JIT blocks\n"); abort(); }
+    }
+    blocks[nblocks++] = (struct jit_block){ start, length, true };
+    for (uint16_t i = 0; i < length; ++i)
+        code_map[(uint16_t)(start + i)] = 1;
+}
+
+// Compile the block starting at start, return its native entry or NULL
+static uint8_t *compileBlock(uint16_t *memory, uint16_t start)
+{
+    struct decoded d[JIT_MAX_BLOCK];
+    struct stub stubs[3 * JIT_MAX_BLOCK];
+    int n = 0, nstubs = 0;
+
+    // Find the extent of the block
+    while (n < JIT_MAX_BLOCK) {
+        uint16_t address = start + n;
+        if (isDevice(address)) break;
+        decodeInstruction(&d[n], address, memory[address]);
+        if (!compilable(&d[n])) break;
+        if (endsBlock(&d[n++])) break;
+    }
+    if (n == 0) {
+        hits[start] = JIT_NEVER;
+        return NULL;
+    }
+
+    // Worst case is ~40 bytes per instruction plus ~30 per stub
+    if (code_used + 256 * JIT_MAX_BLOCK > JIT_CODE_SIZE) {
+        jitFlush();
+        ++jit_stats.flushes;
+    }
+
+    struct emitter e = { code_buffer + code_used };
+    uint8_t *code = e.p;
+
+    // add qword [rsi + count], n
+    op_rm(&e, 64, 0, 0x81, ALU_ADD, RSI, -1, 0, offsetof(struct jit_state, count));
+    emit32(&e, n);
+
+    bool terminated = false;
+    for (int i = 0; i < n; ++i) {
+        uint16_t address = start + i;
+        uint16_t next = address + 1;
+        struct decoded *in = &d[i];
+        int dr = GUEST(in->dr), sr1 = GUEST(in->sr1), sr2 = GUEST(in->sr2);
+        struct stub side = { NULL, STUB_SIDE, address, n - i };
+        struct stub smc = { NULL, STUB_SMC, next, n - i - 1 };
+
+        switch (in->op) {
+        case DOP_ADD:
+            mov_rr(&e, RAX, sr1);
+            alu_rr(&e, 0x01, RAX, sr2);
+            movzx_rr(&e, dr, RAX);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_ADDI:
+            mov_rr(&e, RAX, sr1);
+            alu_ri(&e, ALU_ADD, RAX, in->imm);
+            movzx_rr(&e, dr, RAX);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_AND:
+            mov_rr(&e, RAX, sr1);
+            alu_rr(&e, 0x21, RAX, sr2);
+            mov_rr(&e, dr, RAX);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_ANDI:
+            mov_rr(&e, RAX, sr1);
+            alu_ri(&e, ALU_AND, RAX, in->imm);
+            mov_rr(&e, dr, RAX);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_NOT:
+            mov_rr(&e, RAX, sr1);
+            not_r(&e, RAX);
+            movzx_rr(&e, dr, RAX);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_LEA:
+            mov_ri(&e, dr, in->imm);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_LD:
+            mem_load(&e, dr, -1, 2 * in->imm);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_LDI:
+            mem_load(&e, RAX, -1, 2 * in->imm);
+            alu_ri(&e, ALU_CMP, RAX, MR_KBSR);
+            side.site = jcc(&e, CC_AE);
+            mem_load(&e, dr, RAX, 0);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_LDR:
+            mov_rr(&e, RAX, sr1);
+            alu_ri(&e, ALU_ADD, RAX, in->imm);
+            movzx_rr(&e, RAX, RAX);
+            alu_ri(&e, ALU_CMP, RAX, MR_KBSR);
+            side.site = jcc(&e, CC_AE);
+            mem_load(&e, dr, RAX, 0);
+            mov_rr(&e, RBX, dr);
+            break;
+        case DOP_ST:
+            mov_ri(&e, RAX, in->imm);
+            mem_store(&e, dr, RAX, 0);
+            break;
+        case DOP_STI:
+            mem_load(&e, RAX, -1, 2 * in->imm);
+            alu_ri(&e, ALU_CMP, RAX, MR_KBSR);
+            side.site = jcc(&e, CC_AE);
+            mem_store(&e, dr, RAX, 0);
+            break;
+        case DOP_STR:
+            mov_rr(&e, RAX, sr1);
+            alu_ri(&e, ALU_ADD, RAX, in->imm);
+            movzx_rr(&e, RAX, RAX);
+            alu_ri(&e, ALU_CMP, RAX, MR_KBSR);
+            side.site = jcc(&e, CC_AE);
+            mem_store(&e, dr, RAX, 0);
+            break;
+        case DOP_BR:
+            if (in->sr2 == 0)           // never taken
+                break;
+            if (in->sr2 == (FN | FZ | FP)) {
+                stubs[nstubs++] = (struct stub){ jmp(&e), STUB_CHAIN, in->imm, 0 };
+            }
+            else {
+                test16(&e, RBX);
+                stubs[nstubs++] = (struct stub){ jcc(&e, branchCondition(in->sr2)), STUB_CHAIN, in->imm, 0 };
+                stubs[nstubs++] = (struct stub){ jmp(&e), STUB_CHAIN, next, 0 };
+            }
+            terminated = true;
+            break;
+        case DOP_JSR:
+            mov_ri(&e, GUEST(R7), next);
+            stubs[nstubs++] = (struct stub){ jmp(&e), STUB_CHAIN, in->imm, 0 };
+            terminated = true;
+            break;
+        case DOP_JMP: {
+            // Look up the native entry of the target, or leave with RPC = target
+            mov_rr(&e, RAX, sr1);
+            op_rm(&e, 64, 0, 0x8B, RCX, RSI, -1, 0, offsetof(struct jit_state, entry));
+            op_rm(&e, 64, 0, 0x8B, RCX, RCX, RAX, 3, 0);
+            op_rr(&e, 64, 0x85, RCX, RCX);
+            uint8_t *miss = jcc(&e, CC_E);
+            emit8(&e, 0xFF);            // jmp rcx
+            emit8(&e, 0xE1);
+            patch(miss, e.p);
+            op_rm(&e, 16, 0, 0x89, RAX, RSI, -1, 0, offsetof(struct jit_state, reg) + 2 * RPC);
+            jmp_to(&e, exit_native);
+            terminated = true;
+            break;
+        }
+        default:
+            break;
+        }
+
+        // Stores into compiled code leave native code after the store (address in eax)
+        if (in->op == DOP_ST || in->op == DOP_STI || in->op == DOP_STR) {
+            op_rm(&e, 8, 0, 0x80, ALU_CMP, RBP, RAX, 0, 0);
+            emit8(&e, 0);
+            smc.site = jcc(&e, CC_NE);
+            stubs[nstubs++] = smc;
+        }
+        if (side.site != NULL)
+            stubs[nstubs++] = side;
+    }
+
+    if (!terminated)
+        stubs[nstubs++] = (struct stub){ jmp(&e), STUB_CHAIN, (uint16_t)(start + n), 0 };
+
+    for (int i = 0; i < nstubs; ++i) {
+        struct stub *s = &stubs[i];
+        patch(s->site, e.p);
+        if (s->skip) {
+            op_rm(&e, 64, 0, 0x81, ALU_SUB, RSI, -1, 0, offsetof(struct jit_state, count));
+            emit32(&e, s->skip);
+        }
+        op_rm(&e, 16, 0, 0xC7, 0, RSI, -1, 0, offsetof(struct jit_state, reg) + 2 * RPC);
+        emit16(&e, s->pc);
+        if (s->kind == STUB_CHAIN) {
+            mov_ri64(&e, RAX, (uint64_t)(uintptr_t)s->site);
+            op_rm(&e, 64, 0, 0x89, RAX, RSI, -1, 0, offsetof(struct jit_state, link));
+        }
+        else if (s->kind == STUB_SMC)
+            op_rm(&e, 32, 0, 0x89, RAX, RSI, -1, 0, offsetof(struct jit_state, smc));
+        else {
+            op_rm(&e, 32, 0, 0xC7, 0, RSI, -1, 0, offsetof(struct jit_state, smc));
+            emit32(&e, JIT_SIDE_EXIT);
+        }
+        jmp_to(&e, exit_native);
+    }
+
+    code_used = e.p - code_buffer;
+    entry[start] = code;
+    addBlock(start, n);
+    ++jit_stats.compiled;
+    return code;
+}
+
+
+// ===================================================================================
+// ================================= CHAINING ========================================
+// ===================================================================================
+// Make the jump at site go directly to the compiled block starting at target
+static void chain(uint8_t *site, uint16_t target)
+{
+    if (nlinks == cap_links) {
+        cap_links = cap_links ? 2 * cap_links : 256;
+        links = realloc(links, cap_links * sizeof(*links));
+        if (links == NULL) { fprintf(stderr, "Cannot allocate JIT links\n"); abort(); }
+    }
+    int32_t rel;
+    memcpy(&rel, site, 4);
+    links[nlinks++] = (struct jit_link){ site, site + 4 + rel, target };
+    patch(site, entry[target]);
+}
+
+// A store hit compiled code: drop every block covering address, unchain the jumps
+// that enter them and rebuild the map of compiled words from the remaining blocks
+static void invalidateWord(uint16_t address)
+{
+    for (size_t b = 0; b < nblocks; ++b) {
+        struct jit_block *block = &blocks[b];
+        if (!block->live || (uint16_t)(address - block->start) >= block->length)
+            continue;
+
+        block->live = false;
+        entry[block->start] = NULL;
+        hits[block->start] = 0;
+        ++jit_stats.invalidated;
+
+        for (size_t l = 0; l < nlinks; ) {
+            if (links[l].target == block->start) {
+                patch(links[l].site, links[l].stub);
+                links[l] = links[--nlinks];
+            }
+            else ++l;
+        }
+    }
+
+    memset(code_map, 0, sizeof(code_map));
+    for (size_t b = 0; b < nblocks; ++b)
+        if (blocks[b].live)
+            for (uint16_t i = 0; i < blocks[b].length; ++i)
+                code_map[(uint16_t)(blocks[b].start + i)] = 1;
+    hits[address] = 0;
+}
+
+
+// ===================================================================================
+// ================================== DISPATCHER =====================================
+// ===================================================================================
+// Flag-setting result that gives back the condition code cc
+static uint16_t flagValue(uint16_t cc)
+{
+    if (cc == FZ) return 0;
+    if (cc == FN) return 0x8000;
+    return 1;
+}
+
+// Registers are copied between vm->reg and the state around native code.
+// Return true if native code stopped before an instruction it cannot run
+static bool runNative(struct jit_state *st, struct lc3_vm *vm, uint8_t *code)
+{
+    uint64_t before = st->count;
+
+    memcpy(st->reg, vm->reg, sizeof(st->reg));
+    st->flag = flagValue(st->reg[RCND]);
+    st->link = NULL;
+    st->smc = JIT_NO_SMC;
+    enter_native(vm->memory, st, code);
+    st->reg[RCND] = cc_of(st->flag);
+    memcpy(vm->reg, st->reg, sizeof(st->reg));
+    jit_stats.native += st->count - before;
+
+    if (st->smc == JIT_SIDE_EXIT)
+        return true;
+    if (st->smc != JIT_NO_SMC)
+        invalidateWord(st->smc);
+    else if (st->link != NULL && entry[st->reg[RPC]] != NULL && vm->budget == 0 && vm->irq == NULL)
+        chain(st->link, st->reg[RPC]);
+    return false;
+}
+
+// Address written by a store instruction, or -1
+static int32_t storeTarget(struct lc3_vm *vm, uint16_t instruction)
+{
+    struct decoded d;
+    decodeInstruction(&d, vm->reg[RPC] - 1, instruction);
+    switch (d.op) {
+    case DOP_ST:  return d.imm;
+    case DOP_STI: return vm->memory[d.imm];
+    case DOP_STR: return (uint16_t)(vm->reg[d.sr1] + d.imm);
+    default:      return -1;
+    }
+}
+
+// A native trap wrote a block of memory (trap.h): drop the blocks it overwrote
+static void invalidateBulk(struct lc3_vm *vm)
+{
+    for (uint16_t i = 0; i < vm->bulk_size; ++i) {
+        uint16_t address = vm->bulk_start + i;
+        if (code_map[address]) invalidateWord(address);
+    }
+    vm->bulk_size = 0;
+}
+
+// Run in the interpreter up to the next control flow instruction
+static void interpretBlock(struct jit_state *st, struct lc3_vm *vm)
+{
+    do {
+        uint16_t instruction = mem_read(vm, vm->reg[RPC]++);
+        int32_t written = storeTarget(vm, instruction);
+        ++st->count;
+        executeInstruction(vm, instruction);
+        if (written >= 0 && code_map[written])
+            invalidateWord(written);
+        if (vm->bulk_size)
+            invalidateBulk(vm);
+
+        uint16_t op = instruction >> 12;
+        if (op == op_br || op == op_jmp || op == op_jsr || op == op_trap || op == op_rti)
+            break;
+    } while (vm->running);
+}
+
+// With a budget blocks are not chained and JMP/RET do not look up their target
+// in native code, so control comes back here after every block to check it.
+// The same goes for the pending interrupts of a guest that uses them.
+uint64_t programRunJit(struct lc3_vm *vm)
+{
+    if (!jitInit()) {
+        fprintf(stderr, "Cannot map JIT code buffer, using the threaded engine\n");
+        return programRunThreaded(vm);
+    }
+    jitFlush();
+    memset(&jit_stats, 0, sizeof(jit_stats));
+
+    // Native stores do not track dirty pages: a snapshot restore copies all of them
+    memset(vm->dirty, 1, sizeof(vm->dirty));
+    vm->bulk_size = 0;
+
+    struct jit_state st = {0};
+    st.entry = vm->budget ? no_entry : entry;
+    st.code_map = code_map;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
+
+    while (vm->running && st.count < limit) {
+        // Once the guest uses interrupts, native code comes back here after
+        // every block, like with a budget, so that vm->event is looked at
+        if (vm->irq != NULL && st.entry == entry) {
+            jitFlush();
+            st.entry = no_entry;
+        }
+        if (eventPending(vm)) {
+            interruptPoll(vm);
+            if (vm->bulk_size) invalidateBulk(vm);
+        }
+
+        uint16_t pc = vm->reg[RPC];
+        uint8_t *code = entry[pc];
+        if (code == NULL && hits[pc] != JIT_NEVER && ++hits[pc] >= JIT_THRESHOLD)
+            code = compileBlock(vm->memory, pc);
+
+        // Native code keeps RCND as a result value: it cannot represent the
+        // initial RCND = 0 nor the several bits an RTI may restore from the
+        // PSR, so up to the next flag update the block is interpreted
+        uint16_t cc = vm->reg[RCND];
+        if (code == NULL || (cc != FN && cc != FZ && cc != FP) || runNative(&st, vm, code))
+            interpretBlock(&st, vm);
+    }
+
+    return st.count;
+}
+
+void jitReport(uint64_t count)
+{
+    fprintf(stderr, "jit: %llu blocks compiled, %llu invalidated, %llu flushes, %.1f%% instructions native\n",
+            (unsigned long long)jit_stats.compiled, (unsigned long long)jit_stats.invalidated,
+            (unsigned long long)jit_stats.flushes, count ? 100.0 * jit_stats.native / count : 0.0);
+}
+
+#else
+
+uint64_t programRunJit(struct lc3_vm *vm) { return programRunThreaded(vm); }
+void jitReport(uint64_t count) { (void)count; }
+
+#endif
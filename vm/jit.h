@@ -0,0 +1,39 @@
+#ifndef H_JIT
+#define H_JIT
+
+#include <stdint.h>
+
+#include "lc3vm.h"
+
+// JIT ENGINE
+// Tiered execution for x86-64 Linux. Code starts in the interpreter, which
+// counts how many times each basic block start (the RPC reached after a
+// control flow instruction) is executed. Past JIT_THRESHOLD the block is
+// compiled to native code in an executable buffer:
+// - guest R0-R7 live in host r8-r15, the last flag-setting result in rbx
+//   (RCND is derived from it only when the block exits)
+// - blocks end at control flow instructions; direct successors are chained
+//   by patching the exit jump once the successor is compiled, JMP/RET look
+//   up the target block in a table
+// - TRAP, RTI, RES and device accesses leave native code and run in the
+//   interpreter, so the existing OP_TRAP handlers are used
+// - every store checks a byte map of compiled words: a store into compiled
+//   code leaves native code and invalidates the blocks covering that word
+// On other hosts, or when the executable buffer cannot be mapped,
+// programRunJit falls back to the threaded engine.
+// The code buffer and block tables are global: only one VM at a time can run
+// on this engine.
+#define JIT_THRESHOLD 32        // executions before a block is compiled
+#define JIT_MAX_BLOCK 64        // max instructions in a block
+#define JIT_CODE_SIZE (8 << 20) // bytes of executable buffer
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LC3_NO_JIT)
+#define LC3_JIT 1
+#else
+#define LC3_JIT 0
+#endif
+
+uint64_t programRunJit(struct lc3_vm *vm);
+void jitReport(uint64_t count);
+
+#endif
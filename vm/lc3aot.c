@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "aot.h"
+#include "image.h"
+
+// LC-3 AHEAD-OF-TIME TRANSLATOR
+// Usage: lc3aot program.bin out.c
+// Translate an image into a C translation unit to be compiled with vm/aot.c,
+// vm/lc3vm.c and vm/decode.c (see aot.h and the aot target of the Makefile).
+
+static uint16_t memory[MEMORY_MAX];
+static uint8_t leader[MEMORY_MAX];      // first word of a basic block
+static uint8_t code[MEMORY_MAX];        // word translated into some block
+static struct aot_block blocks[MEMORY_MAX];
+static int nblocks = 0;
+
+// Instructions that end a basic block
+static bool endsBlock(const struct decoded *d)
+{
+    switch (d->op) {
+    case DOP_BR:
+        return d->sr2 != 0;     // BR with an empty mask never jumps
+    case DOP_JMP:
+    case DOP_JSR:
+    case DOP_RTI:
+    case DOP_RES:
+        return true;
+    case DOP_TRAP:
+        return (d->instruction & 0xFF) == TRAP_HALT;
+    default:
+        return false;
+    }
+}
+
+
+// ===================================================================================
+// =============================== CONTROL FLOW DISCOVERY ============================
+// ===================================================================================
+// Follow every direct successor from the entry point. The return address of a JSR is
+// a block start too, since the subroutine comes back there with RET.
+// The mapped registers from MR_KBSR on are never translated.
+static uint16_t worklist[MEMORY_MAX];
+static int pending = 0;
+
+static void addLeader(uint16_t address)
+{
+    if (address >= MR_KBSR || leader[address]) return;
+    leader[address] = 1;
+    worklist[pending++] = address;
+}
+
+static void discover(uint16_t entry)
+{
+    addLeader(entry);
+    while (pending > 0) {
+        uint16_t address = worklist[--pending];
+        for (;;) {
+            struct decoded d;
+            decodeInstruction(&d, address, memory[address]);
+            uint16_t next = address + 1;
+
+            if (d.op == DOP_BR && d.sr2) {
+                addLeader(d.imm);
+                addLeader(next);
+            }
+            else if (d.op == DOP_JSR) {
+                addLeader(d.imm);
+                addLeader(next);
+            }
+            if (endsBlock(&d) || next >= MR_KBSR) break;
+            address = next;
+        }
+    }
+
+    // Split the reached words in blocks
+    for (uint32_t address = 0; address < MR_KBSR; ++address) {
+        if (!leader[address]) continue;
+        uint32_t end = address;
+        for (;;) {
+            struct decoded d;
+            decodeInstruction(&d, end, memory[end]);
+            code[end] = 1;
+            ++end;
+            if (endsBlock(&d) || end >= MR_KBSR || leader[end]) break;
+        }
+        blocks[nblocks].start = address;
+        blocks[nblocks].length = end - address;
+        ++nblocks;
+    }
+}
+
+
+// ===================================================================================
+// ==================================== EMITTER ======================================
+// ===================================================================================
+// Jump to a block, or to the interpreter when the target was not translated
+static void emitJump(FILE *out, uint16_t target)
+{
+    if (target < MR_KBSR && leader[target])
+        fprintf(out, "goto L_%04X;\n", target);
+    else
+        fprintf(out, "{ pc = 0x%04X; goto interp; }\n", target);
+}
+
+// Taken branch: pending interrupts first (interrupt.h)
+static void emitBranch(FILE *out, uint16_t target)
+{
+    fprintf(out, "{ if (eventPending(vm)) { pc = 0x%04X; goto event; } ", target);
+    emitJump(out, target);
+    fprintf(out, "    }\n");
+}
+
+// Leave the block after a store into translated code: left counts the
+// instructions of the block that did not run
+static void emitModified(FILE *out, uint16_t next, int left)
+{
+    fprintf(out, "pc = 0x%04X; count -= %d; goto modified;", next, left);
+}
+
+// Copy the register locals to vm->reg and back
+static void emitSave(FILE *out)
+{
+    fprintf(out, "    vm->reg[R0] = r0; vm->reg[R1] = r1; vm->reg[R2] = r2; vm->reg[R3] = r3;\n");
+    fprintf(out, "    vm->reg[R4] = r4; vm->reg[R5] = r5; vm->reg[R6] = r6; vm->reg[R7] = r7;\n");
+}
+
+static void emitLoad(FILE *out)
+{
+    fprintf(out, "    r0 = vm->reg[R0]; r1 = vm->reg[R1]; r2 = vm->reg[R2]; r3 = vm->reg[R3];\n");
+    fprintf(out, "    r4 = vm->reg[R4]; r5 = vm->reg[R5]; r6 = vm->reg[R6]; r7 = vm->reg[R7];\n");
+}
+
+static void emitTrap(FILE *out, const struct decoded *d, uint16_t next, int left)
+{
+    switch (d->instruction & 0xFF) {
+    case TRAP_GETC:
+        fprintf(out, "    vm->reg[R0] = r0; T_getc(vm); r0 = vm->reg[R0]; cc = vm->reg[RCND];\n");
+        break;
+    case TRAP_OUT:
+        fprintf(out, "    vm->reg[R0] = r0; T_out(vm);\n");
+        break;
+    case TRAP_PUTS:
+        fprintf(out, "    vm->reg[R0] = r0; T_puts(vm);\n");
+        break;
+    case TRAP_IN:
+        fprintf(out, "    vm->reg[R0] = r0; T_in(vm); r0 = vm->reg[R0]; cc = vm->reg[RCND];\n");
+        break;
+    case TRAP_PUTSP:
+        fprintf(out, "    vm->reg[R0] = r0; T_putsp(vm);\n");
+        break;
+    case TRAP_HALT:
+        fprintf(out, "    T_halt(vm); goto done;\n");
+        break;
+    case TRAP_INU16:
+        fprintf(out, "    vm->reg[R0] = r0; T_inu16(vm); r0 = vm->reg[R0];\n");
+        break;
+    case TRAP_OUTU16:
+        fprintf(out, "    vm->reg[R0] = r0; T_outu16(vm);\n");
+        break;
+    default:
+        // Native and registered traps (trap.h) may use any register and write
+        // blocks of memory, even over translated code
+        emitSave(out);
+        fprintf(out, "    vm->reg[RPC] = 0x%04X; vm->reg[RCND] = cc;\n", next);
+        fprintf(out, "    OP_TRAP(vm, 0x%04X);\n", d->instruction);
+        emitLoad(out);
+        fprintf(out, "    cc = vm->reg[RCND];\n");
+        fprintf(out, "    if (!vm->running) goto done;\n");
+        fprintf(out, "    if (aotBulk(&st, vm)) { ");
+        emitModified(out, next, left);
+        fprintf(out, " }\n");
+        break;
+    }
+}
+
+// Same semantics as the OP_* functions, with the fields taken from
+// decodeInstruction (PC relative addresses are already absolute)
+static void emitInstruction(FILE *out, uint16_t address, int left)
+{
+    struct decoded d;
+    decodeInstruction(&d, address, memory[address]);
+    uint16_t next = address + 1;
+
+    fprintf(out, "    // 0x%04X: 0x%04X\n", address, d.instruction);
+    switch (d.op) {
+    case DOP_ADD:
+        fprintf(out, "    cc = cc_of(r%d = r%d + r%d);\n", d.dr, d.sr1, d.sr2);
+        break;
+    case DOP_ADDI:
+        fprintf(out, "    cc = cc_of(r%d = r%d + 0x%04X);\n", d.dr, d.sr1, d.imm);
+        break;
+    case DOP_AND:
+        fprintf(out, "    cc = cc_of(r%d = r%d & r%d);\n", d.dr, d.sr1, d.sr2);
+        break;
+    case DOP_ANDI:
+        fprintf(out, "    cc = cc_of(r%d = r%d & 0x%04X);\n", d.dr, d.sr1, d.imm);
+        break;
+    case DOP_NOT:
+        fprintf(out, "    cc = cc_of(r%d = ~r%d);\n", d.dr, d.sr1);
+        break;
+    case DOP_BR:
+        if (d.sr2 == 0) break;
+        fprintf(out, "    if (cc & %d) ", d.sr2);
+        emitBranch(out, d.imm);
+        break;
+    case DOP_JMP:
+        fprintf(out, "    pc = r%d; if (eventPending(vm)) goto event; goto dispatch;\n", d.sr1);
+        break;
+    case DOP_JSR:
+        fprintf(out, "    r7 = 0x%04X; ", next);
+        emitBranch(out, d.imm);
+        break;
+    case DOP_LD:
+        fprintf(out, "    cc = cc_of(r%d = load(vm, 0x%04X, 0x%04X));\n", d.dr, d.imm, next);
+        break;
+    case DOP_LDI:
+        fprintf(out, "    cc = cc_of(r%d = load(vm, load(vm, 0x%04X, 0x%04X), 0x%04X));\n", d.dr, d.imm, next, next);
+        break;
+    case DOP_LDR:
+        fprintf(out, "    cc = cc_of(r%d = load(vm, r%d + 0x%04X, 0x%04X));\n", d.dr, d.sr1, d.imm, next);
+        break;
+    case DOP_LEA:
+        fprintf(out, "    cc = cc_of(r%d = 0x%04X);\n", d.dr, d.imm);
+        break;
+    case DOP_ST:
+        // The target is known: check it against the code map here
+        if (d.imm >= MR_BASE) {
+            fprintf(out, "    if (aotStore(&st, vm, 0x%04X, r%d)) { ", d.imm, d.dr);
+            emitModified(out, next, left);
+            fprintf(out, " }\n");
+            break;
+        }
+        fprintf(out, "    vm->memory[0x%04X] = r%d;", d.imm, d.dr);
+        if (code[d.imm]) {
+            fprintf(out, " ");
+            emitModified(out, next, left);
+        }
+        fprintf(out, "\n");
+        break;
+    case DOP_STI:
+        fprintf(out, "    if (aotStore(&st, vm, load(vm, 0x%04X, 0x%04X), r%d)) { ", d.imm, next, d.dr);
+        emitModified(out, next, left);
+        fprintf(out, " }\n");
+        break;
+    case DOP_STR:
+        fprintf(out, "    if (aotStore(&st, vm, r%d + 0x%04X, r%d)) { ", d.sr1, d.imm, d.dr);
+        emitModified(out, next, left);
+        fprintf(out, " }\n");
+        break;
+    case DOP_TRAP:
+        emitTrap(out, &d, next, left);
+        break;
+    default:
+        // RTI and RES may move RPC and R6 (interrupt.h)
+        emitSave(out);
+        fprintf(out, "    vm->reg[RPC] = 0x%04X; vm->reg[RCND] = cc;\n", next);
+        fprintf(out, "    executeInstruction(vm, 0x%04X);\n", d.instruction);
+        fprintf(out, "    goto resume;\n");
+        break;
+    }
+}
+
+static void emitProgram(FILE *out, const char *fileName, const struct lc3_image *image)
+{
+    fprintf(out, "// Generated by lc3aot from %s. Do not edit.\n", fileName);
+    fprintf(out, "#include \"lc3vm.h\"\n#include \"decode.h\"\n#include \"aot.h\"\n\n");
+
+    // Segments of the image and block table
+    for (int s = 0; s < image->nsegments; ++s) {
+        const struct image_segment *segment = &image->segments[s];
+        fprintf(out, "static const uint16_t segment%d[%u] = {", s, segment->words ? segment->words : 1);
+        for (uint32_t i = 0; i < segment->words; ++i)
+            fprintf(out, "%s0x%04X,", i % 12 ? " " : "\n    ", memory[segment->origin + i]);
+        fprintf(out, "\n};\n");
+    }
+    fprintf(out, "static const struct aot_segment segments[%d] = {", image->nsegments ? image->nsegments : 1);
+    for (int s = 0; s < image->nsegments; ++s)
+        fprintf(out, "\n    {0x%04X, %u, segment%d},", image->segments[s].origin, image->segments[s].words, s);
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "static const struct aot_block blocks[%d] = {", nblocks ? nblocks : 1);
+    for (int i = 0; i < nblocks; ++i)
+        fprintf(out, "%s{0x%04X, %u},", i % 6 ? " " : "\n    ", blocks[i].start, blocks[i].length);
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "static struct aot_state st;\n\n");
+    fprintf(out, "static uint64_t programRunAot(struct lc3_vm *vm)\n{\n");
+    fprintf(out, "    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, pc, cc;\n");
+    fprintf(out, "    uint64_t count = 0;\n\n");
+    fprintf(out, "    aotInit(&st, vm, blocks, %d);\n", nblocks);
+    fprintf(out, "    goto resume;\n\n");
+
+    // Interpreter fallback: sync the registers with vm->reg around it
+    fprintf(out, "modified:\n    st.modified = true;\n");
+    fprintf(out, "interp:\n");
+    emitSave(out);
+    fprintf(out, "    vm->reg[RPC] = pc; vm->reg[RCND] = cc;\n");
+    fprintf(out, "    aotInterpret(&st, vm);\n");
+    fprintf(out, "    if (!vm->running) goto done;\n");
+    fprintf(out, "    goto resume;\n");
+    // Pending interrupts, at a taken branch to pc
+    fprintf(out, "event:\n");
+    emitSave(out);
+    fprintf(out, "    vm->reg[RPC] = pc; vm->reg[RCND] = cc;\n");
+    fprintf(out, "    interruptPoll(vm);\n");
+    fprintf(out, "resume:\n");
+    emitLoad(out);
+    fprintf(out, "    pc = vm->reg[RPC]; cc = vm->reg[RCND];\n\n");
+
+    // Indirect jumps
+    fprintf(out, "dispatch:\n    switch (pc) {\n");
+    for (int i = 0; i < nblocks; ++i)
+        fprintf(out, "    case 0x%04X: goto L_%04X;\n", blocks[i].start, blocks[i].start);
+    fprintf(out, "    default: goto interp;\n    }\n\n");
+
+    // Blocks, in address order so a fall through needs no jump
+    for (int i = 0; i < nblocks; ++i) {
+        uint16_t start = blocks[i].start;
+        int length = blocks[i].length;
+        fprintf(out, "L_%04X:\n    count += %d;\n", start, length);
+        for (int k = 0; k < length; ++k)
+            emitInstruction(out, start + k, length - 1 - k);
+
+        struct decoded d;
+        uint16_t last = start + length - 1;
+        decodeInstruction(&d, last, memory[last]);
+        bool fallsThrough = i + 1 < nblocks && blocks[i + 1].start == (uint32_t)last + 1;
+        bool leaves = d.op == DOP_JMP || d.op == DOP_JSR || d.op == DOP_RTI || d.op == DOP_RES ||
+                      (d.op == DOP_TRAP && (d.instruction & 0xFF) == TRAP_HALT);
+        if (!leaves && !fallsThrough) {
+            fprintf(out, "    ");
+            emitJump(out, last + 1);
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "done:\n    return count + st.count;\n}\n\n");
+    fprintf(out, "int main(int argc, char **argv)\n{\n");
+    fprintf(out, "    return aotMain(argc, argv, programRunAot, segments, %d, 0x%04X);\n}\n",
+            image->nsegments, image->entry);
+}
+
+
+// ===================================================================================
+// ====================================== MAIN =======================================
+// ===================================================================================
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s program.bin out.c\n", argv[0]);
+        return 1;
+    }
+
+    struct lc3_image *image = imageOpen(argv[1]);
+    imageCopy(image, memory);
+    discover(image->entry);
+
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", argv[2]);
+        return 1;
+    }
+    emitProgram(out, argv[1], image);
+    fclose(out);
+    imageClose(image);
+
+    fprintf(stderr, "%s: %d blocks translated\n", argv[2], nblocks);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "lc3vm.h"
+#include "image.h"
+#include "asm.h"
+
+// LC-3 ASSEMBLER
+// Usage: lc3as [-q] source.asm [out]
+// Assemble source (asm.h) into out, default assembler/program.bin, and print
+// the listing of the words (-q: only the diagnostics). The name of out picks
+// the format (image.h):
+// - .lc3: container, with every segment and the labels as symbols
+// - .obj: LC-3 object, a single segment at any origin
+// - anything else: raw image, a single segment at PC_START
+
+static bool endsWith(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), k = strlen(suffix);
+    return n >= k && strcmp(s + n - k, suffix) == 0;
+}
+
+// Write the single segment of a raw image or of an object, false if the program has other segments
+static bool writeSegment(FILE *out, const struct asm_program *program, bool object)
+{
+    if (program->nsegments > 1) return false;
+    uint16_t origin = program->nsegments ? program->segments[0].origin : PC_START;
+    uint32_t words = program->nsegments ? program->segments[0].words : 0;
+    if (!object && origin != PC_START) return false;
+
+    if (object) {
+        putc(origin >> 8, out);
+        putc(origin & 0xFF, out);
+    }
+    for (uint32_t w = 0; w < words; ++w) {
+        uint16_t value = program->memory[origin + w];
+        putc(object ? value >> 8 : value & 0xFF, out);
+        putc(object ? value & 0xFF : value >> 8, out);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool quiet = argc > 1 && strcmp(argv[1], "-q") == 0;
+    if (argc - quiet < 2 || argc - quiet > 3) {
+        fprintf(stderr, "Usage: %s [-q] source.asm [out]\n", argv[0]);
+        return 1;
+    }
+    const char *source = argv[1 + quiet];
+    const char *output = argc - quiet == 3 ? argv[2 + quiet] : "assembler/program.bin";
+
+    FILE *in = fopen(source, "rb");
+    struct stat st;
+    if (in == NULL || fstat(fileno(in), &st) != 0) {
+        fprintf(stderr, "Cannot open file %s\n", source);
+        return 1;
+    }
+    char *text = malloc(st.st_size ? st.st_size : 1);
+    if (text == NULL) {
+        fprintf(stderr, "Cannot allocate %s\n", source);
+        return 1;
+    }
+    size_t length = fread(text, 1, st.st_size, in);
+    fclose(in);
+
+    struct asm_program *program = asmAssemble(source, text, length, quiet ? NULL : stdout);
+    free(text);
+    if (program->errors) {
+        fprintf(stderr, "%s: %d error%s\n", source, program->errors, program->errors == 1 ? "" : "s");
+        return 1;
+    }
+
+    FILE *out = fopen(output, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", output);
+        return 1;
+    }
+    bool fits = true;
+    if (endsWith(output, ".lc3")) {
+        size_t size;
+        uint8_t *image = asmContainer(program, &size);
+        fwrite(image, 1, size, out);
+        free(image);
+    }
+    else fits = writeSegment(out, program, endsWith(output, ".obj"));
+    bool written = fclose(out) == 0;
+    if (!fits)
+        fprintf(stderr, "Cannot write %s: %s\n", output, program->nsegments > 1
+                ? "more than one segment, use a .lc3 container" : "a raw image starts at 0x3000, use .obj or .lc3");
+    else if (!written) fprintf(stderr, "Cannot write %s\n", output);
+    if (!fits || !written) remove(output);
+    asmFree(program);
+    return fits && written ? 0 : 1;
+}
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+// LC-3 SERVER CLIENT
+// Usage: lc3client socket run image [limit] < input
+//        lc3client socket stats | shutdown
+//        lc3client socket bench image count [limit] [input]
+// Talk to a server started with vm/main -S socket (protocol in server.h).
+// run sends stdin as the input of the program and writes its output on
+// stdout; the exit status is 0 when it halted, 2 when it hit the instruction
+// limit, 1 on an error. bench pipelines count runs of image on one connection
+// and prints the request rate and the latency seen by the client.
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s socket run image [limit] < input\n", prog);
+    fprintf(stderr, "       %s socket stats | shutdown\n", prog);
+    fprintf(stderr, "       %s socket bench image count [limit] [input]\n", prog);
+}
+
+static int connectTo(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool sendAll(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Whole content of a stream, NULL on a read error
+static char *slurp(FILE *in, size_t *size)
+{
+    size_t cap = 4096, used = 0, n;
+    char *data = malloc(cap);
+    while (data && (n = fread(data + used, 1, cap - used, in)) > 0) {
+        used += n;
+        if (used == cap) data = realloc(data, cap *= 2);
+    }
+    if (data == NULL || ferror(in)) {
+        free(data);
+        return NULL;
+    }
+    *size = used;
+    return data;
+}
+
+static bool sendRun(int fd, const char *image, unsigned long long limit, const char *input, size_t size)
+{
+    char header[512];
+    int n = snprintf(header, sizeof(header), "RUN %s %llu %zu\n", image, limit, size);
+    return n < (int)sizeof(header) && sendAll(fd, header, n) && sendAll(fd, input, size);
+}
+
+// Read a response: its line (without the newline) in line, and for OK and
+// STATS the payload, malloc'ed. Return false when the server closed.
+static bool receive(FILE *in, char *line, size_t length, char **payload, size_t *size)
+{
+    *payload = NULL;
+    *size = 0;
+    if (fgets(line, (int)length, in) == NULL) return false;
+    line[strcspn(line, "\n")] = '\0';
+
+    const char *space = strrchr(line, ' ');
+    if (strncmp(line, "OK ", 3) != 0 && strncmp(line, "STATS ", 6) != 0) return true;
+    *size = strtoull(space + 1, NULL, 10);
+    *payload = malloc(*size ? *size : 1);
+    if (*payload == NULL || fread(*payload, 1, *size, in) != *size) {
+        fprintf(stderr, "Truncated response\n");
+        exit(1);
+    }
+    return true;
+}
+
+
+// ===================================================================================
+// ===================================== COMMANDS ====================================
+// ===================================================================================
+static int run(int fd, FILE *in, const char *image, unsigned long long limit)
+{
+    size_t size;
+    char *input = slurp(stdin, &size);
+    if (input == NULL) {
+        fprintf(stderr, "Cannot read the input\n");
+        return 1;
+    }
+    if (!sendRun(fd, image, limit, input, size)) {
+        fprintf(stderr, "Cannot send the request\n");
+        return 1;
+    }
+    free(input);
+
+    char line[512];
+    char *output;
+    if (!receive(in, line, sizeof(line), &output, &size)) {
+        fprintf(stderr, "The server closed the connection\n");
+        return 1;
+    }
+    if (strncmp(line, "OK ", 3) != 0) {
+        fprintf(stderr, "%s\n", line);
+        return 1;
+    }
+    fwrite(output, 1, size, stdout);
+    free(output);
+    return strncmp(line, "OK halted ", 10) == 0 ? 0 : 2;
+}
+
+// A line of a request without a payload, and its response
+static int command(int fd, FILE *in, const char *request)
+{
+    if (!sendAll(fd, request, strlen(request))) {
+        fprintf(stderr, "Cannot send the request\n");
+        return 1;
+    }
+    char line[512];
+    char *payload;
+    size_t size;
+    if (!receive(in, line, sizeof(line), &payload, &size)) {
+        fprintf(stderr, "The server closed the connection\n");
+        return 1;
+    }
+    if (payload) fwrite(payload, 1, size, stdout);
+    else printf("%s\n", line);
+    free(payload);
+    return strncmp(line, "ERR", 3) == 0;
+}
+
+struct bench {
+    int fd;
+    const char *image;
+    unsigned long long limit;
+    const char *input;
+    size_t size;
+    long count;
+    struct timespec *sent;
+};
+
+static void *sender(void *arg)
+{
+    struct bench *b = arg;
+    for (long i = 0; i < b->count; ++i) {
+        clock_gettime(CLOCK_MONOTONIC, &b->sent[i]);
+        if (!sendRun(b->fd, b->image, b->limit, b->input, b->size)) break;
+    }
+    return NULL;
+}
+
+static int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Requests go out from a thread of their own, so the server always has a
+// window of them while the responses are read here
+static int bench(FILE *in, struct bench *b)
+{
+    b->sent = calloc(b->count, sizeof(struct timespec));
+    double *latency = calloc(b->count, sizeof(double));
+    if (b->sent == NULL || latency == NULL) {
+        fprintf(stderr, "Cannot allocate %ld requests\n", b->count);
+        return 1;
+    }
+
+    struct timespec start, end, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sender, b) != 0) {
+        fprintf(stderr, "Cannot create the sender thread\n");
+        return 1;
+    }
+    long received = 0, errors = 0, limited = 0;
+    char line[512];
+    char *payload;
+    size_t size;
+    while (received < b->count && receive(in, line, sizeof(line), &payload, &size)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        latency[received] = (now.tv_sec - b->sent[received].tv_sec) * 1e6 +
+                            (now.tv_nsec - b->sent[received].tv_nsec) * 1e-3;
+        ++received;
+        if (strncmp(line, "OK ", 3) != 0) ++errors;
+        else if (strncmp(line, "OK limit ", 9) == 0) ++limited;
+        free(payload);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_join(thread, NULL);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    qsort(latency, received, sizeof(double), compareDouble);
+    printf("bench: %ld requests in %.3f s, %.1f req/s, %ld stopped by the limit, %ld errors\n",
+           received, seconds, seconds > 0 ? received / seconds : 0.0, limited, errors);
+    if (received)
+        printf("bench: latency p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+               latency[(received - 1) / 2], latency[(long)(0.9 * (received - 1))],
+               latency[(long)(0.99 * (received - 1))], latency[received - 1]);
+    free(latency);
+    free(b->sent);
+    return received == b->count && errors == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *verb = argv[2];
+    bool isRun = strcmp(verb, "run") == 0, isBench = strcmp(verb, "bench") == 0;
+    if ((isRun && (argc < 4 || argc > 5)) || (isBench && (argc < 5 || argc > 7)) ||
+        (!isRun && !isBench && (argc != 3 || (strcmp(verb, "stats") != 0 && strcmp(verb, "shutdown") != 0)))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = connectTo(argv[1]);
+    if (fd < 0) return 1;
+    FILE *in = fdopen(dup(fd), "r");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot read from %s\n", argv[1]);
+        return 1;
+    }
+
+    int status;
+    if (isRun) status = run(fd, in, argv[3], argc > 4 ? strtoull(argv[4], NULL, 0) : 0);
+    else if (isBench) {
+        struct bench b = { fd, argv[3], argc > 5 ? strtoull(argv[5], NULL, 0) : 0, "", 0,
+                           strtol(argv[4], NULL, 0), NULL };
+        char *input = NULL;
+        if (argc > 6) {
+            FILE *file = fopen(argv[6], "rb");
+            if (file == NULL || (input = slurp(file, &b.size)) == NULL) {
+                fprintf(stderr, "Cannot read file %s\n", argv[6]);
+                return 1;
+            }
+            fclose(file);
+            b.input = input;
+        }
+        status = b.count > 0 ? bench(in, &b) : 1;
+        free(input);
+    }
+    else status = command(fd, in, strcmp(verb, "stats") == 0 ? "STATS\n" : "SHUTDOWN\n");
+
+    fclose(in);
+    close(fd);
+    fflush(stdout);
+    return status;
+}
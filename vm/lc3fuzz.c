@@ -0,0 +1,901 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "threaded.h"
+#include "jit.h"
+#include "warp.h"
+#include "console.h"
+#include "interrupt.h"
+#include "trap.h"
+#include "image.h"
+#include "snapshot.h"
+
+// DIFFERENTIAL FUZZER
+// Usage: lc3fuzz [-e engine] [-N interval] [-f] [-l limit] [-i input] [-n execs] [-s seed] [-m max] [-o dir] [seed.bin...]
+//        lc3fuzz [-e engine] [-N interval] [-f] [-l limit] [-i input] -c program...
+// Run LC-3 images on an engine and on the reference switch loop (programRun,
+// one instruction per call) in lockstep: every interval instructions of the
+// engine the reference retires as many, and the two VMs must agree on the
+// registers, condition codes, PSR and stack pointers, the whole memory and the
+// output so far. A guest fault (unknown trap, exception without a handler,
+// both fatal in the VM) must happen on both.
+//
+// A budget changes the engines: the JIT neither chains its blocks nor looks up
+// JMP/RET targets in native code with one. With -f the engine runs without a
+// budget, as in main, up to its halt (within FUZZ_FREE_MS and the limit, or
+// the run is not compared); the reference then retires as many instructions
+// and the VMs are compared once, there. Guest faults stop both VMs (vm->fault)
+// instead of aborting, so they must happen at the same instruction.
+//
+// The images run in a child forked from a server that set everything up once
+// (AFL's fork server in persistent mode): the child takes FUZZ_PERSIST images,
+// each from the snapshot of a blank VM (only the dirty pages are copied back),
+// and a crash or a hang of an engine only costs the server a new child. The
+// child counts the edges between consecutive guest PCs of the reference into a
+// bitmap shared with the server; images that hit new edges (or new hit counts
+// of one) join the corpus, and the next images are mutations of it or freshly
+// generated ones. A divergence is shrunk
+// (words replaced by NOPs while it still diverges) and saved as a raw image
+// in dir, to run again with -c.
+//
+// Every run starts from vmReset with the image at PC_START, the privilege and
+// illegal opcode exceptions handled by an RTI at FUZZ_HANDLER, and input (-i
+// file, default FUZZ_INPUT) on both consoles. The traps that touch host files
+// (FREAD, FWRITE) fail without opening anything. Runs are compared only up to
+// - a guest that enables an interrupt source: the ticker thread makes the
+//   rest depend on time
+// - code fetched from the device region: the switch loop reads a register at
+//   every fetch, the decode caches of the engines once
+#define FUZZ_WORDS    1024              // image words at PC_START
+#define FUZZ_MAP      (1 << 16)         // edge bitmap, indexed by (pc ^ previous pc >> 1)
+#define FUZZ_CORPUS   4096
+#define FUZZ_HANDLER  0x0200
+#define FUZZ_SLACK    (1 << 17)         // reference steps allowed past an engine fault
+#define FUZZ_TIMEOUT  5                 // seconds of a fuzzing run before it counts as a hang
+#define FUZZ_FREE_MS  50                // milliseconds of a -f engine run before it counts as endless
+#define FUZZ_PERSIST  1000              // runs of a child before the server forks a new one
+#define FUZZ_INPUT    "42\n7\n65535\nthe quick brown fox\n0\n"
+
+struct engine {
+    const char *name;
+    uint64_t (*run)(struct lc3_vm *vm);
+};
+
+static const struct engine engines[] = {
+    {"switch", programRun},
+    {"decoded", programRunDecoded},
+    {"threaded", programRunThreaded},
+    {"fused", programRunFused},
+    {"jit", programRunJit},
+    {"warp", programRunWarp},
+};
+
+struct image {
+    uint16_t size;
+    uint16_t words[FUZZ_WORDS];
+};
+
+enum result { SAME, DIVERGED, FAULTED, INTERRUPTS, DEVICE, ENDLESS };
+enum phase { PHASE_ENGINE, PHASE_REFERENCE };
+
+// The run the server asks for, and what the child found
+struct shared {
+    struct image image;
+    char program[4096];                 // or the program file to load, for -c
+    uint8_t map[FUZZ_MAP];
+    enum phase phase;
+    uint64_t checked;                   // instructions compared
+    bool halted;
+    bool device;                        // the reference stopped at a fetch from the device region
+    char report[2048];
+};
+
+struct options {
+    const struct engine *engine;
+    uint64_t interval;
+    bool free;                          // -f: no budget, compared at the halt
+    uint64_t limit;                     // 0 for none
+    const char *input;
+    size_t input_size;
+    bool timeout;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-e engine] [-N interval] [-f] [-l limit] [-i input] [-n execs] [-s seed] [-m max] [-o dir] [seed.bin...]\n", prog);
+    fprintf(stderr, "       %s [-e engine] [-N interval] [-f] [-l limit] [-i input] -c program...\n", prog);
+    fprintf(stderr, "  -e engine    engine compared with the switch loop (default threaded):");
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+        fprintf(stderr, " %s", engines[i].name);
+    fprintf(stderr, "\n  -N interval  instructions between comparisons (default 1000)\n");
+    fprintf(stderr, "  -f           run the engine without a budget and compare at its halt\n");
+    fprintf(stderr, "  -l limit     instructions of a run (default 10000, none with -c)\n");
+    fprintf(stderr, "  -i input     input of the guests (default \"%s\")\n", "42\\n7\\n65535\\n...");
+    fprintf(stderr, "  -n execs     runs to fuzz (default 100000)\n");
+    fprintf(stderr, "  -s seed      random seed (default: the time)\n");
+    fprintf(stderr, "  -m max       stop after max divergences (default 10)\n");
+    fprintf(stderr, "  -o dir       where divergent images are saved (default .)\n");
+    fprintf(stderr, "  -c           check the programs once instead of fuzzing\n");
+}
+
+
+// ===================================================================================
+// ===================================== LOCKSTEP ====================================
+// ===================================================================================
+// In the child: the snapshots of the server, the output of the consoles and the fault handler
+static struct shared *shared;
+static struct lc3_snapshot *blank[2];
+static sigjmp_buf fault;
+static char *output[2];
+static size_t output_size[2];
+static uint16_t previous;
+static int quiet;                       // /dev/null, stderr of the children
+static volatile sig_atomic_t expired;
+static char messages[2][VM_FAULT_SIZE]; // guest faults of a -f run
+
+static void faulted(int sig)
+{
+    (void)sig;
+    siglongjmp(fault, 1);
+}
+
+// The -f engine run took FUZZ_FREE_MS
+static void expire(int sig)
+{
+    (void)sig;
+    expired = 1;
+    siglongjmp(fault, 1);
+}
+
+// SIGALRM after ms milliseconds (it shares the timer of alarm)
+static void arm(int ms)
+{
+    struct itimerval timer = { {0, 0}, {ms / 1000, ms % 1000 * 1000} };
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// FREAD and FWRITE: the file cannot be opened
+static void noFile(struct lc3_vm *vm)
+{
+    vm->reg[R0] = 0xFFFF;
+    update_flag(vm->reg, R0);
+}
+
+// count instructions of programRun, counting the edges between their PCs
+static uint64_t reference(struct lc3_vm *vm, uint64_t count)
+{
+    uint64_t done = 0;
+    vm->budget = 1;
+    while (vm->running && done != count) {
+        uint16_t pc = vm->reg[RPC];
+        if (pc >= MR_BASE) {
+            shared->device = true;
+            break;
+        }
+        ++shared->map[(uint16_t)(pc ^ previous)];
+        previous = pc >> 1;
+        done += programRun(vm);
+    }
+    return done;
+}
+
+static int report(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static int report(const char *format, ...)
+{
+    size_t used = strlen(shared->report);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(shared->report + used, sizeof(shared->report) - used, format, args);
+    va_end(args);
+    return DIVERGED;
+}
+
+// Compare the engine VM with the reference after both retired the same
+// instructions: the pages either of them stored into and the device region, or
+// with full all of memory
+static int compare(struct lc3_vm *vm, struct lc3_vm *ref, bool full)
+{
+    static const char *names[] = {"R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND"};
+    bool same = vm->running == ref->running && vm->psr == ref->psr && vm->ssp == ref->ssp && vm->usp == ref->usp &&
+                memcmp(vm->reg, ref->reg, sizeof(vm->reg)) == 0;
+    if (!same) {
+        report("after %llu instructions (engine, reference):\n", (unsigned long long)shared->checked);
+        for (int r = R0; r < REG_SIZE; ++r)
+            if (vm->reg[r] != ref->reg[r]) report("  %-4s 0x%04X 0x%04X\n", names[r], vm->reg[r], ref->reg[r]);
+        if (vm->psr != ref->psr) report("  PSR  0x%04X 0x%04X\n", vm->psr, ref->psr);
+        if (vm->ssp != ref->ssp) report("  SSP  0x%04X 0x%04X\n", vm->ssp, ref->ssp);
+        if (vm->usp != ref->usp) report("  USP  0x%04X 0x%04X\n", vm->usp, ref->usp);
+        if (vm->running != ref->running) report("  %s %s\n", vm->running ? "running" : "halted", ref->running ? "running" : "halted");
+    }
+    int shown = 0;
+    for (int page = 0; page < PAGE_COUNT; ++page) {
+        if (!full && !vm->dirty[page] && !ref->dirty[page] && page < MR_BASE >> PAGE_BITS) continue;
+        const uint16_t *a = vm->memory + page * PAGE_WORDS, *b = ref->memory + page * PAGE_WORDS;
+        if (memcmp(a, b, PAGE_WORDS * sizeof(uint16_t)) == 0) continue;
+        if (same) report("after %llu instructions (engine, reference):\n", (unsigned long long)shared->checked);
+        same = false;
+        for (int i = 0; i < PAGE_WORDS; ++i)
+            if (a[i] != b[i] && shown++ < 8)
+                report("  [0x%04X] 0x%04X 0x%04X\n", page * PAGE_WORDS + i, a[i], b[i]);
+    }
+    if (shown > 8) report("  and %d more words\n", shown - 8);
+
+    consoleFlush(vm);
+    consoleFlush(ref);
+    size_t common = output_size[0] < output_size[1] ? output_size[0] : output_size[1];
+    size_t at = 0;
+    while (at < common && output[0][at] == output[1][at])
+        ++at;
+    if (at != output_size[0] || at != output_size[1]) {
+        if (same) report("after %llu instructions (engine, reference):\n", (unsigned long long)shared->checked);
+        same = false;
+        report("  output of %zu and %zu bytes, first difference at byte %zu\n", output_size[0], output_size[1], at);
+    }
+    return same ? SAME : DIVERGED;
+}
+
+// The exception handlers of every run
+static void handlers(struct lc3_vm *vm)
+{
+    vm->memory[IVT_BASE + VEC_PRIVILEGE] = FUZZ_HANDLER;
+    vm->memory[IVT_BASE + VEC_ILLEGAL] = FUZZ_HANDLER;
+    vm->memory[FUZZ_HANDLER] = op_rti << 12;
+}
+
+// Start the run in shared on a VM of the child: back to the snapshot of the
+// server (dirty pages only) with the image stored over it, or reset with the
+// program loaded, and fresh streams
+static void begin(struct lc3_vm *vm, int stream, const struct options *opt)
+{
+    static FILE *streams[2][2];
+    if (shared->program[0]) {
+        vmReset(vm);
+        handlers(vm);
+        vm->reg[RPC] = loadProgram(shared->program, vm->memory);
+    }
+    else {
+        snapshotRestore(vm, blank[stream]);
+        for (int i = 0; i < shared->image.size; ++i)
+            mem_write(vm, PC_START + i, shared->image.words[i]);
+    }
+
+    // The output of the last run goes first: its stream writes to output[stream]
+    // until it is closed
+    FILE *in = streams[stream][0];
+    if (streams[stream][1]) {
+        consoleFlush(vm);
+        fclose(streams[stream][1]);
+        free(output[stream]);
+    }
+    streams[stream][0] = fmemopen((void *)opt->input, opt->input_size, "r");
+    streams[stream][1] = open_memstream(&output[stream], &output_size[stream]);
+    if (streams[stream][0] == NULL || streams[stream][1] == NULL) {
+        fprintf(stderr, "Cannot open the guest streams\n");
+        _exit(1);
+    }
+    consoleAttach(vm, streams[stream][0], streams[stream][1]);
+    if (in) fclose(in);
+}
+
+// Run the VMs, comparing every interval
+static int lockstep(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt)
+{
+    previous = 0;
+    while (ref->running && (opt->limit == 0 || shared->checked < opt->limit)) {
+        uint64_t chunk = opt->interval;
+        if (opt->limit && opt->limit - shared->checked < chunk) chunk = opt->limit - shared->checked;
+
+        // A fault of the engine: the reference must fault before it gets much further
+        shared->phase = PHASE_ENGINE;
+        if (sigsetjmp(fault, 1)) {
+            shared->phase = PHASE_REFERENCE;
+            if (sigsetjmp(fault, 1)) return FAULTED;
+            uint64_t done = reference(ref, chunk + FUZZ_SLACK);
+            if (shared->device) return DEVICE;
+            return report("the engine faulted within %llu instructions after %llu; the reference ran %llu more%s\n",
+                          (unsigned long long)chunk, (unsigned long long)shared->checked, (unsigned long long)done,
+                          ref->running ? " without a fault" : " and halted");
+        }
+        vm->budget = chunk;
+        uint64_t count = opt->engine->run(vm);
+        if (count == 0 && vm->running)
+            return report("the engine retired nothing at PC 0x%04X after %llu instructions\n", vm->reg[RPC],
+                          (unsigned long long)shared->checked);
+
+        shared->phase = PHASE_REFERENCE;
+        if (sigsetjmp(fault, 1))
+            return report("the reference faulted at PC 0x%04X within %llu instructions after %llu; the engine did not\n",
+                          (uint16_t)(ref->reg[RPC] - 1), (unsigned long long)count, (unsigned long long)shared->checked);
+        uint64_t done = reference(ref, count);
+        shared->checked += done;
+        if (shared->device) return DEVICE;
+        if (done != count)
+            return report("the engine retired %llu instructions after %llu, the reference halted after %llu\n",
+                          (unsigned long long)count, (unsigned long long)(shared->checked - done), (unsigned long long)done);
+        if (compare(vm, ref, false) != SAME) return DIVERGED;
+        if (vm->irq || ref->irq) return INTERRUPTS;
+    }
+    shared->halted = !ref->running;
+    return compare(vm, ref, true);
+}
+
+// Run the engine without a budget up to its halt, then the reference as far,
+// and compare them there. An endless run leaves the engine anywhere in its
+// loop: the child leaves after it.
+static int freeRun(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt)
+{
+    previous = 0;
+    expired = 0;
+    vm->fault = messages[0];
+    ref->fault = messages[1];
+    messages[0][0] = messages[1][0] = '\0';
+
+    shared->phase = PHASE_ENGINE;
+    if (sigsetjmp(fault, 1)) {
+        signal(SIGALRM, SIG_DFL);
+        if (expired) return ENDLESS;
+        if (opt->timeout) alarm(FUZZ_TIMEOUT);
+        shared->phase = PHASE_REFERENCE;
+        if (sigsetjmp(fault, 1)) return FAULTED;
+        uint64_t done = reference(ref, opt->limit ? opt->limit + FUZZ_SLACK : UINT64_MAX);
+        if (shared->device) return DEVICE;
+        return report("the engine faulted; the reference ran %llu instructions%s\n", (unsigned long long)done,
+                      ref->running ? " without a fault" : " and halted");
+    }
+    vm->budget = 0;
+    if (opt->timeout) {
+        signal(SIGALRM, expire);
+        arm(FUZZ_FREE_MS);
+    }
+    uint64_t count = opt->engine->run(vm);
+    if (opt->timeout) {
+        signal(SIGALRM, SIG_DFL);
+        alarm(FUZZ_TIMEOUT);
+    }
+    if (vm->irq) return INTERRUPTS;
+    if (opt->limit && count > opt->limit) return ENDLESS;
+
+    shared->phase = PHASE_REFERENCE;
+    if (sigsetjmp(fault, 1))
+        return report("the reference faulted at PC 0x%04X within the %llu instructions of the engine; the engine did not\n",
+                      (uint16_t)(ref->reg[RPC] - 1), (unsigned long long)count);
+    uint64_t done = reference(ref, count);
+    shared->checked = done;
+    if (shared->device) return DEVICE;
+    if (done != count)
+        return report("the engine halted after %llu instructions, the reference after %llu\n",
+                      (unsigned long long)count, (unsigned long long)done);
+    if (ref->irq) return INTERRUPTS;
+    shared->halted = !ref->running;
+    if (strcmp(vm->fault, ref->fault) != 0)
+        return report("after %llu instructions the engine %s%s, the reference %s%s\n", (unsigned long long)done,
+                      vm->fault[0] ? "faulted: " : "did not fault", vm->fault,
+                      ref->fault[0] ? "faulted: " : "did not fault", ref->fault);
+    int result = compare(vm, ref, true);
+    return result == SAME && vm->fault[0] ? FAULTED : result;
+}
+
+// The child: a run for every byte on the command pipe, its result on the status
+// pipe. After a divergence the engine may be in any state, so it leaves.
+static void serve(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt, int command, int status)
+{
+    // The messages of the faults (and of engine crashes) are expected
+    if (quiet >= 0) dup2(quiet, STDERR_FILENO);
+    char byte;
+    while (read(command, &byte, 1) == 1) {
+        begin(vm, 0, opt);
+        begin(ref, 1, opt);
+        if (opt->timeout) alarm(FUZZ_TIMEOUT);
+        signal(SIGABRT, faulted);
+        byte = (char)(opt->free ? freeRun(vm, ref, opt) : lockstep(vm, ref, opt));
+        signal(SIGABRT, SIG_DFL);
+        alarm(0);
+        if (write(status, &byte, 1) != 1 || byte == DIVERGED || byte == ENDLESS) break;
+    }
+    _exit(0);
+}
+
+// Server side of the child
+static pid_t child = -1;
+static int to_child = -1, from_child = -1;
+static int served;
+
+static void spawn(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt)
+{
+    int down[2], up[2];
+    if (pipe(down) != 0 || pipe(up) != 0) {
+        fprintf(stderr, "Cannot create the pipes of the child: %s\n", strerror(errno));
+        exit(1);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    child = fork();
+    if (child < 0) {
+        fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (child == 0) {
+        close(down[1]);
+        close(up[0]);
+        serve(vm, ref, opt, down[0], up[1]);
+    }
+    close(down[0]);
+    close(up[1]);
+    to_child = down[1];
+    from_child = up[0];
+    served = 0;
+}
+
+// Let the child go (it leaves at the end of the command pipe) and return its wait status
+static int stop(void)
+{
+    close(to_child);
+    close(from_child);
+    int wstatus = 0;
+    while (waitpid(child, &wstatus, 0) < 0)
+        if (errno != EINTR) {
+            fprintf(stderr, "Cannot wait for the child: %s\n", strerror(errno));
+            exit(1);
+        }
+    child = -1;
+    return wstatus;
+}
+
+// One run of an image, or of a program file, on the child (forked when there is none)
+static int execute(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt, const struct image *image,
+                   const char *program)
+{
+    if (program) snprintf(shared->program, sizeof(shared->program), "%s", program);
+    else {
+        shared->program[0] = '\0';
+        shared->image = *image;
+    }
+    memset(shared->map, 0, sizeof(shared->map));
+    shared->report[0] = '\0';
+    shared->phase = PHASE_ENGINE;
+    shared->checked = 0;
+    shared->halted = false;
+    shared->device = false;
+
+    if (child < 0) spawn(vm, ref, opt);
+    char byte = 0;
+    if (write(to_child, &byte, 1) == 1 && read(from_child, &byte, 1) == 1) {
+        if (++served == FUZZ_PERSIST || byte == DIVERGED || byte == ENDLESS) stop();
+        return byte;
+    }
+
+    // The child died in this run
+    int wstatus = stop();
+    if (!WIFSIGNALED(wstatus)) {
+        snprintf(shared->report, sizeof(shared->report), "the child exited with status %d\n", WEXITSTATUS(wstatus));
+        return DIVERGED;
+    }
+    int sig = WTERMSIG(wstatus);
+    snprintf(shared->report, sizeof(shared->report), "the %s %s after %llu instructions\n",
+             shared->phase == PHASE_ENGINE ? "engine" : "reference",
+             sig == SIGALRM ? "hung" : strsignal(sig), (unsigned long long)shared->checked);
+    return DIVERGED;
+}
+
+
+// ===================================================================================
+// ================================= IMAGE GENERATION ================================
+// ===================================================================================
+static uint64_t rng;
+
+static uint32_t randomBelow(uint32_t n)
+{
+    // xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (uint32_t)((rng * 0x2545F4914F6CDD1DULL) >> 32) % n;
+}
+
+static uint16_t reg(void)
+{
+    return randomBelow(8);
+}
+
+// Small PC-relative offsets stay in the image, so branches make loops and calls
+static uint16_t near(int bits)
+{
+    return (uint16_t)((int)randomBelow(33) - 16) & ((1 << bits) - 1);
+}
+
+// An instruction, mostly well formed: registers, immediates and short offsets.
+// One in eight has random operand bits, for the fields an engine must ignore
+// (JSRR, the register form of ADD/AND) or mask (offsets, immediates).
+static uint16_t instruction(void)
+{
+    static const uint8_t ops[] = {op_add, op_add, op_add, op_and, op_and, op_not, op_br, op_br, op_br, op_br,
+                                  op_ld, op_st, op_jsr, op_jsr, op_ldr, op_ldr, op_str, op_str, op_ldi, op_sti,
+                                  op_jmp, op_jmp, op_lea, op_lea, op_trap, op_trap, op_rti, op_res};
+    static const uint8_t traps[] = {TRAP_GETC, TRAP_OUT, TRAP_PUTS, TRAP_IN, TRAP_PUTSP, TRAP_HALT, TRAP_INU16,
+                                    TRAP_OUTU16, TRAP_MEMCPY, TRAP_MEMSET, TRAP_STRLEN, TRAP_STRCMP, TRAP_MUL,
+                                    TRAP_DIV, TRAP_MOD, TRAP_FREAD, TRAP_FWRITE};
+    uint16_t op = ops[randomBelow(sizeof(ops))];
+    if (randomBelow(8) == 0) return op << 12 | randomBelow(1 << 12);
+
+    switch (op) {
+    case op_add:
+    case op_and:
+        if (randomBelow(2)) return op << 12 | reg() << 9 | reg() << 6 | 0x20 | randomBelow(32);
+        return op << 12 | reg() << 9 | reg() << 6 | reg();
+    case op_not:
+        return op << 12 | reg() << 9 | reg() << 6 | 0x3F;
+    case op_br:
+        return op << 12 | (1 + randomBelow(7)) << 9 | near(9);
+    case op_jsr:
+        if (randomBelow(4) == 0) return op << 12 | reg() << 6;
+        return op << 12 | 0x800 | near(11);
+    case op_jmp:
+        return op << 12 | (randomBelow(2) ? R7 : reg()) << 6;
+    case op_ldr:
+    case op_str:
+        return op << 12 | reg() << 9 | reg() << 6 | randomBelow(64);
+    case op_trap:
+        return op << 12 | traps[randomBelow(sizeof(traps))];
+    case op_rti:
+    case op_res:
+        return op << 12;
+    default:                            // LD, ST, LDI, STI, LEA
+        return op << 12 | reg() << 9 | (randomBelow(2) ? near(9) : randomBelow(512));
+    }
+}
+
+static void generate(struct image *image)
+{
+    image->size = 1 + randomBelow(randomBelow(2) ? 64 : 512);
+    bool raw = randomBelow(8) == 0;
+    for (int i = 0; i < image->size; ++i)
+        image->words[i] = raw ? (uint16_t)randomBelow(1 << 16) : instruction();
+}
+
+static void mutate(struct image *image, const struct image *other)
+{
+    static const uint16_t interesting[] = {0x0000, 0xFFFF, 0x8000, 0x7FFF, 0xF025, 0xC1C0, 0xD000, 0x8000, 0x0E00};
+    for (int n = 1 + randomBelow(4); n > 0; --n) {
+        uint16_t size = image->size;
+        uint16_t at = randomBelow(size);
+        switch (randomBelow(7)) {
+        case 0:
+            image->words[at] = instruction();
+            break;
+        case 1:
+            image->words[at] ^= 1 << randomBelow(16);
+            break;
+        case 2:
+            image->words[at] = interesting[randomBelow(sizeof(interesting) / sizeof(interesting[0]))];
+            break;
+        case 3:                         // insert
+            if (size == FUZZ_WORDS) break;
+            memmove(image->words + at + 1, image->words + at, (size - at) * sizeof(uint16_t));
+            image->words[at] = instruction();
+            ++image->size;
+            break;
+        case 4:                         // delete
+            if (size == 1) break;
+            memmove(image->words + at, image->words + at + 1, (size - at - 1) * sizeof(uint16_t));
+            --image->size;
+            break;
+        case 5: {                       // copy a block within the image
+            uint16_t from = randomBelow(size), length = 1 + randomBelow(16);
+            if (from + length > size) length = size - from;
+            if (at + length > size) length = size - at;
+            memmove(image->words + at, image->words + from, length * sizeof(uint16_t));
+            break;
+        }
+        default:                        // splice: the rest comes from another image
+            if (at >= other->size) break;
+            memcpy(image->words + at, other->words + at, (other->size - at) * sizeof(uint16_t));
+            image->size = other->size;
+            break;
+        }
+    }
+}
+
+
+// ===================================================================================
+// ===================================== CORPUS ======================================
+// ===================================================================================
+static uint8_t seen[FUZZ_MAP];          // hit count classes of every edge so far
+static struct image *corpus[FUZZ_CORPUS];
+static int ncorpus;
+
+// Hit count classes, so a loop running longer is new coverage but not every count
+static uint8_t hitClass(uint8_t hits)
+{
+    return hits >= 128 ? 0x80 : hits >= 32 ? 0x40 : hits >= 16 ? 0x20 : hits >= 8 ? 0x10 :
+           hits >= 4 ? 0x08 : hits == 3 ? 0x04 : hits == 2 ? 0x02 : hits;
+}
+
+// Fold the map of the last run into seen; true when it had something new
+static bool newCoverage(void)
+{
+    bool found = false;
+    const uint64_t *words = (const uint64_t *)shared->map;
+    for (size_t w = 0; w < FUZZ_MAP / 8; ++w) {
+        if (words[w] == 0) continue;
+        for (size_t i = w * 8; i < w * 8 + 8; ++i) {
+            uint8_t c = hitClass(shared->map[i]);
+            if (c & ~seen[i]) {
+                seen[i] |= c;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+static int edges(void)
+{
+    int count = 0;
+    for (size_t i = 0; i < FUZZ_MAP; ++i)
+        count += seen[i] != 0;
+    return count;
+}
+
+static void addCorpus(const struct image *image)
+{
+    if (ncorpus == FUZZ_CORPUS) return;
+    corpus[ncorpus] = malloc(sizeof(struct image));
+    if (corpus[ncorpus] == NULL) {
+        fprintf(stderr, "Cannot allocate the corpus\n");
+        exit(1);
+    }
+    *corpus[ncorpus++] = *image;
+}
+
+// A seed: the words of a program from PC_START
+static bool loadSeed(const char *fileName, struct image *image)
+{
+    uint16_t *memory = calloc(MEMORY_MAX, sizeof(uint16_t));
+    if (memory == NULL) return false;
+    uint16_t entry = loadProgram(fileName, memory);
+    if (entry != PC_START) fprintf(stderr, "%s: entry 0x%04X, the runs start at 0x%04X\n", fileName, entry, PC_START);
+    image->size = 0;
+    for (int i = 0; i < FUZZ_WORDS; ++i)
+        if (memory[PC_START + i]) image->size = i + 1;
+    if (image->size == 0) image->size = 1;
+    memcpy(image->words, memory + PC_START, image->size * sizeof(uint16_t));
+    free(memory);
+    return true;
+}
+
+// Raw image (little endian words at PC_START)
+static void save(const char *dir, int n, const struct image *image)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/diverge-%d.bin", dir, n);
+    FILE *out = fopen(path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", path);
+        return;
+    }
+    for (int i = 0; i < image->size; ++i) {
+        uint8_t bytes[2] = {image->words[i] & 0xFF, image->words[i] >> 8};
+        fwrite(bytes, 1, 2, out);
+    }
+    fclose(out);
+    printf("saved %s (%u words)\n", path, image->size);
+}
+
+// Replace words by NOPs (BR never) while the image still diverges, then drop the tail
+static void shrink(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt, struct image *image)
+{
+    for (int i = image->size - 1; i >= 0; --i) {
+        uint16_t word = image->words[i];
+        if (word == 0) continue;
+        image->words[i] = 0;
+        if (execute(vm, ref, opt, image, NULL) != DIVERGED) image->words[i] = word;
+    }
+    while (image->size > 1 && image->words[image->size - 1] == 0)
+        --image->size;
+    execute(vm, ref, opt, image, NULL);
+}
+
+static double seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+// ===================================================================================
+// ====================================== MAIN =======================================
+// ===================================================================================
+static int check(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt, char **programs, int n)
+{
+    int diverged = 0;
+    for (int i = 0; i < n; ++i) {
+        imageClose(imageOpen(programs[i]));         // a bad file stops here, not in the child
+        int result = execute(vm, ref, opt, NULL, programs[i]);
+        unsigned long long count = (unsigned long long)shared->checked;
+        if (result == SAME)
+            printf("%s: same after %llu instructions (%s)\n", programs[i], count, shared->halted ? "halted" : "limit");
+        else if (result == FAULTED)
+            printf("%s: same fault after %llu instructions\n", programs[i], count);
+        else if (result == INTERRUPTS)
+            printf("%s: same for %llu instructions, until interrupts were enabled\n", programs[i], count);
+        else if (result == DEVICE)
+            printf("%s: same for %llu instructions, until it ran code in the device region\n", programs[i], count);
+        else if (result == ENDLESS)
+            printf("%s: not compared, the engine did not halt within the limit\n", programs[i]);
+        else {
+            printf("%s: %s diverges from switch: %s", programs[i], opt->engine->name, shared->report);
+            ++diverged;
+        }
+    }
+    return diverged ? 1 : 0;
+}
+
+static int fuzz(struct lc3_vm *vm, struct lc3_vm *ref, const struct options *opt, char **seeds, int nseeds,
+                uint64_t execs, int max, const char *dir)
+{
+    static struct image image;
+    uint64_t faults = 0, interrupted = 0, device = 0, endless = 0, done = 0;
+    int diverged = 0;
+    double start = seconds(), last = start;
+
+    for (int i = 0; i < nseeds; ++i)
+        if (loadSeed(seeds[i], &image)) {
+            execute(vm, ref, opt, &image, NULL);
+            newCoverage();
+            addCorpus(&image);
+        }
+
+    for (; done < execs && diverged < max; ++done) {
+        if (ncorpus == 0 || randomBelow(8) == 0) generate(&image);
+        else {
+            image = *corpus[randomBelow(ncorpus)];
+            mutate(&image, corpus[randomBelow(ncorpus)]);
+        }
+
+        int result = execute(vm, ref, opt, &image, NULL);
+        if (newCoverage()) addCorpus(&image);
+        faults += result == FAULTED;
+        interrupted += result == INTERRUPTS;
+        device += result == DEVICE;
+        endless += result == ENDLESS;
+        if (result == DIVERGED) {
+            shrink(vm, ref, opt, &image);
+            printf("%s diverges from switch: %s", opt->engine->name, shared->report);
+            save(dir, ++diverged, &image);
+        }
+
+        if ((done & 255) == 0 && seconds() - last >= 1) {
+            last = seconds();
+            fprintf(stderr, "lc3fuzz: %llu execs (%.0f/s), corpus %d, %d edges, %llu faults, %llu with interrupts, %llu into devices, %llu endless, %d divergences\n",
+                    (unsigned long long)done, done / (last - start), ncorpus, edges(), (unsigned long long)faults,
+                    (unsigned long long)interrupted, (unsigned long long)device, (unsigned long long)endless, diverged);
+        }
+    }
+    double elapsed = seconds() - start;
+    fprintf(stderr, "lc3fuzz: %s against switch: %llu execs in %.1f s (%.0f/s), corpus %d, %d edges, %llu faults, %llu with interrupts, %llu into devices, %llu endless, %d divergences\n",
+            opt->engine->name, (unsigned long long)done, elapsed, elapsed > 0 ? done / elapsed : 0.0, ncorpus, edges(),
+            (unsigned long long)faults, (unsigned long long)interrupted, (unsigned long long)device,
+            (unsigned long long)endless, diverged);
+    return diverged ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct options opt = { &engines[2], 1000, false, 10000, FUZZ_INPUT, sizeof(FUZZ_INPUT) - 1, true };
+    bool checking = false, limited = false;
+    uint64_t execs = 100000;
+    int max = 10;
+    const char *dir = ".";
+    char *input = NULL;
+    rng = (uint64_t)time(NULL) ^ (uint64_t)getpid() << 32;
+
+    int o;
+    while ((o = getopt(argc, argv, "e:N:fl:i:n:s:m:o:ch")) != -1) {
+        switch (o) {
+        case 'e':
+            opt.engine = NULL;
+            for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+                if (strcmp(optarg, engines[i].name) == 0) opt.engine = &engines[i];
+            if (opt.engine == NULL) {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'N':
+            opt.interval = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            opt.free = true;
+            break;
+        case 'l':
+            opt.limit = strtoull(optarg, NULL, 0);
+            limited = true;
+            break;
+        case 'i': {
+            FILE *file = fopen(optarg, "rb");
+            long size;
+            if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0) {
+                fprintf(stderr, "Cannot read file %s\n", optarg);
+                return 1;
+            }
+            rewind(file);
+            input = malloc(size ? size : 1);
+            if (input == NULL || fread(input, 1, size, file) != (size_t)size) {
+                fprintf(stderr, "Cannot read file %s\n", optarg);
+                return 1;
+            }
+            fclose(file);
+            opt.input = input;
+            opt.input_size = size;
+            break;
+        }
+        case 'n':
+            execs = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            rng = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            max = atoi(optarg);
+            break;
+        case 'o':
+            dir = optarg;
+            break;
+        case 'c':
+            checking = true;
+            break;
+        default:
+            usage(argv[0]);
+            return o == 'h' ? 0 : 1;
+        }
+    }
+    if (opt.interval == 0 || (checking && optind == argc)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (rng == 0) rng = 1;
+    if (checking) {
+        if (!limited) opt.limit = 0;
+        opt.timeout = false;
+    }
+
+    // The fork server: everything the children share is set up once
+    trapRegister(TRAP_FREAD, noFile);
+    trapRegister(TRAP_FWRITE, noFile);
+    shared = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "Cannot map the shared state\n");
+        return 1;
+    }
+    struct lc3_vm *vm = vmCreate();
+    struct lc3_vm *ref = vmCreate();
+    handlers(vm);
+    handlers(ref);
+    blank[0] = snapshotCreate(vm);
+    blank[1] = snapshotCreate(ref);
+    quiet = open("/dev/null", O_WRONLY);
+    signal(SIGPIPE, SIG_IGN);
+
+    int status = checking ? check(vm, ref, &opt, argv + optind, argc - optind)
+                          : fuzz(vm, ref, &opt, argv + optind, argc - optind, execs, max, dir);
+    if (child >= 0) stop();
+    free(input);
+    return status;
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "image.h"
+#include "asm.h"
+#include "optimize.h"
+
+// LC-3 IMAGE OPTIMIZER
+// Usage: lc3opt [-q] program out.lc3
+// Optimize a program (any format of image.h, or a source) into an equivalent
+// container image, see optimize.h. Print one line per change and the summary
+// (-q: only the summary). The container keeps the segments of the program,
+// and its symbols moved with the code. A program the optimizer declines is
+// written unchanged, so out can always replace it; the exit status is 0.
+
+int main(int argc, char **argv)
+{
+    bool quiet = argc > 1 && strcmp(argv[1], "-q") == 0;
+    if (argc - quiet != 3) {
+        fprintf(stderr, "Usage: %s [-q] program out.lc3\n", argv[0]);
+        return 1;
+    }
+    const char *input = argv[1 + quiet], *output = argv[2 + quiet];
+
+    struct lc3_image *image = imageOpen(input);
+    struct asm_program *program = calloc(1, sizeof(struct asm_program));
+    uint16_t *map = malloc(MEMORY_MAX * sizeof(uint16_t));
+    if (program == NULL || map == NULL) {
+        fprintf(stderr, "Cannot allocate %s\n", input);
+        return 1;
+    }
+    imageCopy(image, program->memory);
+    program->entry = image->entry;
+    program->nsegments = image->nsegments;
+    for (int s = 0; s < image->nsegments; ++s) {
+        program->segments[s].origin = image->segments[s].origin;
+        program->segments[s].words = image->segments[s].words;
+    }
+
+    struct opt_report report;
+    optimizeImage(program->memory, program->entry, quiet ? NULL : stdout, map, &report);
+    optimizeReport(stdout, &report);
+
+    // Symbols keep their order: code only moves inside its own blocks
+    program->nsymbols = image->nsymbols;
+    program->symbols = malloc((image->nsymbols ? image->nsymbols : 1) * sizeof(struct image_symbol));
+    for (int i = 0; i < image->nsymbols; ++i) {
+        program->symbols[i].address = report.applied ? map[image->symbols[i].address] : image->symbols[i].address;
+        program->symbols[i].name = image->symbols[i].name;
+    }
+
+    size_t size;
+    uint8_t *container = asmContainer(program, &size);
+    FILE *out = fopen(output, "wb");
+    bool written = out != NULL && fwrite(container, 1, size, out) == size;
+    if (out != NULL && fclose(out) != 0) written = false;
+    if (!written) {
+        fprintf(stderr, "Cannot write %s\n", output);
+        remove(output);
+    }
+
+    free(container);
+    free(program->symbols);
+    free(program);
+    free(map);
+    imageClose(image);
+    return written ? 0 : 1;
+}
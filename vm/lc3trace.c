@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "disasm.h"
+#include "trace.h"
+
+// LC-3 TRACE DECODER
+// Usage: lc3trace trace.bin
+// Print a trace written by vm/main -T as one line per retired instruction:
+// count, address, word, disassembly and the register or memory word it wrote,
+// then one line per word of the block it wrote (native traps, interrupt entry).
+
+static struct trace_state state;
+static uint16_t block[MEMORY_MAX];
+
+// A decoded entry
+struct entry {
+    uint16_t pc;
+    uint16_t instruction;
+    int reg;                // register written, -1 for none
+    uint16_t value;
+    bool store;
+    uint16_t address;
+    uint16_t stored;
+    uint16_t bulk_start;    // block written, its words in block
+    uint16_t bulk_size;
+};
+
+static bool readVarint(FILE *in, uint16_t *value)
+{
+    unsigned v = 0;
+    for (int shift = 0; shift < 21; shift += 7) {
+        int c = getc(in);
+        if (c == EOF) return false;
+        v |= (unsigned)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            *value = (uint16_t)v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint16_t unzigzag(uint16_t v)
+{
+    return (v >> 1) ^ (uint16_t)-(v & 1);
+}
+
+// Next record, false at the end of the file. A truncated entry is an error.
+static bool readEntry(FILE *in, struct entry *r, bool *truncated)
+{
+    int header = getc(in);
+    if (header == EOF) return false;
+    *truncated = true;
+
+    uint16_t v;
+    r->pc = state.pc + 1;
+    if (header & TRACE_JUMP) {
+        if (!readVarint(in, &v)) return false;
+        r->pc += unzigzag(v);
+    }
+    state.pc = r->pc;
+
+    if (header & TRACE_WORD) {
+        int lo = getc(in), hi = getc(in);
+        if (hi == EOF) return false;
+        state.code[r->pc] = (uint16_t)(lo | hi << 8);
+    }
+    r->instruction = state.code[r->pc];
+
+    r->reg = -1;
+    if (header & TRACE_REG) {
+        r->reg = (header >> 3) & 0x7;
+        if (!readVarint(in, &v)) return false;
+        r->value = state.reg[r->reg] += unzigzag(v);
+    }
+
+    r->store = false;
+    if (header & TRACE_MEM) {
+        r->store = true;
+        if (!readVarint(in, &v)) return false;
+        r->address = state.address += unzigzag(v);
+        if (!readVarint(in, &r->stored)) return false;
+    }
+
+    r->bulk_size = 0;
+    if (header & TRACE_BULK) {
+        if (!readVarint(in, &v)) return false;
+        r->bulk_start = state.address + unzigzag(v);
+        if (!readVarint(in, &r->bulk_size)) return false;
+        for (uint16_t i = 0; i < r->bulk_size; ++i)
+            if (!readVarint(in, &block[i])) return false;
+        state.address = r->bulk_start + r->bulk_size - 1;
+    }
+
+    *truncated = false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", argv[1]);
+        return 1;
+    }
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a trace file\n", argv[1]);
+        return 1;
+    }
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    state.pc = PC_START - 1;
+
+    struct entry r;
+    bool truncated = false;
+    uint64_t n = 0;
+    while (readEntry(in, &r, &truncated)) {
+        char text[32];
+        disassemble(r.instruction, text, sizeof(text));
+        printf("%10llu  0x%04X  %04X  ", (unsigned long long)n++, r.pc, r.instruction);
+        if (r.reg >= 0) printf("%-18s  R%d = 0x%04X\n", text, r.reg, r.value);
+        else if (r.store) printf("%-18s  [0x%04X] = 0x%04X\n", text, r.address, r.stored);
+        else printf("%s\n", text);
+        for (uint16_t i = 0; i < r.bulk_size; ++i)
+            printf("%10s  %6s  %4s  %-18s  [0x%04X] = 0x%04X\n", "", "", "", "",
+                   (uint16_t)(r.bulk_start + i), block[i]);
+    }
+    fclose(in);
+
+    if (truncated) {
+        fprintf(stderr, "%s: truncated after %llu records\n", argv[1], (unsigned long long)n);
+        return 1;
+    }
+    return 0;
+}
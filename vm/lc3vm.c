@@ -2,8 +2,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
 
 #include "lc3vm.h"
+#include "decode.h"
+#include "console.h"
+#include "device.h"
+#include "replay.h"
+#include "trap.h"
+#include "image.h"
+#include "interrupt.h"
+#include "debug.h"
 
 // Update RCND in base of r-th sign. Used for condition check
 void update_flag(uint16_t *reg, enum regist r)  // as convention, the sign of our value is in the most significant bit
@@ -15,21 +25,80 @@ void update_flag(uint16_t *reg, enum regist r)  // as convention, the sign of ou
 
 
 // Memory Read Access: return value stored into memory address 
-uint16_t mem_read(uint16_t *memory, uint16_t address)
+uint16_t mem_read(struct lc3_vm *vm, uint16_t address)
 {
-    // If memory is mapped keyboard memory
-    if (address == MR_KBSR) {
-        // to implement
-        printf("HIT MAPPED ADDRESS. Not implemented yet!\n");
-    }
-    
-    return memory[address];
+    // If memory is mapped device memory
+    if (address >= MR_BASE) return deviceRead(vm, address);
+    return vm->memory[address];
 }
 
 // Memory Write: write val in memory address
-void mem_write(uint16_t *memory, uint16_t address, uint16_t val)
+// The decoded copy of the word (if any) is dropped, so code written by the
+// program is decoded again the next time it runs
+void mem_write(struct lc3_vm *vm, uint16_t address, uint16_t val)
 {
-    memory[address] = val;
+    if (vm->watch && vm->watch[address >> PAGE_BITS]) debugWatch(vm, address, val);
+    vm->memory[address] = val;
+    vm->dirty[address >> PAGE_BITS] = 1;
+    decode_invalidate(vm->decode, address);
+    if (address >= MR_BASE) deviceWrite(vm, address, val);
+}
+
+
+// ===================================================================================
+// =================================== VM CONTEXT ====================================
+// ===================================================================================
+// A VM is large (main memory plus the decode cache), so it lives on the heap
+struct lc3_vm *vmCreate(void)
+{
+    struct lc3_vm *vm = malloc(sizeof(struct lc3_vm));
+    struct decoded *decode = malloc(MEMORY_MAX * sizeof(struct decoded));
+    struct console *io = consoleCreate();
+    if (vm == NULL || decode == NULL) {
+        fprintf(stderr, "Cannot allocate VM\n");
+        abort();
+    }
+
+    vm->decode = decode;
+    vm->io = io;
+    vm->in = stdin;
+    vm->out = stdout;
+    vm->budget = 0;
+    vm->irq = NULL;
+    vm->debug = NULL;
+    vm->watch = NULL;
+    vm->fault = NULL;
+    atomic_init(&vm->event, false);
+    vmReset(vm);
+    return vm;
+}
+
+void vmDestroy(struct lc3_vm *vm)
+{
+    interruptStop(vm);
+    consoleFlush(vm);
+    consoleDestroy(vm->io);
+    free(vm->decode);
+    free(vm);
+}
+
+void vmReset(struct lc3_vm *vm)
+{
+    memset(vm->memory, 0, sizeof(vm->memory));
+    memset(vm->reg, 0, sizeof(vm->reg));
+    memset(vm->decode, 0, MEMORY_MAX * sizeof(struct decoded));
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->memory[MR_MCR] = 0x8000;    // clock enabled
+    vm->reg[RPC] = PC_START;
+    vm->psr = PSR_USER;             // user mode, priority 0
+    vm->ssp = SSP_START;
+    vm->usp = 0;
+    interruptStop(vm);
+    atomic_store(&vm->event, false);
+    vm->running = true;
+    vm->origin = 0;
+    vm->retired = 0;
+    vm->bulk_size = 0;
 }
 
 
@@ -47,8 +116,9 @@ void mem_write(uint16_t *memory, uint16_t address, uint16_t val)
 //          0001|DR1|SR1|1|IMM05
 //          0001|001|000|1|0101 -> ADD(0001) R1(010) R0(000) 5(0101)
 //                              -> add 5 to content R0 and store in R1 the result
-void OP_ADD(uint16_t *reg, uint16_t instruction)
+void OP_ADD(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;        // destination register
     uint16_t SR1 = (instruction >> 6) & 0x7;        // first source register
     uint16_t IMM_FLAG = (instruction >> 5) & 0x1;   // if 0 -> add1, 1 -> add2
@@ -82,8 +152,9 @@ uint16_t sign_extend(uint16_t x, int bit_count)
 // Compute bitwise and operation between two registers or immediate value
 // register mode:   0101|DR1|SR1|000|SR2
 // immediate mode:  0101|DR1|SR1|1|IMM05
-void OP_AND(uint16_t *reg, uint16_t instruction)
+void OP_AND(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;        // destination register
     uint16_t SR1 = (instruction >> 6) & 0x7;        // first source register
     uint16_t IMM_FLAG = (instruction >> 5) & 0x1;   // if 0 -> add1, 1 -> add2
@@ -103,8 +174,9 @@ void OP_AND(uint16_t *reg, uint16_t instruction)
 // ==================================== NOT ===========================================
 // NOT: compute bitwise not of source register SR1 and store the result in destination register DR1
 // 1001|DR1|SR1|******
-void OP_NOT(uint16_t *reg, uint16_t instruction)
+void OP_NOT(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;        // destination register
     uint16_t SR1 = (instruction >> 6) & 0x7;        // first source register
 
@@ -124,11 +196,12 @@ void OP_NOT(uint16_t *reg, uint16_t instruction)
 //  - 1010 is the operetion code for OP_LDI
 //  - DR1 is the destination register that store the loaded value
 //  - PCoffset9 is 9 bit address in main memory from PC_START
-void OP_LD(uint16_t *reg, uint16_t *memory, uint16_t instruction)
+void OP_LD(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;
     uint16_t PCoffset9 = sign_extend(instruction & 0x1FF, 9);
-    reg[DR1] = mem_read(memory, reg[RPC] + PCoffset9);
+    reg[DR1] = mem_read(vm, reg[RPC] + PCoffset9);
     update_flag(reg, DR1);
 }
 
@@ -143,31 +216,34 @@ void OP_LD(uint16_t *reg, uint16_t *memory, uint16_t instruction)
         0x456: 'a'
     Program: (e.g. PC = 0x100)
         LID R0 0x023 ; load value pointed by PC + offset: 'a' */
-void OP_LDI(uint16_t *reg, uint16_t *memory, uint16_t instruction)
+void OP_LDI(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;
     uint16_t PCoffset9 = sign_extend(instruction & 0x1ff, 9);
-    reg[DR1] = mem_read(memory, mem_read(memory, reg[RPC] + PCoffset9));
+    reg[DR1] = mem_read(vm, mem_read(vm, reg[RPC] + PCoffset9));
     update_flag(reg, DR1);
 }
 
 // ==================================== LDR ===========================================
 // LDR Load Register: load memory in position SR1 + offset to DR1
 // 0110|DR1|SR1|OFFST6
-void OP_LDR(uint16_t *reg, uint16_t *memory, uint16_t instruction)
+void OP_LDR(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;
     uint16_t SR1 = (instruction >> 6) & 0x7;
     uint16_t SRoffset6 = sign_extend(instruction & 0x3f, 6);
-    reg[DR1] = mem_read(memory, reg[SR1] + SRoffset6);
+    reg[DR1] = mem_read(vm, reg[SR1] + SRoffset6);
     update_flag(reg, DR1);
 }
 
 // ==================================== LEA ===========================================
 // LEA Load Effective Address: load in the register DR1 program position RPC + offset
 // 1110|DR1|PCOFFSET9
-void OP_LEA(uint16_t *reg, uint16_t instruction)
+void OP_LEA(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t DR1 = (instruction >> 9) & 0x7;
     uint16_t PCoffset9 = sign_extend(instruction & 0x1ff, 9);
     reg[DR1] = reg[RPC] + PCoffset9;
@@ -181,33 +257,36 @@ void OP_LEA(uint16_t *reg, uint16_t instruction)
 // ==================================== ST ============================================
 // ST: store the value of a given register SR1 to a memory location PC + offset.
 // 0011|SR1|PCOFFSET9
-void OP_ST(uint16_t *reg, uint16_t *memory, uint16_t instruction)
+void OP_ST(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t SR1 = (instruction >> 9) & 0x7;
     uint16_t PCoffset9 = sign_extend(instruction & 0x1FF, 9);
-    mem_write(memory, reg[RPC] + PCoffset9, reg[SR1]);
+    mem_write(vm, reg[RPC] + PCoffset9, reg[SR1]);
 }
 
 // ==================================== STI ============================================
 // STI: like ST but instead of writing to memory address directly, it use intermediate
 // address from the main memory where the actual address is.
 // 0011|SR1|PCOFFSET9
-void OP_STI(uint16_t *reg, uint16_t *memory, uint16_t instruction)
+void OP_STI(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t SR1 = (instruction >> 9) & 0x7;
     uint16_t PCoffset9 = sign_extend(instruction & 0x1FF, 9);
-    mem_write(memory, mem_read(memory, reg[RPC] + PCoffset9), reg[SR1]);
+    mem_write(vm, mem_read(vm, reg[RPC] + PCoffset9), reg[SR1]);
 }
 
 // ==================================== STR ============================================
 // STR: like ST but instead of starting from RPC, we can specify another address base in SR2.
 // 0011|SR1|SR2|OFFST6
-void OP_STR(uint16_t *reg, uint16_t *memory, uint16_t instruction)
+void OP_STR(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t SR1 = (instruction >> 9) & 0x7;
     uint16_t SR2 = (instruction >> 6) & 0x7;
     uint16_t offset = sign_extend(instruction & 0x1FF, 6);
-    mem_write(memory, reg[SR2] + offset, reg[SR1]);
+    mem_write(vm, reg[SR2] + offset, reg[SR1]);
 }
 
 
@@ -219,10 +298,12 @@ void OP_STR(uint16_t *reg, uint16_t *memory, uint16_t instruction)
 // RPC is incremented each instruction executed but we can jump to a
 // specific location in memory specified in SR1
 // 1100|000|SR1|000000
-void OP_JMP(uint16_t *reg, uint16_t instruction)
+void OP_JMP(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t SR1 = (instruction >> 6) & 0x7;
     reg[RPC] = reg[SR1];
+    if (eventPending(vm)) interruptPoll(vm);
 }
 
 // ==================================== JSR ===========================================
@@ -230,8 +311,9 @@ void OP_JMP(uint16_t *reg, uint16_t instruction)
 // into register R7). It has two formmat:
 // - JSR:  0100|1|***OFFSET11    -> jump to PC + offset 
 // - JSRR: 0100|0|00|SR1|000000  -> jump to PC + SR1
-void OP_JSR(uint16_t *reg, uint16_t instruction)
+void OP_JSR(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t JMP_FLAG = (instruction >> 11) & 1;
     reg[R7] = reg[RPC]; // save in R7 where we branch
     if (JMP_FLAG){
@@ -242,6 +324,7 @@ void OP_JSR(uint16_t *reg, uint16_t instruction)
         uint16_t SR1 = (instruction >> 6) & 0x7;
         reg[RPC] += SR1;
     }
+    if (eventPending(vm)) interruptPoll(vm);
 }
 
 // ==================================== BR ============================================
@@ -251,137 +334,188 @@ void OP_JSR(uint16_t *reg, uint16_t instruction)
 // - NZP = 010 : jump if zero
 // - NZP = 100 : jump if negative
 // 0000|NZP|OFFSET009 
-void OP_BR(uint16_t *reg, uint16_t instruction)
+// A taken branch, like JMP and JSR, ends a block: pending interrupts are taken
+// there (interrupt.h)
+void OP_BR(struct lc3_vm *vm, uint16_t instruction)
 {
+    uint16_t *reg = vm->reg;
     uint16_t PC_OFFSET = sign_extend(instruction & 0x1FF, 9);
     uint16_t COND_FLAG = (instruction >> 9) & 0x7;
-    if (COND_FLAG & reg[RCND])
+    if (COND_FLAG & reg[RCND]) {
         reg[RPC] += PC_OFFSET;
+        if (eventPending(vm)) interruptPoll(vm);
+    }
 }
 
 
 // ===================================================================================
 // ============================ TRAP ROUTINE INSTRUCTIONS ============================
 // ===================================================================================
+// The guest cannot go on: abort, or stop the VM with the error in vm->fault
+static void guestFault(struct lc3_vm *vm, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void guestFault(struct lc3_vm *vm, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    consoleFlush(vm);
+    if (vm->fault) {
+        vsnprintf(vm->fault, VM_FAULT_SIZE, format, args);
+        vm->running = false;
+        va_end(args);
+        return;
+    }
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    abort();
+}
+
 // TRAP routines are used for performing common tasks and interacting with the I/O
 // TRAP routines are identified by trap code -> 1111|0000|TRAPVEC8
-void OP_TRAP(uint16_t *reg, uint16_t *memory, uint16_t instruction, bool *running)
-{
-    switch (instruction & 0xFF) {
-        case TRAP_GETC:
-            T_getc(reg);
-            break;
-        case TRAP_OUT:
-            T_out(reg);
-            break;
-        case TRAP_PUTS:
-            T_puts(reg, memory);
-            break;
-        case TRAP_IN:
-            T_in(reg);
-            break;
-        case TRAP_PUTSP:
-            T_putsp(reg, memory);
-            break;
-        case TRAP_HALT:
-            T_halt(running);
-            break;
-        case TRAP_INU16:
-            T_inu16(reg);
-            break;
-        case TRAP_OUTU16:
-            T_outu16(reg);
-            break;
+void OP_TRAP(struct lc3_vm *vm, uint16_t instruction)
+{
+    trap_fn trap = trap_table[instruction & 0xFF];
+    if (trap == NULL) {
+        guestFault(vm, "Unknown trap vector 0x%02X at 0x%04X", instruction & 0xFF, (uint16_t)(vm->reg[RPC] - 1));
+        return;
     }
+    trap(vm);
 }
 
 // TRAP_GETC: Read a char from the keyboard and store in R0
-void T_getc(uint16_t *reg) { 
-    reg[R0] = (uint16_t)getchar();
-    update_flag(reg, R0);
+void T_getc(struct lc3_vm *vm) { 
+    vm->reg[R0] = (uint16_t)inputGetc(vm);
+    update_flag(vm->reg, R0);
 }
 
 // TRAP_OUT: Print in the terminal the char stored in R0
-void T_out(uint16_t *reg) { 
-    putc((char)reg[R0], stdout);
-    fflush(stdout); 
+void T_out(struct lc3_vm *vm) { 
+    consolePutc(vm, (char)vm->reg[R0]);
+    consoleEndTrap(vm);
 }
 
 // TRAP_PUTS
 // Write a string of charaters to the console stored contiguously in the memory starting
-// from the address specify in R0
-void T_puts(uint16_t *reg, uint16_t *memory)
+// from the address specify in R0. The chars go straight into the console buffer.
+void T_puts(struct lc3_vm *vm)
 {
-    uint16_t* c = memory + reg[R0];
-    while (*c) {
-        putc((char)*c, stdout);
-        ++c;
+    struct console *io = vm->io;
+    uint16_t address = vm->reg[R0];
+    while (vm->memory[address]) {
+        if (io->out_used == CONSOLE_OUT_SIZE) consoleFlush(vm);
+        size_t used = io->out_used;
+        while (used < CONSOLE_OUT_SIZE && vm->memory[address]) {
+            char c = (char)vm->memory[address++];
+            io->newline |= c == '\n';
+            io->out[used++] = c;
+        }
+        io->out_used = used;
     }
-    fflush(stdout);
+    consoleEndTrap(vm);
 }
 
 // TRAP_IN
 // Like TRAP_GETC but print to the console
-void T_in(uint16_t *reg)
+void T_in(struct lc3_vm *vm)
 {
-    char c = getchar();
-    putc(c, stdout);
-    fflush(stdout);
-    reg[R0] = (uint16_t)c;
-    update_flag(reg, R0);
+    char c = inputGetc(vm);
+    if (!vm->running) return;       // end of an input replay
+    consolePutc(vm, c);
+    consoleEndTrap(vm);
+    vm->reg[R0] = (uint16_t)c;
+    update_flag(vm->reg, R0);
 }
 
 // TRAP_PUTSP
 // Write a string of charaters to the console stored contiguously in the memory starting
 // from the address specify in R0. Each memory address contain 2 char (one char per byte)
-void T_putsp(uint16_t *reg, uint16_t *memory)
-{
-    uint16_t* c = memory + reg[R0];
-    while (*c) {
-        char c1 = (*c) & 0xFF;
-        putc(c1, stdout);
-        char c2 = (*c) >> 8;
-        if (c2) putc(c2, stdout);
-        ++c;
+void T_putsp(struct lc3_vm *vm)
+{
+    struct console *io = vm->io;
+    uint16_t address = vm->reg[R0];
+    while (vm->memory[address]) {
+        if (io->out_used + 1 >= CONSOLE_OUT_SIZE) consoleFlush(vm);
+        size_t used = io->out_used;
+        while (used + 1 < CONSOLE_OUT_SIZE && vm->memory[address]) {
+            uint16_t word = vm->memory[address++];
+            char c1 = word & 0xFF;
+            char c2 = word >> 8;
+            io->newline |= c1 == '\n' || c2 == '\n';
+            io->out[used++] = c1;
+            if (c2) io->out[used++] = c2;
+        }
+        io->out_used = used;
     }
-    fflush(stdout);
+    consoleEndTrap(vm);
 }
 
 // TRAP_HALT
 // Keep track of the running VM in a boolean
-void T_halt(bool *running) {
-    fflush(stdout);
-    *running = false; 
+void T_halt(struct lc3_vm *vm) {
+    consoleFlush(vm);
+    vm->running = false; 
 }
 
 // TRAP_INU16
 // Take a uint16_t and store in R0
-void T_inu16(uint16_t *reg) { if(fscanf(stdin, "%hu", &reg[R0])); }
+void T_inu16(struct lc3_vm *vm) { inputReadU16(vm, &vm->reg[R0]); }
 
 // TRAP_INU16
 // Write a uint16_t stored in R0 and print it
-void T_outu16(uint16_t *reg) { fprintf(stdout, "%hu\n", reg[R0]); }
+void T_outu16(struct lc3_vm *vm)
+{
+    char text[8];
+    int n = snprintf(text, sizeof(text), "%hu\n", vm->reg[R0]);
+    consoleWrite(vm, text, n);
+    consoleEndTrap(vm);
+}
 
 
 // ===================================================================================
-// ========================== NOT IMPLEMENTED INSTRUCTIONS ===========================
+// ============================== INTERRUPT INSTRUCTIONS =============================
 // ===================================================================================
+// Enter the handler of an exception; without one the guest cannot go on
+static void exception(struct lc3_vm *vm, uint8_t vector, uint16_t instruction, const char *what)
+{
+    if (vm->memory[IVT_BASE + vector] == 0) {
+        guestFault(vm, "%s (0x%04X) at 0x%04X", what, instruction, (uint16_t)(vm->reg[RPC] - 1));
+        return;
+    }
+    interruptEnter(vm, vector, -1);
+}
 
 // ==================================== RTI ===========================================
-// Not implemented instruction
-void OP_RTI()
+// Return from an interrupt or exception handler: pop RPC and the PSR from the
+// supervisor stack, and go back to the user stack when the PSR says user mode.
+// Only allowed in supervisor mode (privilege mode exception).
+// 1000|000000000000
+void OP_RTI(struct lc3_vm *vm, uint16_t instruction)
 {
-    printf("RTI instruction is not implemented!\n");
-    abort();
+    uint16_t *reg = vm->reg;
+    if (vm->psr & PSR_USER) {
+        exception(vm, VEC_PRIVILEGE, instruction, "RTI in user mode");
+        return;
+    }
+    reg[RPC] = mem_read(vm, reg[R6]);
+    uint16_t psr = mem_read(vm, reg[R6] + 1);
+    reg[R6] += 2;
+    vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+    reg[RCND] = psr & 0x7;
+    if (psr & PSR_USER) {
+        vm->ssp = reg[R6];
+        reg[R6] = vm->usp;
+    }
+    // The priority may have dropped below a waiting request
+    if (vm->irq) interruptPoll(vm);
 }
 
 
 // ==================================== RES ===========================================
-// Not implemented instruction
-void OP_RES()
+// Reserved opcode: illegal opcode exception, or a breakpoint of the debugger
+void OP_RES(struct lc3_vm *vm, uint16_t instruction)
 {
-    printf("RES instruction is not implemented!\n");
-    abort();
+    if (vm->debug && debugBreak(vm)) return;
+    exception(vm, VEC_ILLEGAL, instruction, "Illegal opcode");
 }
 
 
@@ -389,126 +523,106 @@ void OP_RES()
 // ===================================================================================
 // ================================== RUN PROGRAM ====================================
 // ===================================================================================
-void programRun(uint16_t* memory)
+// Execute an instruction already fetched from memory (RPC points to the next one).
+// Shared by programRun and, through executeInstruction, by the engines that fall
+// back to single steps.
+static inline void execute(struct lc3_vm *vm, uint16_t instruction)
 {
-    // Register Initialization
-    uint16_t reg[REG_SIZE] = {0};
-    reg[RPC] = PC_START;
+    uint16_t op = instruction >> 12;
+
+    switch (op)
+    {
+    case op_add:
+        OP_ADD(vm, instruction);
+        break;
+    case op_and:
+        OP_AND(vm, instruction);
+        break;
+    case op_not:
+        OP_NOT(vm, instruction);
+        break;
+    case op_br:
+        OP_BR(vm, instruction);
+        break;
+    case op_jmp:
+        OP_JMP(vm, instruction);
+        break;
+    case op_jsr:
+        OP_JSR(vm, instruction);
+        break;
+    case op_ld:
+        OP_LD(vm, instruction);
+        break;
+    case op_ldi:
+        OP_LDI(vm, instruction);
+        break;
+    case op_ldr:
+        OP_LDR(vm, instruction);
+        break;
+    case op_lea:
+        OP_LEA(vm, instruction);
+        break;
+    case op_st:
+        OP_ST(vm, instruction);
+        break;
+    case op_sti:
+        OP_STI(vm, instruction);
+        break;
+    case op_str:
+        OP_STR(vm, instruction);
+        break;
+    case op_trap:
+        OP_TRAP(vm, instruction);
+        break;
+    case op_res:
+        OP_RES(vm, instruction);
+        break;
+    case op_rti:
+        OP_RTI(vm, instruction);
+        break;
+    default:
+        printf("Instruction not implemented\n");
+        abort();   
+    }
+}
+
+void executeInstruction(struct lc3_vm *vm, uint16_t instruction)
+{
+    execute(vm, instruction);
+}
 
-    // Start virtual machine
-    bool running = true;
+// Run from vm->reg[RPC] until HALT or until the budget is used up.
+// Return the number of retired instructions
+uint64_t programRun(struct lc3_vm *vm)
+{
+    uint64_t count = 0;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
 
-    while (running)
+    while (vm->running && count != limit)
     {
-        // printf("0x%04X: ", reg[RPC]);
-        uint16_t instruction = mem_read(memory, reg[RPC]++);
+        // printf("0x%04X: ", vm->reg[RPC]);
+        uint16_t instruction = mem_read(vm, vm->reg[RPC]++);
         // printf("0x%04X", instruction);
         // getchar();
         // printf("\n");
-        uint16_t op = instruction >> 12;
-
-        switch (op)
-        {
-        case op_add:
-            OP_ADD(reg, instruction);
-            break;
-        case op_and:
-            OP_AND(reg, instruction);
-            break;
-        case op_not:
-            OP_NOT(reg, instruction);
-            break;
-        case op_br:
-            OP_BR(reg, instruction);
-            break;
-        case op_jmp:
-            OP_JMP(reg, instruction);
-            break;
-        case op_jsr:
-            OP_JSR(reg, instruction);
-            break;
-        case op_ld:
-            OP_LD(reg, memory, instruction);
-            break;
-        case op_ldi:
-            OP_LDI(reg, memory, instruction);
-            break;
-        case op_ldr:
-            OP_LDR(reg, memory, instruction);
-            break;
-        case op_lea:
-            OP_LEA(reg, instruction);
-            break;
-        case op_st:
-            OP_ST(reg, memory, instruction);
-            break;
-        case op_sti:
-            OP_STI(reg, memory, instruction);
-            break;
-        case op_str:
-            OP_STR(reg, memory, instruction);
-            break;
-        case op_trap:
-            OP_TRAP(reg, memory, instruction, &running);
-            break;
-        case op_res:
-            OP_RES();
-            break;
-        case op_rti:
-            OP_RTI();
-            break;
-        default:
-            printf("Instruction not implemented\n");
-            abort();   
-        }
+        ++count;
+        ++vm->retired;
+        execute(vm, instruction);
     }
+
+    return count;
 }
 
 
 // ===================================================================================
 // ================================== RUN PROGRAM ====================================
 // ===================================================================================
-void loadProgram(char* fileName, uint16_t* memory)
+// Load a program file in any of the formats of image.h and return its entry point
+uint16_t loadProgram(const char *fileName, uint16_t *memory)
 {
-    // Open file
-    FILE *fileptr = fopen(fileName, "rb");
-    if (fileptr == NULL) {
-        fprintf(stderr, "Cannot open file %s\n", fileName);
-        abort();
-    }
-
-    // Find size of binary file in bit.
-    // To find the numbeer of 16 byte instruction
-    // we have to divide by 2 because 1 byte = 8 bit
-    fseek(fileptr, 0, SEEK_END);
-    size_t numInstr = ftell(fileptr) / 2;
-    rewind(fileptr);
-
-    // Allocate program memory
-    uint16_t *program = (uint16_t *)malloc(numInstr * sizeof(uint16_t));
-    if (program == NULL) {
-        fprintf(stderr, "Cannot allocate %ld bit\n", numInstr * sizeof(uint16_t));
-        free(program);
-        fclose(fileptr);
-        abort();
-    }
-
-    // Read file
-    size_t readElem = fread(program, sizeof(uint16_t), numInstr, fileptr);
-    if (readElem != numInstr) {
-        fprintf(stderr, "File not read properly\n");
-        fclose(fileptr);
-        free(program);
-        abort();
-    }
-
-    // Save program into memory array
-    for (size_t i = 0; i < numInstr; ++i) {
-        // printf("%zu: 0x%04X\n", i + 1, program[i]);
-        memory[PC_START + i] = program[i];
-    }
-
-    // Close file
-    fclose(fileptr);
-    free(program);
+    struct lc3_image *image = imageOpen(fileName);
+    imageCopy(image, memory);
+    uint16_t entry = image->entry;
+    imageClose(image);
+    return entry;
 }
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
 
 // MAIN MEMORY
 // Main memory, max 65535 instructions (128 kB)
@@ -27,58 +29,136 @@ enum flags {FP = 1 << 0, FZ = 1 << 1, FN = 1 << 2 };
 void update_flag(uint16_t *reg, enum regist r);
 
 
+// VM CONTEXT
+// Everything a guest needs to run, so a process can run many guests at once
+// (one per thread, see batch.h). Engines start from reg (RPC = PC_START after
+// vmReset, or the entry point returned by loadProgram) and save the registers
+// back when they stop.
+// - in/out: streams used by the TRAP routines (stdin/stdout by default), through
+//   the buffers of io (console.h). Change them with consoleAttach.
+// - budget: max retired instructions of a run, 0 for no limit. The switch engine
+//   stops exactly there, the others at the next control flow instruction.
+// - decode: decode cache of the decoded/threaded/fused engines (decode.h). It
+//   always matches memory: stores drop the entries they overwrite, and code that
+//   fills memory directly (loadProgram) must do it right after vmCreate/vmReset,
+//   when the cache is empty.
+// - dirty/origin: pages written since the VM was restored from the snapshot with
+//   id origin (snapshot.h, 0 for none). Every store marks its page.
+// - retired: instructions retired since vmReset, counted by the switch loop
+//   (and the profiling/tracing copies of it) for input record/replay (replay.h)
+// - bulk_start/bulk_size: words written by the last native trap that wrote a
+//   block of memory (trap.h), or pushed by an interrupt or exception entry. The
+//   jit and aot engines check them against their translated code and clear bulk_size.
+// - psr/ssp/usp: privilege and priority of the processor status register, and
+//   the saved supervisor and user stack pointers (interrupt.h). They are not
+//   in reg, so the engines that copy reg to locals never hold a stale copy.
+// - event/irq: interrupt requests may be waiting, tested on block boundaries,
+//   and the state of the interrupt sources (interrupt.h, NULL until the guest
+//   uses one)
+// - debug/watch: the debugger attached (debug.h) and its watched pages, NULL
+//   when there is none (when there are no watchpoints)
+// - fault: NULL, and a guest fault (unknown trap, exception without a handler)
+//   prints its error and aborts, like vm/main. A host that must outlive its
+//   guests (server.h) points it to a buffer of VM_FAULT_SIZE bytes: the fault
+//   is described there and the VM stops.
+#define PAGE_BITS 8                             // 256 words per page
+#define PAGE_WORDS (1 << PAGE_BITS)
+#define PAGE_COUNT (MEMORY_MAX >> PAGE_BITS)
+#define VM_FAULT_SIZE 128
+
+struct decoded;
+struct console;
+struct interrupts;
+struct lc3_debug;
+struct lc3_vm {
+    uint16_t memory[MEMORY_MAX];
+    uint16_t reg[REG_SIZE];
+    uint16_t psr, ssp, usp;
+    bool running;
+    FILE *in;
+    FILE *out;
+    struct console *io;
+    uint64_t budget;
+    struct decoded *decode;
+    uint8_t dirty[PAGE_COUNT];
+    uint64_t origin;
+    uint64_t retired;
+    uint16_t bulk_start;
+    uint16_t bulk_size;
+    atomic_bool event;
+    struct interrupts *irq;
+    struct lc3_debug *debug;
+    uint8_t *watch;
+    char *fault;
+};
+
+struct lc3_vm *vmCreate(void);
+void vmDestroy(struct lc3_vm *vm);  // flush pending output and free
+void vmReset(struct lc3_vm *vm);    // clear memory, registers and decode cache, keep streams and budget
+
+
 // OPERATIONS
 // operation are in the first 4 bits of a memory address
 // in total we have 2^4 = 16 operation
-void OP_BR(uint16_t *reg, uint16_t instruction);                    // 0x0 0000 Conditional Branch 
-void OP_ADD(uint16_t *reg, uint16_t instruction);                   // 0x1 0001 Addition
-void OP_LD(uint16_t *reg, uint16_t *memory, uint16_t instruction);  // 0x2 0010 Load RPC + offset
-void OP_ST(uint16_t *reg, uint16_t *memory, uint16_t instruction);  // 0x3 0011 Store
-void OP_JSR(uint16_t *reg, uint16_t instruction);                   // 0x4 0100 Jump to subrutine
-void OP_AND(uint16_t *reg, uint16_t instruction);                   // 0x5 0101 Bitwise and
-void OP_LDR(uint16_t *reg, uint16_t *memory, uint16_t instruction); // 0x6 0110 Load base + offset
-void OP_STR(uint16_t *reg, uint16_t *memory, uint16_t instruction); // 0x7 0111 Store base + offset
-void OP_RTI();                                                      // 0x8 1000 Return from intrrupt (not implemented)
-void OP_NOT(uint16_t *reg, uint16_t instruction);                   // 0x9 1001 Bitwise not
-void OP_LDI(uint16_t *reg, uint16_t *memory, uint16_t instruction); // 0xA 1010 Load Indirect
-void OP_STI(uint16_t *reg, uint16_t *memory, uint16_t instruction); // 0xB 1011 Store Indirect
-void OP_JMP(uint16_t *reg, uint16_t instruction);                   // 0xC 1100 Jump/return to subrutine
-void OP_RES();                                                      // 0xD 1101 Unused (not implemented)
-void OP_LEA(uint16_t *reg, uint16_t instruction);                   // 0xE 1110 Load effective address
-void OP_TRAP(uint16_t *reg, uint16_t *memory, 						// 0xF 1111 System trap/call
-			 uint16_t instruction, bool *running);					
+void OP_BR(struct lc3_vm *vm, uint16_t instruction);                // 0x0 0000 Conditional Branch 
+void OP_ADD(struct lc3_vm *vm, uint16_t instruction);               // 0x1 0001 Addition
+void OP_LD(struct lc3_vm *vm, uint16_t instruction);                // 0x2 0010 Load RPC + offset
+void OP_ST(struct lc3_vm *vm, uint16_t instruction);                // 0x3 0011 Store
+void OP_JSR(struct lc3_vm *vm, uint16_t instruction);               // 0x4 0100 Jump to subrutine
+void OP_AND(struct lc3_vm *vm, uint16_t instruction);               // 0x5 0101 Bitwise and
+void OP_LDR(struct lc3_vm *vm, uint16_t instruction);               // 0x6 0110 Load base + offset
+void OP_STR(struct lc3_vm *vm, uint16_t instruction);               // 0x7 0111 Store base + offset
+void OP_RTI(struct lc3_vm *vm, uint16_t instruction);               // 0x8 1000 Return from interrupt
+void OP_NOT(struct lc3_vm *vm, uint16_t instruction);               // 0x9 1001 Bitwise not
+void OP_LDI(struct lc3_vm *vm, uint16_t instruction);               // 0xA 1010 Load Indirect
+void OP_STI(struct lc3_vm *vm, uint16_t instruction);               // 0xB 1011 Store Indirect
+void OP_JMP(struct lc3_vm *vm, uint16_t instruction);               // 0xC 1100 Jump/return to subrutine
+void OP_RES(struct lc3_vm *vm, uint16_t instruction);               // 0xD 1101 Reserved (illegal opcode exception)
+void OP_LEA(struct lc3_vm *vm, uint16_t instruction);               // 0xE 1110 Load effective address
+void OP_TRAP(struct lc3_vm *vm, uint16_t instruction);              // 0xF 1111 System trap/call
 
 enum op {op_br = 0, op_add, op_ld, op_st, op_jsr, op_and, op_ldr, op_str, op_rti, op_not,
 		 op_ldi, op_sti, op_jmp, op_res, op_lea, op_trap};
 
 
 // TRAP FUNCTIONS
-void T_getc(uint16_t *reg);						// 0x20 Read a char from keyboard
-void T_out(uint16_t *reg);						// 0x21 Write a char to console
-void T_puts(uint16_t *reg, uint16_t *memory);	// 0x22 Write a string of chars to the console
-void T_in(uint16_t *reg);						// 0x23 Read a char from keyboard and print to console
-void T_putsp(uint16_t *reg, uint16_t *memory);	// 0x24 Output a byte string
-void T_halt(bool *running);						// 0x25 Halt the execution
-void T_inu16(uint16_t *reg);					// 0x26 Read a uint16_t from terminal
-void T_outu16(uint16_t *reg);					// 0x27 Write uint16_t
+void T_getc(struct lc3_vm *vm);					// 0x20 Read a char from keyboard
+void T_out(struct lc3_vm *vm);					// 0x21 Write a char to console
+void T_puts(struct lc3_vm *vm);					// 0x22 Write a string of chars to the console
+void T_in(struct lc3_vm *vm);					// 0x23 Read a char from keyboard and print to console
+void T_putsp(struct lc3_vm *vm);				// 0x24 Output a byte string
+void T_halt(struct lc3_vm *vm);					// 0x25 Halt the execution
+void T_inu16(struct lc3_vm *vm);				// 0x26 Read a uint16_t from terminal
+void T_outu16(struct lc3_vm *vm);				// 0x27 Write uint16_t
 
 enum traps {TRAP_GETC = 0x20, TRAP_OUT = 0x21, TRAP_PUTS = 0x22, 
 			TRAP_IN = 0x23, TRAP_PUTSP = 0x24, TRAP_HALT = 0x25,
-			TRAP_INU16 = 0x26, TRAP_OUTU16 = 0x27 };
+			TRAP_INU16 = 0x26, TRAP_OUTU16 = 0x27,
+			// native traps (trap.h)
+			TRAP_MEMCPY = 0x28, TRAP_MEMSET = 0x29, TRAP_STRLEN = 0x2A,
+			TRAP_STRCMP = 0x2B, TRAP_MUL = 0x2C, TRAP_DIV = 0x2D, TRAP_MOD = 0x2E,
+			TRAP_FREAD = 0x2F, TRAP_FWRITE = 0x30 };
 
 
 // MAPPED REGISTERS
 // Memory used for interact with special hardware. LC-3 has keyboard status
-// register (if a key is pressed) and keyboard data register (which key)
-enum {MR_KBSR = 0xFE00, MR_KBDR = 0xFE02};
+// register (if a key is pressed) and keyboard data register (which key), display
+// status and data registers and the machine control register (clear bit 15 to
+// halt). The timer status and interval registers and the processor status
+// register belong to the interrupt model (interrupt.h). Everything from MR_BASE up is the device region (device.h): a single
+// compare sends an access there, the rest of memory is plain RAM.
+enum {MR_BASE = 0xFE00, MR_KBSR = 0xFE00, MR_KBDR = 0xFE02,
+      MR_DSR = 0xFE04, MR_DDR = 0xFE06, MR_TSR = 0xFE08, MR_TIR = 0xFE0A,
+      MR_PSR = 0xFFFC, MR_MCR = 0xFFFE};
 
 
 // UTILS
 uint16_t sign_extend(uint16_t x, int bit_count);
-uint16_t mem_read(uint16_t *memory, uint16_t address);
-void mem_write(uint16_t *memory, uint16_t address, uint16_t val);
+uint16_t mem_read(struct lc3_vm *vm, uint16_t address);
+void mem_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
 
-void programRun(uint16_t* memory);
-void loadProgram(char* fileName, uint16_t* memory);
+void executeInstruction(struct lc3_vm *vm, uint16_t instruction);
+uint64_t programRun(struct lc3_vm *vm);
+uint16_t loadProgram(const char *fileName, uint16_t *memory);
 
 #endif
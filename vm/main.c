@@ -1,19 +1,277 @@
 #include "lc3vm.h"
-#include "lc3vm.h"
+#include "decode.h"
+#include "threaded.h"
+#include "fuse.h"
+#include "jit.h"
+#include "batch.h"
+#include "console.h"
+#include "profile.h"
+#include "trace.h"
+#include "replay.h"
+#include "optimize.h"
+#include "warp.h"
+#include "interrupt.h"
+#include "server.h"
+#include "debug.h"
+#include "perf.h"
 #include <stdint.h>
 #include <stdio.h>
-//#include <stdlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Engines that can execute a loaded program
+// report (optional) prints engine specific statistics after a run
+// reentrant engines keep all their state in the VM and can run in batch mode
+struct engine {
+    const char *name;
+    uint64_t (*run)(struct lc3_vm *vm);
+    void (*report)(uint64_t count);
+    bool reentrant;
+};
+
+static void reportFused(uint64_t count)
+{
+    fprintf(stderr, "fused: %llu of %llu dynamic instructions (%.1f%%)\n",
+            (unsigned long long)fused_instructions, (unsigned long long)count,
+            count ? 100.0 * fused_instructions / count : 0.0);
+}
+
+static void reportWarp(uint64_t count)
+{
+    (void)count;
+    warpReport(stderr, &warp_stats);
+}
+
+static const struct engine engines[] = {
+    {"switch",  programRun, NULL, true},                // reference interpreter
+    {"decoded", programRunDecoded, NULL, true},         // pre-decoded instruction cache
+    {"threaded", programRunThreaded, NULL, true},       // decode cache with computed goto dispatch
+    {"fused", programRunFused, reportFused, true},      // threaded with superinstructions
+    {"jit", programRunJit, jitReport, false},           // x86-64 basic block compiler
+    {"warp", programRunWarp, reportWarp, true},         // SIMD lockstep lanes, batches of the same program
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-e engine] [-s] [-O] [-b budget] [-u] [-p folded.txt] [-c] [-T trace.bin] [-R|-P input.log] [-D commands] [program.bin]\n", prog);
+    fprintf(stderr, "       %s [-e engine] [-b budget] [-t threads] -j jobs.txt\n", prog);
+    fprintf(stderr, "       %s [-e engine] [-b budget] [-t threads] -S socket [program.bin...]\n", prog);
+    fprintf(stderr, "  -e engine  execution engine:");
+    for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+        fprintf(stderr, " %s", engines[i].name);
+    fprintf(stderr, " (default %s)\n", engines[0].name);
+    fprintf(stderr, "  -s         print retired instructions and MIPS on stderr\n");
+    fprintf(stderr, "  -O         optimize the image before running it (see vm/lc3opt), print the summary on stderr\n");
+    fprintf(stderr, "  -b budget  stop a run after about budget instructions\n");
+    fprintf(stderr, "  -u         unbuffered console: flush after every output trap\n");
+    fprintf(stderr, "  -p file    run the profiling interpreter instead of the engine: print hot spots,\n");
+    fprintf(stderr, "             opcode mix and subroutines on stderr, folded call stacks to file\n");
+    fprintf(stderr, "  -c         run the counting interpreter instead of the engine: print host cycles,\n");
+    fprintf(stderr, "             instructions and branch and L1d misses per guest opcode on stderr\n");
+    fprintf(stderr, "             (perf_event_open, or rdtsc timing when there are no counters)\n");
+    fprintf(stderr, "  -T file    run the tracing interpreter instead of the engine: write every\n");
+    fprintf(stderr, "             retired instruction to file (print it with vm/lc3trace)\n");
+    fprintf(stderr, "  -R file    record every input the guest gets, with its instruction count, to file\n");
+    fprintf(stderr, "  -P file    replay the input recorded with -R instead of reading the terminal\n");
+    fprintf(stderr, "  -D file    run under the debugger, with the commands of file (/dev/tty: interactive)\n");
+    fprintf(stderr, "  -j jobs    run the jobs listed in a file (\"program.bin [input]\" per line)\n");
+    fprintf(stderr, "             in parallel, print their outputs in order and a throughput report\n");
+    fprintf(stderr, "  -S socket  serve run requests for the programs on a Unix socket (see vm/lc3client)\n");
+    fprintf(stderr, "  -t threads worker threads for -j and -S (default: one per CPU)\n");
+}
+
+// Run a job list and print the captured outputs in job order
+static int runBatch(const struct engine *engine, const char *jobList, int threads, uint64_t budget)
+{
+    if (!engine->reentrant) {
+        fprintf(stderr, "Engine %s cannot run in batch mode\n", engine->name);
+        return 1;
+    }
+
+    size_t njobs;
+    struct lc3_job *jobs = batchLoad(jobList, &njobs);
+    struct batch_report report;
+    batchRun(jobs, njobs, threads, engine->run, budget, &report);
+
+    for (size_t i = 0; i < njobs; ++i)
+        fwrite(jobs[i].output, 1, jobs[i].output_size, stdout);
+    fflush(stdout);
+    batchReport(&report);
+
+    batchFree(jobs, njobs);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const struct engine *engine = &engines[0];
+    char *fileName = "assembler/program.bin";
+    char *jobList = NULL;
+    char *socketPath = NULL;
+    char *folded = NULL;
+    char *traceFile = NULL;
+    char *inputFile = NULL;
+    char *debugFile = NULL;
+    bool counted = false;
+    bool replay = false;
+    bool stats = false;
+    bool optimize = false;
+    uint64_t budget = 0;
+    int threads = 0;
+    // A terminal gets each line as soon as it is complete
+    enum console_mode mode = isatty(STDOUT_FILENO) ? CONSOLE_LINE : CONSOLE_BUFFERED;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:sOb:up:cT:R:P:D:j:S:t:h")) != -1) {
+        switch (opt) {
+        case 'e':
+            engine = NULL;
+            for (size_t i = 0; i < sizeof(engines) / sizeof(engines[0]); ++i)
+                if (strcmp(optarg, engines[i].name) == 0) engine = &engines[i];
+            if (engine == NULL) {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'O':
+            optimize = true;
+            break;
+        case 'b':
+            budget = strtoull(optarg, NULL, 0);
+            break;
+        case 'u':
+            mode = CONSOLE_UNBUFFERED;
+            break;
+        case 'p':
+            folded = optarg;
+            break;
+        case 'c':
+            counted = true;
+            break;
+        case 'T':
+            traceFile = optarg;
+            break;
+        case 'R':
+        case 'P':
+            inputFile = optarg;
+            replay = opt == 'P';
+            break;
+        case 'D':
+            debugFile = optarg;
+            break;
+        case 'j':
+            jobList = optarg;
+            break;
+        case 'S':
+            socketPath = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) fileName = argv[optind];
+
+    if (jobList != NULL && (folded != NULL || counted || traceFile != NULL || inputFile != NULL || debugFile != NULL ||
+                            optimize)) {
+        fprintf(stderr, "-p, -c, -T, -R, -P, -D and -O cannot be used with -j\n");
+        return 1;
+    }
+    if (socketPath != NULL && (jobList != NULL || folded != NULL || counted || traceFile != NULL || inputFile != NULL ||
+                               debugFile != NULL || optimize)) {
+        fprintf(stderr, "-j, -p, -c, -T, -R, -P, -D and -O cannot be used with -S\n");
+        return 1;
+    }
+    if ((folded != NULL) + counted + (traceFile != NULL) + (debugFile != NULL) > 1) {
+        fprintf(stderr, "-p, -c, -T and -D cannot be used together\n");
+        return 1;
+    }
+    // Only the switch loop counts the retired instructions that time the input events,
+    // and the debugger drives it
+    if ((inputFile != NULL || debugFile != NULL) && engine != &engines[0]) {
+        fprintf(stderr, "-R, -P and -D need the %s engine\n", engines[0].name);
+        return 1;
+    }
+    if (jobList != NULL)
+        return runBatch(engine, jobList, threads, budget);
+    if (socketPath != NULL) {
+        if (!engine->reentrant) {
+            fprintf(stderr, "Engine %s cannot run in server mode\n", engine->name);
+            return 1;
+        }
+        if (optind < argc) return serverRun(socketPath, argv + optind, argc - optind, threads, engine->run, budget);
+        return serverRun(socketPath, &fileName, 1, threads, engine->run, budget);
+    }
+
+    // VM Initialization
+    struct lc3_vm *vm = vmCreate();
+    vm->budget = budget;
+    vm->io->mode = mode;
+    if (inputFile) vm->io->log = inputLogOpen(inputFile, replay);
 
-int main()
-{    
-    // Memory Initialization
-    uint16_t memory[MEMORY_MAX] = {0};
-    
     // Program load
-    loadProgram("assembler/program.bin", memory);
+    vm->reg[RPC] = loadProgram(fileName, vm->memory);
+    if (optimize) {
+        struct opt_report report;
+        optimizeImage(vm->memory, vm->reg[RPC], NULL, NULL, &report);
+        optimizeReport(stderr, &report);
+    }
+
+    // Program run. The profiler, the counters and the tracer are separate loops, so the engines never test for them.
+    struct lc3_profile *prof = folded ? profileCreate() : NULL;
+    struct lc3_perf *perf = counted ? perfCreate() : NULL;
+    struct lc3_trace *trace = traceFile ? traceOpen(traceFile) : NULL;
+    FILE *debug = NULL;
+    if (debugFile && (debug = fopen(debugFile, "r")) == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", debugFile);
+        abort();
+    }
+    const char *name = prof ? "profile" : perf ? "counters" : trace ? "trace" : debug ? "debug" : engine->name;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t count = prof ? programRunProfiled(vm, prof) : perf ? programRunCounted(vm, perf) : trace ? programRunTraced(vm, trace) :
+                     debug ? debugRun(vm, debug, fileName) : engine->run(vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    consoleFlush(vm);
+    if (debug) fclose(debug);
+
+    if (trace) traceClose(trace, stats);
+    if (vm->io->log) inputLogClose(vm->io->log, stats);
+
+    if (prof) {
+        FILE *out = fopen(folded, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot open file %s\n", folded);
+            abort();
+        }
+        profileFolded(prof, out);
+        fclose(out);
+        profileReport(prof, vm, stderr);
+        profileDestroy(prof);
+    }
+    if (perf) {
+        perfReport(perf, stderr);
+        perfDestroy(perf);
+    }
 
-    // Program run
-    programRun(memory);
+    if (stats) {
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        fprintf(stderr, "engine %s: %llu instructions in %.3f s, %.1f MIPS\n", name,
+                (unsigned long long)count, seconds, seconds > 0 ? count / seconds * 1e-6 : 0.0);
+        if (engine->report && name == engine->name) engine->report(count);
+        consoleReport(vm);
+        interruptReport(vm, stderr);
+    }
 
+    vmDestroy(vm);
     return 0;
 }
@@ -0,0 +1,762 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "disasm.h"
+#include "optimize.h"
+#include "interrupt.h"
+
+#define CC_NONE   0x8                       // RCND = 0: no instruction has set it yet
+#define CC_FLAGS  (FN | FZ | FP)
+#define CC_ANY    (CC_FLAGS | CC_NONE)
+#define LIVE_CC   0x100                     // RCND in a set of live registers
+#define LIVE_ALL  (0xFF | LIVE_CC)
+#define CHASE_MAX 16                        // branches followed by the threading
+
+// Why an instruction was taken out
+enum removal { KEPT = 0, NEVER_TAKEN, REDUNDANT, DEAD };
+
+// Changes to an instruction that stays
+enum change { FOLDED = 1, REWRITTEN = 2, THREADED = 4 };
+
+// What is known before an instruction, on every path that gets there
+struct state {
+    bool reached;
+    uint8_t known;                          // registers with a known value
+    int8_t ccreg;                           // RCND was set from this register, which has not changed since (-1 for none)
+    uint8_t cc;                             // the values RCND may have (FN, FZ, FP, CC_NONE)
+    uint16_t value[8];
+};
+
+struct optimizer {
+    uint16_t *memory;
+    uint16_t entry;
+    struct opt_report *report;
+    bool failed;
+    bool grew;                              // the analysis found words written by a store
+    uint8_t code[MEMORY_MAX];               // instructions found from the entry
+    uint8_t returns[MEMORY_MAX];            // return points, the words after a JSR
+    uint8_t stored[MEMORY_MAX];             // words a store may write
+    uint8_t reach[MEMORY_MAX];              // instructions still reachable after the changes
+    uint8_t removed[MEMORY_MAX];            // enum removal
+    uint8_t changes[MEMORY_MAX];            // enum change
+    uint16_t word[MEMORY_MAX];              // instruction, as changed
+    uint16_t target[MEMORY_MAX];            // BR/JSR: where it goes, an original address
+    uint16_t live[MEMORY_MAX];              // registers and RCND read after the instruction
+    uint16_t moved[MEMORY_MAX];             // new address of each kept instruction
+    uint16_t out[MEMORY_MAX];               // the new image
+    uint16_t work[2 * MEMORY_MAX + 1];
+    uint8_t queued[MEMORY_MAX];
+    struct state state[MEMORY_MAX];
+};
+
+static void fail(struct optimizer *o, const char *format, ...)
+{
+    if (o->failed) return;
+    o->failed = true;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(o->report->reason, sizeof(o->report->reason), format, args);
+    va_end(args);
+}
+
+
+// ===================================================================================
+// ================================== INSTRUCTIONS ===================================
+// ===================================================================================
+// Same as sign_extend of the VM
+static uint16_t sext(uint16_t x, int bits)
+{
+    return (x >> (bits - 1)) & 1 ? x | (0xFFFF << bits) : x;
+}
+
+static uint16_t pcRelative(uint16_t address, uint16_t w, int bits)
+{
+    return address + 1 + sext(w & ((1 << bits) - 1), bits);
+}
+
+static uint8_t flagsOf(uint16_t value)
+{
+    return value == 0 ? FZ : value >> 15 ? FN : FP;
+}
+
+static bool fallsThrough(uint16_t w)
+{
+    switch (w >> 12) {
+    case op_br:   return ((w >> 9) & 7) != 7;
+    case op_jmp:
+    case op_rti:
+    case op_res:  return false;
+    case op_trap: return (w & 0xFF) != TRAP_HALT;
+    default:      return true;
+    }
+}
+
+// ADD/AND/NOT/LD/LDI/LDR/LEA: they only set a register and RCND
+static bool setsRegister(uint16_t w)
+{
+    switch (w >> 12) {
+    case op_add: case op_and: case op_not: case op_ld: case op_ldi: case op_ldr: case op_lea:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// ADD R R 0x00, AND R R 0x1F, AND R R R: the register keeps its value
+static bool identity(uint16_t w)
+{
+    int d = (w >> 9) & 7, r1 = (w >> 6) & 7;
+    if (r1 != d) return false;
+    if ((w >> 12) == op_add) return (w & 0x3F) == 0x20;
+    if ((w >> 12) == op_and) return (w & 0x3F) == 0x3F || (w & 0x3F) == d;
+    return false;
+}
+
+// Registers (bits 0-7) and RCND (LIVE_CC) read and written
+static uint16_t uses(uint16_t w)
+{
+    int d = (w >> 9) & 7, r1 = (w >> 6) & 7, r2 = w & 7;
+    switch (w >> 12) {
+    case op_add:
+    case op_and: if ((w & 0xF03F) == 0x5020) return 0;   // AND R R 0x00
+                 return 1 << r1 | (w & 0x20 ? 0 : 1 << r2);
+    case op_not:
+    case op_ldr: return 1 << r1;
+    case op_st:
+    case op_sti: return 1 << d;
+    case op_str: return 1 << d | 1 << r1;
+    case op_br:  return LIVE_CC;
+    case op_ld:
+    case op_ldi:
+    case op_lea:
+    case op_jsr: return 0;
+    case op_jmp: return 1 << R7;
+    default:     return LIVE_ALL;           // traps may read anything
+    }
+}
+
+static uint16_t defs(uint16_t w)
+{
+    if (setsRegister(w)) return 1 << ((w >> 9) & 7) | LIVE_CC;
+    return (w >> 12) == op_jsr ? 1 << R7 : 0;
+}
+
+
+// ===================================================================================
+// ===================================== ANALYSIS ====================================
+// ===================================================================================
+// Instructions reachable from the entry, following every branch both ways
+static void discover(struct optimizer *o)
+{
+    int n = 0;
+    o->work[n++] = o->entry;
+    while (n > 0 && !o->failed) {
+        uint16_t a = o->work[--n];
+        if (o->code[a]) continue;
+        if (a >= MR_BASE) {
+            fail(o, "code in the device region at 0x%04X", a);
+            return;
+        }
+        uint16_t w = o->memory[a];
+        o->code[a] = 1;
+        o->word[a] = w;
+        switch (w >> 12) {
+        case op_br:
+            if ((w >> 9) & 7) o->work[n++] = o->target[a] = pcRelative(a, w, 9);
+            break;
+        case op_jsr:
+            if (!(w & 0x800)) fail(o, "JSRR at 0x%04X", a);
+            o->work[n++] = o->target[a] = pcRelative(a, w, 11);
+            o->returns[a + 1] = 1;
+            break;
+        case op_jmp:
+            if (((w >> 6) & 7) != R7) fail(o, "indirect jump at 0x%04X", a);
+            break;
+        }
+        if (fallsThrough(w)) o->work[n++] = a + 1;
+    }
+}
+
+// Value of a word that no store writes; false for the device region and for
+// written words. Reading code is a failure.
+static bool readCell(struct optimizer *o, uint16_t at, uint16_t address, uint16_t *value)
+{
+    if (o->code[address]) {
+        fail(o, "load at 0x%04X reads code at 0x%04X", at, address);
+        return false;
+    }
+    if (address >= MR_BASE || o->stored[address]) return false;
+    *value = o->memory[address];
+    return true;
+}
+
+static void store(struct optimizer *o, uint16_t at, uint16_t address, uint16_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        uint16_t x = address + i;
+        if (o->code[x]) {
+            fail(o, "store at 0x%04X writes code at 0x%04X", at, x);
+            return;
+        }
+        if (!o->stored[x]) o->grew = true;
+        o->stored[x] = 1;
+    }
+}
+
+// Record the words the instruction may write; an unknown address is a failure
+static void stores(struct optimizer *o, uint16_t a, uint16_t w, const struct state *s)
+{
+    int base = (w >> 6) & 7, dst = -1;
+    uint16_t pointer;
+    switch (w >> 12) {
+    case op_st:
+        store(o, a, pcRelative(a, w, 9), 1);
+        break;
+    case op_sti:
+        if (readCell(o, a, pcRelative(a, w, 9), &pointer)) store(o, a, pointer, 1);
+        else fail(o, "store at 0x%04X to an unknown address", a);
+        break;
+    case op_str:
+        if (s->known >> base & 1) store(o, a, s->value[base] + sext(w & 0x1FF, 6), 1);
+        else fail(o, "store at 0x%04X to an unknown address", a);
+        break;
+    case op_trap:
+        if ((w & 0xFF) == TRAP_MEMCPY || (w & 0xFF) == TRAP_MEMSET) dst = R0;
+        if ((w & 0xFF) == TRAP_FREAD) dst = R1;
+        if (dst < 0) break;
+        if ((s->known >> dst & 1) && (s->known >> R2 & 1)) store(o, a, s->value[dst], s->value[R2]);
+        else fail(o, "trap at 0x%04X writes memory at an unknown address", a);
+        break;
+    }
+}
+
+static void setResult(struct state *s, int r, bool known, uint16_t value)
+{
+    if (known) {
+        s->known |= 1 << r;
+        s->value[r] = value;
+        s->cc = flagsOf(value);
+    }
+    else {
+        s->known &= ~(1 << r);
+        s->cc = CC_FLAGS;
+    }
+    s->ccreg = r;
+}
+
+// A register changes without setting RCND
+static void clobber(struct state *s, int r)
+{
+    s->known &= ~(1 << r);
+    if (s->ccreg == r) s->ccreg = -1;
+}
+
+// State after the instruction at a (at the callee for a JSR)
+static struct state step(struct optimizer *o, uint16_t a, uint16_t w, struct state s)
+{
+    int d = (w >> 9) & 7, r1 = (w >> 6) & 7;
+    bool k1 = s.known >> r1 & 1, k2 = true, known;
+    uint16_t v1 = s.value[r1], v2, v = 0, pointer = 0;
+    switch (w >> 12) {
+    case op_add:
+    case op_and:
+        if (w & 0x20) v2 = sext(w & 0x1F, 5);
+        else k2 = s.known >> (w & 7) & 1, v2 = s.value[w & 7];
+        if ((w >> 12) == op_add) setResult(&s, d, k1 && k2, v1 + v2);
+        else if ((k1 && v1 == 0) || (k2 && v2 == 0)) setResult(&s, d, true, 0);
+        else setResult(&s, d, k1 && k2, v1 & v2);
+        break;
+    case op_not:
+        setResult(&s, d, k1, ~v1);
+        break;
+    case op_lea:
+        v = pcRelative(a, w, 9);
+        if (o->code[v]) fail(o, "LEA at 0x%04X takes the address of code", a);
+        setResult(&s, d, true, v);
+        break;
+    case op_ld:
+        known = readCell(o, a, pcRelative(a, w, 9), &v);
+        setResult(&s, d, known, v);
+        break;
+    case op_ldi:
+        known = readCell(o, a, pcRelative(a, w, 9), &pointer) && readCell(o, a, pointer, &v);
+        setResult(&s, d, known, v);
+        break;
+    case op_ldr:
+        known = k1 && readCell(o, a, v1 + sext(w & 0x3F, 6), &v);
+        setResult(&s, d, known, v);
+        break;
+    case op_jsr:
+        clobber(&s, R7);
+        s.known |= 1 << R7;
+        s.value[R7] = a + 1;
+        break;
+    case op_trap:
+        // R0 may be a result; RCND is set by some traps, never cleared
+        clobber(&s, R0);
+        s.cc |= CC_FLAGS;
+        s.ccreg = -1;
+        break;
+    }
+    return s;
+}
+
+// Keep only the RCND values in cc; RCND zero and known to come from a register makes it 0
+static struct state refine(struct state s, uint8_t cc)
+{
+    s.cc &= cc;
+    if (s.cc == FZ && s.ccreg >= 0) {
+        s.known |= 1 << s.ccreg;
+        s.value[s.ccreg] = 0;
+    }
+    return s;
+}
+
+static void propagate(struct optimizer *o, uint16_t a, struct state s, int *n)
+{
+    struct state *t = &o->state[a];
+    if (!t->reached) *t = s;
+    else {
+        uint8_t known = t->known & s.known;
+        for (int r = 0; r < 8; ++r)
+            if ((known >> r & 1) && t->value[r] != s.value[r]) known &= ~(1 << r);
+        int8_t ccreg = t->ccreg == s.ccreg ? s.ccreg : -1;
+        uint8_t cc = t->cc | s.cc;
+        if (known == t->known && ccreg == t->ccreg && cc == t->cc) return;
+        t->known = known;
+        t->ccreg = ccreg;
+        t->cc = cc;
+    }
+    t->reached = true;
+    if (!o->queued[a]) {
+        o->queued[a] = 1;
+        o->work[(*n)++] = a;
+    }
+}
+
+// Constant propagation to a fixed point. Words written by stores are not
+// constants, and stores depend on the constants, so it starts by taking no
+// word as written and runs again while it finds more of them.
+static void analyze(struct optimizer *o)
+{
+    do {
+        o->grew = false;
+        memset(o->state, 0, sizeof(o->state));
+        memset(o->queued, 0, sizeof(o->queued));
+        int n = 0;
+        struct state start = { .reached = true, .known = 0xFF, .ccreg = -1, .cc = CC_NONE };   // vmReset
+        propagate(o, o->entry, start, &n);
+
+        while (n > 0 && !o->failed) {
+            uint16_t a = o->work[--n];
+            o->queued[a] = 0;
+            struct state s = o->state[a];
+            uint16_t w = o->word[a];
+            stores(o, a, w, &s);
+            struct state next = step(o, a, w, s);
+
+            switch (w >> 12) {
+            case op_br: {
+                int nzp = (w >> 9) & 7;
+                struct state taken = refine(s, nzp), fall = refine(s, ~nzp & CC_ANY);
+                if (nzp == 7 && (s.cc & CC_NONE)) fail(o, "BR at 0x%04X may run before RCND is set", a);
+                if (nzp && taken.cc) propagate(o, o->target[a], taken, &n);
+                if (nzp != 7 && fall.cc) propagate(o, a + 1, fall, &n);
+                break;
+            }
+            case op_jsr: {
+                // The callee may change anything but cannot clear RCND
+                struct state back = { .reached = true, .known = 0, .ccreg = -1, .cc = s.cc | CC_FLAGS };
+                propagate(o, o->target[a], next, &n);
+                propagate(o, a + 1, back, &n);
+                break;
+            }
+            default:
+                if (fallsThrough(w)) propagate(o, a + 1, next, &n);
+                break;
+            }
+        }
+    } while (o->grew && !o->failed);
+}
+
+
+// ===================================================================================
+// ================================= TRANSFORMATIONS =================================
+// ===================================================================================
+static void foldBranches(struct optimizer *o)
+{
+    for (uint32_t a = 0; a < MR_BASE; ++a) {
+        uint16_t w = o->word[a];
+        if (!o->state[a].reached || (w >> 12) != op_br) continue;
+        int nzp = (w >> 9) & 7;
+        uint8_t cc = o->state[a].cc;
+        if (!(cc & nzp)) o->removed[a] = NEVER_TAKEN;
+        else if (!(cc & ~nzp & CC_ANY) && nzp != 7) {
+            o->word[a] = w | 0x0E00;
+            o->changes[a] |= FOLDED;
+        }
+    }
+}
+
+// Instructions that leave the register and RCND as they found them
+static void removeRedundant(struct optimizer *o)
+{
+    for (uint32_t a = 0; a < MR_BASE; ++a) {
+        uint16_t w = o->word[a];
+        const struct state *s = &o->state[a];
+        if (!s->reached || o->removed[a] || !setsRegister(w)) continue;
+        int d = (w >> 9) & 7;
+        struct state next = step(o, a, w, *s);
+        bool knownBefore = s->known >> d & 1, knownAfter = next.known >> d & 1;
+        bool sameValue = identity(w) || (knownBefore && knownAfter && s->value[d] == next.value[d]);
+        bool sameCC = s->ccreg == d || (knownBefore && s->cc == flagsOf(s->value[d]));
+        if (sameValue && sameCC) o->removed[a] = REDUNDANT;
+    }
+}
+
+// ADD/AND/NOT that read their own register to make a constant: make it from
+// another register with a known value, so the previous value may be dead
+static void rewriteConstants(struct optimizer *o)
+{
+    for (uint32_t a = 0; a < MR_BASE; ++a) {
+        uint16_t w = o->word[a];
+        const struct state *s = &o->state[a];
+        int op = w >> 12, d = (w >> 9) & 7;
+        if (!s->reached || o->removed[a] || (op != op_add && op != op_and && op != op_not)) continue;
+        bool readsOwn = ((w >> 6) & 7) == d || (op != op_not && !(w & 0x20) && (w & 7) == d);
+        if (op == op_and && (w & 0x3F) == 0x20) readsOwn = false;  // AND R R 0x00 only needs R, not its value
+        struct state next = step(o, a, w, *s);
+        if (!readsOwn || !(s->known >> d & 1) || !(next.known >> d & 1)) continue;
+
+        uint16_t k = next.value[d], rewrite = 0;
+        for (int r = 0; r < 8 && !rewrite; ++r) {
+            if (r == d || !(s->known >> r & 1)) continue;
+            uint16_t v = s->value[r], inverse = ~v;
+            int16_t diff = (int16_t)(k - v);
+            if (diff >= -16 && diff <= 15) rewrite = 0x1000 | d << 9 | r << 6 | 0x20 | (diff & 0x1F);
+            else if (inverse == k) rewrite = 0x9000 | d << 9 | r << 6 | 0x3F;
+            for (int imm = -16; imm <= 15 && !rewrite; ++imm)
+                if ((v & (uint16_t)imm) == k) rewrite = 0x5000 | d << 9 | r << 6 | 0x20 | (imm & 0x1F);
+        }
+        if (rewrite) {
+            o->word[a] = rewrite;
+            o->changes[a] |= REWRITTEN;
+        }
+    }
+}
+
+// Instructions reachable through the branches as they are now
+static void findReachable(struct optimizer *o)
+{
+    memset(o->reach, 0, sizeof(o->reach));
+    int n = 0;
+    o->work[n++] = o->entry;
+    while (n > 0) {
+        uint16_t a = o->work[--n];
+        if (o->reach[a]) continue;
+        o->reach[a] = 1;
+        uint16_t w = o->word[a];
+        if (o->removed[a]) {
+            o->work[n++] = a + 1;
+            continue;
+        }
+        if ((w >> 12) == op_br || (w >> 12) == op_jsr) o->work[n++] = o->target[a];
+        if (fallsThrough(w)) o->work[n++] = a + 1;
+    }
+}
+
+static bool fallsKept(struct optimizer *o, uint16_t a)
+{
+    return o->removed[a] || fallsThrough(o->word[a]);
+}
+
+// The first instruction left at or after a, where a jump to a lands
+static uint16_t firstKept(struct optimizer *o, uint16_t a)
+{
+    while (o->removed[a]) ++a;
+    return a;
+}
+
+static uint16_t liveIn(struct optimizer *o, uint16_t a)
+{
+    uint16_t w = o->word[a];
+    return o->removed[a] ? o->live[a] : uses(w) | (o->live[a] & ~defs(w));
+}
+
+// Registers read after each instruction. A call goes on at its target, and
+// a RET at every return point, so a callee leaves dead what its callers overwrite.
+static void liveness(struct optimizer *o)
+{
+    memset(o->live, 0, sizeof(o->live));
+    for (bool changed = true; changed; ) {
+        changed = false;
+        uint16_t back = 0;
+        for (uint32_t a = 0; a < MR_BASE; ++a)
+            if (o->reach[a] && o->returns[a]) back |= liveIn(o, a);
+        for (int32_t a = MR_BASE - 1; a >= 0; --a) {
+            if (!o->reach[a]) continue;
+            uint16_t w = o->word[a], out = 0;
+            if (o->removed[a]) out = liveIn(o, a + 1);
+            else if ((w >> 12) == op_jsr) out = liveIn(o, o->target[a]);
+            else if ((w >> 12) == op_jmp) out = back;
+            else {
+                if ((w >> 12) == op_br) out |= liveIn(o, o->target[a]);
+                if (fallsThrough(w)) out |= liveIn(o, a + 1);
+            }
+            if (out != o->live[a]) {
+                o->live[a] = out;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Loads that cannot reach a device register, so they can go
+static bool pureLoad(struct optimizer *o, uint16_t a, uint16_t w)
+{
+    const struct state *s = &o->state[a];
+    uint16_t pointer;
+    switch (w >> 12) {
+    case op_ld:  return pcRelative(a, w, 9) < MR_BASE;
+    case op_ldi: return readCell(o, a, pcRelative(a, w, 9), &pointer) && pointer < MR_BASE;
+    case op_ldr: return (s->known >> ((w >> 6) & 7) & 1) && (uint16_t)(s->value[(w >> 6) & 7] + sext(w & 0x3F, 6)) < MR_BASE;
+    default:     return true;
+    }
+}
+
+static void removeDead(struct optimizer *o)
+{
+    for (bool removed = true; removed; ) {
+        removed = false;
+        liveness(o);
+        for (uint32_t a = 0; a < MR_BASE; ++a) {
+            uint16_t w = o->word[a];
+            if (!o->reach[a] || o->removed[a] || !setsRegister(w) || (o->live[a] & defs(w))) continue;
+            if (!pureLoad(o, a, w)) continue;
+            o->removed[a] = DEAD;
+            removed = true;
+        }
+    }
+}
+
+// Branches and calls that land on an unconditional BR go to its target
+static void threadBranches(struct optimizer *o)
+{
+    for (uint32_t a = 0; a < MR_BASE; ++a) {
+        uint16_t w = o->word[a];
+        if (!o->reach[a] || o->removed[a] || ((w >> 12) != op_br && (w >> 12) != op_jsr)) continue;
+        uint16_t t = o->target[a];
+        for (int i = 0; i < CHASE_MAX; ++i) {
+            uint16_t f = firstKept(o, t), next = o->word[f];
+            if (f == a || (next >> 12) != op_br || ((next >> 9) & 7) != 7) break;
+            t = o->target[f];
+        }
+        if (t != o->target[a]) {
+            o->target[a] = t;
+            o->changes[a] |= THREADED;
+        }
+    }
+}
+
+
+// ===================================================================================
+// ====================================== LAYOUT =====================================
+// ===================================================================================
+// Words that keep their address: the entry point and the return points
+static bool pinned(struct optimizer *o, uint16_t a)
+{
+    return a == o->entry || o->returns[a];
+}
+
+// Pack the kept instructions of [start, end], a piece of straight line code that
+// may only move inside its words. A piece that falls into a pinned word and
+// starts at one needs a BR over the gap, so it is packed only when that
+// saves at least one more instruction.
+static void placePiece(struct optimizer *o, uint16_t start, uint16_t end, bool startPinned, bool endPinned)
+{
+    uint16_t length = end - start + 1, n = 0;
+    for (uint32_t a = start; a <= end; ++a) n += !o->removed[a];
+    bool bridge = startPinned && endPinned && n < length;
+    if (bridge && length - n < 2) {
+        for (uint32_t a = start; a <= end; ++a) {
+            if (o->removed[a] == NEVER_TAKEN) o->word[a] = 0x0000;
+            o->removed[a] = KEPT;
+        }
+        n = length;
+        bridge = false;
+    }
+
+    for (uint32_t a = start; a <= end; ++a) o->out[a] = 0x0000;
+    uint16_t at = endPinned && !startPinned ? end + 1 - n : start, placed = 0;
+    for (uint32_t a = start; a <= end; ++a) {
+        if (o->removed[a]) continue;
+        if (bridge && ++placed == n) at = end;      // the last one keeps falling into the pinned word
+        o->moved[a] = at++;
+    }
+    if (bridge) {
+        uint16_t from = start + (n ? n - 1 : 0), to = n ? end : end + 1;
+        o->out[from] = 0x0E00 | ((to - from - 1) & 0x1FF);
+        if (to - from - 1 > 255) fail(o, "piece at 0x%04X is too long to bridge", start);
+    }
+}
+
+// Split the code in chains of instructions that fall into each other, and the
+// chains in pieces at the pinned words
+static void layout(struct optimizer *o)
+{
+    memcpy(o->out, o->memory, sizeof(o->out));
+    for (uint32_t a = 0; a < MR_BASE; ++a)
+        if (o->code[a] && !o->reach[a]) o->out[a] = 0x0000;
+
+    for (uint32_t a = 0; a < MR_BASE; ) {
+        if (!o->reach[a] || (a > 0 && o->reach[a - 1] && fallsKept(o, a - 1))) {
+            ++a;
+            continue;
+        }
+        uint32_t end = a;
+        while (fallsKept(o, end)) ++end;
+        for (uint32_t start = a; start <= end; ) {
+            uint32_t last = start;
+            while (last < end && !pinned(o, last + 1)) ++last;
+            placePiece(o, start, last, pinned(o, start), last < end);
+            start = last + 1;
+        }
+        a = end + 1;
+    }
+}
+
+// Set the offset of bits of w to reach to from at
+static uint16_t encode(struct optimizer *o, uint16_t w, uint16_t at, uint16_t to, int bits, uint16_t original)
+{
+    int16_t offset = (int16_t)(to - at - 1);
+    if (offset < -(1 << (bits - 1)) || offset >= (1 << (bits - 1)))
+        fail(o, "offset of 0x%04X out of range after packing", original);
+    return (w & ~((1 << bits) - 1)) | (offset & ((1 << bits) - 1));
+}
+
+static void relocate(struct optimizer *o)
+{
+    for (uint32_t a = 0; a < MR_BASE; ++a) {
+        if (!o->reach[a] || o->removed[a]) continue;
+        uint16_t w = o->word[a], at = o->moved[a];
+        switch (w >> 12) {
+        case op_br:
+            if ((w >> 9) & 7) w = encode(o, w, at, o->moved[firstKept(o, o->target[a])], 9, a);
+            break;
+        case op_jsr:
+            w = encode(o, w, at, o->moved[firstKept(o, o->target[a])], 11, a);
+            break;
+        case op_ld: case op_ldi: case op_st: case op_sti: case op_lea:
+            w = encode(o, w, at, pcRelative(a, w, 9), 9, a);
+            break;
+        }
+        o->out[at] = w;
+    }
+}
+
+
+// ===================================================================================
+// ===================================== REPORT ======================================
+// ===================================================================================
+static void count(struct optimizer *o, FILE *log)
+{
+    struct opt_report *r = o->report;
+    static const char *why[] = { "", "never taken", "redundant", "dead" };
+    for (uint32_t a = 0; a < MR_BASE; ++a) {
+        if (!o->code[a]) continue;
+        char before[32], after[32];
+        disassemble(o->memory[a], before, sizeof(before));
+        if (!o->reach[a]) {
+            ++r->unreachable;
+            if (log) fprintf(log, "0x%04X  %-18s  removed: unreachable\n", a, before);
+            continue;
+        }
+        r->never_taken += o->removed[a] == NEVER_TAKEN;
+        r->redundant += o->removed[a] == REDUNDANT;
+        r->dead += o->removed[a] == DEAD;
+        r->folded += (o->changes[a] & FOLDED) && !o->removed[a];
+        r->rewritten += (o->changes[a] & REWRITTEN) && !o->removed[a];
+        r->threaded += (o->changes[a] & THREADED) && !o->removed[a];
+        if (log == NULL) continue;
+        if (o->removed[a]) fprintf(log, "0x%04X  %-18s  removed: %s\n", a, before, why[o->removed[a]]);
+        else if (o->changes[a]) {
+            disassemble(o->out[o->moved[a]], after, sizeof(after));
+            fprintf(log, "0x%04X  %-18s  -> 0x%04X  %-18s %s%s%s\n", a, before, o->moved[a], after,
+                    o->changes[a] & FOLDED ? " always taken" : "", o->changes[a] & REWRITTEN ? " constant" : "",
+                    o->changes[a] & THREADED ? " threaded" : "");
+        }
+    }
+    r->saved = r->never_taken + r->redundant + r->dead + r->unreachable;
+}
+
+void optimizeReport(FILE *out, const struct opt_report *r)
+{
+    if (!r->applied) {
+        fprintf(out, "optimizer: image left as it is: %s\n", r->reason);
+        return;
+    }
+    fprintf(out, "optimizer: %d instructions, %d removed (%d never taken branches, %d redundant, %d dead, %d unreachable)\n",
+            r->instructions, r->saved, r->never_taken, r->redundant, r->dead, r->unreachable);
+    fprintf(out, "optimizer: %d branches always taken, %d threaded, %d constants built from other registers\n",
+            r->folded, r->threaded, r->rewritten);
+}
+
+
+// ===================================================================================
+// ==================================== OPTIMIZER ====================================
+// ===================================================================================
+// Interrupt handlers are not reached from the entry and may change registers and
+// memory between any two blocks: an image with a handler in the vector table, or
+// that stores one there, is left alone
+static void interrupts(struct optimizer *o)
+{
+    for (uint16_t a = IVT_BASE; a < IVT_BASE + 0x100; ++a)
+        if (o->memory[a] != 0 || o->stored[a]) {
+            fail(o, "interrupt vector 0x%02X is set", a - IVT_BASE);
+            return;
+        }
+}
+
+bool optimizeImage(uint16_t *memory, uint16_t entry, FILE *log, uint16_t *map, struct opt_report *report)
+{
+    struct optimizer *o = calloc(1, sizeof(struct optimizer));
+    if (o == NULL) {
+        fprintf(stderr, "Cannot allocate the optimizer\n");
+        abort();
+    }
+    memset(report, 0, sizeof(*report));
+    o->memory = memory;
+    o->entry = entry;
+    o->report = report;
+
+    discover(o);
+    if (!o->failed) analyze(o);
+    if (!o->failed) interrupts(o);
+    if (!o->failed) {
+        for (uint32_t a = 0; a < MR_BASE; ++a) report->instructions += o->state[a].reached;
+        foldBranches(o);
+        removeRedundant(o);
+        rewriteConstants(o);
+        findReachable(o);
+        removeDead(o);
+        threadBranches(o);
+        findReachable(o);
+        layout(o);
+        relocate(o);
+    }
+
+    if (!o->failed) {
+        count(o, log);
+        for (uint32_t a = 0; map && a < MEMORY_MAX; ++a)
+            map[a] = a < MR_BASE && o->reach[a] ? o->moved[firstKept(o, a)] : a;
+        memcpy(memory, o->out, sizeof(o->out));
+        report->applied = true;
+    }
+    free(o);
+    return report->applied;
+}
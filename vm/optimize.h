@@ -0,0 +1,61 @@
+#ifndef H_OPTIMIZE
+#define H_OPTIMIZE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// IMAGE OPTIMIZER
+// Rewrite a loaded image into an equivalent one that retires fewer
+// instructions, so every engine benefits, the switch loop included.
+// The analysis follows the control flow from the entry point (BR, JSR, RET,
+// HALT) and propagates constants through the registers and RCND, starting from
+// the state of vmReset (registers 0, RCND 0). Then it:
+// - folds branches: a BR that can never be taken is removed, one that is always
+//   taken becomes unconditional, and code only reached through them is dropped
+// - removes instructions that set a register and RCND to the values they
+//   already hold (ADD R1 R1 0x00 after RCND was set from R1), and instructions
+//   whose register and RCND are both overwritten before being read
+// - rewrites constant loads (AND R3 R3 0x00 / ADD R3 R3 0x0F) to build the
+//   value from a register known to hold a constant (ADD R3 R2 0x0F when R2 is
+//   0), so the first instruction is removed as dead
+// - threads branches that land on an unconditional BR to its target
+// The blocks are then packed into fewer words, and PC relative offsets are
+// encoded again. Return points (the word after a JSR) and the entry point
+// stay where they are, so R7 holds the same values as in the original image.
+//
+// The image is only rewritten when the analysis proves it does not modify or
+// inspect its code: every store (ST, STI, STR, the native traps that write
+// memory) must have a known address outside the code, every load with a known
+// address must read data, no LEA may take the address of code, and every jump
+// must have a known target (no JMP other than RET, no JSRR, whose target in
+// this VM depends on its own address). Otherwise the report says why and the
+// image is left alone. Loads through pointers the analysis cannot follow are
+// assumed to read data. JMP R7 is taken to return after a JSR. Images that set
+// an interrupt vector (interrupt.h) are left alone too.
+
+struct opt_report {
+    bool applied;
+    char reason[96];            // why the image was left alone
+    int instructions;           // reachable instructions found
+    int folded;                 // branches made unconditional
+    int never_taken;            // branches removed
+    int redundant;              // instructions that did not change anything
+    int rewritten;              // constant loads built from another register
+    int dead;                   // instructions whose results were never read
+    int threaded;               // branches sent straight to the final target
+    int unreachable;            // words of code left unreachable by folding
+    int saved;                  // instructions removed from the code
+};
+
+// Optimize the image in memory (entry is its entry point). With log, write
+// one line per change. With map, fill it with the new address of every
+// original address (unchanged for data). Return report->applied.
+bool optimizeImage(uint16_t *memory, uint16_t entry, FILE *log, uint16_t *map, struct opt_report *report);
+
+// Summary of a report, a few lines
+void optimizeReport(FILE *out, const struct opt_report *report);
+
+#endif
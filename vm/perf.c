@@ -0,0 +1,276 @@
+#define _GNU_SOURCE                     // F_SETSIG, F_SETOWN_EX
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "lc3vm.h"
+#include "disasm.h"
+#include "perf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CLOCK_UNIT "TSC ticks"
+static inline uint64_t clockTicks(void)
+{
+    return __rdtsc();
+}
+#else
+#define CLOCK_UNIT "ns"
+static inline uint64_t clockTicks(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+#endif
+
+// Periods are prime, so the overflows do not lock onto a loop of the guest
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    uint64_t period;
+} events[PERF_EVENTS] = {
+    [PERF_CYCLES]        = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 100003},
+    [PERF_INSTRUCTIONS]  = {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 100003},
+    [PERF_BRANCH_MISSES] = {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 1009},
+    [PERF_L1D_MISSES]    = {"L1d-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), 1009},
+};
+
+// The measured run, for the signal handler
+static struct lc3_perf *sampled;
+
+
+// ===================================================================================
+// ===================================== COUNTERS ====================================
+// ===================================================================================
+// An overflow: charge it to the opcode being executed and arm the next one
+static void overflow(int sig, siginfo_t *info, void *context)
+{
+    (void)sig;
+    (void)context;
+    struct lc3_perf *perf = sampled;
+    if (perf == NULL) return;
+    for (int e = 0; e < PERF_EVENTS; ++e)
+        if (perf->fd[e] == info->si_fd) {
+            ++perf->samples[e][perf->op & 0xF];
+            ioctl(perf->fd[e], PERF_EVENT_IOC_REFRESH, 1);
+        }
+}
+
+static int openCounter(int e)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[e].type;
+    attr.config = events[e].config;
+    attr.sample_period = events[e].period;
+    attr.wakeup_events = 1;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) return -1;
+
+    // The overflow signal goes to this thread, with the descriptor in si_fd. It is
+    // a realtime signal: those queue, where two overflows would make one SIGIO and
+    // the counter whose signal is lost would never be refreshed.
+    struct f_owner_ex owner = { F_OWNER_TID, (pid_t)syscall(SYS_gettid) };
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGRTMIN) != 0 ||
+        fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Clock ticks of two back to back reads, the least of a few tries
+static uint64_t clockOverhead(void)
+{
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 1000; ++i) {
+        uint64_t start = clockTicks();
+        uint64_t ticks = clockTicks() - start;
+        if (ticks < best) best = ticks;
+    }
+    return best;
+}
+
+struct lc3_perf *perfCreate(void)
+{
+    struct lc3_perf *perf = calloc(1, sizeof(struct lc3_perf));
+    if (perf == NULL) {
+        fprintf(stderr, "Cannot allocate the host counters\n");
+        abort();
+    }
+    for (int e = 0; e < PERF_EVENTS; ++e)
+        perf->fd[e] = -1;
+    perf->overhead = clockOverhead();
+
+    perf->fd[PERF_CYCLES] = openCounter(PERF_CYCLES);
+    if (perf->fd[PERF_CYCLES] < 0) {
+        snprintf(perf->why, sizeof(perf->why), "perf_event_open cycles: %s", strerror(errno));
+        return perf;
+    }
+    for (int e = PERF_CYCLES + 1; e < PERF_EVENTS; ++e)
+        perf->fd[e] = openCounter(e);      // optional, not every PMU has them
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = overflow;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGRTMIN, &action, NULL);
+    perf->counters = true;
+    return perf;
+}
+
+void perfDestroy(struct lc3_perf *perf)
+{
+    for (int e = 0; e < PERF_EVENTS; ++e)
+        if (perf->fd[e] >= 0) close(perf->fd[e]);
+    if (perf->counters) signal(SIGRTMIN, SIG_DFL);
+    free(perf);
+}
+
+static void startCounters(struct lc3_perf *perf)
+{
+    sampled = perf;
+    for (int e = 0; e < PERF_EVENTS; ++e)
+        if (perf->fd[e] >= 0) {
+            ioctl(perf->fd[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf->fd[e], PERF_EVENT_IOC_REFRESH, 1);
+        }
+}
+
+static void stopCounters(struct lc3_perf *perf)
+{
+    for (int e = 0; e < PERF_EVENTS; ++e) {
+        if (perf->fd[e] < 0) continue;
+        ioctl(perf->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value;
+        if (read(perf->fd[e], &value, sizeof(value)) == sizeof(value)) perf->total[e] += value;
+    }
+    sampled = NULL;
+}
+
+
+// ===================================================================================
+// ================================== COUNTED RUN ====================================
+// ===================================================================================
+// The loop of programRun. Without counters every PERF_TIMING_PERIOD-th
+// instruction is timed; with them the countdown never ends.
+uint64_t programRunCounted(struct lc3_vm *vm, struct lc3_perf *perf)
+{
+    uint64_t count = 0;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
+    uint64_t countdown = perf->counters ? UINT64_MAX : PERF_TIMING_PERIOD;
+
+    if (perf->counters) startCounters(perf);
+    uint64_t start = clockTicks();
+    while (vm->running && count != limit)
+    {
+        uint16_t instruction = mem_read(vm, vm->reg[RPC]++);
+        uint16_t op = instruction >> 12;
+        ++count;
+        ++vm->retired;
+        ++perf->executed[op];
+        perf->op = op;
+
+        if (--countdown == 0) {
+            countdown = PERF_TIMING_PERIOD;
+            uint64_t t = clockTicks();
+            executeInstruction(vm, instruction);
+            t = clockTicks() - t;
+            perf->ticks[op] += t > perf->overhead ? t - perf->overhead : 0;
+            ++perf->timed[op];
+        }
+        else executeInstruction(vm, instruction);
+    }
+    perf->elapsed += clockTicks() - start;
+    if (perf->counters) stopCounters(perf);
+    return count;
+}
+
+
+// ===================================================================================
+// ===================================== REPORT ======================================
+// ===================================================================================
+// Share of the total of counter e charged to op, per instruction of op; -1 without samples
+static double perInstruction(const struct lc3_perf *perf, int e, int op)
+{
+    uint64_t samples = 0;
+    for (int k = 0; k < 16; ++k)
+        samples += perf->samples[e][k];
+    if (perf->fd[e] < 0 || samples == 0 || perf->executed[op] == 0) return -1;
+    return (double)perf->total[e] * perf->samples[e][op] / samples / perf->executed[op];
+}
+
+static void column(FILE *out, double value, const char *format)
+{
+    if (value < 0) fprintf(out, " %10s", "-");
+    else fprintf(out, format, value);
+}
+
+void perfReport(const struct lc3_perf *perf, FILE *out)
+{
+    uint64_t instructions = 0;
+    for (int op = 0; op < 16; ++op)
+        instructions += perf->executed[op];
+    if (instructions == 0) return;
+
+    if (perf->counters) {
+        fprintf(out, "host counters: perf_event_open, user space, sampled on overflow\n");
+        for (int e = 0; e < PERF_EVENTS; ++e)
+            if (perf->fd[e] >= 0)
+                fprintf(out, "  %-14s %14llu  %8.2f per guest instruction\n", events[e].name,
+                        (unsigned long long)perf->total[e], (double)perf->total[e] / instructions);
+            else fprintf(out, "  %-14s %14s\n", events[e].name, "unavailable");
+        if (perf->total[PERF_CYCLES])
+            fprintf(out, "  host IPC %.2f\n", (double)perf->total[PERF_INSTRUCTIONS] / perf->total[PERF_CYCLES]);
+    }
+    else {
+        fprintf(out, "host timing: %s, one instruction in %d timed (%s)\n", CLOCK_UNIT,
+                PERF_TIMING_PERIOD, perf->why);
+        fprintf(out, "  %llu %s, %.2f per guest instruction (clock read %llu)\n",
+                (unsigned long long)perf->elapsed, CLOCK_UNIT, (double)perf->elapsed / instructions,
+                (unsigned long long)perf->overhead);
+    }
+
+    fprintf(out, "%-5s %14s %7s %10s %10s %10s %10s\n", "op", "executed", "share",
+            perf->counters ? "cycles" : "ticks", "host ins", "br-miss %", "L1d-miss");
+    for (int op = 0; op < 16; ++op) {
+        if (perf->executed[op] == 0) continue;
+        fprintf(out, "%-5s %14llu %6.2f%%", opcodeName(op), (unsigned long long)perf->executed[op],
+                100.0 * perf->executed[op] / instructions);
+        if (perf->counters) {
+            column(out, perInstruction(perf, PERF_CYCLES, op), " %10.2f");
+            column(out, perInstruction(perf, PERF_INSTRUCTIONS, op), " %10.2f");
+            double misses = perInstruction(perf, PERF_BRANCH_MISSES, op);
+            column(out, misses < 0 ? -1 : 100 * misses, " %10.2f");
+            column(out, perInstruction(perf, PERF_L1D_MISSES, op), " %10.3f");
+        }
+        else {
+            column(out, perf->timed[op] ? (double)perf->ticks[op] / perf->timed[op] : -1, " %10.2f");
+            column(out, -1, "");
+            column(out, -1, "");
+            column(out, -1, "");
+        }
+        fprintf(out, "\n");
+    }
+    fprintf(out, "(per guest instruction of the opcode; br-miss %% counts all branch misses, mostly the dispatch jump)\n");
+}
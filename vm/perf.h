@@ -0,0 +1,54 @@
+#ifndef H_PERF
+#define H_PERF
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// HOST COUNTERS
+// programRunCounted is a copy of the programRun loop that measures what each
+// guest opcode costs the host. It dispatches through executeInstruction, the
+// same switch as programRun, and stores the opcode it is executing in op.
+// - With perf_event_open (Linux, a PMU the process may use), the counters of
+//   perf_events run around the loop for the calling thread, user space only.
+//   Each one overflows every period events and the overflow signal adds a
+//   sample to the bucket of the opcode being executed, so the total of a
+//   counter is split among the opcodes in proportion to their samples.
+//   Without a cycles counter nothing is opened.
+// - Otherwise (containers, VMs without a virtual PMU, other systems) one
+//   instruction in PERF_TIMING_PERIOD is timed with rdtsc (clock_gettime off
+//   x86), minus the cost of reading the clock, into the bucket of its opcode.
+// The report shows for each opcode its share of the retired instructions,
+// host cycles (or TSC ticks) per instruction, and with counters host
+// instructions, branch misses (mostly the indirect jump of the dispatch
+// switch) and L1d read misses per instruction.
+enum perf_event_id { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_L1D_MISSES, PERF_EVENTS };
+#define PERF_TIMING_PERIOD 61           // prime, so loops do not always time the same instruction
+
+struct lc3_perf {
+    volatile sig_atomic_t op;           // opcode being executed, read by the overflow signal
+    bool counters;                      // perf_event_open, else rdtsc timing
+    int fd[PERF_EVENTS];                // -1 for a counter that cannot be opened
+    uint64_t total[PERF_EVENTS];        // read when the loop ends
+    uint64_t samples[PERF_EVENTS][16];  // overflows by opcode
+    uint64_t executed[16];              // retired instructions by opcode
+    uint64_t ticks[16], timed[16];      // rdtsc timing
+    uint64_t elapsed;                   // clock ticks of the whole loop
+    uint64_t overhead;                  // clock ticks of reading the clock twice
+    char why[128];                      // why there are no counters
+};
+
+// Open the counters, or get the timing fallback ready. One at a time per process.
+struct lc3_perf *perfCreate(void);
+void perfDestroy(struct lc3_perf *perf);
+
+// Same as programRun, measuring into perf. Runs keep adding to the same buckets.
+uint64_t programRunCounted(struct lc3_vm *vm, struct lc3_perf *perf);
+
+// Per opcode table and totals
+void perfReport(const struct lc3_perf *perf, FILE *out);
+
+#endif
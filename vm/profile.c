@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "disasm.h"
+#include "profile.h"
+
+#define HASH_SIZE (2 * PROFILE_NODES)   // power of two, at most half full
+#define HOT_SPOTS 20                    // lines of each table of the report
+
+// ===================================================================================
+// ================================== CALL TREE ======================================
+// ===================================================================================
+struct lc3_profile *profileCreate(void)
+{
+    struct lc3_profile *prof = calloc(1, sizeof(struct lc3_profile));
+    struct profile_node *nodes = malloc(PROFILE_NODES * sizeof(struct profile_node));
+    uint32_t *children = calloc(HASH_SIZE, sizeof(uint32_t));
+    if (prof == NULL || nodes == NULL || children == NULL) {
+        fprintf(stderr, "Cannot allocate profiler\n");
+        abort();
+    }
+    prof->nodes = nodes;
+    prof->children = children;
+
+    // The root stands for the code outside any subroutine, its entry is set by the first run
+    prof->nodes[0] = (struct profile_node){ 0, PC_START, 0, 0, 0 };
+    prof->nnodes = 1;
+    prof->stack[0] = (struct profile_frame){ 0, 0 };
+    prof->depth = 1;
+    return prof;
+}
+
+void profileDestroy(struct lc3_profile *prof)
+{
+    free(prof->nodes);
+    free(prof->children);
+    free(prof);
+}
+
+static inline uint32_t hash(uint32_t parent, uint16_t entry)
+{
+    return ((parent * 0x9E3779B1u) ^ (entry * 0x85EBCA6Bu)) & (HASH_SIZE - 1);
+}
+
+// Node for a call of entry from node parent, created on the first call.
+// When the tree is full the callee is charged to the caller.
+static uint32_t child(struct lc3_profile *prof, uint32_t parent, uint16_t entry)
+{
+    uint32_t h = hash(parent, entry);
+    for (uint32_t slot; (slot = prof->children[h]) != 0; h = (h + 1) & (HASH_SIZE - 1)) {
+        struct profile_node *node = &prof->nodes[slot - 1];
+        if (node->parent == parent && node->entry == entry) return slot - 1;
+    }
+    if (prof->nnodes == PROFILE_NODES) {
+        ++prof->lost;
+        return parent;
+    }
+
+    uint32_t id = prof->nnodes++;
+    prof->nodes[id] = (struct profile_node){ parent, entry, prof->nodes[parent].depth + 1, 0, 0 };
+    prof->children[h] = id + 1;
+    return id;
+}
+
+// JSR/JSRR to entry, returning to ret
+static void call(struct lc3_profile *prof, uint16_t entry, uint16_t ret)
+{
+    if (prof->depth == PROFILE_DEPTH) {
+        ++prof->lost;
+        return;
+    }
+    uint32_t node = child(prof, prof->stack[prof->depth - 1].node, entry);
+    ++prof->nodes[node].calls;
+    prof->stack[prof->depth++] = (struct profile_frame){ node, ret };
+}
+
+// JMP to target: a return when target is the return address of a frame on the
+// stack. Frames above it returned without going through their own return address.
+static void jump(struct lc3_profile *prof, uint16_t target)
+{
+    for (uint32_t i = prof->depth - 1; i > 0; --i)
+        if (prof->stack[i].ret == target) {
+            prof->depth = i;
+            return;
+        }
+}
+
+
+// ===================================================================================
+// ================================ PROFILED RUN =====================================
+// ===================================================================================
+// The loop of programRun, with the bookkeeping around each instruction
+uint64_t programRunProfiled(struct lc3_vm *vm, struct lc3_profile *prof)
+{
+    uint64_t count = 0;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
+    if (prof->instructions == 0) prof->nodes[0].entry = vm->reg[RPC];
+
+    while (vm->running && count != limit)
+    {
+        uint16_t pc = vm->reg[RPC];
+        uint16_t instruction = mem_read(vm, vm->reg[RPC]++);
+        uint16_t op = instruction >> 12;
+        ++count;
+        ++vm->retired;
+
+        ++prof->count[pc];
+        ++prof->opcode[op];
+        ++prof->nodes[prof->stack[prof->depth - 1].node].self;
+        if (op == op_trap) ++prof->trap[instruction & 0xFF];
+
+        executeInstruction(vm, instruction);
+
+        if (op == op_jsr) call(prof, vm->reg[RPC], vm->reg[R7]);
+        else if (op == op_jmp) jump(prof, vm->reg[RPC]);
+    }
+
+    prof->instructions += count;
+    return count;
+}
+
+
+// ===================================================================================
+// =================================== REPORTS =======================================
+// ===================================================================================
+static const uint64_t *sortKey;
+
+// Indices by decreasing sortKey[index]
+static int byCount(const void *a, const void *b)
+{
+    uint64_t x = sortKey[*(const uint32_t *)a], y = sortKey[*(const uint32_t *)b];
+    return (x < y) - (x > y);
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+// Per subroutine entry: calls, instructions run inside it (inclusive, counted
+// once per stack even in recursion) and in its own code (exclusive)
+static void subroutines(const struct lc3_profile *prof, uint64_t *calls,
+                        uint64_t *inclusive, uint64_t *exclusive)
+{
+    uint32_t *seen = calloc(MEMORY_MAX, sizeof(uint32_t));  // last node that counted an entry
+    if (seen == NULL) {
+        fprintf(stderr, "Cannot allocate profiler report\n");
+        abort();
+    }
+    for (uint32_t n = 0; n < prof->nnodes; ++n) {
+        const struct profile_node *node = &prof->nodes[n];
+        calls[node->entry] += node->calls;
+        exclusive[node->entry] += node->self;
+        if (node->self == 0) continue;
+        for (uint32_t a = n;; a = prof->nodes[a].parent) {
+            uint16_t entry = prof->nodes[a].entry;
+            if (seen[entry] != n + 1) {
+                seen[entry] = n + 1;
+                inclusive[entry] += node->self;
+            }
+            if (a == 0) break;
+        }
+    }
+    free(seen);
+}
+
+void profileReport(const struct lc3_profile *prof, const struct lc3_vm *vm, FILE *out)
+{
+    uint64_t total = prof->instructions;
+    uint32_t *order = malloc(MEMORY_MAX * sizeof(uint32_t));
+    uint64_t *calls = calloc(3 * MEMORY_MAX, sizeof(uint64_t));
+    if (order == NULL || calls == NULL) {
+        fprintf(stderr, "Cannot allocate profiler report\n");
+        abort();
+    }
+    uint64_t *inclusive = calls + MEMORY_MAX, *exclusive = inclusive + MEMORY_MAX;
+
+    fprintf(out, "profile: %llu instructions, %u call stacks",
+            (unsigned long long)total, prof->nnodes);
+    if (prof->lost) fprintf(out, ", %llu calls not recorded", (unsigned long long)prof->lost);
+    fprintf(out, "\n");
+
+    // Hottest addresses, with the word found there at the end of the run
+    uint32_t n = 0;
+    for (uint32_t address = 0; address < MEMORY_MAX; ++address)
+        if (prof->count[address]) order[n++] = address;
+    sortKey = prof->count;
+    qsort(order, n, sizeof(uint32_t), byCount);
+    fprintf(out, "\nhot spots:\n  address        count       %%  instruction\n");
+    for (uint32_t i = 0; i < n && i < HOT_SPOTS; ++i) {
+        char text[32];
+        disassemble(vm->memory[order[i]], text, sizeof(text));
+        fprintf(out, "   0x%04X %12llu  %5.1f%%  %s\n", order[i],
+                (unsigned long long)prof->count[order[i]], percent(prof->count[order[i]], total), text);
+    }
+
+    fprintf(out, "\nopcodes:\n");
+    for (unsigned op = 0; op < 16; ++op)
+        if (prof->opcode[op])
+            fprintf(out, "   %-8s %12llu  %5.1f%%\n", opcodeName(op),
+                    (unsigned long long)prof->opcode[op], percent(prof->opcode[op], total));
+
+    fprintf(out, "\ntraps:\n");
+    for (unsigned vector = 0; vector < 256; ++vector)
+        if (prof->trap[vector]) {
+            char name[8];
+            snprintf(name, sizeof(name), "%s", trapName(vector) ? trapName(vector) : "");
+            if (name[0] == '\0') snprintf(name, sizeof(name), "0x%02X", vector);
+            fprintf(out, "   %-8s %12llu\n", name, (unsigned long long)prof->trap[vector]);
+        }
+
+    // Subroutines by inclusive instructions; the root is the code run from the start PC
+    subroutines(prof, calls, inclusive, exclusive);
+    n = 0;
+    for (uint32_t address = 0; address < MEMORY_MAX; ++address)
+        if (inclusive[address]) order[n++] = address;
+    sortKey = inclusive;
+    qsort(order, n, sizeof(uint32_t), byCount);
+    fprintf(out, "\nsubroutines:\n    entry        calls     inclusive       %%     exclusive       %%\n");
+    for (uint32_t i = 0; i < n && i < HOT_SPOTS; ++i) {
+        uint32_t entry = order[i];
+        fprintf(out, "   0x%04X %12llu  %12llu  %5.1f%%  %12llu  %5.1f%%\n", entry,
+                (unsigned long long)calls[entry],
+                (unsigned long long)inclusive[entry], percent(inclusive[entry], total),
+                (unsigned long long)exclusive[entry], percent(exclusive[entry], total));
+    }
+
+    free(order);
+    free(calls);
+}
+
+void profileFolded(const struct lc3_profile *prof, FILE *out)
+{
+    uint16_t path[PROFILE_DEPTH];
+    for (uint32_t n = 0; n < prof->nnodes; ++n) {
+        if (prof->nodes[n].self == 0) continue;
+        int depth = 0;
+        for (uint32_t a = n;; a = prof->nodes[a].parent) {
+            path[depth++] = prof->nodes[a].entry;
+            if (a == 0) break;
+        }
+        while (depth--) fprintf(out, "0x%04X%c", path[depth], depth ? ';' : ' ');
+        fprintf(out, "%llu\n", (unsigned long long)prof->nodes[n].self);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef H_PROFILE
+#define H_PROFILE
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// GUEST PROFILER
+// programRunProfiled is a copy of the programRun loop that also records:
+// - how many times each address was executed
+// - the opcode mix and the trap vectors called
+// - a call tree: JSR/JSRR push a frame (the target is the subroutine, R7 the
+//   return address), a JMP to the return address of a frame on the stack pops
+//   up to it. Every instruction is charged to the node of the current stack.
+// It lives in its own translation unit and the engines do not know about it,
+// so a run without -p pays nothing for the profiler.
+#define PROFILE_DEPTH 256           // deeper calls are charged to the deepest frame
+#define PROFILE_NODES (1 << 16)     // distinct call stacks, then charged to the caller
+
+// Node of the call tree: one per distinct stack of subroutine entries
+struct profile_node {
+    uint32_t parent;
+    uint16_t entry;                 // first address of the subroutine
+    uint16_t depth;
+    uint64_t self;                  // instructions executed with this stack
+    uint64_t calls;
+};
+
+struct profile_frame {
+    uint32_t node;
+    uint16_t ret;                   // R7 at the call
+};
+
+struct lc3_profile {
+    uint64_t count[MEMORY_MAX];     // executions per address
+    uint64_t opcode[16];
+    uint64_t trap[256];
+    uint64_t instructions;
+    struct profile_node *nodes;     // nodes[0] is the root (the code run from the start PC)
+    uint32_t nnodes;
+    uint32_t *children;             // open addressing hash of (parent, entry) -> node + 1
+    struct profile_frame stack[PROFILE_DEPTH];
+    uint32_t depth;                 // frames on the stack, stack[0] is the root
+    uint64_t lost;                  // calls not recorded because of PROFILE_DEPTH/PROFILE_NODES
+};
+
+struct lc3_profile *profileCreate(void);
+void profileDestroy(struct lc3_profile *prof);
+
+// Same as programRun, recording into prof. Runs keep adding to the same profile.
+uint64_t programRunProfiled(struct lc3_vm *vm, struct lc3_profile *prof);
+
+// Hot spot report: hottest addresses with their disassembly, opcode and trap
+// mix, subroutines with calls and inclusive/exclusive instructions
+void profileReport(const struct lc3_profile *prof, const struct lc3_vm *vm, FILE *out);
+
+// One line per call stack, "0x3000;0x3012;0x3040 count", the folded format of
+// flamegraph.pl and compatible tools
+void profileFolded(const struct lc3_profile *prof, FILE *out);
+
+#endif
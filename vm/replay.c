@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "console.h"
+#include "replay.h"
+
+static const char *const eventNames[] = {
+    [INPUT_GETC] = "getc", [INPUT_U16] = "u16", [INPUT_KBSR] = "kbsr", [INPUT_KBDR] = "kbdr",
+};
+#define EVENT_KINDS (sizeof(eventNames) / sizeof(eventNames[0]))
+
+// ===================================================================================
+// ==================================== LOG FILE =====================================
+// ===================================================================================
+// Read the next event of a replay
+static void advance(struct input_log *log)
+{
+    unsigned long long at;
+    char kind[8];
+    int value;
+    int n = fscanf(log->file, "%llu %7s %d", &at, kind, &value);
+    if (n == EOF) {
+        log->at = UINT64_MAX;
+        return;
+    }
+    ++log->line;
+    size_t k = 0;
+    while (n == 3 && k < EVENT_KINDS && strcmp(kind, eventNames[k]) != 0) ++k;
+    if (n != 3 || k == EVENT_KINDS) {
+        fprintf(stderr, "Malformed input log, event %llu\n", (unsigned long long)log->line);
+        abort();
+    }
+    log->at = at;
+    log->kind = k;
+    log->value = value;
+}
+
+struct input_log *inputLogOpen(const char *fileName, bool replay)
+{
+    struct input_log *log = calloc(1, sizeof(struct input_log));
+    if (log == NULL) {
+        fprintf(stderr, "Cannot allocate input log\n");
+        abort();
+    }
+    log->file = fopen(fileName, replay ? "r" : "w");
+    if (log->file == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", fileName);
+        abort();
+    }
+    log->replay = replay;
+
+    if (!replay) {
+        fputs(INPUT_LOG_MAGIC, log->file);
+        return log;
+    }
+    char magic[sizeof(INPUT_LOG_MAGIC)];
+    if (fgets(magic, sizeof(magic), log->file) == NULL || strcmp(magic, INPUT_LOG_MAGIC) != 0) {
+        fprintf(stderr, "%s is not an input log\n", fileName);
+        abort();
+    }
+    advance(log);
+    return log;
+}
+
+void inputLogClose(struct input_log *log, bool report)
+{
+    if (log->replay && log->at != UINT64_MAX)
+        fprintf(stderr, "input: the run ended before the %s event of instruction %llu\n",
+                eventNames[log->kind], (unsigned long long)log->at);
+    if (report)
+        fprintf(stderr, "input: %s %llu events\n", log->replay ? "replayed" : "recorded",
+                (unsigned long long)log->events);
+    fclose(log->file);
+    free(log);
+}
+
+
+// ===================================================================================
+// ===================================== RECORD ======================================
+// ===================================================================================
+static void record(struct lc3_vm *vm, enum input_event kind, int value)
+{
+    struct input_log *log = vm->io->log;
+    fprintf(log->file, "%llu %s %d\n", (unsigned long long)vm->retired, eventNames[kind], value);
+    log->unwritten = true;
+    ++log->events;
+}
+
+// Write the events out before the guest waits for input, so a recording
+// interrupted while the guest waits has all of them
+static void flushLog(struct input_log *log)
+{
+    if (log->unwritten) {
+        fflush(log->file);
+        log->unwritten = false;
+    }
+}
+
+static bool buffered(struct lc3_vm *vm)
+{
+    return vm->io->in_pos < vm->io->in_len;
+}
+
+
+// ===================================================================================
+// ===================================== REPLAY ======================================
+// ===================================================================================
+static void diverged(struct lc3_vm *vm, enum input_event kind)
+{
+    struct input_log *log = vm->io->log;
+    consoleFlush(vm);
+    fprintf(stderr, "Input replay diverged: %s at instruction %llu, the log has ",
+            eventNames[kind], (unsigned long long)vm->retired);
+    if (log->at == UINT64_MAX) fprintf(stderr, "no more events\n");
+    else fprintf(stderr, "%s at instruction %llu\n", eventNames[log->kind], (unsigned long long)log->at);
+    abort();
+}
+
+// The recording was cut while the guest waited for input: stop where it stopped
+static void ended(struct lc3_vm *vm)
+{
+    consoleFlush(vm);
+    fprintf(stderr, "input: log ended, run stopped at instruction %llu\n", (unsigned long long)vm->retired);
+    vm->running = false;
+}
+
+// True when the log has an event of kind at this instruction. An event left
+// behind, or of another kind, means the run diverged.
+static bool pending(struct lc3_vm *vm, enum input_event kind)
+{
+    struct input_log *log = vm->io->log;
+    if (log->at < vm->retired || (log->at == vm->retired && log->kind != kind))
+        diverged(vm, kind);
+    return log->at == vm->retired;
+}
+
+// Take the value of the pending event
+static int take(struct input_log *log)
+{
+    int value = log->value;
+    ++log->events;
+    advance(log);
+    return value;
+}
+
+
+// ===================================================================================
+// ================================== INPUT EVENTS ===================================
+// ===================================================================================
+int inputGetc(struct lc3_vm *vm)
+{
+    struct input_log *log = vm->io->log;
+    if (log == NULL) return consoleGetc(vm);
+    if (log->replay) {
+        if (log->at == UINT64_MAX) {
+            ended(vm);
+            return EOF;
+        }
+        if (!pending(vm, INPUT_GETC)) diverged(vm, INPUT_GETC);
+        return take(log);
+    }
+
+    if (!buffered(vm)) flushLog(log);
+    int c = consoleGetc(vm);
+    record(vm, INPUT_GETC, c);
+    return c;
+}
+
+bool inputReadU16(struct lc3_vm *vm, uint16_t *value)
+{
+    struct input_log *log = vm->io->log;
+    if (log == NULL) return consoleReadU16(vm, value);
+    if (log->replay) {
+        if (log->at == UINT64_MAX) {
+            ended(vm);
+            return false;
+        }
+        if (!pending(vm, INPUT_U16)) diverged(vm, INPUT_U16);
+        int n = take(log);
+        if (n < 0) return false;
+        *value = (uint16_t)n;
+        return true;
+    }
+
+    if (!buffered(vm)) flushLog(log);
+    bool ok = consoleReadU16(vm, value);
+    record(vm, INPUT_U16, ok ? *value : -1);
+    return ok;
+}
+
+bool inputReady(struct lc3_vm *vm, int wait)
+{
+    struct input_log *log = vm->io->log;
+    if (log != NULL && log->replay) {
+        if (log->at == UINT64_MAX && wait != 0) ended(vm);
+        if (!pending(vm, INPUT_KBSR)) return false;
+        take(log);
+        return true;
+    }
+
+    if (!consoleReady(vm) && wait != 0) {
+        if (log) flushLog(log);
+        consoleWait(vm, wait);
+    }
+    bool ready = consoleReady(vm);
+    if (log) {
+        if (ready) record(vm, INPUT_KBSR, 0x8000);
+        else flushLog(log);
+    }
+    return ready;
+}
+
+int inputKey(struct lc3_vm *vm)
+{
+    struct input_log *log = vm->io->log;
+    if (log != NULL && log->replay)
+        return pending(vm, INPUT_KBDR) ? take(log) : EOF;
+
+    if (!consoleReady(vm)) return EOF;
+    int c = consoleGetc(vm);
+    if (log) record(vm, INPUT_KBDR, c);
+    return c;
+}
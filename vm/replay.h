@@ -0,0 +1,68 @@
+#ifndef H_REPLAY
+#define H_REPLAY
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// INPUT RECORD/REPLAY
+// Everything a guest learns from the outside goes through four points: the
+// GETC/IN and IN_U16 traps and the KBSR/KBDR registers. The traps and the
+// devices call the input functions below instead of the console; with a log
+// attached to the console (vm->io->log) they also:
+// - record: append every value the guest got, with the retired instruction
+//   count (vm->retired) of the instruction that got it
+// - replay: hand out the logged values at the same instructions, without
+//   touching the input stream: no terminal, no blocking, no parking
+// Without input from outside a run is deterministic, so a replay retires the
+// same instructions as the recorded run; with -b it stops at any point of it.
+// A guest that asks for input where the log has none (or the other way round)
+// diverged from the recording: the replay reports it and aborts. Host files
+// read by the FREAD trap (trap.h) are not logged: a replay reads them again.
+// vm->retired is kept by the switch loop and the profiling/tracing copies of it,
+// the other engines cannot record or replay.
+//
+// Log format: INPUT_LOG_MAGIC, then one line per event, "count kind value":
+// - getc:  GETC/IN returned value (-1 for EOF)
+// - u16:   IN_U16 read value (-1 when the input did not start with a number)
+// - kbsr:  KBSR read a key ready (value 0x8000). Reads with no key are not logged.
+// - kbdr:  KBDR read a new key. Reads of the old key are not logged.
+#define INPUT_LOG_MAGIC "LC3INPUT1\n"
+
+enum input_event { INPUT_GETC = 0, INPUT_U16, INPUT_KBSR, INPUT_KBDR };
+
+struct input_log {
+    FILE *file;
+    bool replay;
+    bool unwritten;                 // record: events still in the stdio buffer
+    uint64_t events;                // recorded or replayed
+    uint64_t at;                    // replay: next event, UINT64_MAX at the end of the log
+    enum input_event kind;
+    int value;
+    uint64_t line;
+};
+
+// Create a log to record, or open one to replay
+struct input_log *inputLogOpen(const char *fileName, bool replay);
+
+// Close and free. With report, print the number of events on stderr.
+// A replay warns about the events the run did not get to.
+void inputLogClose(struct input_log *log, bool report);
+
+// GETC/IN: next char or EOF
+int inputGetc(struct lc3_vm *vm);
+
+// IN_U16: like consoleReadU16
+bool inputReadU16(struct lc3_vm *vm, uint16_t *value);
+
+// KBSR: true when a key is ready. A poll that parks may block up to wait
+// milliseconds (-1 for no limit, 0 does not park) until one is (consoleWait);
+// a replay never blocks, and stops the run when a parking poll finds the log ended.
+bool inputReady(struct lc3_vm *vm, int wait);
+
+// KBDR: the new key, EOF when no key is ready
+int inputKey(struct lc3_vm *vm);
+
+#endif
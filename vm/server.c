@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "lc3vm.h"
+#include "snapshot.h"
+#include "console.h"
+#include "server.h"
+
+#define LINE_MAX_SIZE 512
+
+enum request_kind { REQ_RUN, REQ_REPLY };
+
+// A request read from a connection. Runs are queued for the workers; every
+// request also sits in the ring of its connection until its response is sent.
+struct request {
+    struct request *next;           // worker queue
+    struct connection *conn;
+    enum request_kind kind;
+    size_t image;
+    uint64_t limit;
+    char *input;
+    size_t input_size;
+    char header[LINE_MAX_SIZE];     // response line
+    char *payload;                  // response payload
+    size_t payload_size;
+    uint64_t count;
+    bool halted;
+    bool done;
+    struct timespec start;
+};
+
+struct connection {
+    struct connection *next;
+    struct server *server;
+    int fd;
+    FILE *in;
+    pthread_t reader, writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct request *ring[SERVER_INFLIGHT];  // requests in order, not answered yet
+    size_t head, used;
+    bool eof;                       // the reader read its last request
+    atomic_bool finished;           // both threads returned
+};
+
+struct server {
+    char **images;
+    int nimages;
+    struct lc3_snapshot **snapshots;
+    uint64_t (*run)(struct lc3_vm *vm);
+    uint64_t budget;
+    int wake[2];                    // pipe that interrupts accept
+    atomic_bool stopping;
+    struct connection *connections;
+
+    // worker queue
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct request *first, *last;
+    size_t queued;
+    bool quit;
+    pthread_t *workers;
+    int nworkers;
+
+    // statistics, under stats_lock
+    pthread_mutex_t stats_lock;
+    struct timespec started;
+    uint64_t requests, errors, halted, limited, instructions;
+    uint64_t accepted, active;
+    uint32_t latency[SERVER_SAMPLES];     // microseconds, ring
+    uint64_t samples;
+};
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) * 1e-9;
+}
+
+
+// ===================================================================================
+// ===================================== WORKERS =====================================
+// ===================================================================================
+static void enqueue(struct server *s, struct request *req)
+{
+    pthread_mutex_lock(&s->lock);
+    req->next = NULL;
+    if (s->last) s->last->next = req;
+    else s->first = req;
+    s->last = req;
+    ++s->queued;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static struct request *dequeue(struct server *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->first == NULL && !s->quit)
+        pthread_cond_wait(&s->ready, &s->lock);
+    struct request *req = s->first;
+    if (req) {
+        s->first = req->next;
+        if (s->first == NULL) s->last = NULL;
+        --s->queued;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return req;
+}
+
+// The response is ready: hand it to the writer of the connection
+static void complete(struct request *req)
+{
+    struct connection *conn = req->conn;
+    pthread_mutex_lock(&conn->lock);
+    req->done = true;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void record(struct server *s, struct request *req)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double us = elapsed(&req->start, &end) * 1e6;
+
+    pthread_mutex_lock(&s->stats_lock);
+    ++s->requests;
+    if (req->halted) ++s->halted;
+    else ++s->limited;
+    s->instructions += req->count;
+    s->latency[s->samples++ % SERVER_SAMPLES] = us < UINT32_MAX ? (uint32_t)us : UINT32_MAX;
+    pthread_mutex_unlock(&s->stats_lock);
+}
+
+static void failed(struct server *s)
+{
+    pthread_mutex_lock(&s->stats_lock);
+    ++s->errors;
+    pthread_mutex_unlock(&s->stats_lock);
+}
+
+// Same life cycle as a batch job: restore the image, attach in-memory
+// streams, run, and detach the streams before closing them. A guest fault
+// stops the VM (vm->fault of the worker) and is answered as an error.
+static void runRequest(struct server *s, struct lc3_vm *vm, struct request *req)
+{
+    snapshotRestore(vm, s->snapshots[req->image]);
+    vm->budget = req->limit ? req->limit : s->budget;
+    vm->fault[0] = '\0';
+
+    FILE *in = req->input_size ? fmemopen(req->input, req->input_size, "r") : fopen("/dev/null", "r");
+    FILE *out = open_memstream(&req->payload, &req->payload_size);
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "Cannot attach the streams of a request\n");
+        abort();
+    }
+    consoleAttach(vm, in, out);
+    req->count = s->run(vm);
+    req->halted = !vm->running;
+    consoleAttach(vm, stdin, stdout);
+    fclose(in);
+    fclose(out);
+
+    free(req->input);
+    req->input = NULL;
+    if (vm->fault[0]) {
+        free(req->payload);
+        req->payload = NULL;
+        req->payload_size = 0;
+        snprintf(req->header, sizeof(req->header), "ERR %s\n", vm->fault);
+        failed(s);
+        return;
+    }
+    snprintf(req->header, sizeof(req->header), "OK %s %llu %zu\n", req->halted ? "halted" : "limit",
+             (unsigned long long)req->count, req->payload_size);
+    record(s, req);
+}
+
+static void *workerMain(void *arg)
+{
+    struct server *s = arg;
+    struct lc3_vm *vm = vmCreate();
+    char fault[VM_FAULT_SIZE];
+    vm->fault = fault;
+    struct request *req;
+    while ((req = dequeue(s)) != NULL) {
+        runRequest(s, vm, req);
+        complete(req);
+    }
+    vmDestroy(vm);
+    return NULL;
+}
+
+
+// ===================================================================================
+// ==================================== STATISTICS ===================================
+// ===================================================================================
+static int compareU32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t n, double p)
+{
+    if (n == 0) return 0;
+    size_t k = (size_t)(p * (n - 1) + 0.5);
+    return sorted[k];
+}
+
+// "name value" lines of the counters, in a malloc'ed payload
+static void statistics(struct server *s, struct request *req)
+{
+    uint32_t *sorted = malloc(SERVER_SAMPLES * sizeof(uint32_t));
+    if (sorted == NULL) {
+        fprintf(stderr, "Cannot allocate the statistics\n");
+        abort();
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&s->stats_lock);
+    uint64_t requests = s->requests, errors = s->errors, halted = s->halted, limited = s->limited;
+    uint64_t instructions = s->instructions, accepted = s->accepted, active = s->active;
+    size_t n = s->samples < SERVER_SAMPLES ? s->samples : SERVER_SAMPLES;
+    memcpy(sorted, s->latency, n * sizeof(uint32_t));
+    pthread_mutex_unlock(&s->stats_lock);
+    pthread_mutex_lock(&s->lock);
+    size_t queued = s->queued;
+    pthread_mutex_unlock(&s->lock);
+    qsort(sorted, n, sizeof(uint32_t), compareU32);
+
+    double uptime = elapsed(&s->started, &now);
+    FILE *out = open_memstream(&req->payload, &req->payload_size);
+    if (out == NULL) {
+        fprintf(stderr, "Cannot allocate the statistics\n");
+        abort();
+    }
+    fprintf(out, "images %d\nworkers %d\n", s->nimages, s->nworkers);
+    fprintf(out, "uptime %.3f\n", uptime);
+    fprintf(out, "connections %llu\nconnections_open %llu\n",
+            (unsigned long long)accepted, (unsigned long long)active);
+    fprintf(out, "requests %llu\nhalted %llu\nlimited %llu\nerrors %llu\n", (unsigned long long)requests,
+            (unsigned long long)halted, (unsigned long long)limited, (unsigned long long)errors);
+    fprintf(out, "queued %zu\n", queued);
+    fprintf(out, "instructions %llu\n", (unsigned long long)instructions);
+    fprintf(out, "requests_per_s %.1f\nmips %.1f\n", uptime > 0 ? requests / uptime : 0.0,
+            uptime > 0 ? instructions / uptime * 1e-6 : 0.0);
+    fprintf(out, "latency_samples %zu\n", n);
+    fprintf(out, "latency_p50_us %u\nlatency_p90_us %u\nlatency_p99_us %u\nlatency_max_us %u\n",
+            percentile(sorted, n, 0.50), percentile(sorted, n, 0.90),
+            percentile(sorted, n, 0.99), n ? sorted[n - 1] : 0);
+    fclose(out);
+    free(sorted);
+    snprintf(req->header, sizeof(req->header), "STATS %zu\n", req->payload_size);
+}
+
+
+// ===================================================================================
+// =================================== CONNECTIONS ===================================
+// ===================================================================================
+// Index of an image: its position, its path or the last component of its path
+static long findImage(struct server *s, const char *name)
+{
+    char *end;
+    long index = strtol(name, &end, 10);
+    if (*name && *end == '\0') return index >= 0 && index < s->nimages ? index : -1;
+    for (int i = 0; i < s->nimages; ++i)
+        if (strcmp(s->images[i], name) == 0) return i;
+    for (int i = 0; i < s->nimages; ++i) {
+        const char *base = strrchr(s->images[i], '/');
+        if (strcmp(base ? base + 1 : s->images[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static struct request *newRequest(struct connection *conn)
+{
+    struct request *req = calloc(1, sizeof(struct request));
+    if (req == NULL) {
+        fprintf(stderr, "Cannot allocate a request\n");
+        abort();
+    }
+    req->conn = conn;
+    clock_gettime(CLOCK_MONOTONIC, &req->start);
+    return req;
+}
+
+static void reply(struct request *req, const char *format, const char *argument)
+{
+    req->kind = REQ_REPLY;
+    snprintf(req->header, sizeof(req->header), format, argument);
+    req->done = true;
+}
+
+// Parse the request of line (and read its payload). Return false when the
+// connection cannot go on.
+static bool parse(struct connection *conn, struct request *req, char *line)
+{
+    struct server *s = conn->server;
+    size_t length = strlen(line);
+    if (length == 0 || line[length - 1] != '\n') {
+        failed(s);
+        reply(req, "ERR %s\n", length ? "request line too long" : "truncated request");
+        return false;
+    }
+    line[length - 1] = '\0';
+
+    char image[LINE_MAX_SIZE];
+    unsigned long long limit;
+    size_t size;
+    char extra;
+    if (sscanf(line, "RUN %511s %llu %zu %c", image, &limit, &size, &extra) == 3) {
+        if (size > SERVER_MAX_INPUT) {
+            failed(s);
+            reply(req, "ERR %s\n", "input too large");
+            return false;
+        }
+        req->input = malloc(size ? size : 1);
+        if (req->input == NULL) {
+            fprintf(stderr, "Cannot allocate %zu bytes of input\n", size);
+            abort();
+        }
+        if (fread(req->input, 1, size, conn->in) != size) {
+            failed(s);
+            reply(req, "ERR %s\n", "truncated input");
+            return false;
+        }
+        req->input_size = size;
+        long index = findImage(s, image);
+        if (index < 0) {
+            failed(s);
+            reply(req, "ERR unknown image %.400s\n", image);
+            return true;
+        }
+        req->kind = REQ_RUN;
+        req->image = (size_t)index;
+        req->limit = limit;
+        return true;
+    }
+    if (strcmp(line, "STATS") == 0) {
+        req->kind = REQ_REPLY;
+        statistics(s, req);
+        req->done = true;
+        return true;
+    }
+    if (strcmp(line, "SHUTDOWN") == 0) {
+        reply(req, "%s", "BYE\n");
+        atomic_store(&s->stopping, true);
+        if (write(s->wake[1], "", 1) < 0) { /* the pipe only wakes accept up */ }
+        return false;
+    }
+    failed(s);
+    reply(req, "ERR %s\n", "unknown request");
+    return false;
+}
+
+static void *readerMain(void *arg)
+{
+    struct connection *conn = arg;
+    char line[LINE_MAX_SIZE];
+    bool more = true;
+    while (more) {
+        pthread_mutex_lock(&conn->lock);
+        while (conn->used == SERVER_INFLIGHT)
+            pthread_cond_wait(&conn->changed, &conn->lock);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (fgets(line, sizeof(line), conn->in) == NULL) break;
+        struct request *req = newRequest(conn);
+        more = parse(conn, req, line);
+        bool queued = req->kind == REQ_RUN;     // a reply may be sent and freed once in the ring
+
+        pthread_mutex_lock(&conn->lock);
+        conn->ring[(conn->head + conn->used++) % SERVER_INFLIGHT] = req;
+        pthread_cond_broadcast(&conn->changed);
+        pthread_mutex_unlock(&conn->lock);
+        if (queued) enqueue(conn->server, req);
+    }
+    pthread_mutex_lock(&conn->lock);
+    conn->eof = true;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->lock);
+    return NULL;
+}
+
+static bool sendAll(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Send the responses in request order. Once the client is gone the reader is
+// stopped, and the requests still running are waited for and dropped.
+static void *writerMain(void *arg)
+{
+    struct connection *conn = arg;
+    bool connected = true;
+    for (;;) {
+        pthread_mutex_lock(&conn->lock);
+        while (!(conn->used > 0 && conn->ring[conn->head]->done) && !(conn->used == 0 && conn->eof))
+            pthread_cond_wait(&conn->changed, &conn->lock);
+        if (conn->used == 0) {
+            pthread_mutex_unlock(&conn->lock);
+            break;
+        }
+        struct request *req = conn->ring[conn->head];
+        pthread_mutex_unlock(&conn->lock);
+
+        if (connected && !(sendAll(conn->fd, req->header, strlen(req->header)) &&
+                           sendAll(conn->fd, req->payload, req->payload_size))) {
+            connected = false;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        free(req->input);
+        free(req->payload);
+        free(req);
+
+        pthread_mutex_lock(&conn->lock);
+        conn->head = (conn->head + 1) % SERVER_INFLIGHT;
+        --conn->used;
+        pthread_cond_broadcast(&conn->changed);
+        pthread_mutex_unlock(&conn->lock);
+    }
+    atomic_store(&conn->finished, true);
+    if (write(conn->server->wake[1], "", 1) < 0) { /* reaped at the next wake up */ }
+    return NULL;
+}
+
+static void openConnection(struct server *s, int fd)
+{
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    if (conn == NULL || (conn->in = fdopen(fd, "r")) == NULL) {
+        fprintf(stderr, "Cannot allocate a connection\n");
+        abort();
+    }
+    conn->server = s;
+    conn->fd = fd;
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_cond_init(&conn->changed, NULL);
+    atomic_init(&conn->finished, false);
+    if (pthread_create(&conn->reader, NULL, readerMain, conn) != 0 ||
+        pthread_create(&conn->writer, NULL, writerMain, conn) != 0) {
+        fprintf(stderr, "Cannot create the threads of a connection\n");
+        abort();
+    }
+    conn->next = s->connections;
+    s->connections = conn;
+
+    pthread_mutex_lock(&s->stats_lock);
+    ++s->accepted;
+    ++s->active;
+    pthread_mutex_unlock(&s->stats_lock);
+}
+
+// Join and free the connections whose threads returned (all of them, after
+// stopping their readers, when all is set)
+static void reapConnections(struct server *s, bool all)
+{
+    struct connection **link = &s->connections;
+    while (*link) {
+        struct connection *conn = *link;
+        if (all) shutdown(conn->fd, SHUT_RD);
+        else if (!atomic_load(&conn->finished)) {
+            link = &conn->next;
+            continue;
+        }
+        pthread_join(conn->reader, NULL);
+        pthread_join(conn->writer, NULL);
+        fclose(conn->in);
+        pthread_mutex_destroy(&conn->lock);
+        pthread_cond_destroy(&conn->changed);
+        *link = conn->next;
+        free(conn);
+
+        pthread_mutex_lock(&s->stats_lock);
+        --s->active;
+        pthread_mutex_unlock(&s->stats_lock);
+    }
+}
+
+
+// ===================================================================================
+// ====================================== SERVER =====================================
+// ===================================================================================
+static int listenOn(const char *path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by a server that is gone is replaced, a live one is not
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            close(probe);
+            fprintf(stderr, "A server is already listening on %s\n", path);
+            return -1;
+        }
+        if (probe >= 0) close(probe);
+        unlink(path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Load every image once, as a snapshot of a VM right after loadProgram
+static void loadImages(struct server *s)
+{
+    s->snapshots = calloc(s->nimages, sizeof(struct lc3_snapshot *));
+    if (s->snapshots == NULL) {
+        fprintf(stderr, "Cannot allocate %d images\n", s->nimages);
+        abort();
+    }
+    struct lc3_vm *vm = vmCreate();
+    for (int i = 0; i < s->nimages; ++i) {
+        vmReset(vm);
+        vm->reg[RPC] = loadProgram(s->images[i], vm->memory);
+        s->snapshots[i] = snapshotCreate(vm);
+    }
+    vmDestroy(vm);
+}
+
+int serverRun(const char *socketPath, char **images, int nimages, int threads,
+              uint64_t (*run)(struct lc3_vm *vm), uint64_t budget)
+{
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+
+    struct server *s = calloc(1, sizeof(struct server));
+    if (s == NULL || pipe(s->wake) != 0) {
+        fprintf(stderr, "Cannot allocate the server\n");
+        abort();
+    }
+    s->images = images;
+    s->nimages = nimages;
+    s->run = run;
+    s->budget = budget;
+    s->nworkers = threads;
+    atomic_init(&s->stopping, false);
+    loadImages(s);
+    int listener = listenOn(socketPath);
+    if (listener < 0) {
+        for (int i = 0; i < nimages; ++i)
+            snapshotDestroy(s->snapshots[i]);
+        free(s->snapshots);
+        close(s->wake[0]);
+        close(s->wake[1]);
+        free(s);
+        return 1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+    pthread_mutex_init(&s->stats_lock, NULL);
+
+    s->workers = calloc(threads, sizeof(pthread_t));
+    if (s->workers == NULL) {
+        fprintf(stderr, "Cannot allocate %d workers\n", threads);
+        abort();
+    }
+    for (int i = 0; i < threads; ++i)
+        if (pthread_create(&s->workers[i], NULL, workerMain, s) != 0) {
+            fprintf(stderr, "Cannot create worker thread\n");
+            abort();
+        }
+    clock_gettime(CLOCK_MONOTONIC, &s->started);
+    fprintf(stderr, "server: %d images, %d workers, listening on %s\n", nimages, threads, socketPath);
+
+    struct pollfd fds[2] = { { listener, POLLIN, 0 }, { s->wake[0], POLLIN, 0 } };
+    while (!atomic_load(&s->stopping)) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Cannot wait for connections: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            if (read(s->wake[0], drain, sizeof(drain)) < 0) { /* nothing to drain */ }
+            reapConnections(s, false);
+        }
+        if ((fds[0].revents & POLLIN) && !atomic_load(&s->stopping)) {
+            int fd = accept(listener, NULL, NULL);
+            if (fd >= 0) openConnection(s, fd);
+            else if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "Cannot accept a connection: %s\n", strerror(errno));
+        }
+    }
+    close(listener);
+    unlink(socketPath);
+
+    // Answer what was read, then stop the workers
+    reapConnections(s, true);
+    pthread_mutex_lock(&s->lock);
+    s->quit = true;
+    pthread_cond_broadcast(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    for (int i = 0; i < threads; ++i)
+        pthread_join(s->workers[i], NULL);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsed(&s->started, &end);
+    fprintf(stderr, "server: %llu requests in %.3f s, %llu instructions, %llu errors\n",
+            (unsigned long long)s->requests, seconds, (unsigned long long)s->instructions,
+            (unsigned long long)s->errors);
+
+    for (int i = 0; i < nimages; ++i)
+        snapshotDestroy(s->snapshots[i]);
+    free(s->snapshots);
+    free(s->workers);
+    close(s->wake[0]);
+    close(s->wake[1]);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->ready);
+    pthread_mutex_destroy(&s->stats_lock);
+    free(s);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef H_SERVER
+#define H_SERVER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lc3vm.h"
+
+// RESIDENT VM SERVER
+// Keep a set of images loaded and a pool of warm VMs, and run jobs sent over a
+// Unix domain socket, so a short program costs neither a process start nor an
+// image load. Every image is loaded once into a snapshot (snapshot.h); a
+// worker thread owns one VM and restores the image of each job into it, which
+// copies back only the pages the previous job of that image wrote.
+//
+// Protocol: a connection carries any number of requests, which may be sent
+// without waiting for the responses (pipelining). The requests of a connection
+// run in parallel on the workers and are answered in the order they came.
+// Lines end with '\n', sizes are in bytes.
+// - "RUN image limit size\n" then size bytes of input for the input traps.
+//   image is an index in the list of images, the path as given to the server
+//   or its last component. limit is the instruction budget, 0 for the one of
+//   the server (-b). Answer "OK status count size\n" then size bytes of
+//   output: status is "halted" or "limit" (stopped by the budget), count the
+//   retired instructions.
+// - "STATS\n": answer "STATS size\n" then size bytes of "name value" lines:
+//   requests, errors, instructions, uptime and throughput counters, and the
+//   percentiles of the latency (from the request read to its response ready,
+//   in microseconds) over the last SERVER_SAMPLES requests.
+// - "SHUTDOWN\n": answer "BYE\n", finish the requests already read and stop.
+// A request the server cannot run is answered "ERR message\n". After a
+// malformed line the rest of the connection cannot be parsed: the server
+// answers and closes it.
+// A guest fault (unknown trap, exception without a handler), which would stop
+// vm/main, stops only its run: the request is answered "ERR message\n".
+#define SERVER_SAMPLES   65536     // latency window
+#define SERVER_INFLIGHT  64        // requests read ahead of their responses, per connection
+#define SERVER_MAX_INPUT (1 << 24) // largest input payload
+
+// Serve until a SHUTDOWN request. threads <= 0 uses one worker per online CPU.
+// Return 0, or 1 if the socket cannot be set up.
+int serverRun(const char *socketPath, char **images, int nimages, int threads,
+              uint64_t (*run)(struct lc3_vm *vm), uint64_t budget);
+
+#endif
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "snapshot.h"
+#include "interrupt.h"
+
+// ===================================================================================
+// ================================== SNAPSHOTS ======================================
+// ===================================================================================
+// Ids instead of pointers tell snapshots apart, since a new snapshot can be
+// allocated where a destroyed one was
+static uint64_t next_id = 0;
+
+struct lc3_snapshot *snapshotCreate(struct lc3_vm *vm)
+{
+    struct lc3_snapshot *snap = malloc(sizeof(struct lc3_snapshot));
+    if (snap == NULL) {
+        fprintf(stderr, "Cannot allocate snapshot\n");
+        abort();
+    }
+
+    snap->id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+    memcpy(snap->memory, vm->memory, sizeof(snap->memory));
+    memcpy(snap->reg, vm->reg, sizeof(snap->reg));
+    snap->psr = vm->psr;
+    snap->ssp = vm->ssp;
+    snap->usp = vm->usp;
+    snap->running = vm->running;
+
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->origin = snap->id;
+    return snap;
+}
+
+void snapshotDestroy(struct lc3_snapshot *snap)
+{
+    free(snap);
+}
+
+// Copy a page back and drop its decoded entries. decode_invalidate on the first
+// word also drops a fused group that starts in the previous page and reaches it.
+static void restorePage(struct lc3_vm *vm, const struct lc3_snapshot *snap, uint32_t page)
+{
+    uint32_t start = page << PAGE_BITS;
+    memcpy(vm->memory + start, snap->memory + start, PAGE_WORDS * sizeof(uint16_t));
+    memset(vm->decode + start, 0, PAGE_WORDS * sizeof(struct decoded));
+    decode_invalidate(vm->decode, start);
+}
+
+void snapshotRestore(struct lc3_vm *vm, const struct lc3_snapshot *snap)
+{
+    if (vm->origin != snap->id) {
+        memcpy(vm->memory, snap->memory, sizeof(vm->memory));
+        memset(vm->decode, 0, MEMORY_MAX * sizeof(struct decoded));
+        vm->origin = snap->id;
+    }
+    else {
+        for (uint32_t page = 0; page < PAGE_COUNT; ++page)
+            if (vm->dirty[page])
+                restorePage(vm, snap, page);
+    }
+
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    memcpy(vm->reg, snap->reg, sizeof(vm->reg));
+    vm->psr = snap->psr;
+    vm->ssp = snap->ssp;
+    vm->usp = snap->usp;
+    vm->running = snap->running;
+    interruptStop(vm);      // restart from the sources the restored registers enable
+    interruptArm(vm);
+}
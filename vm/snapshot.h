@@ -0,0 +1,32 @@
+#ifndef H_SNAPSHOT
+#define H_SNAPSHOT
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lc3vm.h"
+
+// SNAPSHOTS
+// Copy of a loaded (and possibly already partly run) VM: memory, registers,
+// processor status and running flag. Restoring a VM from a snapshot copies back only the pages the
+// guest wrote since it was last restored from the same snapshot, so running the
+// same image many times costs a reset proportional to the memory each run
+// touched instead of a full clear and load. A VM restored from another
+// snapshot, or never restored, gets a full copy.
+// Streams and budget belong to the VM and are not part of the snapshot.
+struct lc3_snapshot {
+    uint64_t id;            // unique, never 0
+    uint16_t memory[MEMORY_MAX];
+    uint16_t reg[REG_SIZE];
+    uint16_t psr, ssp, usp;
+    bool running;
+};
+
+// Capture vm. From now on vm counts as restored from the new snapshot.
+struct lc3_snapshot *snapshotCreate(struct lc3_vm *vm);
+void snapshotDestroy(struct lc3_snapshot *snap);
+
+// Bring vm back to the state of snap
+void snapshotRestore(struct lc3_vm *vm, const struct lc3_snapshot *snap);
+
+#endif
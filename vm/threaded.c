@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "threaded.h"
+#include "fuse.h"
+
+// ===================================================================================
+// ============================== RUN THREADED PROGRAM ===============================
+// ===================================================================================
+// Same machine as programRunDecoded. The register file, RPC and RCND are locals of
+// this function and every handler is inlined in its own label, so executing an
+// instruction costs one indirect jump, predicted separately for each handler.
+// reg is copied back only around the TRAP routines, RTI, RES and interrupts, and
+// when the run stops.
+// The budget is checked only by the control flow handlers, so that the other
+// handlers stay a single indirect jump.
+// The decode cache must match memory (see lc3vm.h), fused entries included.
+// Return the number of retired instructions.
+#if LC3_COMPUTED_GOTO
+static uint64_t threadedLoop(struct lc3_vm *vm, bool fuse)
+{
+    static const void *const handlers[DOP_COUNT] = {
+        [DOP_NONE] = &&l_decode, [DOP_ADD] = &&l_add,   [DOP_ADDI] = &&l_addi,
+        [DOP_AND] = &&l_and,     [DOP_ANDI] = &&l_andi, [DOP_NOT] = &&l_not,
+        [DOP_BR] = &&l_br,       [DOP_JMP] = &&l_jmp,   [DOP_JSR] = &&l_jsr,
+        [DOP_LD] = &&l_ld,       [DOP_LDI] = &&l_ldi,   [DOP_LDR] = &&l_ldr,
+        [DOP_LEA] = &&l_lea,     [DOP_ST] = &&l_st,     [DOP_STI] = &&l_sti,
+        [DOP_STR] = &&l_str,     [DOP_TRAP] = &&l_trap, [DOP_RTI] = &&l_rti,
+        [DOP_RES] = &&l_res,     [DOP_ADDI_BR] = &&l_addi_br,
+        [DOP_CONST] = &&l_const, [DOP_LDR_ADD_STR] = &&l_ldr_add_str,
+    };
+
+    struct decoded *cache = vm->decode;
+    uint16_t reg[REG_SIZE];
+    memcpy(reg, vm->reg, sizeof(reg));
+    uint16_t pc = reg[RPC];
+    uint16_t cc = reg[RCND];
+
+    uint64_t count = 0;
+    uint64_t fused = 0;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
+    struct decoded *d;
+
+// Fetch the decoded instruction at RPC and jump to its handler
+#define DISPATCH() do { d = &cache[pc++]; ++count; goto *handlers[d->op]; } while (0)
+// Control flow handlers: stop once the budget is used up
+#define DISPATCH_BRANCH() do { if (count >= limit) goto stop; DISPATCH(); } while (0)
+// Taken branches, JMP and JSR take the pending interrupts (interrupt.h)
+#define POLL_EVENTS() do { \
+        if (eventPending(vm)) { \
+            saveRegisters(vm, reg, pc, cc); \
+            interruptPoll(vm); \
+            loadRegisters(vm, reg, &pc, &cc); \
+        } \
+    } while (0)
+
+    if (!vm->running) return 0;
+    DISPATCH();
+
+l_decode:
+    // First execution of this word: decode it and dispatch again
+    --pc;
+    --count;
+    if (fuse) fuseInstruction(vm, pc);
+    else decodeInstruction(d, pc, mem_read(vm, pc));
+    DISPATCH();
+l_add:
+    cc = cc_of(reg[d->dr] = reg[d->sr1] + reg[d->sr2]);
+    DISPATCH();
+l_addi:
+    cc = cc_of(reg[d->dr] = reg[d->sr1] + d->imm);
+    DISPATCH();
+l_and:
+    cc = cc_of(reg[d->dr] = reg[d->sr1] & reg[d->sr2]);
+    DISPATCH();
+l_andi:
+    cc = cc_of(reg[d->dr] = reg[d->sr1] & d->imm);
+    DISPATCH();
+l_not:
+    cc = cc_of(reg[d->dr] = ~reg[d->sr1]);
+    DISPATCH();
+l_br:
+    if (d->sr2 & cc) {
+        pc = d->imm;
+        POLL_EVENTS();
+    }
+    DISPATCH_BRANCH();
+l_jmp:
+    pc = reg[d->sr1];
+    POLL_EVENTS();
+    DISPATCH_BRANCH();
+l_jsr:
+    reg[R7] = pc;
+    pc = d->imm;
+    POLL_EVENTS();
+    DISPATCH_BRANCH();
+l_ld:
+    cc = cc_of(reg[d->dr] = load(vm, d->imm, pc));
+    DISPATCH();
+l_ldi:
+    cc = cc_of(reg[d->dr] = load(vm, load(vm, d->imm, pc), pc));
+    DISPATCH();
+l_ldr:
+    cc = cc_of(reg[d->dr] = load(vm, reg[d->sr1] + d->imm, pc));
+    DISPATCH();
+l_lea:
+    cc = cc_of(reg[d->dr] = d->imm);
+    DISPATCH();
+l_st:
+    if (!store(vm, d->imm, reg[d->dr])) goto stop;
+    DISPATCH();
+l_sti:
+    if (!store(vm, load(vm, d->imm, pc), reg[d->dr])) goto stop;
+    DISPATCH();
+l_str:
+    if (!store(vm, reg[d->sr1] + d->imm, reg[d->dr])) goto stop;
+    DISPATCH();
+l_trap:
+    memcpy(vm->reg, reg, sizeof(reg));
+    vm->reg[RPC] = pc;
+    vm->reg[RCND] = cc;
+    OP_TRAP(vm, d->instruction);
+    memcpy(reg, vm->reg, sizeof(reg));
+    cc = reg[RCND];
+    if (!vm->running) goto stop;
+    DISPATCH();
+l_rti:
+l_res:
+    saveRegisters(vm, reg, pc, cc);
+    executeInstruction(vm, d->instruction);
+    loadRegisters(vm, reg, &pc, &cc);
+    if (!vm->running) goto stop;                // the handler entry may push onto MCR
+    DISPATCH_BRANCH();
+
+// Superinstructions: the following words of the group are read from their own
+// decode cache entries, RPC and the retired counter advance as if they were
+// executed one by one
+l_addi_br:
+    cc = cc_of(reg[d->dr] = reg[d->sr1] + d->imm);
+    d = &cache[pc++];
+    ++count;
+    fused += 2;
+    if (d->sr2 & cc) {
+        pc = d->imm;
+        POLL_EVENTS();
+    }
+    DISPATCH_BRANCH();
+l_const:
+    reg[d->dr] = 0;
+    d = &cache[pc++];
+    cc = cc_of(reg[d->dr] = d->imm);
+    ++count;
+    fused += 2;
+    DISPATCH();
+l_ldr_add_str:
+    reg[d->dr] = load(vm, reg[d->sr1] + d->imm, pc);
+    d = &cache[pc++];
+    if ((d->instruction >> 5) & 0x1)
+        reg[d->dr] = reg[d->sr1] + d->imm;
+    else
+        reg[d->dr] = reg[d->sr1] + reg[d->sr2];
+    cc = cc_of(reg[d->dr]);
+    d = &cache[pc++];
+    count += 2;
+    fused += 3;
+    if (!store(vm, reg[d->sr1] + d->imm, reg[d->dr])) goto stop;
+    DISPATCH();
+
+stop:
+    memcpy(vm->reg, reg, sizeof(reg));
+    vm->reg[RPC] = pc;
+    vm->reg[RCND] = cc;
+    fused_instructions = fused;
+    return count;
+
+#undef POLL_EVENTS
+#undef DISPATCH_BRANCH
+#undef DISPATCH
+}
+#endif
+
+uint64_t programRunThreaded(struct lc3_vm *vm)
+{
+#if LC3_COMPUTED_GOTO
+    return threadedLoop(vm, false);
+#else
+    return programRunDecoded(vm);
+#endif
+}
+
+// Threaded engine that fuses the words it decodes
+uint64_t programRunFused(struct lc3_vm *vm)
+{
+#if LC3_COMPUTED_GOTO
+    return threadedLoop(vm, true);
+#else
+    return programRunDecoded(vm);
+#endif
+}
@@ -0,0 +1,23 @@
+#ifndef H_THREADED
+#define H_THREADED
+
+#include <stdint.h>
+
+#include "lc3vm.h"
+
+// THREADED ENGINE
+// Dispatch with GCC labels-as-values: every handler of the decode cache is a
+// label of a single function and ends with its own indirect jump to the next
+// handler, instead of going back to a shared switch. It needs a GCC compatible
+// compiler: elsewhere, or when built with -DLC3_NO_COMPUTED_GOTO,
+// programRunThreaded falls back to the decoded engine.
+#if defined(__GNUC__) && !defined(LC3_NO_COMPUTED_GOTO)
+#define LC3_COMPUTED_GOTO 1
+#else
+#define LC3_COMPUTED_GOTO 0
+#endif
+
+uint64_t programRunThreaded(struct lc3_vm *vm);
+uint64_t programRunFused(struct lc3_vm *vm);    // with superinstructions, see fuse.h
+
+#endif
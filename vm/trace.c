@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "lc3vm.h"
+#include "trace.h"
+
+// ===================================================================================
+// ==================================== WRITER =======================================
+// ===================================================================================
+static void flush(struct lc3_trace *trace)
+{
+    if (fwrite(trace->buffer, 1, trace->used, trace->file) != trace->used) {
+        fprintf(stderr, "Cannot write the trace\n");
+        abort();
+    }
+    trace->bytes += trace->used;
+    trace->used = 0;
+}
+
+static inline uint8_t *varint(uint8_t *p, uint16_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+// Small positive and negative deltas both get small codes
+static inline uint16_t zigzag(uint16_t delta)
+{
+    return (uint16_t)(delta << 1) ^ (uint16_t)-(delta >> 15);
+}
+
+static inline uint16_t sext(uint16_t x, int bits)
+{
+    return (uint16_t)((int16_t)(x << (16 - bits)) >> (16 - bits));
+}
+
+// What each opcode changed, for the encoder
+enum { WRITES_NONE = 0, WRITES_DR, WRITES_R7, WRITES_TRAP, STORES_ST, STORES_STI, STORES_STR };
+static const uint8_t effect[16] = {
+    [op_add] = WRITES_DR, [op_and] = WRITES_DR, [op_not] = WRITES_DR, [op_ld] = WRITES_DR,
+    [op_ldi] = WRITES_DR, [op_ldr] = WRITES_DR, [op_lea] = WRITES_DR, [op_jsr] = WRITES_R7,
+    [op_trap] = WRITES_TRAP, [op_st] = STORES_ST, [op_sti] = STORES_STI, [op_str] = STORES_STR,
+};
+
+// Append the entry of a record (at most 1 + 3 + 2 + 3 + 3 + 3 + 3 + 3 bytes), or
+// a word of the block of the last entry
+static void encode(struct lc3_trace *trace, const struct trace_record *r)
+{
+    struct trace_state *s = &trace->state;
+    uint8_t *start = (uint8_t *)trace->buffer + trace->used;
+    if (__builtin_expect(s->pending != 0, 0)) {
+        --s->pending;
+        trace->used += varint(start, r->value) - start;
+        return;
+    }
+    uint8_t *p = start + 1;
+    uint8_t header = 0;
+    uint16_t instruction = r->instruction;
+
+    uint16_t delta = r->pc - (uint16_t)(s->pc + 1);
+    if (delta) {
+        header = TRACE_JUMP;
+        p = varint(p, zigzag(delta));
+    }
+    s->pc = r->pc;
+    if (__builtin_expect(instruction != s->code[r->pc], 0)) {
+        header |= TRACE_WORD;
+        *p++ = instruction & 0xFF;
+        *p++ = instruction >> 8;
+        s->code[r->pc] = instruction;
+    }
+
+    // Register written, store address (same offsets as the OP_ handlers)
+    unsigned written = (instruction >> 9) & 0x7;
+    uint16_t address;
+    switch (effect[instruction >> 12]) {
+    case WRITES_NONE:
+        goto done;
+    case WRITES_TRAP:
+        // Any trap may return a value in R0; an unchanged R0 costs one byte
+        written = R0;
+        goto reg;
+    case WRITES_R7:
+        written = R7;
+        // fall through
+    case WRITES_DR:
+    reg:
+        header |= TRACE_REG | (written << 3);
+        p = varint(p, zigzag(r->value - s->reg[written]));
+        s->reg[written] = r->value;
+        goto done;
+    case STORES_ST:
+        address = r->pc + 1 + sext(instruction & 0x1FF, 9);
+        break;
+    case STORES_STI:
+        address = r->pointer;
+        break;
+    default:
+        address = r->base + sext(instruction & 0x1FF, 6);
+        break;
+    }
+    header |= TRACE_MEM;
+    p = varint(p, zigzag(address - s->address));
+    p = varint(p, r->value);
+    s->address = address;
+
+done:
+    if (__builtin_expect(r->bulk_size != 0, 0)) {
+        header |= TRACE_BULK;
+        p = varint(p, zigzag(r->bulk_start - s->address));
+        p = varint(p, r->bulk_size);
+        s->address = r->bulk_start + r->bulk_size - 1;
+        s->pending = r->bulk_size;
+    }
+    *start = header;
+    trace->used += p - start;
+}
+
+// Encode records [tail, head) of the ring
+static void encodeRange(struct lc3_trace *trace, uint64_t tail, uint64_t head)
+{
+    for (; tail != head; ++tail) {
+        if (trace->used > sizeof(trace->buffer) - 32) flush(trace);
+        encode(trace, &trace->ring[tail & (TRACE_RING - 1)]);
+    }
+}
+
+// Sleep until the guest publishes enough records, or stops. Return false once
+// the ring is drained and the guest is done.
+static bool waitData(struct lc3_trace *trace, uint64_t tail)
+{
+    pthread_mutex_lock(&trace->lock);
+    for (;;) {
+        atomic_store(&trace->idle, true);
+        if (atomic_load(&trace->head) != tail || atomic_load(&trace->done)) break;
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += TRACE_LATENCY_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&trace->data, &trace->lock, &until);
+    }
+    atomic_store(&trace->idle, false);
+    pthread_mutex_unlock(&trace->lock);
+    return atomic_load(&trace->head) != tail;
+}
+
+static void *writerMain(void *arg)
+{
+    struct lc3_trace *trace = arg;
+    uint64_t tail = 0;
+    while (waitData(trace, tail)) {
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        encodeRange(trace, tail, head);
+        tail = head;
+        atomic_store(&trace->tail, tail);
+
+        // The guest may be asleep on a full ring
+        if (atomic_load(&trace->full)) {
+            pthread_mutex_lock(&trace->lock);
+            pthread_cond_signal(&trace->space);
+            pthread_mutex_unlock(&trace->lock);
+        }
+    }
+    flush(trace);
+    return NULL;
+}
+
+struct lc3_trace *traceOpen(const char *fileName)
+{
+    struct lc3_trace *trace = calloc(1, sizeof(struct lc3_trace));
+    if (trace == NULL) {
+        fprintf(stderr, "Cannot allocate trace buffers\n");
+        abort();
+    }
+    trace->file = fopen(fileName, "wb");
+    if (trace->file == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", fileName);
+        abort();
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace->file);
+
+    trace->state.pc = PC_START - 1;
+    trace->free_until = TRACE_RING;
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->done, false);
+    atomic_init(&trace->idle, false);
+    atomic_init(&trace->full, false);
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->data, NULL);
+    pthread_cond_init(&trace->space, NULL);
+    if (pthread_create(&trace->writer, NULL, writerMain, trace) != 0) {
+        fprintf(stderr, "Cannot create trace writer thread\n");
+        abort();
+    }
+    return trace;
+}
+
+void traceClose(struct lc3_trace *trace, bool report)
+{
+    atomic_store(&trace->head, trace->next);
+    atomic_store(&trace->done, true);
+    pthread_mutex_lock(&trace->lock);
+    pthread_cond_signal(&trace->data);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+    fclose(trace->file);
+    pthread_mutex_destroy(&trace->lock);
+    pthread_cond_destroy(&trace->data);
+    pthread_cond_destroy(&trace->space);
+
+    if (report)
+        fprintf(stderr, "trace: %llu records in %llu bytes, %.2f bytes per record\n",
+                (unsigned long long)trace->next, (unsigned long long)trace->bytes,
+                trace->next ? (double)trace->bytes / trace->next : 0.0);
+    free(trace);
+}
+
+
+// ===================================================================================
+// ================================= TRACED RUN ======================================
+// ===================================================================================
+// Wake the writer when it sleeps with a quarter of the ring published. The
+// flag is cleared here, so the guest makes the call once per wakeup.
+static void wakeWriter(struct lc3_trace *trace)
+{
+    pthread_mutex_lock(&trace->lock);
+    if (atomic_load(&trace->idle)) {
+        atomic_store(&trace->idle, false);
+        pthread_cond_signal(&trace->data);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+// Sleep until the writer frees part of the full ring
+static void waitSpace(struct lc3_trace *trace)
+{
+    atomic_store(&trace->head, trace->next);
+    pthread_mutex_lock(&trace->lock);
+    atomic_store(&trace->full, true);
+    uint64_t tail;
+    while ((tail = atomic_load(&trace->tail)) + TRACE_RING == trace->next) {
+        atomic_store(&trace->idle, false);
+        pthread_cond_signal(&trace->data);
+        pthread_cond_wait(&trace->space, &trace->lock);
+    }
+    atomic_store(&trace->full, false);
+    pthread_mutex_unlock(&trace->lock);
+    trace->free_until = tail + TRACE_RING;
+}
+
+// Slot for the next record
+static inline struct trace_record *slot(struct lc3_trace *trace)
+{
+    if (__builtin_expect(trace->next == trace->free_until, 0)) waitSpace(trace);
+    return &trace->ring[trace->next & (TRACE_RING - 1)];
+}
+
+static inline void publish(struct lc3_trace *trace)
+{
+    if ((++trace->next & (TRACE_BATCH - 1)) == 0) {
+        atomic_store(&trace->head, trace->next);
+        if (__builtin_expect(atomic_load_explicit(&trace->idle, memory_order_relaxed), 0)
+            && trace->next - atomic_load_explicit(&trace->tail, memory_order_relaxed) >= TRACE_RING / 4)
+            wakeWriter(trace);
+    }
+}
+
+// Register holding the value of a record: the DR field (TRACE_DR), or R7/R0
+#define TRACE_DR 0xFF
+static const uint8_t destination[16] = {
+    [op_br] = TRACE_DR, [op_add] = TRACE_DR, [op_ld] = TRACE_DR, [op_st] = TRACE_DR,
+    [op_jsr] = R7, [op_and] = TRACE_DR, [op_ldr] = TRACE_DR, [op_str] = TRACE_DR,
+    [op_rti] = TRACE_DR, [op_not] = TRACE_DR, [op_ldi] = TRACE_DR, [op_sti] = TRACE_DR,
+    [op_jmp] = TRACE_DR, [op_res] = TRACE_DR, [op_lea] = TRACE_DR, [op_trap] = R0,
+};
+
+// The loop of programRun. Filling a record takes no decision on the
+// instruction: the writer thread sorts out what it did (see trace_record).
+uint64_t programRunTraced(struct lc3_vm *vm, struct lc3_trace *trace)
+{
+    uint16_t *reg = vm->reg;
+    uint64_t count = 0;
+    uint64_t limit = vm->budget ? vm->budget : UINT64_MAX;
+    vm->bulk_size = 0;
+
+    while (vm->running && count != limit)
+    {
+        uint16_t pc = reg[RPC];
+        uint16_t instruction = mem_read(vm, reg[RPC]++);
+        uint16_t pcOffset9 = (uint16_t)((int16_t)(instruction << 7) >> 7);
+        uint16_t dest = destination[instruction >> 12];
+        if (dest == TRACE_DR) dest = (instruction >> 9) & 0x7;
+        ++count;
+        ++vm->retired;
+
+        struct trace_record *r = slot(trace);
+        r->pc = pc;
+        r->instruction = instruction;
+        r->pointer = vm->memory[(uint16_t)(pc + 1 + pcOffset9)];
+
+        executeInstruction(vm, instruction);
+
+        r->value = reg[dest];
+        r->base = reg[(instruction >> 6) & 0x7];
+        r->bulk_start = vm->bulk_start;
+        r->bulk_size = vm->bulk_size;
+        publish(trace);
+
+        // A native trap or an interrupt entry wrote a block: a record per word
+        if (__builtin_expect(vm->bulk_size != 0, 0)) {
+            for (uint16_t i = 0; i < vm->bulk_size; ++i) {
+                slot(trace)->value = vm->memory[(uint16_t)(vm->bulk_start + i)];
+                publish(trace);
+            }
+            vm->bulk_size = 0;
+        }
+    }
+
+    return count;
+}
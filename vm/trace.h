@@ -0,0 +1,101 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "lc3vm.h"
+
+// EXECUTION TRACE
+// programRunTraced is a copy of the programRun loop that records every retired
+// instruction: its address, the word, the register it wrote and the memory
+// words it stored, those of the native traps (MEMCPY, MEMSET, FREAD) and of
+// an interrupt entry included. Like the profiler it is a separate loop, so the engines pay
+// nothing when tracing is off.
+// The loop only fills fixed size records into a single producer/single
+// consumer ring. A writer thread takes them from there, compresses them and
+// writes the file, so the guest thread never formats or writes anything. The
+// ring is never overwritten: when the writer falls behind the guest waits.
+// Neither side spins: the writer sleeps until a quarter of the ring is
+// published (or TRACE_LATENCY_MS passed), the guest sleeps while the ring is full.
+// vm/lc3trace prints a trace file as a disassembly listing.
+#define TRACE_RING  (1 << 16)       // records, power of two
+#define TRACE_BATCH 64              // records published to the writer at once
+#define TRACE_LATENCY_MS 100        // longest time published records wait for the writer
+
+// A record holds raw values, taken without looking at what the instruction
+// does; the writer works out from the word which register and which memory
+// word changed:
+// - value:   register written by the opcode after it ran (DR, R7 for JSR, R0 for traps)
+// - base:    SR1/BaseR after the instruction (STR address)
+// - pointer: word at RPC + PCoffset9 before the instruction (STI address)
+// - bulk_start/bulk_size: block of memory written besides (vm->bulk_start/bulk_size)
+// The stored word is value (the SR of a store is in the DR field). A record
+// with a block is followed by bulk_size records that only hold the words
+// written, in value.
+struct trace_record {
+    uint16_t pc;
+    uint16_t instruction;
+    uint16_t value;
+    uint16_t base;
+    uint16_t pointer;
+    uint16_t bulk_start;
+    uint16_t bulk_size;
+};
+
+// File format: TRACE_MAGIC, then one entry per record. An entry starts with a
+// header byte, followed by the fields it announces:
+// - TRACE_JUMP:  pc is not the previous pc + 1, varint of the zigzag delta from it
+// - TRACE_WORD:  the word differs from the last one traced at pc, 2 bytes little endian
+// - TRACE_REG:   register (bits 3-5) written, varint of the zigzag delta from its last traced value
+// - TRACE_MEM:   varint of the zigzag delta from the last stored address, varint of the value
+// - TRACE_BULK:  a block written besides: varint of the zigzag delta of its first
+//                address from the last stored address, varint of its size, then
+//                a varint per word. The last stored address becomes its last word.
+// Loops re-execute the same words from consecutive addresses, so most entries
+// are 1-3 bytes instead of the 12 of a record.
+#define TRACE_MAGIC "LC3TRC1\n"
+enum { TRACE_JUMP = 0x01, TRACE_WORD = 0x02, TRACE_REG = 0x04, TRACE_MEM = 0x40, TRACE_BULK = 0x80 };
+
+// State of the encoder/decoder, in step on both sides
+struct trace_state {
+    uint16_t pc;                    // pc of the previous record
+    uint16_t address;
+    uint16_t pending;               // words of a block still to encode
+    uint16_t reg[8];
+    uint16_t code[MEMORY_MAX];
+};
+
+struct lc3_trace {
+    struct trace_record ring[TRACE_RING];
+    _Alignas(64) atomic_uint_fast64_t head;     // records published by the guest
+    atomic_bool done;
+    atomic_bool idle;                           // writer waiting on data
+    _Alignas(64) atomic_uint_fast64_t tail;     // records taken by the writer
+    atomic_bool full;                           // guest waiting on space
+    pthread_mutex_t lock;                       // only taken to sleep and to wake the other side
+    pthread_cond_t data, space;
+    _Alignas(64) uint64_t next;                 // guest side: index of the next record
+    uint64_t free_until;                        // next can grow up to here before reloading tail
+    FILE *file;
+    pthread_t writer;
+    uint64_t bytes;                             // written by the writer
+    char buffer[1 << 16];                       // encoded entries not written yet
+    size_t used;
+    struct trace_state state;
+};
+
+// Create the file and start the writer thread
+struct lc3_trace *traceOpen(const char *fileName);
+
+// Wait for the writer to drain the ring, close the file and free. With report,
+// print the number of records and the size of the file on stderr.
+void traceClose(struct lc3_trace *trace, bool report);
+
+// Same as programRun, recording every instruction into trace
+uint64_t programRunTraced(struct lc3_vm *vm, struct lc3_trace *trace);
+
+#endif
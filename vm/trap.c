@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "decode.h"
+#include "trap.h"
+
+// ===================================================================================
+// =================================== TRAP TABLE ====================================
+// ===================================================================================
+trap_fn trap_table[256] = {
+    [TRAP_GETC] = T_getc,     [TRAP_OUT] = T_out,       [TRAP_PUTS] = T_puts,
+    [TRAP_IN] = T_in,         [TRAP_PUTSP] = T_putsp,   [TRAP_HALT] = T_halt,
+    [TRAP_INU16] = T_inu16,   [TRAP_OUTU16] = T_outu16,
+    [TRAP_MEMCPY] = T_memcpy, [TRAP_MEMSET] = T_memset, [TRAP_STRLEN] = T_strlen,
+    [TRAP_STRCMP] = T_strcmp, [TRAP_MUL] = T_mul,       [TRAP_DIV] = T_div,
+    [TRAP_MOD] = T_mod,       [TRAP_FREAD] = T_fread,   [TRAP_FWRITE] = T_fwrite,
+};
+
+void trapRegister(uint8_t vector, trap_fn fn)
+{
+    trap_table[vector] = fn;
+}
+
+
+// ===================================================================================
+// ================================== BLOCK WRITES ===================================
+// ===================================================================================
+// True when count words from address are plain RAM, without wrapping around.
+// With watchpoints (debug.h) every write goes through mem_write.
+static bool inRam(struct lc3_vm *vm, uint16_t address, uint16_t count)
+{
+    return (uint32_t)address + count <= MR_BASE && vm->watch == NULL;
+}
+
+// RAM words [address, address + count) were written: mark their pages and drop
+// their decoded copies, like store does for a single word, and publish the range
+static void wroteRam(struct lc3_vm *vm, uint16_t address, uint16_t count)
+{
+    vm->bulk_start = address;
+    vm->bulk_size = count;
+    if (count == 0) return;
+    for (uint32_t page = address >> PAGE_BITS; page <= (uint32_t)(address + count - 1) >> PAGE_BITS; ++page)
+        vm->dirty[page] = 1;
+    memset(vm->decode + address, 0, count * sizeof(struct decoded));
+    decode_invalidate(vm->decode, address);
+}
+
+// Write count words from data at address. A range that wraps around or reaches
+// the device registers is written a word at a time with mem_write, and stops
+// if a device write halts the machine (MCR, not a stop of the debugger).
+static void writeBlock(struct lc3_vm *vm, uint16_t address, const uint16_t *data, uint16_t count)
+{
+    if (inRam(vm, address, count)) {
+        memcpy(vm->memory + address, data, count * sizeof(uint16_t));
+        wroteRam(vm, address, count);
+        return;
+    }
+    for (uint16_t i = 0; i < count; ++i) {
+        mem_write(vm, address + i, data[i]);
+        if ((uint16_t)(address + i) == MR_MCR && !(data[i] & 0x8000)) break;
+    }
+    vm->bulk_start = address;
+    vm->bulk_size = count;
+}
+
+static uint16_t *buffer(uint16_t count)
+{
+    uint16_t *data = malloc(count ? count * sizeof(uint16_t) : 1);
+    if (data == NULL) {
+        fprintf(stderr, "Cannot allocate trap buffer\n");
+        abort();
+    }
+    return data;
+}
+
+// Copy of count words from address, wrapping around at the end of memory
+static uint16_t *readBlock(struct lc3_vm *vm, uint16_t address, uint16_t count)
+{
+    uint16_t *data = buffer(count);
+    for (uint16_t i = 0; i < count; ++i)
+        data[i] = vm->memory[(uint16_t)(address + i)];
+    return data;
+}
+
+// Host copy of the string at address, NULL when it does not fit in size
+static char *hostString(struct lc3_vm *vm, uint16_t address, char *text, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        text[i] = (char)vm->memory[(uint16_t)(address + i)];
+        if (text[i] == '\0') return text;
+    }
+    return NULL;
+}
+
+static void result(struct lc3_vm *vm, uint16_t value)
+{
+    vm->reg[R0] = value;
+    update_flag(vm->reg, R0);
+}
+
+
+// ===================================================================================
+// ================================== NATIVE TRAPS ===================================
+// ===================================================================================
+void T_memcpy(struct lc3_vm *vm)
+{
+    uint16_t dst = vm->reg[R0], src = vm->reg[R1], count = vm->reg[R2];
+    if (inRam(vm, dst, count) && (uint32_t)src + count <= MEMORY_MAX) {
+        memmove(vm->memory + dst, vm->memory + src, count * sizeof(uint16_t));
+        wroteRam(vm, dst, count);
+        return;
+    }
+    uint16_t *data = readBlock(vm, src, count);
+    writeBlock(vm, dst, data, count);
+    free(data);
+}
+
+void T_memset(struct lc3_vm *vm)
+{
+    uint16_t dst = vm->reg[R0], value = vm->reg[R1], count = vm->reg[R2];
+    if (inRam(vm, dst, count)) {
+        for (uint16_t i = 0; i < count; ++i)
+            vm->memory[dst + i] = value;
+        wroteRam(vm, dst, count);
+        return;
+    }
+    uint16_t *data = buffer(count);
+    for (uint16_t i = 0; i < count; ++i)
+        data[i] = value;
+    writeBlock(vm, dst, data, count);
+    free(data);
+}
+
+void T_strlen(struct lc3_vm *vm)
+{
+    uint16_t address = vm->reg[R0], length = 0;
+    while (vm->memory[(uint16_t)(address + length)] && length != 0xFFFF)
+        ++length;
+    result(vm, length);
+}
+
+void T_strcmp(struct lc3_vm *vm)
+{
+    uint16_t a = vm->reg[R0], b = vm->reg[R1];
+    for (uint32_t i = 0; i < MEMORY_MAX; ++i) {
+        uint16_t x = vm->memory[(uint16_t)(a + i)], y = vm->memory[(uint16_t)(b + i)];
+        if (x != y || x == 0) {
+            result(vm, x - y);
+            return;
+        }
+    }
+    result(vm, 0);
+}
+
+void T_mul(struct lc3_vm *vm)
+{
+    result(vm, (uint16_t)((uint32_t)vm->reg[R0] * vm->reg[R1]));
+}
+
+void T_div(struct lc3_vm *vm)
+{
+    result(vm, vm->reg[R1] ? vm->reg[R0] / vm->reg[R1] : 0xFFFF);
+}
+
+void T_mod(struct lc3_vm *vm)
+{
+    result(vm, vm->reg[R1] ? vm->reg[R0] % vm->reg[R1] : vm->reg[R0]);
+}
+
+void T_fread(struct lc3_vm *vm)
+{
+    char name[256];
+    FILE *file = hostString(vm, vm->reg[R0], name, sizeof(name)) ? fopen(name, "rb") : NULL;
+    if (file == NULL) {
+        result(vm, 0xFFFF);
+        return;
+    }
+    uint16_t count = vm->reg[R2];
+    uint16_t *data = buffer(count);
+    uint16_t n = fread(data, sizeof(uint16_t), count, file);
+    fclose(file);
+    writeBlock(vm, vm->reg[R1], data, n);
+    free(data);
+    result(vm, n);
+}
+
+void T_fwrite(struct lc3_vm *vm)
+{
+    char name[256];
+    FILE *file = hostString(vm, vm->reg[R0], name, sizeof(name)) ? fopen(name, "wb") : NULL;
+    if (file == NULL) {
+        result(vm, 0xFFFF);
+        return;
+    }
+    uint16_t *data = readBlock(vm, vm->reg[R1], vm->reg[R2]);
+    uint16_t n = fwrite(data, sizeof(uint16_t), vm->reg[R2], file);
+    fclose(file);
+    free(data);
+    result(vm, n);
+}
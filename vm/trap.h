@@ -0,0 +1,40 @@
+#ifndef H_TRAP
+#define H_TRAP
+
+#include <stdint.h>
+
+#include "lc3vm.h"
+
+// TRAP TABLE
+// OP_TRAP calls the host function registered for the vector of the instruction,
+// with RPC already past the TRAP. The console traps (0x20-0x27, lc3vm.c) and the
+// native traps below are registered from the start; a program embedding the VM
+// adds its own vectors with trapRegister before it runs guests (the table is
+// shared by all VMs of the process). A vector with no function is a fatal error.
+typedef void (*trap_fn)(struct lc3_vm *vm);
+
+extern trap_fn trap_table[256];
+
+// Set the function of a vector, NULL to remove it
+void trapRegister(uint8_t vector, trap_fn fn);
+
+// NATIVE TRAPS
+// Bulk work a guest would otherwise do in LC-3 loops, at host speed. Strings
+// hold one char per word, like PUTS. Traps that return a value put it in R0
+// and set the condition codes; the others change no register.
+// Writes into memory go through the same bookkeeping as the store instructions
+// (dirty pages, decode cache, devices above MR_BASE), and the written range is
+// left in vm->bulk_start/bulk_size for the engines that translate code.
+void T_memcpy(struct lc3_vm *vm);       // 0x28 Copy R2 words from R1 to R0 (ranges may overlap)
+void T_memset(struct lc3_vm *vm);       // 0x29 Store R1 into the R2 words from R0
+void T_strlen(struct lc3_vm *vm);       // 0x2A R0 = length of the string at R0
+void T_strcmp(struct lc3_vm *vm);       // 0x2B R0 = first difference between the strings at R0 and R1, or 0
+void T_mul(struct lc3_vm *vm);          // 0x2C R0 = R0 * R1 (low 16 bits)
+void T_div(struct lc3_vm *vm);          // 0x2D R0 = R0 / R1, unsigned (0xFFFF when R1 is 0)
+void T_mod(struct lc3_vm *vm);          // 0x2E R0 = R0 % R1, unsigned (R0 when R1 is 0)
+void T_fread(struct lc3_vm *vm);        // 0x2F Read up to R2 words of the host file named at R0 to R1; R0 = words read
+void T_fwrite(struct lc3_vm *vm);       // 0x30 Write R2 words from R1 to the host file named at R0; R0 = words written
+// Files hold words in host byte order, like the raw images (image.h). FREAD and FWRITE
+// return 0xFFFF when the file cannot be opened.
+
+#endif
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "lc3vm.h"
+#include "warp.h"
+
+#if WARP_LANES != 8 && WARP_LANES != 16
+#error "WARP_LANES must be 8 or 16"
+#endif
+
+// A register of every lane. Comparisons give 0xFFFF (true) or 0 in each lane,
+// used as masks.
+typedef uint16_t lanes_t __attribute__((vector_size(2 * WARP_LANES)));
+
+_Thread_local struct warp_stats warp_stats;
+
+// Between two steps, the PC of an active lane is at, the one of any other
+// live lane is in pc
+struct warp {
+    lanes_t reg[8];
+    lanes_t cnd;
+    lanes_t pc;
+    lanes_t live;                       // lanes still running in the warp
+    lanes_t active;                     // live lanes at the warp PC
+    lanes_t pending;                    // instructions retired since the last fold
+    uint16_t at;                        // warp PC
+    bool diverged;                      // some live lanes are not active
+    bool changed;                       // lanes left: schedule again before the next step
+    uint32_t others;                    // lowest PC of the live lanes not active, 0x10000 for none
+    int n, nlive, nactive;
+    int lanes[WARP_LANES];              // active lanes, the first one fetches
+    uint32_t horizon;                   // steps before the next check
+    uint64_t steps;
+    struct lc3_vm **vms;
+    uint64_t *count;
+    uint64_t limit[WARP_LANES];         // budget of each lane, UINT64_MAX for none
+    uint64_t seen[WARP_LANES];          // step when each lane was last active
+    struct warp_stats *stats;
+    uint8_t written[MEMORY_MAX];        // words stored by some lane: the lanes may disagree on them
+};
+
+
+// ===================================================================================
+// ====================================== LANES ======================================
+// ===================================================================================
+static inline lanes_t broadcast(uint16_t x)
+{
+    return (lanes_t){0} + x;
+}
+
+// a where mask is set, b elsewhere
+static inline lanes_t blend(lanes_t mask, lanes_t a, lanes_t b)
+{
+    return (a & mask) | (b & ~mask);
+}
+
+static inline bool any(lanes_t mask)
+{
+    uint64_t q[WARP_LANES / 4], x = 0;
+    memcpy(q, &mask, sizeof(q));
+    for (int k = 0; k < WARP_LANES / 4; ++k) x |= q[k];
+    return x != 0;
+}
+
+// RCND of every lane, as update_flag
+static inline lanes_t flags(lanes_t v)
+{
+    lanes_t zero = (lanes_t)(v == 0), negative = -(v >> 15);
+    return (zero & FZ) | (negative & FN) | (~zero & ~negative & FP);
+}
+
+static void syncOut(struct warp *w, int i, uint16_t pc)
+{
+    struct lc3_vm *vm = w->vms[i];
+    for (int r = 0; r < 8; ++r) vm->reg[r] = w->reg[r][i];
+    vm->reg[RPC] = pc;
+    vm->reg[RCND] = w->cnd[i];
+}
+
+static void syncIn(struct warp *w, int i)
+{
+    struct lc3_vm *vm = w->vms[i];
+    for (int r = 0; r < 8; ++r) w->reg[r][i] = vm->reg[r];
+    w->cnd[i] = vm->reg[RCND];
+}
+
+// Move the instructions counted in the lanes to count
+static void fold(struct warp *w)
+{
+    for (int i = 0; i < w->n; ++i) {
+        w->count[i] += w->pending[i];
+        w->stats->lanes += w->pending[i];
+    }
+    w->pending = broadcast(0);
+}
+
+static void leave(struct warp *w, int i)
+{
+    w->live[i] = 0;
+    w->active[i] = 0;
+    --w->nlive;
+    w->changed = true;
+}
+
+// Finish lane i with programRun, from pc
+static void peel(struct warp *w, int i, uint16_t pc)
+{
+    struct lc3_vm *vm = w->vms[i];
+    uint64_t budget = vm->budget;
+    syncOut(w, i, pc);
+    w->count[i] += w->pending[i];
+    w->stats->lanes += w->pending[i];
+    w->pending[i] = 0;
+    leave(w, i);
+
+    vm->budget = budget ? budget - w->count[i] : 0;     // count < budget while the lane is live
+    uint64_t n = programRun(vm);
+    vm->budget = budget;
+    w->count[i] += n;
+    w->stats->scalar += n;
+    ++w->stats->peeled;
+}
+
+// Make the lanes at the lowest PC the active ones. Needs pc of every live lane.
+static void schedule(struct warp *w)
+{
+    uint32_t low = 0x10000, others = 0x10000;
+    for (int i = 0; i < w->n; ++i)
+        if (w->live[i] && w->pc[i] < low) low = w->pc[i];
+    w->nactive = 0;
+    for (int i = 0; i < w->n; ++i) {
+        w->active[i] = w->live[i] && w->pc[i] == low ? 0xFFFF : 0;
+        if (w->active[i]) {
+            w->lanes[w->nactive++] = i;
+            w->seen[i] = w->steps;
+        }
+        else if (w->live[i] && w->pc[i] < others) others = w->pc[i];
+    }
+    w->at = low;
+    w->others = others;
+    w->diverged = others != 0x10000;
+    w->changed = false;
+}
+
+// Retire the lanes at their budget, peel the ones that cannot go on in the
+// warp and schedule again; at least every WARP_PATIENCE steps
+static void check(struct warp *w)
+{
+    fold(w);
+    w->pc = blend(w->active, broadcast(w->at), w->pc);
+    for (int k = 0; k < w->nactive; ++k) w->seen[w->lanes[k]] = w->steps;
+    do {
+        for (int i = 0; i < w->n; ++i) {
+            if (!w->live[i]) continue;
+            if (w->count[i] >= w->limit[i]) {
+                syncOut(w, i, w->pc[i]);
+                leave(w, i);
+            }
+            else if ((w->nlive == 1 && w->n > 1) || w->pc[i] >= MR_BASE || w->steps - w->seen[i] >= WARP_PATIENCE ||
+                     w->vms[i]->irq != NULL)
+                peel(w, i, w->pc[i]);
+        }
+        if (w->changed) schedule(w);
+    } while (w->changed);
+
+    uint64_t horizon = WARP_PATIENCE;
+    for (int i = 0; i < w->n; ++i)
+        if (w->live[i] && w->limit[i] - w->count[i] < horizon) horizon = w->limit[i] - w->count[i];
+    w->horizon = horizon;
+}
+
+
+// ===================================================================================
+// ==================================== EXECUTION ====================================
+// ===================================================================================
+static inline void setRegister(struct warp *w, int d, lanes_t v)
+{
+    w->reg[d] = w->diverged ? blend(w->active, v, w->reg[d]) : v;
+    w->cnd = w->diverged ? blend(w->active, flags(v), w->cnd) : flags(v);
+}
+
+// Word at address of every active lane
+static lanes_t gather(struct warp *w, lanes_t address)
+{
+    lanes_t v = broadcast(0);
+    for (int k = 0; k < w->nactive; ++k) {
+        int i = w->lanes[k];
+        uint16_t a = address[i];
+        v[i] = a < MR_BASE ? w->vms[i]->memory[a] : mem_read(w->vms[i], a);
+    }
+    return v;
+}
+
+// Store value at address in every active lane. A lane that halts (MCR) leaves the
+// warp, one that enabled an interrupt source is peeled off at the next check.
+static void scatter(struct warp *w, lanes_t address, lanes_t value, uint16_t next)
+{
+    for (int k = 0; k < w->nactive; ++k) {
+        int i = w->lanes[k];
+        uint16_t a = address[i];
+        mem_write(w->vms[i], a, value[i]);
+        w->written[a] = 1;
+        if (a >= MR_BASE && !w->vms[i]->running) {
+            syncOut(w, i, next);
+            leave(w, i);
+        }
+        else if (a >= MR_BASE && w->vms[i]->irq != NULL)
+            w->horizon = 0;             // check, which peels the lane off
+    }
+}
+
+// All the active lanes go to next
+static void advance(struct warp *w, uint16_t next)
+{
+    w->at = next;
+    if (next >= w->others) {            // at or past waiting lanes: they may join or run first
+        w->pc = blend(w->active, broadcast(next), w->pc);
+        schedule(w);
+    }
+}
+
+// Every active lane (mask m) goes to its own target
+static void jump(struct warp *w, lanes_t m, lanes_t target)
+{
+    if (w->nactive == 0) return;
+    uint16_t first = target[w->lanes[0]];
+    if (!any((lanes_t)(target != first) & m)) {
+        advance(w, first);
+        return;
+    }
+    ++w->stats->divergent;
+    w->pc = blend(m, target, w->pc);
+    schedule(w);
+}
+
+// TRAP, RTI, RES: every active lane runs the instruction in its VM
+static void scalar(struct warp *w, uint16_t instruction, uint16_t next)
+{
+    lanes_t m = w->active, target = broadcast(next);
+    for (int k = 0; k < w->nactive; ++k) {
+        int i = w->lanes[k];
+        struct lc3_vm *vm = w->vms[i];
+        syncOut(w, i, next);
+        executeInstruction(vm, instruction);
+        vm->bulk_size = 0;
+        if (!vm->running) {
+            leave(w, i);
+            continue;
+        }
+        syncIn(w, i);
+        target[i] = vm->reg[RPC];
+    }
+    jump(w, m & w->live, target);
+}
+
+static void step(struct warp *w)
+{
+    uint16_t at = w->at, next = at + 1;
+    uint16_t instruction = w->vms[w->lanes[0]]->memory[at];
+    if (w->written[at]) {
+        for (int k = 1; k < w->nactive; ++k)
+            if (w->vms[w->lanes[k]]->memory[at] != instruction) peel(w, w->lanes[k], at);
+        if (w->changed) return;
+    }
+    ++w->steps;
+    --w->horizon;
+    w->pending += w->active & 1;
+
+    int d = (instruction >> 9) & 7, r1 = (instruction >> 6) & 7;
+    uint16_t pc9 = next + sign_extend(instruction & 0x1FF, 9);
+    lanes_t operand;
+    switch (instruction >> 12) {
+    case op_add:
+        operand = instruction & 0x20 ? broadcast(sign_extend(instruction & 0x1F, 5)) : w->reg[instruction & 7];
+        setRegister(w, d, w->reg[r1] + operand);
+        break;
+    case op_and:
+        operand = instruction & 0x20 ? broadcast(sign_extend(instruction & 0x1F, 5)) : w->reg[instruction & 7];
+        setRegister(w, d, w->reg[r1] & operand);
+        break;
+    case op_not:
+        setRegister(w, d, ~w->reg[r1]);
+        break;
+    case op_lea:
+        setRegister(w, d, broadcast(pc9));
+        break;
+    case op_ld:
+        setRegister(w, d, gather(w, broadcast(pc9)));
+        break;
+    case op_ldi:
+        setRegister(w, d, gather(w, gather(w, broadcast(pc9))));
+        break;
+    case op_ldr:
+        setRegister(w, d, gather(w, w->reg[r1] + sign_extend(instruction & 0x3F, 6)));
+        break;
+    case op_st:
+        scatter(w, broadcast(pc9), w->reg[d], next);
+        break;
+    case op_sti:
+        scatter(w, gather(w, broadcast(pc9)), w->reg[d], next);
+        break;
+    case op_str:
+        scatter(w, w->reg[r1] + sign_extend(instruction & 0x1FF, 6), w->reg[d], next);
+        break;
+    case op_br:
+        operand = (lanes_t)((w->cnd & ((instruction >> 9) & 7)) != 0);
+        jump(w, w->active, blend(operand, broadcast(pc9), broadcast(next)));
+        return;
+    case op_jmp:
+        jump(w, w->active, w->reg[r1]);
+        return;
+    case op_jsr:
+        w->reg[R7] = blend(w->active, broadcast(next), w->reg[R7]);
+        advance(w, instruction & 0x800 ? next + sign_extend(instruction & 0x7FF, 11) : next + r1);  // JSRR adds the register index, as OP_JSR
+        return;
+    default:
+        scalar(w, instruction, next);
+        return;
+    }
+    advance(w, next);
+}
+
+void warpRun(struct lc3_vm **vms, int n, uint64_t *count, struct warp_stats *stats)
+{
+    // The lanes need the alignment of their vectors, more than malloc gives for AVX2
+    struct warp *w = aligned_alloc(_Alignof(struct warp), sizeof(struct warp));
+    if (w == NULL || n > WARP_LANES) {
+        fprintf(stderr, "Cannot run a warp of %d lanes\n", n);
+        abort();
+    }
+    memset(w, 0, sizeof(struct warp));
+    w->vms = vms;
+    w->count = count;
+    w->n = n;
+    w->stats = stats;
+    for (int i = 0; i < n; ++i) {
+        count[i] = 0;
+        w->limit[i] = vms[i]->budget ? vms[i]->budget : UINT64_MAX;
+        syncIn(w, i);
+        w->pc[i] = vms[i]->reg[RPC];
+        if (vms[i]->running) {
+            w->live[i] = 0xFFFF;
+            ++w->nlive;
+        }
+    }
+    w->changed = true;
+
+    while (w->nlive > 0) {
+        if (w->horizon == 0 || w->changed) check(w);
+        else step(w);
+    }
+    fold(w);
+    stats->steps += w->steps;
+    free(w);
+}
+
+uint64_t programRunWarp(struct lc3_vm *vm)
+{
+    uint64_t count;
+    warp_stats = (struct warp_stats){0};
+    warpRun(&vm, 1, &count, &warp_stats);
+    return count;
+}
+
+void warpReport(FILE *out, const struct warp_stats *stats)
+{
+    fprintf(out, "warp: %d lanes, %llu steps, %.1f%% lane utilization, %llu divergent branches\n", WARP_LANES,
+            (unsigned long long)stats->steps, stats->steps ? 100.0 * stats->lanes / (stats->steps * WARP_LANES) : 0.0,
+            (unsigned long long)stats->divergent);
+    if (stats->peeled)
+        fprintf(out, "warp: %llu lanes peeled off to programRun, %llu instructions there\n",
+                (unsigned long long)stats->peeled, (unsigned long long)stats->scalar);
+}
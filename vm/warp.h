@@ -0,0 +1,59 @@
+#ifndef H_WARP
+#define H_WARP
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lc3vm.h"
+
+// LOCKSTEP WARPS
+// Run several VMs loaded with the same image in lockstep, like the threads of
+// a GPU warp: every instruction is fetched and decoded once for all of them.
+// The registers are laid out as structure of arrays (a vector per register,
+// one lane per VM), so ADD, AND, NOT, LEA, the condition codes and the BR
+// tests are vector operations, written with GCC vector extensions: 8 lanes
+// in SSE2 registers, 16 in AVX2 ones when built with -mavx2 (or -march=native
+// on a CPU that has it). Memory stays in each VM: LD/ST read and write the
+// same address in every lane, LDR/STR gather and scatter with an address per lane.
+// Every lane has its own PC. While they agree the warp runs with all of them;
+// after a BR or JMP that sends lanes different ways, the warp runs the lowest
+// PC with the lanes that are there, the others masked off, until they meet
+// again. A lane is peeled off and finished by programRun in its own VM when:
+// - it waited WARP_PATIENCE warp steps in a row (it took a path of its own)
+// - its copy of the code at the PC differs from the others (self-modifying code)
+// - it is the last one left of a warp that had more
+// - its PC reaches the device region
+// - it uses interrupts: warps have no block boundary checks (interrupt.h)
+// Traps run in each VM through OP_TRAP, with the lane's registers copied in
+// and back, so consoles, devices and budgets work as in the other engines.
+#ifndef WARP_LANES
+#ifdef __AVX2__
+#define WARP_LANES 16
+#else
+#define WARP_LANES 8
+#endif
+#endif
+#define WARP_PATIENCE 4096
+
+struct warp_stats {
+    uint64_t steps;                     // instructions fetched by warps
+    uint64_t lanes;                     // instructions retired by lanes of warps
+    uint64_t divergent;                 // BR and JMP that split the active lanes
+    uint64_t peeled;                    // lanes finished by programRun
+    uint64_t scalar;                    // instructions retired by them there
+};
+
+// Run n <= WARP_LANES VMs, each set up as for programRun (registers, streams,
+// budget); count[i] gets the instructions retired by vms[i]. Adds to stats.
+void warpRun(struct lc3_vm **vms, int n, uint64_t *count, struct warp_stats *stats);
+
+// A warp of one VM, as an engine. Its statistics go to warp_stats.
+uint64_t programRunWarp(struct lc3_vm *vm);
+
+// Statistics of the last programRunWarp of the calling thread
+extern _Thread_local struct warp_stats warp_stats;
+
+// Print the lane utilization of stats on out
+void warpReport(FILE *out, const struct warp_stats *stats);
+
+#endif